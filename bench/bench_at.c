@@ -0,0 +1,144 @@
+/*
+ * AT command path benchmark
+ *
+ * Drives libhuawei's startup and command code against the simulated
+ * modem (huawei_sim.c), so the numbers are the library's overhead plus
+ * whatever modem time the simulator is told to add. Reports, one JSON
+ * object per line:
+ *
+ *   startup        per-phase open cost with the endpoint cache off
+ *   startup_cached the same with the endpoint cache warm
+ *   roundtrip      p50/p99/mean latency and commands per second for "AT"
+ *   bulk           the same plus bytes per second for a large multi-line reply
+ *
+ * Usage: bench_at [iterations] [simulator options]
+ *   e.g. bench_at 5000 latency=0
+ *        bench_at 200 latency=5,chunk=64
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../libhuawei.h"
+
+#define BULK_LINES          250
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, int n, int pct) {
+    int i = (int)((int64_t)n * pct / 100);
+    return sorted[i < n ? i : n - 1];
+}
+
+static void bench_startup(struct huawei_ctx *hc, const char *name, const char *sim_spec, int iterations) {
+    struct huawei_startup startup, *st = &startup;
+    struct huawei_filter filter = {0};
+    struct huawei_modem *modem;
+    
+    huawei_clear_startup(hc);
+    for (int i = 0; i < iterations; i++) {
+        if (huawei_open(hc, &filter, &modem) < 0) {
+            fprintf(stderr, "%s: no simulated modem\n", name);
+            exit(1);
+        }
+        huawei_close(modem);
+    }
+    
+    huawei_get_startup(hc, st);
+    uint64_t total = st->discover_us + st->open_us + st->endpoints_us + st->detach_us + st->claim_us +
+                     st->engine_us;
+    printf("{\"bench\":\"%s\",\"sim\":\"%s\",\"iterations\":%d,\"discover_us\":%.3f,\"open_us\":%.3f,"
+           "\"endpoints_us\":%.3f,\"detach_us\":%.3f,\"claim_us\":%.3f,\"engine_us\":%.3f,\"total_us\":%.3f,"
+           "\"cache_hits\":%d,\"cache_misses\":%d}\n",
+           name, sim_spec, iterations,
+           (double)st->discover_us / iterations, (double)st->open_us / iterations,
+           (double)st->endpoints_us / iterations, (double)st->detach_us / iterations,
+           (double)st->claim_us / iterations, (double)st->engine_us / iterations,
+           (double)total / iterations, st->cache_hits, st->cache_misses);
+}
+
+static void bench_command(struct huawei_modem *m, const char *name, const char *sim_spec, const char *cmd,
+                          int iterations) {
+    struct huawei_result *res = huawei_result_new();
+    uint64_t *samples = malloc(sizeof(uint64_t) * (size_t)iterations);
+    uint64_t bytes = 0;
+    int failures = 0;
+    int truncated = 0;
+    
+    if (!res || !samples) exit(1);
+    
+    uint64_t start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        uint64_t t = now_us();
+        int r = huawei_command(m, cmd, res);
+        samples[i] = now_us() - t;
+        if (r <= 0 || huawei_result_final(res) != HUAWEI_FINAL_OK) failures++;
+        if (r > 0) bytes += (uint64_t)r;
+        truncated |= huawei_result_truncated(res);
+    }
+    double elapsed = (double)(now_us() - start) / 1e6;
+    
+    uint64_t sum = 0;
+    for (int i = 0; i < iterations; i++) sum += samples[i];
+    qsort(samples, (size_t)iterations, sizeof(samples[0]), compare_u64);
+    
+    printf("{\"bench\":\"%s\",\"sim\":\"%s\",\"cmd\":\"%s\",\"iterations\":%d,\"failures\":%d,"
+           "\"p50_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu,\"mean_us\":%.3f,\"cmds_per_s\":%.1f,"
+           "\"bytes_per_cmd\":%.1f,\"bytes_per_s\":%.0f,\"truncated\":%s}\n",
+           name, sim_spec, cmd, iterations, failures,
+           (unsigned long long)percentile(samples, iterations, 50),
+           (unsigned long long)percentile(samples, iterations, 99),
+           (unsigned long long)samples[iterations - 1],
+           (double)sum / iterations, iterations / elapsed,
+           (double)bytes / iterations, bytes / elapsed, truncated ? "true" : "false");
+    
+    free(samples);
+    huawei_result_free(res);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    const char *sim_spec = argc > 2 ? argv[2] : "";
+    struct huawei_filter filter = {0};
+    struct huawei_modem *modem;
+    struct huawei_ctx *hc;
+    char info[BULK_LINES * 40];
+    size_t len = 0;
+    
+    if (iterations < 1) iterations = 1;
+    
+    // Keep the on-disk endpoint cache out of it: cold first, then in memory only
+    if (huawei_init(&hc, &(struct huawei_options){.transport = "sim", .sim = sim_spec, .endpoint_cache = ""}) < 0) {
+        return 1;
+    }
+    
+    // Multi-line reply close to the 4 KiB a result holds, like a long AT+CLAC listing
+    for (int i = 0; i < BULK_LINES && len + 40 < sizeof(info); i++) {
+        len += (size_t)snprintf(info + len, sizeof(info) - len, "%sAT^BENCH%04d", i ? "\r\n" : "", i);
+    }
+    huawei_sim_script(hc, "AT+CLAC", info);
+    
+    huawei_set_endpoint_cache(hc, 0);
+    bench_startup(hc, "startup", sim_spec, iterations);
+    huawei_set_endpoint_cache(hc, 1);
+    bench_startup(hc, "startup_cached", sim_spec, iterations);
+    
+    if (huawei_open(hc, &filter, &modem) < 0) return 1;
+    bench_command(modem, "roundtrip", sim_spec, "AT", iterations);
+    bench_command(modem, "bulk", sim_spec, "AT+CLAC", iterations);
+    huawei_close(modem);
+    
+    huawei_exit(hc);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Device discovery benchmark
+ *
+ * Compares the old discovery strategy (one libusb_open_device_with_vid_pid
+ * per known PID, each of which enumerates the whole bus) with the library's
+ * own, huawei_list_devices(): a single enumeration pass classified through
+ * the shared PID table. Both run on the transport the library picks, so
+ * HUAWEI_TRANSPORT=sim with HUAWEI_SIM=sticks=N gives a bus of N simulated
+ * sticks; on a real bus, the more devices and hubs are attached, the larger
+ * the gap.
+ *
+ * Usage: bench_discovery [iterations]
+ *   e.g. HUAWEI_TRANSPORT=sim HUAWEI_SIM=sticks=8 bench_discovery 1000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../libhuawei.h"
+#include "../huawei_usb.h"
+#include "../huawei_pids.h"
+
+#define BENCH_DEVICES_MAX   16
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// libusb_open_device_with_vid_pid() over a transport: enumerate, open the first match
+static libusb_device_handle *open_vid_pid(const struct usb_transport *usb, libusb_context *ctx, uint16_t pid) {
+    libusb_device **devs;
+    libusb_device_handle *h = NULL;
+    ssize_t cnt = usb->get_device_list(ctx, &devs);
+    
+    for (ssize_t i = 0; i < cnt; i++) {
+        struct libusb_device_descriptor desc;
+        if (usb->get_device_descriptor(devs[i], &desc) < 0) continue;
+        if (desc.idVendor == HUAWEI_VENDOR_ID && desc.idProduct == pid) {
+            if (usb->open(devs[i], &h) < 0) h = NULL;
+            break;
+        }
+    }
+    if (cnt >= 0) usb->free_device_list(devs, 1);
+    return h;
+}
+
+// Old way: probe every PID in turn until one opens
+static int discover_per_pid(const struct usb_transport *usb, libusb_context *ctx) {
+    for (int i = 0; i < HUAWEI_PID_COUNT; i++) {
+        libusb_device_handle *h = open_vid_pid(usb, ctx, huawei_pids[i].pid);
+        if (h) {
+            usb->close(h);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// New way: the library's single pass, roles included
+static int discover_library(struct huawei_ctx *hc) {
+    struct huawei_device_info list[BENCH_DEVICES_MAX];
+    
+    return huawei_list_devices(hc, list, BENCH_DEVICES_MAX);
+}
+
+static int linear_lookup(uint16_t pid) {
+    for (int i = 0; i < HUAWEI_PID_COUNT; i++) {
+        if (huawei_pids[i].pid == pid) return i;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    const char *transport = getenv("HUAWEI_TRANSPORT");
+    int sim = transport && strcmp(transport, "sim") == 0;
+    const struct usb_transport *usb = sim ? &huawei_usb_sim : &huawei_usb_libusb;
+    libusb_context *ctx = NULL;
+    struct huawei_ctx *hc;
+    char err[256] = "";
+    int iterations = argc > 1 ? atoi(argv[1]) : 50;
+    
+    if (iterations <= 0) iterations = 50;
+    
+    // The old probe gets a bus of its own, set up like the library's
+    int r = sim ? huawei_usb_sim_open(&ctx, getenv("HUAWEI_SIM"), err, sizeof(err)) : usb->init(&ctx);
+    if (r < 0 || huawei_init(&hc, NULL) < 0) {
+        fprintf(stderr, "Failed to init %s%s%s\n", usb->name, err[0] ? ": " : "", err);
+        return 1;
+    }
+    
+    libusb_device **devs;
+    ssize_t cnt = usb->get_device_list(ctx, &devs);
+    if (cnt >= 0) usb->free_device_list(devs, 1);
+    printf("USB devices on bus (%s): %zd, Huawei: %d, known PIDs: %d, iterations: %d\n\n", usb->name, cnt,
+           discover_library(hc), HUAWEI_PID_COUNT, iterations);
+    
+    double t0 = now_ms();
+    for (int i = 0; i < iterations; i++) discover_per_pid(usb, ctx);
+    double per_pid = (now_ms() - t0) / iterations;
+    
+    t0 = now_ms();
+    for (int i = 0; i < iterations; i++) discover_library(hc);
+    double single = (now_ms() - t0) / iterations;
+    
+    printf("%-28s %10.3f ms/discovery\n", "per-PID open (old)", per_pid);
+    printf("%-28s %10.3f ms/discovery\n", "huawei_list_devices (new)", single);
+    if (single > 0) printf("%-28s %10.1fx\n", "speedup", per_pid / single);
+    
+    // Classification cost alone, over the whole 16-bit PID space
+    const int rounds = 200;
+    volatile int sink = 0;
+    
+    t0 = now_ms();
+    for (int r = 0; r < rounds; r++) {
+        for (unsigned pid = 0; pid <= 0xffff; pid++) sink += linear_lookup((uint16_t)pid);
+    }
+    double linear = (now_ms() - t0) * 1e6 / (rounds * 65536.0);
+    
+    t0 = now_ms();
+    for (int r = 0; r < rounds; r++) {
+        for (unsigned pid = 0; pid <= 0xffff; pid++) sink += huawei_pid_lookup((uint16_t)pid) != NULL;
+    }
+    double table = (now_ms() - t0) * 1e6 / (rounds * 65536.0);
+    
+    printf("\n%-28s %10.2f ns/lookup\n", "linear PID list (old)", linear);
+    printf("%-28s %10.2f ns/lookup\n", "direct-mapped table (new)", table);
+    
+    (void)sink;
+    huawei_exit(hc);
+    usb->exit(ctx);
+    return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * NCM datapath benchmark
+ *
+ * Runs libhuawei's NCM engine against the simulated modem (huawei_sim.c with
+ * ncm=1), whose NCM function sends every block it receives straight back.
+ * A socketpair stands in for the TAP device: one thread writes frames into
+ * it as fast as it can, the engine packs them into blocks, the simulator
+ * loops them, the engine unpacks them back into the socketpair and the main
+ * thread counts what arrives. Reports, one JSON object per line:
+ *
+ *   codec_ntb16/32  packing and walking blocks in memory, no USB
+ *   loop_ntb16/32   frames per second and Mbit/s through the whole loop,
+ *                   frames per block each way, frames lost
+ *
+ * Usage: bench_ncm [frames] [frame size] [simulator options]
+ *   e.g. bench_ncm 200000 1514
+ *        bench_ncm 500000 64
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "../libhuawei.h"
+#include "../huawei_ncm.h"
+
+#define BENCH_IDLE_US       1000000 // nothing arrived for this long: the rest is lost
+#define BENCH_NTB_MAX       32768   // the engine's block size
+#define BENCH_ETH_HLEN      14
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+struct bench_writer {
+    int fd;
+    int frames;
+    size_t size;
+};
+
+static void bench_frame(uint8_t *f, size_t size, uint32_t n) {
+    memset(f, 0, size);
+    memset(f, 0xff, 6);
+    memcpy(f + 6, "\x02\x00\x00\x00\x00\x01", 6);
+    f[12] = 0x08;
+    f[13] = 0x00;
+    if (size >= 18) ncm_put32(f + 14, n);
+}
+
+static void *bench_write(void *arg) {
+    struct bench_writer *w = arg;
+    uint8_t frame[HUAWEI_NCM_FRAME_MAX];
+    
+    for (int i = 0; i < w->frames; i++) {
+        bench_frame(frame, w->size, (uint32_t)i);
+        if (send(w->fd, frame, w->size, 0) < 0) break;
+    }
+    return NULL;
+}
+
+static void *bench_run(void *arg) {
+    huawei_ncm_run(arg);
+    return NULL;
+}
+
+static void bench_count(void *opaque, uint8_t *data, size_t len) {
+    (void)data;
+    (*(size_t *)opaque) += len;
+}
+
+static void bench_codec(const char *name, int ntb32, int frames, size_t size) {
+    struct ncm_params p = {3, BENCH_NTB_MAX, BENCH_NTB_MAX, 4, 2, 4, 0};
+    uint8_t *block = malloc(BENCH_NTB_MAX);
+    uint8_t frame[HUAWEI_NCM_FRAME_MAX];
+    struct ncm_tx tx;
+    int blocks = 0, packed = 0;
+    size_t bytes = 0;
+    
+    if (!block) exit(1);
+    bench_frame(frame, size, 0);
+    
+    uint64_t start = now_us();
+    while (packed < frames) {
+        uint8_t *at;
+        ncm_tx_begin(&tx, block, BENCH_NTB_MAX, ntb32, &p);
+        while (packed < frames && (at = ncm_tx_reserve(&tx, size))) {
+            memcpy(at, frame, size);
+            ncm_tx_commit(&tx, size);
+            packed++;
+        }
+        size_t len = ncm_tx_finish(&tx, (uint16_t)blocks++, 512);
+        if (ncm_parse(block, len, bench_count, &bytes) != tx.count) {
+            fprintf(stderr, "%s: block %d does not parse\n", name, blocks);
+            exit(1);
+        }
+    }
+    double secs = (now_us() - start) / 1e6;
+    
+    printf("{\"bench\":\"%s\",\"frames\":%d,\"size\":%zu,\"blocks\":%d,\"frames_per_block\":%.1f,"
+           "\"pps\":%.0f,\"mbit_s\":%.1f}\n",
+           name, frames, size, blocks, (double)frames / blocks, frames / secs, bytes * 8 / secs / 1e6);
+    free(block);
+}
+
+static void bench_loop(struct huawei_ctx *hc, const char *name, const char *sim_spec, int ntb32, int frames,
+                       size_t size) {
+    struct huawei_ncm *s;
+    struct huawei_link_stats rx, tx;
+    struct huawei_filter filter = {0};
+    struct huawei_modem *modem;
+    struct bench_writer w = {-1, frames, size};
+    pthread_t writer, runner;
+    int sv[2];
+    int buffer = 8 << 20;
+    uint8_t frame[HUAWEI_NCM_FRAME_MAX];
+    int received = 0;
+    
+    if (huawei_open(hc, &filter, &modem) < 0) {
+        fprintf(stderr, "%s: no simulated modem\n", name);
+        exit(1);
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) exit(1);
+    for (int i = 0; i < 2; i++) {
+        setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+        setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    if (huawei_ncm_open(&s, modem, sv[0], &(struct huawei_ncm_options){.ntb32 = ntb32}) < 0) exit(1);
+    if (ntb32 && !huawei_ncm_ntb32(s)) {
+        fprintf(stderr, "%s: simulator did not switch to NTB32\n", name);
+        exit(1);
+    }
+    
+    w.fd = sv[1];
+    uint64_t start = now_us();
+    uint64_t last = start;
+    pthread_create(&runner, NULL, bench_run, s);
+    pthread_create(&writer, NULL, bench_write, &w);
+    
+    while (received < frames && now_us() - last < BENCH_IDLE_US) {
+        struct pollfd p = {sv[1], POLLIN, 0};
+        if (poll(&p, 1, 100) <= 0) continue;
+        while (recv(sv[1], frame, sizeof(frame), MSG_DONTWAIT) > 0) {
+            received++;
+            last = now_us();
+        }
+    }
+    double secs = (last - start) / 1e6;
+    
+    pthread_join(writer, NULL);
+    huawei_ncm_shutdown(s);
+    pthread_join(runner, NULL);
+    
+    huawei_ncm_stats(s, &rx, &tx);
+    printf("{\"bench\":\"%s\",\"sim\":\"%s\",\"frames\":%d,\"size\":%zu,\"received\":%d,\"lost\":%d,"
+           "\"pps\":%.0f,\"mbit_s\":%.1f,\"tx_blocks\":%llu,\"tx_frames_per_block\":%.1f,"
+           "\"rx_blocks\":%llu,\"rx_frames_per_block\":%.1f}\n",
+           name, sim_spec, frames, size, received, frames - received, received / secs,
+           (double)received * size * 8 / secs / 1e6, (unsigned long long)tx.transfers,
+           tx.transfers ? (double)tx.packets / tx.transfers : 0.0, (unsigned long long)rx.transfers,
+           rx.transfers ? (double)rx.packets / rx.transfers : 0.0);
+    
+    huawei_ncm_close(s);
+    close(sv[0]);
+    close(sv[1]);
+    huawei_close(modem);
+}
+
+int main(int argc, char **argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : 200000;
+    size_t size = argc > 2 ? (size_t)atoi(argv[2]) : 1514;
+    char sim_spec[256];
+    struct huawei_ctx *hc;
+    
+    if (frames < 1) frames = 1;
+    if (size < BENCH_ETH_HLEN) size = BENCH_ETH_HLEN;
+    if (size > HUAWEI_NCM_FRAME_MAX) size = HUAWEI_NCM_FRAME_MAX;
+    snprintf(sim_spec, sizeof(sim_spec), "ncm=1%s%s", argc > 3 ? "," : "", argc > 3 ? argv[3] : "");
+    
+    bench_codec("codec_ntb16", 0, frames, size);
+    bench_codec("codec_ntb32", 1, frames, size);
+    
+    if (huawei_init(&hc, &(struct huawei_options){.transport = "sim", .sim = sim_spec, .no_endpoint_cache = 1}) < 0) {
+        return 1;
+    }
+    bench_loop(hc, "loop_ntb16", sim_spec, 0, frames, size);
+    bench_loop(hc, "loop_ntb32", sim_spec, 1, frames, size);
+    huawei_exit(hc);
+    return 0;
+}
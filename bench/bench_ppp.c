@@ -0,0 +1,294 @@
+/*
+ * PPP datapath benchmark
+ *
+ * Times the HDLC codec (huawei_hdlc.h) byte at a time against its vector
+ * and carry-less multiply paths, then runs libhuawei's PPP session against
+ * the simulated modem, which dials like a network and sends every IP packet
+ * back. A socketpair stands in for the TUN device: one thread writes IPv4
+ * packets into it as fast as it can, the session frames them, the
+ * simulator unframes and loops them, the session unframes them back into
+ * the socketpair and the main thread counts what arrives. Reports, one
+ * JSON object per line:
+ *
+ *   codec_fcs       CRC-16/X.25 over a frame, MB/s scalar and SIMD
+ *   codec_encode    framing with an empty and a full ACCM, MB/s each way
+ *   codec_decode    unframing and checking the same frames
+ *   loop            packets per second and Mbit/s through the whole loop,
+ *                   packets per transfer each way, packets lost
+ *
+ * Usage: bench_ppp [packets] [packet size] [simulator options]
+ *   e.g. bench_ppp 200000 1500
+ *        bench_ppp 500000 64
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "../libhuawei.h"
+#include "../huawei_hdlc.h"
+
+#define BENCH_IDLE_US       1000000 // nothing arrived for this long: the rest is lost
+#define BENCH_FRAMES        64      // distinct frames the codec runs cycle through
+#define BENCH_FRAME_MAX     2048    // one frame unescaped, header and FCS included
+#define BENCH_NEGOTIATE_MS  30000   // CONNECT to IPCP up
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+struct bench_writer {
+    int fd;
+    int packets;
+    size_t size;
+};
+
+struct bench_decoded {
+    uint8_t *expect;
+    size_t len;
+    int ok;
+};
+
+// An IPv4/UDP-looking packet; the payload is noisy so the ACCM matters
+static void bench_packet(uint8_t *p, size_t size, uint32_t n) {
+    uint32_t x = n * 2654435761u + 1;
+    
+    for (size_t i = 0; i < size; i++) {
+        x = x * 1103515245 + 12345;
+        p[i] = (uint8_t)(x >> 16);
+    }
+    p[0] = 0x45;
+    p[2] = (uint8_t)(size >> 8);
+    p[3] = (uint8_t)size;
+    p[9] = 17;
+    memcpy(p + 12, "\x0a\x40\x00\x02\x0a\x40\x00\x01", 8);
+}
+
+static void *bench_write(void *arg) {
+    struct bench_writer *w = arg;
+    uint8_t packet[HUAWEI_PPP_MRU];
+    
+    for (int i = 0; i < w->packets; i++) {
+        bench_packet(packet, w->size, (uint32_t)i);
+        if (send(w->fd, packet, w->size, 0) < 0) break;
+    }
+    return NULL;
+}
+
+static void *bench_run(void *arg) {
+    huawei_ppp_run(arg);
+    return NULL;
+}
+
+static void bench_check(void *opaque, uint8_t *frame, size_t len) {
+    struct bench_decoded *d = opaque;
+    d->ok += len == d->len && memcmp(frame, d->expect, len) == 0;
+}
+
+static void bench_count(void *opaque, uint8_t *frame, size_t len) {
+    (void)frame;
+    (*(size_t *)opaque) += len;
+}
+
+static double bench_mb_s(size_t bytes, uint64_t start) {
+    uint64_t us = now_us() - start;
+    return us ? bytes / (double)us : 0.0;
+}
+
+static void bench_result(const char *name, uint32_t accm, int with_accm, size_t bytes, double scalar,
+                         double simd) {
+    char extra[32] = "";
+    
+    if (with_accm) snprintf(extra, sizeof(extra), "\"accm\":\"%08x\",", accm);
+    printf("{\"bench\":\"%s\",%s\"bytes\":%zu,\"scalar_mb_s\":%.1f,\"simd_mb_s\":%.1f,\"speedup\":%.2f,"
+           "\"vector\":%d,\"clmul\":%d}\n",
+           name, extra, bytes, scalar, simd, scalar > 0 ? simd / scalar : 0.0, HDLC_VECTOR, hdlc_have_clmul());
+}
+
+static void bench_codec(int packets, size_t size) {
+    static uint8_t frames[BENCH_FRAMES][BENCH_FRAME_MAX];
+    static uint8_t encoded[BENCH_FRAMES][HDLC_ENCODED_MAX(BENCH_FRAME_MAX)];
+    static uint8_t scratch[HDLC_ENCODED_MAX(BENCH_FRAME_MAX)];
+    static uint8_t rx_buf[BENCH_FRAME_MAX];
+    static const uint32_t accms[2] = {0, HDLC_ACCM_ALL};
+    size_t flen = size + 4, elen[BENCH_FRAMES];
+    size_t bytes = (size_t)packets * flen;
+    volatile uint16_t sink = 0;
+    struct hdlc_rx rx;
+    uint64_t start;
+    
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        memcpy(frames[i], "\xff\x03\x00\x21", 4);
+        bench_packet(frames[i] + 4, size, (uint32_t)i);
+    }
+    
+    // FCS
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        if (hdlc_fcs16(HDLC_INITFCS, frames[i], flen) != hdlc_fcs16_scalar(HDLC_INITFCS, frames[i], flen)) {
+            fprintf(stderr, "codec_fcs: SIMD and scalar FCS differ\n");
+            exit(1);
+        }
+    }
+    start = now_us();
+    for (int i = 0; i < packets; i++) sink ^= hdlc_fcs16_scalar(HDLC_INITFCS, frames[i % BENCH_FRAMES], flen);
+    double scalar = bench_mb_s(bytes, start);
+    start = now_us();
+    for (int i = 0; i < packets; i++) sink ^= hdlc_fcs16(HDLC_INITFCS, frames[i % BENCH_FRAMES], flen);
+    bench_result("codec_fcs", 0, 0, bytes, scalar, bench_mb_s(bytes, start));
+    
+    for (int a = 0; a < 2; a++) {
+        uint32_t accm = accms[a];
+        
+        // Encoding, both paths must give the same bytes
+        for (int i = 0; i < BENCH_FRAMES; i++) {
+            elen[i] = hdlc_encode(encoded[i], frames[i], flen, accm);
+            if (hdlc_encode_scalar(scratch, frames[i], flen, accm) != elen[i] ||
+                memcmp(scratch, encoded[i], elen[i]) != 0) {
+                fprintf(stderr, "codec_encode: SIMD and scalar framing differ\n");
+                exit(1);
+            }
+        }
+        start = now_us();
+        for (int i = 0; i < packets; i++) {
+            size_t n = hdlc_encode_scalar(scratch, frames[i % BENCH_FRAMES], flen, accm);
+            sink ^= scratch[n - 2];
+        }
+        scalar = bench_mb_s(bytes, start);
+        start = now_us();
+        for (int i = 0; i < packets; i++) {
+            size_t n = hdlc_encode(scratch, frames[i % BENCH_FRAMES], flen, accm);
+            sink ^= scratch[n - 2];
+        }
+        bench_result("codec_encode", accm, 1, bytes, scalar, bench_mb_s(bytes, start));
+        
+        // Decoding gets every frame back intact
+        for (int i = 0; i < BENCH_FRAMES; i++) {
+            struct bench_decoded d = {frames[i], flen, 0};
+            hdlc_rx_init(&rx, rx_buf, sizeof(rx_buf));
+            hdlc_rx_feed(&rx, encoded[i], elen[i], bench_check, &d);
+            hdlc_rx_feed_scalar(&rx, encoded[i], elen[i], bench_check, &d);
+            if (d.ok != 2) {
+                fprintf(stderr, "codec_decode: frame %d does not come back\n", i);
+                exit(1);
+            }
+        }
+        size_t got = 0;
+        hdlc_rx_init(&rx, rx_buf, sizeof(rx_buf));
+        start = now_us();
+        for (int i = 0; i < packets; i++) {
+            hdlc_rx_feed_scalar(&rx, encoded[i % BENCH_FRAMES], elen[i % BENCH_FRAMES], bench_count, &got);
+        }
+        scalar = bench_mb_s(bytes, start);
+        start = now_us();
+        for (int i = 0; i < packets; i++) {
+            hdlc_rx_feed(&rx, encoded[i % BENCH_FRAMES], elen[i % BENCH_FRAMES], bench_count, &got);
+        }
+        bench_result("codec_decode", accm, 1, bytes, scalar, bench_mb_s(bytes, start));
+        if (got != 2 * bytes || rx.errors) {
+            fprintf(stderr, "codec_decode: %llu bad frames\n", (unsigned long long)rx.errors);
+            exit(1);
+        }
+    }
+    (void)sink;
+}
+
+static void bench_loop(struct huawei_ctx *hc, const char *sim_spec, int packets, size_t size) {
+    struct huawei_ppp *s;
+    struct huawei_link_stats rx, tx;
+    struct huawei_filter filter = {0};
+    struct huawei_modem *modem;
+    struct bench_writer w = {-1, packets, size};
+    pthread_t writer, runner;
+    int sv[2];
+    int buffer = 8 << 20;
+    uint8_t packet[BENCH_FRAME_MAX];
+    int received = 0;
+    
+    if (huawei_open(hc, &filter, &modem) < 0) {
+        fprintf(stderr, "loop: no simulated modem\n");
+        exit(1);
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) exit(1);
+    for (int i = 0; i < 2; i++) {
+        setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+        setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    if (huawei_ppp_dial(&s, modem, sv[0], &(struct huawei_ppp_options){0}) < 0) {
+        fprintf(stderr, "loop: simulator did not answer CONNECT\n");
+        exit(1);
+    }
+    
+    pthread_create(&runner, NULL, bench_run, s);
+    uint64_t deadline = now_us() + (uint64_t)BENCH_NEGOTIATE_MS * 1000;
+    while (!huawei_ppp_is_up(s) && now_us() < deadline) {
+        poll(NULL, 0, 1);
+    }
+    if (!huawei_ppp_is_up(s)) {
+        fprintf(stderr, "loop: IPCP did not come up\n");
+        exit(1);
+    }
+    
+    w.fd = sv[1];
+    uint64_t start = now_us();
+    uint64_t last = start;
+    pthread_create(&writer, NULL, bench_write, &w);
+    
+    while (received < packets && now_us() - last < BENCH_IDLE_US) {
+        struct pollfd p = {sv[1], POLLIN, 0};
+        if (poll(&p, 1, 100) <= 0) continue;
+        while (recv(sv[1], packet, sizeof(packet), MSG_DONTWAIT) > 0) {
+            received++;
+            last = now_us();
+        }
+    }
+    double secs = (last - start) / 1e6;
+    
+    pthread_join(writer, NULL);
+    huawei_ppp_shutdown(s);
+    pthread_join(runner, NULL);
+    
+    huawei_ppp_stats(s, &rx, &tx);
+    printf("{\"bench\":\"loop\",\"sim\":\"%s\",\"packets\":%d,\"size\":%zu,\"received\":%d,\"lost\":%d,"
+           "\"pps\":%.0f,\"mbit_s\":%.1f,\"tx_transfers\":%llu,\"tx_packets_per_transfer\":%.1f,"
+           "\"rx_transfers\":%llu,\"rx_packets_per_transfer\":%.1f,\"dropped\":%llu,\"bad_frames\":%llu}\n",
+           sim_spec, packets, size, received, packets - received, received / secs,
+           (double)received * size * 8 / secs / 1e6, (unsigned long long)tx.transfers,
+           tx.transfers ? (double)tx.packets / tx.transfers : 0.0, (unsigned long long)rx.transfers,
+           rx.transfers ? (double)rx.packets / rx.transfers : 0.0, (unsigned long long)(rx.dropped + tx.dropped),
+           (unsigned long long)rx.errors);
+    
+    huawei_ppp_close(s);
+    close(sv[0]);
+    close(sv[1]);
+    huawei_close(modem);
+}
+
+int main(int argc, char **argv) {
+    int packets = argc > 1 ? atoi(argv[1]) : 200000;
+    size_t size = argc > 2 ? (size_t)atoi(argv[2]) : 1500;
+    const char *sim_spec = argc > 3 ? argv[3] : "";
+    struct huawei_ctx *hc;
+    
+    if (packets < 1) packets = 1;
+    if (size < 20) size = 20;
+    if (size > HUAWEI_PPP_MRU) size = HUAWEI_PPP_MRU;
+    
+    bench_codec(packets, size);
+    
+    if (huawei_init(&hc, &(struct huawei_options){.transport = "sim", .sim = sim_spec, .no_endpoint_cache = 1}) < 0) {
+        return 1;
+    }
+    bench_loop(hc, sim_spec, packets, size);
+    huawei_exit(hc);
+    return 0;
+}
@@ -1,308 +1,3258 @@
 /*
  * Huawei AT Command Tool (Universal)
  * Supports multiple Huawei modem PIDs: 0x1003, 0x1506, etc.
+ * Discovery and the AT command engine are in libhuawei (libhuawei.h)
  * 
  * Usage: huawei_at "AT+CPIN?"
  *        huawei_at -p 1506 "ATI"    (force specific PID)
+ *        huawei_at -d               (daemon: keep modem claimed, serve
+ *                                    commands over a Unix socket)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
 #include <unistd.h>
-#include <libusb-1.0/libusb.h>
-
-#define HUAWEI_VENDOR_ID    0x12D1
-#define TIMEOUT_MS          2000
-#define READ_TIMEOUT_MS     500
-#define MAX_RESPONSE_SIZE   4096
-
-// Supported modem PIDs (in order of priority)
-// Includes all known Huawei USB modems in modem/network mode
-static uint16_t supported_pids[] = {
-    // === Classic 3G/HSPA Modems ===
-    0x1001,  // E169/E620/E800/E1550 HSDPA Modem
-    0x1003,  // E1550 Modem mode
-    0x140c,  // E180/E1550 Modem
-    0x1406,  // E1750 Modem
-    0x1436,  // E173/E1750 Modem
-    0x1465,  // K3765 HSPA Modem
-    0x14AC,  // E1820 Modem
-    0x14C6,  // K4605 Modem
-    0x14C9,  // K4505 HSPA+ Modem
-    0x1c05,  // E173 Modem
-    0x1c07,  // E173s Modem
-    0x1c1b,  // E3531 Modem
-    
-    // === E3xx Series (3G/4G) ===
-    0x1506,  // E303/E3131/MS2372 Modem mode
-    0x14db,  // E3131/E353 HiLink mode
-    0x14fe,  // E303/E3131 Intermediate/Storage
-    0x15ca,  // E3131h-2 Modem
-    0x1f01,  // E353/E3131 (initial/ZeroCD, but sometimes modem)
-    
-    // === E3372/E8372 LTE Series ===
-    0x1442,  // E3372 Stick/Modem mode
-    0x14dc,  // E3372/E8372 HiLink mode
-    0x155e,  // E8372 Stick/NCM mode
-    0x157f,  // E8372 alternate mode
-    0x1592,  // E8372h mode
-    
-    // === K-Series LTE Modems ===
-    0x1505,  // E398/K5005 LTE Modem
-    0x1520,  // K3765 HSPA
-    0x1521,  // K4505 HSPA+
-    0x1575,  // K5150 LTE Modem
-    0x15c1,  // ME906s LTE M.2 Module
-    
-    // === Mobile WiFi (USB tethering mode) ===
-    0x1f1e,  // K5160 initial
-    
-    // === Legacy/Other ===
-    0x1404,  // E1752 Modem
-    0x1411,  // E510 Modem
-    0x141b,  // E1752 alternate
-    0x1446,  // E1756/E173 (sometimes modem)
-    0x1464,  // K4510/K4511 Modem
-    0x14ba,  // E173 alternate
-    0x14d1,  // E173 mode
-    0x1c0b,  // E173s (modem off state)
-    0x1da1,  // E3372 (some variants)
-    0
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__linux__)
+#include <net/if_arp.h>
+#include <linux/if_tun.h>
+#elif defined(__APPLE__)
+#include <sys/kern_control.h>
+#include <sys/sys_domain.h>
+#include <net/if_utun.h>
+#endif
+
+#include "huawei_pids.h"
+#include "libhuawei.h"
+#include "huawei_metrics.h"
+#include "huawei_sms.h"
+#include "huawei_telemetry.h"
+#include "huawei_diag.h"
+
+#define SOCKET_NAME         "huawei_at.sock"     // in $XDG_RUNTIME_DIR, else /tmp/huawei_at-<uid>/
+#define DAEMON_MAX_CLIENTS  64
+#define DAEMON_LINE_MAX     512
+#define SCHED_JOBS          (DAEMON_MAX_CLIENTS + HUAWEI_CHANNELS_MAX)
+#define SCHED_AGE_MS        2000    // waited this long, a command moves up one priority class
+#define SCHED_SLICE_US      2000    // socket check interval while a command runs
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void scan_huawei_devices(struct huawei_ctx *hc) {
+    struct huawei_device_info *list = calloc(HUAWEI_MODEMS_MAX, sizeof(*list));
+    int cnt = list ? huawei_list_devices(hc, list, HUAWEI_MODEMS_MAX) : 0;
+    
+    fprintf(stderr, "\nAvailable Huawei devices:\n");
+    for (int i = 0; i < cnt; i++) {
+        const struct huawei_device_info *d = &list[i];
+        fprintf(stderr, "  %-10s 12d1:%04x - %s\n", d->path, d->pid, huawei_pid_name(d->pid));
+        
+        // Serial interfaces and their roles, the names -I takes
+        const struct huawei_pid *p = huawei_pid_lookup(d->pid);
+        if (d->nports <= 0 || !p || !p->priority) continue;
+        fprintf(stderr, "  %-10s", "");
+        for (int k = 0; k < d->nports; k++) {
+            fprintf(stderr, " if%d=%s%s", d->ports[k].interface, huawei_role_name(d->ports[k].role),
+                    k == d->preferred ? "*" : "");
+        }
+        fprintf(stderr, "\n");
+    }
+    
+    if (cnt <= 0) {
+        fprintf(stderr, "  No Huawei devices found\n");
+    }
+    free(list);
+}
+
+void print_timing(const struct huawei_ctx *hc, struct huawei_modem *m) {
+    struct huawei_startup startup;
+    struct huawei_command_stats cmd;
+    const struct huawei_startup *st = &startup;
+    
+    huawei_get_startup(hc, &startup);
+    huawei_port_stats(huawei_modem_port(m, 0, NULL), &cmd);
+    uint64_t total = st->init_us + st->discover_us + st->open_us + st->endpoints_us + st->detach_us +
+                     st->claim_us + st->engine_us;
+    
+    fprintf(stderr, "Timing:\n");
+    fprintf(stderr, "  libusb_init   %9.3f ms\n", st->init_us / 1000.0);
+    fprintf(stderr, "  discovery     %9.3f ms\n", st->discover_us / 1000.0);
+    fprintf(stderr, "  open          %9.3f ms\n", st->open_us / 1000.0);
+    fprintf(stderr, "  endpoints     %9.3f ms  (cache: %d hit, %d miss)\n", st->endpoints_us / 1000.0,
+            st->cache_hits, st->cache_misses);
+    fprintf(stderr, "  detach        %9.3f ms\n", st->detach_us / 1000.0);
+    fprintf(stderr, "  claim         %9.3f ms\n", st->claim_us / 1000.0);
+    fprintf(stderr, "  engine        %9.3f ms\n", st->engine_us / 1000.0);
+    fprintf(stderr, "  startup total %9.3f ms\n", total / 1000.0);
+    fprintf(stderr, "  command tx    %9.3f ms\n", cmd.tx_us / 1000.0);
+    fprintf(stderr, "  first byte    %9.3f ms\n", cmd.first_byte_us / 1000.0);
+    fprintf(stderr, "  final result  %9.3f ms\n", cmd.final_us / 1000.0);
+}
+
+// One line per modem for --metrics; startup phases are summed over all opened modems
+void print_metrics(enum metrics_format format, const struct huawei_ctx *hc, struct huawei_modem *m) {
+    struct huawei_startup startup;
+    struct huawei_command_stats cmd;
+    const struct huawei_startup *st = &startup;
+    
+    huawei_get_startup(hc, &startup);
+    huawei_port_stats(huawei_modem_port(m, 0, NULL), &cmd);
+    struct metric v[] = {
+        {"init_us", st->init_us},
+        {"discover_us", st->discover_us},
+        {"open_us", st->open_us},
+        {"descriptors_us", st->endpoints_us},
+        {"detach_us", st->detach_us},
+        {"claim_us", st->claim_us},
+        {"engine_us", st->engine_us},
+        {"tx_us", cmd.tx_us},
+        {"first_byte_us", cmd.first_byte_us},
+        {"final_us", cmd.final_us},
+        {"cache_hits", (uint64_t)st->cache_hits},
+        {"cache_misses", (uint64_t)st->cache_misses},
+    };
+    
+    metrics_emit(stderr, format, "huawei_at", huawei_modem_path(m), v, (int)(sizeof(v) / sizeof(v[0])));
+}
+
+void modems_close(struct huawei_modem **modems, int count) {
+    for (int i = 0; i < count; i++) {
+        huawei_close(modems[i]);
+    }
+}
+
+int device_selected(const struct huawei_filter *filter) {
+    return filter->pid || filter->path || filter->serial || filter->all || filter->ports;
+}
+
+void results_free(struct huawei_result **res, int count) {
+    if (!res) return;
+    for (int i = 0; i < count; i++) {
+        huawei_result_free(res[i]);
+    }
+    free(res);
+}
+
+// One result per modem for the commands that run on all of them; NULL if out of memory
+struct huawei_result **results_new(int count) {
+    struct huawei_result **res = calloc((size_t)count, sizeof(*res));
+    
+    for (int i = 0; res && i < count; i++) {
+        res[i] = huawei_result_new();
+        if (!res[i]) {
+            results_free(res, i);
+            return NULL;
+        }
+    }
+    return res;
+}
+
+void print_result(const struct huawei_result *res, int raw_mode, int verbose) {
+    const char *info = huawei_result_info(res);
+    size_t len = strlen(info);
+    
+    if (raw_mode) {
+        const char *raw = huawei_result_raw(res, &len);
+        fwrite(raw, 1, len, stdout);
+        return;
+    }
+    
+    if (verbose && huawei_result_urc(res)[0]) {
+        fprintf(stderr, "Unsolicited:\n%s", huawei_result_urc(res));
+    }
+    
+    fwrite(info, 1, len, stdout);
+    if (huawei_result_final(res) != HUAWEI_FINAL_NONE) {
+        if (huawei_result_lines(res) > 0) printf("\n");
+        printf("%s\n", huawei_result_final_line(res));
+    } else if (len > 0 && info[len - 1] != '\n') {
+        printf("\n");
+    }
+    if (huawei_result_truncated(res)) {
+        fprintf(stderr, "Warning: response truncated\n");
+    }
+}
+
+/*
+ * Streaming output (--stream)
+ *
+ * Information lines are written to stdout as the parser produces them, so
+ * replies of any size (AT+COPS=?, phonebook dumps) show up while they are
+ * still arriving and nothing is cut at HUAWEI_RESPONSE_MAX. The echo is
+ * recognised line by line as usual; lines longer than HUAWEI_LINE_MAX come
+ * through in pieces. With several modems every line is prefixed by the
+ * device's port path.
+ */
+
+struct stream_out {
+    const char *prefix;     // port path with several modems, NULL otherwise
+    int lines;
+    int mid_line;           // an overlong line is still being written
+};
+
+static void stream_line(void *opaque, enum huawei_line_kind kind, const char *line, size_t len) {
+    struct stream_out *out = opaque;
+    
+    if (out->prefix && !out->mid_line) printf("%s: ", out->prefix);
+    fwrite(line, 1, len, stdout);
+    out->mid_line = kind == HUAWEI_LINE_PARTIAL;
+    if (!out->mid_line) {
+        putchar('\n');
+        out->lines++;
+    }
+    fflush(stdout);
+}
+
+// Same layout as print_result(), for what is left once the lines are out
+void stream_finish(const struct stream_out *out, const struct huawei_result *res, int verbose) {
+    if (verbose && huawei_result_urc(res)[0]) {
+        fprintf(stderr, "Unsolicited:\n%s", huawei_result_urc(res));
+    }
+    
+    if (out->mid_line) putchar('\n');
+    if (huawei_result_final(res) != HUAWEI_FINAL_NONE) {
+        if (out->prefix) {
+            printf("%s: ", out->prefix);
+        } else if (out->lines > 0) {
+            printf("\n");
+        }
+        printf("%s\n", huawei_result_final_line(res));
+    }
+    fflush(stdout);
+}
+
+// Run cmd on every modem at once, writing lines as they come in
+void stream_command_all(struct huawei_modem **modems, int count, const char *cmd, struct huawei_result **results,
+                        struct stream_out *outs, int *status) {
+    struct huawei_port *ports[HUAWEI_MODEMS_MAX];
+    int n = 0;
+    
+    for (int i = 0; i < count; i++) {
+        struct huawei_port *port = huawei_modem_port(modems[i], 0, NULL);
+        outs[i].prefix = count > 1 ? huawei_modem_path(modems[i]) : NULL;
+        outs[i].lines = 0;
+        outs[i].mid_line = 0;
+        if (huawei_port_stream(port, cmd, results[i], stream_line, &outs[i]) == 0) {
+            ports[n++] = port;
+        }
+    }
+    huawei_run(ports, n);
+    
+    for (int i = 0; i < count; i++) {
+        struct huawei_port *port = huawei_modem_port(modems[i], 0, NULL);
+        status[i] = huawei_port_result(port);
+        if (status[i] < 0) {
+            fprintf(stderr, "%s: error sending command: %s\n", huawei_modem_path(modems[i]),
+                    libusb_strerror(huawei_port_error(port)));
+        }
+    }
+}
+
+/*
+ * Metrics endpoint (daemon -M)
+ *
+ * The daemon counts commands by outcome, their latency, timeouts, transfer
+ * errors, USB bytes and reconnects, and keeps the last signal values seen
+ * in replies to AT+CSQ, AT^HCSQ?, AT^SYSINFOEX and AT+CREG?. A thread of
+ * its own serves them in Prometheus text format over HTTP, on a loopback
+ * TCP port ("9101", "127.0.0.1:9101") or a Unix socket (an argument with a
+ * '/'). The command path only does relaxed atomic adds and publishes signal
+ * values under a sequence counter, so scrapes never wait for the modem and
+ * never hold up a command.
+ */
+
+#define STATS_BUCKETS       12
+#define STATS_ERRORS        14      // LIBUSB_ERROR_IO (-1) to LIBUSB_ERROR_NOT_SUPPORTED (-12), other
+#define STATS_BODY_MAX      16384
+
+static const double stats_bucket_s[STATS_BUCKETS] = {
+    0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5
+};
+
+enum stats_outcome {
+    STATS_OK,
+    STATS_ERROR,
+    STATS_NORESP,
+    STATS_FAILED,
+    STATS_OUTCOMES
+};
+
+static const char *stats_outcome_names[STATS_OUTCOMES] = {"ok", "error", "noresp", "failed"};
+
+// Priority classes of the daemon's command scheduler, most urgent first
+enum sched_class {
+    SCHED_HIGH,
+    SCHED_NORMAL,
+    SCHED_BULK,
+    SCHED_CLASSES
+};
+
+static const char *sched_class_names[SCHED_CLASSES] = {"high", "normal", "bulk"};
+
+struct stats {
+    _Atomic uint64_t commands[STATS_OUTCOMES];
+    _Atomic uint64_t latency[STATS_BUCKETS + 1];    // per bucket, the last one is +Inf
+    _Atomic uint64_t latency_sum_us;
+    _Atomic uint64_t timeouts;                      // gave up waiting for the final result code
+    _Atomic uint64_t transfer_errors[STATS_ERRORS];
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t reconnects;
+    _Atomic uint64_t cache_hits;
+    _Atomic uint64_t cache_misses;                  // cacheable commands sent to the modem
+    _Atomic uint64_t cache_invalidations;
+    _Atomic uint64_t requests[SCHED_CLASSES];       // by the class asked for
+    _Atomic uint64_t coalesced;                     // answered by another client's command
+    _Atomic uint64_t expired;
+    _Atomic uint64_t queue_wait_us;                 // sum over commands sent, queued to sent
+    atomic_int up;
+    atomic_int clients;
+    atomic_int queued;
+    
+    // Last signal values, consistent as a set while seq is even and unchanged
+    atomic_uint seq;
+    _Atomic int32_t signal[TLM_METRICS][TLM_FIELDS_MAX];
+    _Atomic uint64_t signal_us[TLM_METRICS];        // wall clock of the reply, 0 = never seen
+    
+    char device[HUAWEI_PATH_MAX];                   // set before the thread starts
+    uint64_t start_us;
+};
+
+static struct stats stats;
+static atomic_int stats_stop;
+
+// Defined further down with the daemon, monitor and sampler
+static int write_all(int fd, const void *buf, size_t len);
+static uint64_t wall_us(void);
+static int sample_parse(struct tlm_sample *s, enum tlm_metric m, const struct huawei_result *res);
+
+static void stats_signal(const char *cmd, const struct huawei_result *res) {
+    struct tlm_sample sample;
+    int m = 0;
+    
+    while (m < TLM_METRICS && strcasecmp(cmd, tlm_metrics[m].cmd) != 0) m++;
+    if (m == TLM_METRICS || huawei_result_final(res) != HUAWEI_FINAL_OK) return;
+    if (sample_parse(&sample, (enum tlm_metric)m, res) < 0) return;
+    
+    // Single writer: the daemon thread
+    unsigned seq = atomic_load_explicit(&stats.seq, memory_order_relaxed);
+    atomic_store_explicit(&stats.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (int f = 0; f < tlm_metrics[m].fields; f++) {
+        atomic_store_explicit(&stats.signal[m][f], sample.value[m][f], memory_order_relaxed);
+    }
+    atomic_store_explicit(&stats.signal_us[m], wall_us(), memory_order_relaxed);
+    atomic_store_explicit(&stats.seq, seq + 2, memory_order_release);
+}
+
+// Account one huawei_command() on port; r is its return value
+static void stats_command(const struct huawei_port *port, const char *cmd, int r, const struct huawei_result *res) {
+    enum stats_outcome outcome = r < 0 ? STATS_FAILED : r == 0 ? STATS_NORESP :
+                                 huawei_final_is_error(huawei_result_final(res)) ? STATS_ERROR : STATS_OK;
+    struct huawei_command_stats st;
+    int b = 0;
+    
+    huawei_port_stats(port, &st);
+    uint64_t us = st.final_us;
+    while (b < STATS_BUCKETS && us > stats_bucket_s[b] * 1e6) b++;
+    atomic_fetch_add_explicit(&stats.commands[outcome], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.latency[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.latency_sum_us, us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.bytes_out, strlen(cmd) + 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.bytes_in, st.rx_bytes, memory_order_relaxed);
+    
+    if (r < 0) {
+        int e = -huawei_port_error(port);
+        atomic_fetch_add_explicit(&stats.transfer_errors[e >= 1 && e < STATS_ERRORS ? e : 0], 1,
+                                  memory_order_relaxed);
+    } else if (huawei_result_final(res) == HUAWEI_FINAL_NONE) {
+        atomic_fetch_add_explicit(&stats.timeouts, 1, memory_order_relaxed);
+    } else {
+        stats_signal(cmd, res);
+    }
+}
+
+static uint64_t stats_get(_Atomic uint64_t *v) {
+    return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+static void stats_printf(char *buf, size_t *len, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+static void stats_printf(char *buf, size_t *len, const char *fmt, ...) {
+    va_list ap;
+    
+    if (*len >= STATS_BODY_MAX) return;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len, STATS_BODY_MAX - *len, fmt, ap);
+    va_end(ap);
+    if (n > 0) *len += (size_t)n;
+}
+
+static size_t stats_render(char *buf) {
+    const char *dev = stats.device;
+    size_t len = 0;
+    int32_t signal[TLM_METRICS][TLM_FIELDS_MAX];
+    uint64_t signal_us[TLM_METRICS];
+    unsigned seq;
+    
+    stats_printf(buf, &len, "# HELP huawei_at_commands_total AT commands by outcome.\n"
+                            "# TYPE huawei_at_commands_total counter\n");
+    for (int i = 0; i < STATS_OUTCOMES; i++) {
+        stats_printf(buf, &len, "huawei_at_commands_total{device=\"%s\",outcome=\"%s\"} %llu\n", dev,
+                     stats_outcome_names[i], (unsigned long long)stats_get(&stats.commands[i]));
+    }
+    
+    uint64_t count = 0;
+    stats_printf(buf, &len, "# HELP huawei_at_command_seconds USB round trip of AT commands.\n"
+                            "# TYPE huawei_at_command_seconds histogram\n");
+    for (int b = 0; b <= STATS_BUCKETS; b++) {
+        count += stats_get(&stats.latency[b]);
+        if (b < STATS_BUCKETS) {
+            stats_printf(buf, &len, "huawei_at_command_seconds_bucket{device=\"%s\",le=\"%g\"} %llu\n", dev,
+                         stats_bucket_s[b], (unsigned long long)count);
+        } else {
+            stats_printf(buf, &len, "huawei_at_command_seconds_bucket{device=\"%s\",le=\"+Inf\"} %llu\n", dev,
+                         (unsigned long long)count);
+        }
+    }
+    stats_printf(buf, &len, "huawei_at_command_seconds_sum{device=\"%s\"} %.6f\n", dev,
+                 stats_get(&stats.latency_sum_us) / 1e6);
+    stats_printf(buf, &len, "huawei_at_command_seconds_count{device=\"%s\"} %llu\n", dev, (unsigned long long)count);
+    
+    stats_printf(buf, &len, "# HELP huawei_at_timeouts_total Commands that ended without a final result code.\n"
+                            "# TYPE huawei_at_timeouts_total counter\n"
+                            "huawei_at_timeouts_total{device=\"%s\"} %llu\n", dev,
+                 (unsigned long long)stats_get(&stats.timeouts));
+    
+    stats_printf(buf, &len, "# HELP huawei_at_transfer_errors_total Commands failed by a USB transfer error.\n"
+                            "# TYPE huawei_at_transfer_errors_total counter\n");
+    for (int e = 0; e < STATS_ERRORS; e++) {
+        uint64_t v = stats_get(&stats.transfer_errors[e]);
+        if (v || e == 0) {
+            stats_printf(buf, &len, "huawei_at_transfer_errors_total{device=\"%s\",error=\"%s\"} %llu\n", dev,
+                         e ? libusb_error_name(-e) : "OTHER", (unsigned long long)v);
+        }
+    }
+    
+    stats_printf(buf, &len, "# HELP huawei_at_usb_bytes_total Bytes over the AT interface.\n"
+                            "# TYPE huawei_at_usb_bytes_total counter\n"
+                            "huawei_at_usb_bytes_total{device=\"%s\",direction=\"in\"} %llu\n"
+                            "huawei_at_usb_bytes_total{device=\"%s\",direction=\"out\"} %llu\n",
+                 dev, (unsigned long long)stats_get(&stats.bytes_in),
+                 dev, (unsigned long long)stats_get(&stats.bytes_out));
+    stats_printf(buf, &len, "# HELP huawei_at_reconnects_total Times the modem was reopened.\n"
+                            "# TYPE huawei_at_reconnects_total counter\n"
+                            "huawei_at_reconnects_total{device=\"%s\"} %llu\n"
+                            "# HELP huawei_at_up Whether the modem is open.\n"
+                            "# TYPE huawei_at_up gauge\n"
+                            "huawei_at_up{device=\"%s\"} %d\n"
+                            "# HELP huawei_at_clients Connected daemon clients.\n"
+                            "# TYPE huawei_at_clients gauge\n"
+                            "huawei_at_clients %d\n"
+                            "# HELP huawei_at_start_time_seconds When the daemon started.\n"
+                            "# TYPE huawei_at_start_time_seconds gauge\n"
+                            "huawei_at_start_time_seconds %.3f\n",
+                 dev, (unsigned long long)stats_get(&stats.reconnects), dev,
+                 atomic_load_explicit(&stats.up, memory_order_relaxed),
+                 atomic_load_explicit(&stats.clients, memory_order_relaxed), stats.start_us / 1e6);
+    
+    stats_printf(buf, &len, "# HELP huawei_at_cache_hits_total Commands answered from the response cache.\n"
+                            "# TYPE huawei_at_cache_hits_total counter\n"
+                            "huawei_at_cache_hits_total{device=\"%s\"} %llu\n"
+                            "# HELP huawei_at_cache_misses_total Cacheable commands sent to the modem.\n"
+                            "# TYPE huawei_at_cache_misses_total counter\n"
+                            "huawei_at_cache_misses_total{device=\"%s\"} %llu\n"
+                            "# HELP huawei_at_cache_invalidations_total Cache flushes (reconnect, ^BOOT, SIM events).\n"
+                            "# TYPE huawei_at_cache_invalidations_total counter\n"
+                            "huawei_at_cache_invalidations_total{device=\"%s\"} %llu\n",
+                 dev, (unsigned long long)stats_get(&stats.cache_hits), dev,
+                 (unsigned long long)stats_get(&stats.cache_misses), dev,
+                 (unsigned long long)stats_get(&stats.cache_invalidations));
+    
+    stats_printf(buf, &len, "# HELP huawei_at_requests_total Daemon requests by priority class.\n"
+                            "# TYPE huawei_at_requests_total counter\n");
+    for (int i = 0; i < SCHED_CLASSES; i++) {
+        stats_printf(buf, &len, "huawei_at_requests_total{device=\"%s\",class=\"%s\"} %llu\n", dev,
+                     sched_class_names[i], (unsigned long long)stats_get(&stats.requests[i]));
+    }
+    stats_printf(buf, &len, "# HELP huawei_at_coalesced_total Requests that shared a command already queued or "
+                            "running.\n"
+                            "# TYPE huawei_at_coalesced_total counter\n"
+                            "huawei_at_coalesced_total{device=\"%s\"} %llu\n"
+                            "# HELP huawei_at_expired_total Requests answered EXPIRED at their deadline.\n"
+                            "# TYPE huawei_at_expired_total counter\n"
+                            "huawei_at_expired_total{device=\"%s\"} %llu\n"
+                            "# HELP huawei_at_queue_wait_seconds_total Time commands spent queued before being "
+                            "sent.\n"
+                            "# TYPE huawei_at_queue_wait_seconds_total counter\n"
+                            "huawei_at_queue_wait_seconds_total{device=\"%s\"} %.6f\n"
+                            "# HELP huawei_at_queued Commands waiting for the modem.\n"
+                            "# TYPE huawei_at_queued gauge\n"
+                            "huawei_at_queued{device=\"%s\"} %d\n",
+                 dev, (unsigned long long)stats_get(&stats.coalesced), dev,
+                 (unsigned long long)stats_get(&stats.expired), dev, stats_get(&stats.queue_wait_us) / 1e6, dev,
+                 atomic_load_explicit(&stats.queued, memory_order_relaxed));
+    
+    // Copy the signal set out, retrying if the daemon was writing it
+    do {
+        seq = atomic_load_explicit(&stats.seq, memory_order_acquire);
+        for (int m = 0; m < TLM_METRICS; m++) {
+            signal_us[m] = stats_get(&stats.signal_us[m]);
+            for (int f = 0; f < TLM_FIELDS_MAX; f++) {
+                signal[m][f] = atomic_load_explicit(&stats.signal[m][f], memory_order_relaxed);
+            }
+        }
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&stats.seq, memory_order_relaxed));
+    
+    for (int m = 0; m < TLM_METRICS; m++) {
+        if (!signal_us[m]) continue;
+        for (int f = 0; f < tlm_metrics[m].fields; f++) {
+            if (signal[m][f] == TLM_NONE) continue;
+            stats_printf(buf, &len, "# TYPE huawei_at_%s_%s gauge\nhuawei_at_%s_%s{device=\"%s\"} %d\n",
+                         tlm_metrics[m].name, tlm_metrics[m].field[f], tlm_metrics[m].name,
+                         tlm_metrics[m].field[f], dev, signal[m][f]);
+        }
+        stats_printf(buf, &len, "# TYPE huawei_at_%s_time_seconds gauge\nhuawei_at_%s_time_seconds{device=\"%s\"} "
+                     "%.3f\n", tlm_metrics[m].name, tlm_metrics[m].name, dev, signal_us[m] / 1e6);
+    }
+    return len;
+}
+
+static void stats_respond(int fd) {
+    static char body[STATS_BODY_MAX];
+    char req[1024];
+    size_t n = 0;
+    
+    // Only the request line matters; give slow clients a second
+    while (n < sizeof(req) - 1 && !memchr(req, '\n', n)) {
+        struct pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, 1000) <= 0) return;
+        ssize_t r = read(fd, req + n, sizeof(req) - 1 - n);
+        if (r <= 0) return;
+        n += (size_t)r;
+    }
+    req[n] = '\0';
+    
+    char hdr[160];
+    size_t len = 0;
+    int ok = strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET / ", 6) == 0;
+    if (ok) len = stats_render(body);
+    int h = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n", ok ? "200 OK" : "404 Not Found", len);
+    if (write_all(fd, hdr, (size_t)h) == 0 && len > 0) write_all(fd, body, len);
+}
+
+static void *stats_thread(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    
+    while (!atomic_load(&stats_stop)) {
+        struct pollfd p = {lfd, POLLIN, 0};
+        if (poll(&p, 1, 200) <= 0) continue;
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) continue;
+        stats_respond(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+// "[host:]port" on loopback unless another host is given, or a Unix socket path
+static int stats_listen(const char *addr) {
+    int fd;
+    int bound;
+    
+    if (strchr(addr, '/')) {
+        struct sockaddr_un un;
+        if (strlen(addr) >= sizeof(un.sun_path)) return -1;
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strncpy(un.sun_path, addr, sizeof(un.sun_path) - 1);
+        unlink(addr);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        
+        // Owner only from the moment it exists, like the command socket
+        mode_t mask = umask(077);
+        bound = fd >= 0 && bind(fd, (struct sockaddr *)&un, sizeof(un)) == 0;
+        umask(mask);
+    } else {
+        struct sockaddr_in in;
+        const char *colon = strrchr(addr, ':');
+        char host[64] = "127.0.0.1";
+        int one = 1;
+        
+        if (colon) snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons((uint16_t)atoi(colon ? colon + 1 : addr));
+        if (inet_pton(AF_INET, host, &in.sin_addr) != 1) return -1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        bound = fd >= 0 && bind(fd, (struct sockaddr *)&in, sizeof(in)) == 0;
+    }
+    
+    if (bound && listen(fd, 8) == 0) return fd;
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+/*
+ * Response cache (daemon)
+ *
+ * Answers that do not change while the device stays attached (ATI, IMEI,
+ * IMSI, ICCID, firmware versions) are kept with a per-class TTL and served
+ * without a USB round trip. Commands are matched after normalization
+ * (upper case, no blanks). Everything is dropped when the modem is
+ * reopened or reports ^BOOT/^SYSSTART, and the SIM class on ^SIMST or a
+ * command that can change the SIM or radio state (AT+CPIN=, AT+CFUN=, ...).
+ * Only OK replies are stored. The "status" class (registration, signal)
+ * is off by default; a short TTL there lets many pollers share one query.
+ */
+
+#define CACHE_ENTRIES       32
+#define CACHE_FOREVER       UINT64_MAX
+
+enum cache_class {
+    CACHE_IDENTITY,
+    CACHE_SIM,
+    CACHE_STATUS,
+    CACHE_CLASSES
+};
+
+static const char *cache_class_names[CACHE_CLASSES] = {"identity", "sim", "status"};
+
+static const struct {
+    const char *cmd;        // normalized
+    enum cache_class cls;
+} cache_commands[] = {
+    {"ATI",         CACHE_IDENTITY}, {"AT+CGMI",     CACHE_IDENTITY}, {"AT+GMI",      CACHE_IDENTITY},
+    {"AT+CGMM",     CACHE_IDENTITY}, {"AT+GMM",      CACHE_IDENTITY}, {"AT+CGMR",     CACHE_IDENTITY},
+    {"AT+GMR",      CACHE_IDENTITY}, {"AT+CGSN",     CACHE_IDENTITY}, {"AT+GSN",      CACHE_IDENTITY},
+    {"AT+GCAP",     CACHE_IDENTITY}, {"AT^VERSION?", CACHE_IDENTITY}, {"AT^HWVER",    CACHE_IDENTITY},
+    {"AT+CIMI",     CACHE_SIM},      {"AT^ICCID?",   CACHE_SIM},      {"AT+CNUM",     CACHE_SIM},
+    {"AT+CPIN?",    CACHE_SIM},
+    {"AT+CSQ",      CACHE_STATUS},   {"AT^HCSQ?",    CACHE_STATUS},   {"AT^SYSINFOEX", CACHE_STATUS},
+    {"AT+CREG?",    CACHE_STATUS},   {"AT+CGREG?",   CACHE_STATUS},   {"AT+CEREG?",   CACHE_STATUS},
+    {"AT+COPS?",    CACHE_STATUS},
+};
+
+// Commands after which the SIM and everything derived from it may differ
+static const char *cache_sim_changers[] = {
+    "AT+CPIN=", "AT+CFUN=", "AT^RESET", "ATZ", "AT&F", "AT+CLCK=", "AT^CARDMODE", NULL
+};
+
+struct cache_entry {
+    char cmd[HUAWEI_COMMAND_MAX];
+    enum cache_class cls;
+    uint64_t expires_us;    // 0 = free slot
+    uint64_t stored_us;
+    size_t len;
+    char raw[HUAWEI_RESPONSE_MAX];
+};
+
+struct cache {
+    uint64_t ttl_us[CACHE_CLASSES];     // 0 = class not cached
+    struct cache_entry entry[CACHE_ENTRIES];
+};
+
+// "identity=inf,sim=3600,status=2" or "off"; seconds
+static int cache_configure(struct cache *c, const char *spec) {
+    char copy[128];
+    
+    c->ttl_us[CACHE_IDENTITY] = CACHE_FOREVER;
+    c->ttl_us[CACHE_SIM] = CACHE_FOREVER;
+    c->ttl_us[CACHE_STATUS] = 0;
+    if (!spec) return 0;
+    if (strcmp(spec, "off") == 0) {
+        memset(c->ttl_us, 0, sizeof(c->ttl_us));
+        return 0;
+    }
+    
+    snprintf(copy, sizeof(copy), "%s", spec);
+    for (char *item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        char *eq = strchr(item, '=');
+        int cls = 0;
+        
+        if (!eq) return -1;
+        *eq++ = '\0';
+        while (cls < CACHE_CLASSES && strcmp(item, cache_class_names[cls]) != 0) cls++;
+        if (cls == CACHE_CLASSES) return -1;
+        c->ttl_us[cls] = strcmp(eq, "inf") == 0 ? CACHE_FOREVER : (uint64_t)(atof(eq) * 1e6);
+    }
+    return 0;
+}
+
+// "at+cgsn " -> "AT+CGSN"; quoted arguments are left alone
+static void cache_normalize(const char *cmd, char *out, size_t size) {
+    size_t n = 0;
+    int quoted = 0;
+    
+    for (; *cmd && n < size - 1; cmd++) {
+        if (*cmd == '"') quoted = !quoted;
+        if (!quoted && (*cmd == ' ' || *cmd == '\t')) continue;
+        out[n++] = quoted ? *cmd : (char)toupper((unsigned char)*cmd);
+    }
+    out[n] = '\0';
+}
+
+static int cache_class_of(const struct cache *c, const char *key) {
+    for (size_t i = 0; i < sizeof(cache_commands) / sizeof(cache_commands[0]); i++) {
+        if (strcmp(key, cache_commands[i].cmd) == 0) {
+            return c->ttl_us[cache_commands[i].cls] ? (int)cache_commands[i].cls : -1;
+        }
+    }
+    return -1;
+}
+
+// Drop every entry of class cls, or all of them for cls < 0
+static void cache_invalidate(struct cache *c, int cls, const char *why, int verbose) {
+    int dropped = 0;
+    
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+        struct cache_entry *e = &c->entry[i];
+        if (e->expires_us && (cls < 0 || e->cls == (enum cache_class)cls)) {
+            e->expires_us = 0;
+            dropped++;
+        }
+    }
+    if (dropped) {
+        atomic_fetch_add_explicit(&stats.cache_invalidations, 1, memory_order_relaxed);
+        if (verbose) fprintf(stderr, "daemon: cache: dropped %d entries (%s)\n", dropped, why);
+    }
+}
+
+static const struct cache_entry *cache_lookup(struct cache *c, const char *key, uint64_t now) {
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+        struct cache_entry *e = &c->entry[i];
+        if (!e->expires_us || strcmp(e->cmd, key) != 0) continue;
+        if (now < e->expires_us) return e;
+        e->expires_us = 0;
+    }
+    return NULL;
+}
+
+static void cache_store(struct cache *c, const char *key, enum cache_class cls, const char *raw, size_t len,
+                        uint64_t now) {
+    struct cache_entry *slot = &c->entry[0];
+    
+    // A free or expired slot, else the oldest entry
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+        struct cache_entry *e = &c->entry[i];
+        if (!e->expires_us || now >= e->expires_us || strcmp(e->cmd, key) == 0) {
+            slot = e;
+            break;
+        }
+        if (e->stored_us < slot->stored_us) slot = e;
+    }
+    
+    snprintf(slot->cmd, sizeof(slot->cmd), "%s", key);
+    slot->cls = cls;
+    slot->stored_us = now;
+    slot->expires_us = c->ttl_us[cls] == CACHE_FOREVER ? CACHE_FOREVER : now + c->ttl_us[cls];
+    slot->len = len;
+    memcpy(slot->raw, raw, len);
+}
+
+// A command that went to the modem: drop what it may have changed
+static void cache_after_command(struct cache *c, const char *key, int verbose) {
+    for (int i = 0; cache_sim_changers[i]; i++) {
+        if (strncmp(key, cache_sim_changers[i], strlen(cache_sim_changers[i])) == 0) {
+            cache_invalidate(c, strncmp(key, "AT^RESET", 8) == 0 || strncmp(key, "ATZ", 3) == 0 ? -1 : CACHE_SIM,
+                             key, verbose);
+            cache_invalidate(c, CACHE_STATUS, key, verbose);
+            return;
+        }
+    }
+}
+
+/*
+ * Daemon mode
+ *
+ * The daemon opens and claims the modem once and then serves AT commands
+ * over a Unix stream socket. Protocol, one request per line:
+ *
+ *   client -> daemon:  [@<class>[/<deadline_ms>] ]<AT command>\n
+ *   daemon -> client:  <status> <latency_us> <length>\n<length bytes of raw response>
+ *
+ * status is OK, NORESP (nothing came back), EXPIRED (the deadline passed
+ * first) or ERROR (command could not be sent, even after reopening the
+ * device). latency_us covers the USB round trip only, measured with the
+ * monotonic clock; for EXPIRED it is the time the request waited.
+ *
+ * Requests from all clients go through a scheduler. A client has at most
+ * one command queued or running; lines it sends meanwhile stay in its
+ * buffer, so its replies come back in order. The next command out is the
+ * oldest of the most urgent class (high, normal, bulk), which with one
+ * command per client is round robin between clients. Every SCHED_AGE_MS of
+ * waiting moves a command up one class, so bulk work still gets through
+ * under steady interactive load. Queries (read and test commands ending in
+ * '?' and the ones the cache knows) join an identical command that is
+ * already queued or running and get its reply instead of going out again.
+ *
+ * A deadline covers queueing and the reply. A command still running when
+ * every client waiting for it has expired is cut short like a timeout, and
+ * the next one waits for the late final result code (or
+ * HUAWEI_RESPONSE_TIMEOUT_MS) so the two replies do not mix.
+ *
+ * With -I the daemon runs one command at a time on each AT port it claimed
+ * (the diagnostic port excluded). High and normal commands take any free
+ * port, bulk ones only the extra ports, so a long listing on the modem port
+ * leaves the PC UI port to interactive requests.
+ */
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void daemon_signal(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+struct daemon_client {
+    int fd;
+    int job;                // queued or running for this client, -1 = none
+    int eof;                // sent everything; dropped once answered
+    int dead;               // a reply could not be written
+    uint64_t queued_us;
+    uint64_t deadline_us;   // 0 = none
+    size_t len;
+    char line[DAEMON_LINE_MAX];
+};
+
+struct sched_job {
+    int used;
+    int chan;               // running on this channel, -1 = queued
+    int waiters;            // clients whose job this is
+    int retried;            // sent again after reopening the modem
+    enum sched_class cls;
+    int cache_cls;          // -1 = not cacheable
+    uint64_t queued_us;
+    char cmd[HUAWEI_COMMAND_MAX];
+    char key[HUAWEI_COMMAND_MAX];   // cache_normalize()d
+};
+
+// One AT port of the modem and the command on it
+struct daemon_channel {
+    struct daemon *daemon;
+    struct huawei_port *port;
+    enum huawei_role role;
+    int job;                    // running here, -1 = none
+    uint64_t start_us;          // when it went out
+    uint64_t deadline_us;       // when it is cut short, 0 = never
+    uint64_t settle_us;         // after a cut: no new command before the late reply or this
+    struct huawei_result *res;
+};
+
+struct daemon {
+    struct huawei_ctx *hc;
+    struct huawei_filter filter;
+    char path[HUAWEI_PATH_MAX]; // reopen the same physical stick after a replug
+    int verbose;
+    int open;
+    struct huawei_modem *modem;
+    struct cache cache;
+    
+    // Scheduler: one job per client, plus one per channel left running after its clients went
+    struct daemon_client client[DAEMON_MAX_CLIENTS];
+    int nclients;
+    struct sched_job job[SCHED_JOBS];
+    struct daemon_channel chan[HUAWEI_CHANNELS_MAX];
+    int nchan;
+};
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int daemon_reply(int fd, const char *status, uint64_t latency_us, const char *data, int len) {
+    char hdr[64];
+    int n = snprintf(hdr, sizeof(hdr), "%s %llu %d\n", status, (unsigned long long)latency_us, len);
+    if (write_all(fd, hdr, (size_t)n) < 0) return -1;
+    if (len > 0 && write_all(fd, data, (size_t)len) < 0) return -1;
+    return 0;
+}
+
+// Unsolicited results, also between commands (see daemon_pump())
+static void daemon_urc(void *opaque, const char *line, size_t len) {
+    struct daemon_channel *ch = opaque;
+    struct daemon *d = ch->daemon;
+    
+    if (ch->settle_us && huawei_at_match_final(line, len, 1) != HUAWEI_FINAL_NONE) {
+        // The late reply of a command cut short is complete
+        ch->settle_us = 0;
+    }
+    if (huawei_at_starts_with(line, len, "^BOOT") || huawei_at_starts_with(line, len, "^SYSSTART")) {
+        cache_invalidate(&d->cache, -1, "^BOOT", d->verbose);
+    } else if (huawei_at_starts_with(line, len, "^SIMST")) {
+        cache_invalidate(&d->cache, CACHE_SIM, "^SIMST", d->verbose);
+        cache_invalidate(&d->cache, CACHE_STATUS, "^SIMST", d->verbose);
+    }
+}
+
+static int daemon_open(struct daemon *d) {
+    d->open = huawei_open_all(d->hc, &d->filter, &d->modem, 1, d->verbose);
+    atomic_store_explicit(&stats.up, d->open, memory_order_relaxed);
+    if (!d->open) return 0;
+    
+    // The primary port first, then the extra ones that speak AT
+    d->nchan = 0;
+    for (int k = 0; k < HUAWEI_CHANNELS_MAX; k++) {
+        struct daemon_channel *ch = &d->chan[d->nchan];
+        enum huawei_role role;
+        struct huawei_port *port = huawei_modem_port(d->modem, k, &role);
+        if (!port) break;
+        if (role == HUAWEI_ROLE_DIAG) continue;
+        ch->daemon = d;
+        ch->port = port;
+        ch->role = role;
+        ch->job = -1;
+        ch->deadline_us = 0;
+        ch->settle_us = 0;
+        huawei_port_set_urc(ch->port, daemon_urc, ch);
+        d->nchan++;
+    }
+    return 1;
+}
+
+static void daemon_close(struct daemon *d) {
+    huawei_close(d->modem);
+    d->modem = NULL;
+    d->open = 0;
+}
+
+// Take in whatever arrived since the last command without waiting, so
+// URCs reach daemon_urc() before a cached answer goes out
+static void daemon_pump(struct daemon *d) {
+    if (!d->open) return;
+    huawei_handle_events(d->hc, 0);
+    if (huawei_port_queued(huawei_modem_port(d->modem, 0, NULL)) == 0) {
+        // Every IN transfer failed: the stick is most likely gone
+        cache_invalidate(&d->cache, -1, "IN transfers stopped", d->verbose);
+    }
+}
+
+static void daemon_answer(struct daemon_client *c, const char *status, uint64_t latency_us, const char *data,
+                          int len) {
+    if (daemon_reply(c->fd, status, latency_us, data, len) < 0) c->dead = 1;
+}
+
+// "@high/500 AT+CSQ": class and deadline (both optional) ahead of the
+// command. Returns the command, NULL if the options are malformed.
+static char *sched_options(char *line, enum sched_class *cls, unsigned long *deadline_ms) {
+    *cls = SCHED_NORMAL;
+    *deadline_ms = 0;
+    if (*line != '@') return line;
+    
+    char *name = line + 1;
+    char *end = name + strcspn(name, "/ \t");
+    if (end > name) {
+        int c = 0;
+        while (c < SCHED_CLASSES && (strlen(sched_class_names[c]) != (size_t)(end - name) ||
+                                     strncmp(name, sched_class_names[c], (size_t)(end - name)) != 0)) c++;
+        if (c == SCHED_CLASSES) return NULL;
+        *cls = (enum sched_class)c;
+    }
+    if (*end == '/') {
+        char *num = end + 1;
+        *deadline_ms = strtoul(num, &end, 10);
+        if (end == num) return NULL;
+    }
+    if (*end != ' ' && *end != '\t') return NULL;
+    while (*end == ' ' || *end == '\t') end++;
+    return *end ? end : NULL;
+}
+
+// Read ("?") and test ("=?") commands and the ones the cache knows change
+// nothing on the modem, so identical ones can share a reply
+static int sched_is_query(const char *key) {
+    size_t n = strlen(key);
+    
+    if (n > 0 && key[n - 1] == '?') return 1;
+    for (size_t i = 0; i < sizeof(cache_commands) / sizeof(cache_commands[0]); i++) {
+        if (strcmp(key, cache_commands[i].cmd) == 0) return 1;
+    }
+    return 0;
+}
+
+// Cut the running job j short at the latest deadline of its clients,
+// unless one of them has none
+static void sched_set_deadline(struct daemon *d, int j) {
+    struct daemon_channel *ch = &d->chan[d->job[j].chan];
+    uint64_t latest = 0;
+    
+    for (int i = 0; i < d->nclients; i++) {
+        const struct daemon_client *c = &d->client[i];
+        if (c->job != j) continue;
+        if (!c->deadline_us) {
+            latest = 0;
+            break;
+        }
+        if (c->deadline_us > latest) latest = c->deadline_us;
+    }
+    ch->deadline_us = latest;
+    huawei_port_set_deadline(ch->port, latest);
+}
+
+// Client c no longer waits for its job; a queued job nobody waits for is dropped
+static void sched_detach(struct daemon *d, struct daemon_client *c) {
+    struct sched_job *job = &d->job[c->job];
+    
+    if (--job->waiters == 0 && job->chan < 0) job->used = 0;
+    c->job = -1;
+}
+
+// Queue one request line of client c, or answer it right away
+static void sched_submit(struct daemon *d, struct daemon_client *c, char *line) {
+    enum sched_class cls;
+    unsigned long deadline_ms;
+    char key[HUAWEI_COMMAND_MAX];
+    uint64_t now = now_us();
+    const char *cmd = sched_options(line, &cls, &deadline_ms);
+    
+    if (!cmd || strlen(cmd) >= HUAWEI_COMMAND_MAX) {
+        daemon_answer(c, "ERROR", 0, NULL, 0);
+        return;
+    }
+    atomic_fetch_add_explicit(&stats.requests[cls], 1, memory_order_relaxed);
+    
+    cache_normalize(cmd, key, sizeof(key));
+    int cache_cls = cache_class_of(&d->cache, key);
+    if (cache_cls >= 0) {
+        daemon_pump(d);
+        const struct cache_entry *e = cache_lookup(&d->cache, key, now);
+        if (e) {
+            uint64_t latency = now_us() - now;
+            atomic_fetch_add_explicit(&stats.cache_hits, 1, memory_order_relaxed);
+            if (d->verbose) {
+                fprintf(stderr, "daemon: %s -> %zu bytes in %.3f ms (cached)\n", cmd, e->len, latency / 1000.0);
+            }
+            daemon_answer(c, "OK", latency, e->raw, (int)e->len);
+            return;
+        }
+    }
+    
+    c->queued_us = now;
+    c->deadline_us = deadline_ms ? now + (uint64_t)deadline_ms * 1000 : 0;
+    
+    int j = 0;
+    if (sched_is_query(key)) {
+        while (j < SCHED_JOBS && !(d->job[j].used && strcmp(d->job[j].key, key) == 0)) j++;
+        if (j < SCHED_JOBS) {
+            struct sched_job *job = &d->job[j];
+            job->waiters++;
+            if (cls < job->cls) job->cls = cls;
+            c->job = j;
+            if (job->chan >= 0) sched_set_deadline(d, j);
+            atomic_fetch_add_explicit(&stats.coalesced, 1, memory_order_relaxed);
+            if (d->verbose) {
+                fprintf(stderr, "daemon: %s joins one %s\n", cmd, job->chan >= 0 ? "running" : "queued");
+            }
+            return;
+        }
+    }
+    
+    for (j = 0; d->job[j].used; j++) {
+    }
+    struct sched_job *job = &d->job[j];
+    job->used = 1;
+    job->chan = -1;
+    job->waiters = 1;
+    job->retried = 0;
+    job->cls = cls;
+    job->cache_cls = cache_cls;
+    job->queued_us = now;
+    snprintf(job->cmd, sizeof(job->cmd), "%s", cmd);
+    snprintf(job->key, sizeof(job->key), "%s", key);
+    c->job = j;
+}
+
+// Answer EXPIRED to clients past their deadline
+static void sched_expire(struct daemon *d, uint64_t now) {
+    for (int i = 0; i < d->nclients; i++) {
+        struct daemon_client *c = &d->client[i];
+        if (c->job < 0 || !c->deadline_us || now < c->deadline_us) continue;
+        if (d->verbose) {
+            fprintf(stderr, "daemon: %s expired after %.3f ms\n", d->job[c->job].cmd,
+                    (now - c->queued_us) / 1000.0);
+        }
+        atomic_fetch_add_explicit(&stats.expired, 1, memory_order_relaxed);
+        daemon_answer(c, "EXPIRED", now - c->queued_us, NULL, 0);
+        sched_detach(d, c);
+    }
+}
+
+// Most urgent class after aging first, oldest first within a class, among
+// the jobs channel k may run: bulk stays off the primary port if there are others
+static int sched_pick(const struct daemon *d, int k, uint64_t now) {
+    int best = -1;
+    int64_t best_rank = 0;
+    
+    for (int j = 0; j < SCHED_JOBS; j++) {
+        const struct sched_job *job = &d->job[j];
+        if (!job->used || job->chan >= 0) continue;
+        if (job->cls == SCHED_BULK && k == 0 && d->nchan > 1) continue;
+        int64_t rank = (int64_t)job->cls - (int64_t)((now - job->queued_us) / (SCHED_AGE_MS * 1000));
+        if (rank < 0) rank = 0;
+        if (best < 0 || rank < best_rank || (rank == best_rank && job->queued_us < d->job[best].queued_us)) {
+            best = j;
+            best_rank = rank;
+        }
+    }
+    return best;
+}
+
+// The job on channel ch ended with r (see huawei_port_result()). A failed
+// transfer reopens the modem and queues it once more, along with whatever
+// ran on the other channels; otherwise everyone waiting for it gets the reply.
+static void sched_complete(struct daemon *d, struct daemon_channel *ch, int r) {
+    int j = ch->job;
+    struct sched_job *job = &d->job[j];
+    
+    if (d->open) stats_command(ch->port, job->cmd, r, ch->res);
+    
+    if (r < 0 && !job->retried) {
+        // Device probably went away (replug, mode switch) - reopen once
+        if (d->verbose) fprintf(stderr, "daemon: reopening modem\n");
+        job->retried = 1;
+        for (int k = 0; k < d->nchan; k++) {
+            if (d->chan[k].job >= 0) d->job[d->chan[k].job].chan = -1;
+            d->chan[k].job = -1;
+        }
+        daemon_close(d);
+        cache_invalidate(&d->cache, -1, "reopen", d->verbose);
+        if (daemon_open(d)) atomic_fetch_add_explicit(&stats.reconnects, 1, memory_order_relaxed);
+        return;
+    }
+    
+    uint64_t now = now_us();
+    uint64_t latency = now - ch->start_us;
+    ch->job = -1;
+    job->chan = -1;
+    if (r >= 0 && huawei_result_final(ch->res) == HUAWEI_FINAL_NONE && ch->deadline_us && now >= ch->deadline_us) {
+        // The modem is most likely still answering, and the rest of this
+        // reply would be taken for the next command's
+        ch->settle_us = now + (uint64_t)HUAWEI_RESPONSE_TIMEOUT_MS * 1000;
+    }
+    if (d->verbose) {
+        fprintf(stderr, "daemon: %s -> %d bytes in %.3f ms", job->cmd, r, latency / 1000.0);
+        if (d->nchan > 1) fprintf(stderr, " on %s", huawei_role_name(ch->role));
+        if (job->waiters > 1) fprintf(stderr, " for %d clients", job->waiters);
+        fprintf(stderr, "\n");
+    }
+    
+    cache_after_command(&d->cache, job->key, d->verbose);
+    if (job->cache_cls >= 0 && r > 0 && huawei_result_final(ch->res) == HUAWEI_FINAL_OK &&
+        !huawei_result_truncated(ch->res)) {
+        size_t len;
+        const char *raw = huawei_result_raw(ch->res, &len);
+        cache_store(&d->cache, job->key, (enum cache_class)job->cache_cls, raw, len, now);
+    }
+    
+    for (int i = 0; i < d->nclients; i++) {
+        struct daemon_client *c = &d->client[i];
+        if (c->job != j) continue;
+        if (r < 0) {
+            daemon_answer(c, "ERROR", latency, NULL, 0);
+        } else if (r == 0) {
+            daemon_answer(c, "NORESP", latency, NULL, 0);
+        } else {
+            daemon_answer(c, "OK", latency, huawei_result_raw(ch->res, NULL), r);
+        }
+        c->job = -1;
+    }
+    job->used = 0;
+    job->waiters = 0;
+}
+
+// Put the next job on every free channel
+static void sched_dispatch(struct daemon *d) {
+    for (int k = 0; k < d->nchan; k++) {
+        struct daemon_channel *ch = &d->chan[k];
+        uint64_t now = now_us();
+        
+        if (ch->job >= 0 || (ch->settle_us && now < ch->settle_us)) continue;
+        ch->settle_us = 0;
+        int j = sched_pick(d, k, now);
+        if (j < 0) continue;
+        
+        struct sched_job *job = &d->job[j];
+        ch->job = j;
+        job->chan = k;
+        ch->start_us = now;
+        atomic_fetch_add_explicit(&stats.queue_wait_us, now - job->queued_us, memory_order_relaxed);
+        if (job->cache_cls >= 0) atomic_fetch_add_explicit(&stats.cache_misses, 1, memory_order_relaxed);
+        
+        if (!d->open) {
+            sched_complete(d, ch, -1);
+        } else if (huawei_port_command(ch->port, job->cmd, ch->res) < 0) {
+            sched_complete(d, ch, huawei_port_result(ch->port));
+        } else {
+            sched_set_deadline(d, j);
+        }
+    }
+}
+
+// Whether the loop has something to do without waiting for a socket
+static int sched_ready(const struct daemon *d) {
+    for (int k = 0; k < d->nchan; k++) {
+        if (d->chan[k].job >= 0 || d->chan[k].settle_us) return 1;
+    }
+    for (int j = 0; j < SCHED_JOBS; j++) {
+        if (d->job[j].used) return 1;
+    }
+    for (int i = 0; i < d->nclients; i++) {
+        const struct daemon_client *c = &d->client[i];
+        if (c->job < 0 && memchr(c->line, '\n', c->len)) return 1;
+    }
+    return 0;
+}
+
+// Hand the client's next complete line to the scheduler once it has
+// nothing queued or running. Returns -1 when the client should be dropped.
+static int daemon_client_next(struct daemon *d, struct daemon_client *c) {
+    while (c->job < 0 && !c->dead) {
+        char *nl = memchr(c->line, '\n', c->len);
+        if (!nl) {
+            if (c->len == sizeof(c->line) - 1) {
+                // Line too long for any AT command
+                daemon_reply(c->fd, "ERROR", 0, NULL, 0);
+                return -1;
+            }
+            return c->eof ? -1 : 0;
+        }
+        *nl = '\0';
+        if (nl > c->line && nl[-1] == '\r') nl[-1] = '\0';
+        if (c->line[0]) sched_submit(d, c, c->line);
+        
+        size_t used = (size_t)(nl + 1 - c->line);
+        c->len -= used;
+        memmove(c->line, c->line + used, c->len);
+    }
+    return c->dead ? -1 : 0;
+}
+
+int run_daemon(struct huawei_ctx *hc, const struct huawei_filter *filter, int verbose, const char *socket_path,
+               const char *stats_addr, const char *cache_spec) {
+    static struct daemon d;
+    struct sockaddr_un addr;
+    struct pollfd pfds[DAEMON_MAX_CLIENTS + 1];
+    int stats_fd = -1;
+    pthread_t stats_tid;
+    
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    
+    d.hc = hc;
+    d.filter = *filter;
+    d.filter.all = 0;
+    d.verbose = verbose;
+    if (cache_configure(&d.cache, cache_spec) < 0) {
+        fprintf(stderr, "Bad cache TTLs '%s' (e.g. identity=inf,sim=3600,status=2 or off)\n", cache_spec);
+        return 1;
+    }
+    for (int k = 0; k < HUAWEI_CHANNELS_MAX; k++) {
+        d.chan[k].res = huawei_result_new();
+        if (!d.chan[k].res) return 1;
+    }
+    if (!daemon_open(&d)) {
+        scan_huawei_devices(hc);
+        return 1;
+    }
+    snprintf(d.path, sizeof(d.path), "%s", huawei_modem_path(d.modem));
+    d.filter.path = d.path;
+    
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("socket");
+        daemon_close(&d);
+        return 1;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    
+    // The socket gives full modem access - owner only from the moment it exists
+    mode_t mask = umask(077);
+    int bound = bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(lfd, DAEMON_MAX_CLIENTS) < 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        close(lfd);
+        daemon_close(&d);
+        return 1;
+    }
+    
+    if (stats_addr) {
+        snprintf(stats.device, sizeof(stats.device), "%s", d.path);
+        stats.start_us = wall_us();
+        atomic_store(&stats.up, 1);
+        stats_fd = stats_listen(stats_addr);
+        if (stats_fd < 0 || pthread_create(&stats_tid, NULL, stats_thread, (void *)(intptr_t)stats_fd) != 0) {
+            fprintf(stderr, "Cannot serve metrics on %s: %s\n", stats_addr, strerror(errno));
+            if (stats_fd >= 0) close(stats_fd);
+            close(lfd);
+            unlink(socket_path);
+            daemon_close(&d);
+            return 1;
+        }
+    }
+    
+    signal(SIGINT, daemon_signal);
+    signal(SIGTERM, daemon_signal);
+    signal(SIGPIPE, SIG_IGN);
+    
+    fprintf(stderr, "huawei_at daemon for %s listening on %s\n", d.path, socket_path);
+    if (stats_addr) fprintf(stderr, "Metrics on %s\n", stats_addr);
+    
+    while (!daemon_stop) {
+        pfds[0].fd = lfd;
+        pfds[0].events = POLLIN;
+        for (int i = 0; i < d.nclients; i++) {
+            struct daemon_client *c = &d.client[i];
+            pfds[i + 1].fd = c->fd;
+            pfds[i + 1].events = !c->eof && c->len < sizeof(c->line) - 1 ? POLLIN : 0;
+        }
+        
+        // While a command runs the sockets are only checked in passing;
+        // the wait happens in the USB event loop below
+        if (poll(pfds, (nfds_t)(d.nclients + 1), sched_ready(&d) ? 0 : -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        
+        for (int i = 0; i < d.nclients; i++) {
+            struct daemon_client *c = &d.client[i];
+            if (!pfds[i + 1].revents) continue;
+            ssize_t n = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len);
+            if (n > 0) {
+                c->len += (size_t)n;
+            } else if (n == 0 || errno != EINTR) {
+                c->eof = 1;
+            }
+        }
+        
+        if (pfds[0].revents & POLLIN) {
+            int cfd = accept(lfd, NULL, NULL);
+            if (cfd >= 0) {
+                if (d.nclients == DAEMON_MAX_CLIENTS) {
+                    daemon_reply(cfd, "ERROR", 0, NULL, 0);
+                    close(cfd);
+                } else {
+                    struct daemon_client *c = &d.client[d.nclients++];
+                    c->fd = cfd;
+                    c->job = -1;
+                    c->eof = 0;
+                    c->dead = 0;
+                    c->len = 0;
+                }
+            }
+        }
+        
+        struct huawei_port *running[HUAWEI_CHANNELS_MAX];
+        int nrunning = 0;
+        int settling = 0;
+        for (int k = 0; k < d.nchan; k++) {
+            if (d.chan[k].job >= 0) running[nrunning++] = d.chan[k].port;
+            if (d.chan[k].settle_us) settling = 1;
+        }
+        if (nrunning > 0) {
+            huawei_poll_wait(running, nrunning, SCHED_SLICE_US);
+        } else if (settling && d.open) {
+            huawei_handle_events(d.hc, SCHED_SLICE_US);
+        }
+        sched_expire(&d, now_us());
+        for (int k = 0; k < d.nchan; k++) {
+            struct daemon_channel *ch = &d.chan[k];
+            if (ch->job >= 0 && !huawei_port_pending(ch->port)) sched_complete(&d, ch, huawei_port_result(ch->port));
+        }
+        
+        // Queue the next line of every idle client; compact the array as they drop out
+        int kept = 0;
+        for (int i = 0; i < d.nclients; i++) {
+            struct daemon_client *c = &d.client[i];
+            if (daemon_client_next(&d, c) < 0) {
+                if (c->job >= 0) sched_detach(&d, c);
+                close(c->fd);
+                continue;
+            }
+            if (kept != i) d.client[kept] = *c;
+            kept++;
+        }
+        d.nclients = kept;
+        sched_dispatch(&d);
+        
+        int queued = 0;
+        for (int j = 0; j < SCHED_JOBS; j++) {
+            if (d.job[j].used && d.job[j].chan < 0) queued++;
+        }
+        atomic_store_explicit(&stats.clients, d.nclients, memory_order_relaxed);
+        atomic_store_explicit(&stats.queued, queued, memory_order_relaxed);
+    }
+    
+    if (stats_fd >= 0) {
+        atomic_store(&stats_stop, 1);
+        pthread_join(stats_tid, NULL);
+        close(stats_fd);
+        if (strchr(stats_addr, '/')) unlink(stats_addr);
+    }
+    
+    for (int i = 0; i < d.nclients; i++) {
+        close(d.client[i].fd);
+    }
+    close(lfd);
+    unlink(socket_path);
+    daemon_close(&d);
+    for (int k = 0; k < HUAWEI_CHANNELS_MAX; k++) {
+        huawei_result_free(d.chan[k].res);
+    }
+    fprintf(stderr, "huawei_at daemon stopped\n");
+    return 0;
+}
+
+// "@<class>/<ms> " from -P and -D, sent ahead of every command
+static char daemon_options[48];
+
+/*
+ * Default socket path: $XDG_RUNTIME_DIR/huawei_at.sock, else a private
+ * /tmp/huawei_at-<uid>/ directory. With create the directory is made if
+ * needed and must be ours and 0700, so nobody else can plant a socket there
+ * or reach ours
+ */
+int default_socket_path(char *buf, size_t size, int create) {
+    const char *run = getenv("XDG_RUNTIME_DIR");
+    char dir[PATH_MAX];
+    struct stat st;
+    
+    if (run && run[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s", run);
+    } else {
+        snprintf(dir, sizeof(dir), "/tmp/huawei_at-%u", (unsigned)getuid());
+        if (create) {
+            if (mkdir(dir, 0700) < 0 && errno != EEXIST) return -1;
+            if (lstat(dir, &st) < 0) return -1;
+            if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+                errno = EPERM;
+                return -1;
+            }
+        }
+    }
+    if ((size_t)snprintf(buf, size, "%s/" SOCKET_NAME, dir) >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int daemon_connect(const char *socket_path) {
+    struct sockaddr_un addr;
+    
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return -1;
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int daemon_running(const char *socket_path) {
+    int fd = daemon_connect(socket_path);
+    if (fd < 0) return 0;
+    close(fd);
+    return 1;
+}
+
+/*
+ * Thin client: forward one command to a running daemon.
+ * Returns the response length (0 for no response), -1 on a daemon-side
+ * error, or -2 if no daemon is listening so the caller should fall back
+ * to opening the device directly.
+ */
+int daemon_command(const char *socket_path, const char *cmd, char *response, size_t response_size,
+                   uint64_t *latency_us) {
+    char hdr[64];
+    char status[16];
+    unsigned long long latency = 0;
+    int len = 0;
+    size_t n = 0;
+    
+    int fd = daemon_connect(socket_path);
+    if (fd < 0) return -2;
+    
+    if (write_all(fd, daemon_options, strlen(daemon_options)) < 0 || write_all(fd, cmd, strlen(cmd)) < 0 ||
+        write_all(fd, "\n", 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    // Header line
+    while (n < sizeof(hdr) - 1) {
+        if (read_all(fd, hdr + n, 1) < 0) {
+            close(fd);
+            return -1;
+        }
+        if (hdr[n] == '\n') break;
+        n++;
+    }
+    hdr[n] = '\0';
+    
+    if (sscanf(hdr, "%15s %llu %d", status, &latency, &len) != 3 || len < 0) {
+        close(fd);
+        return -1;
+    }
+    if (latency_us) *latency_us = latency;
+    
+    // Body - keep what fits, drain the rest
+    size_t keep = (size_t)len < response_size - 1 ? (size_t)len : response_size - 1;
+    if (read_all(fd, response, keep) < 0) {
+        close(fd);
+        return -1;
+    }
+    response[keep] = '\0';
+    for (size_t rest = (size_t)len - keep; rest > 0; ) {
+        char drain[256];
+        size_t chunk = rest < sizeof(drain) ? rest : sizeof(drain);
+        if (read_all(fd, drain, chunk) < 0) break;
+        rest -= chunk;
+    }
+    close(fd);
+    
+    if (strcmp(status, "ERROR") == 0) return -1;
+    return (int)keep;
+}
+
+/*
+ * Batch mode
+ *
+ * Reads one AT command per line (blank lines and '#' comments are skipped)
+ * and runs them back to back over the one claimed interface, or through a
+ * running daemon. Each command produces one JSON object per output line:
+ *
+ *   {"cmd":"AT+CSQ","status":"ok","final":"OK","response":"+CSQ: 20,99\n","ms":3.412}
+ *
+ * status is ok, error (final result code was an error), noresp or failed
+ * (transfer error).
+ */
+
+static const char *batch_status(int r, const struct huawei_result *res) {
+    if (r < 0) return "failed";
+    if (r == 0) return "noresp";
+    if (huawei_final_is_error(huawei_result_final(res))) return "error";
+    return "ok";
+}
+
+static void batch_emit(const char *cmd, const char *dev, int r, const struct huawei_result *res, uint64_t latency) {
+    printf("{\"cmd\":");
+    json_string(stdout, cmd, strlen(cmd));
+    if (dev) {
+        printf(",\"dev\":");
+        json_string(stdout, dev, strlen(dev));
+    }
+    printf(",\"status\":\"%s\",\"final\":", batch_status(r, res));
+    if (r > 0) {
+        const char *final_line = huawei_result_final_line(res), *info = huawei_result_info(res);
+        json_string(stdout, final_line, strlen(final_line));
+        printf(",\"response\":");
+        json_string(stdout, info, strlen(info));
+    } else {
+        printf("null,\"response\":null");
+    }
+    printf(",\"ms\":%.3f}\n", latency / 1000.0);
+}
+
+/*
+ * Commands go to every opened modem concurrently (a "dev" field is added
+ * when there is more than one), or through the daemon when socket_path is
+ * set. Returns the number of commands that did not end in OK/CONNECT.
+ */
+int run_batch(FILE *in, struct huawei_modem **modems, int count, const char *socket_path, int stop_on_error) {
+    static char relay[HUAWEI_RESPONSE_MAX];
+    char line[HUAWEI_COMMAND_MAX];
+    int status[HUAWEI_MODEMS_MAX];
+    int failures = 0;
+    int n = socket_path ? 1 : count;
+    struct huawei_result **res = results_new(n);
+    
+    if (!res) return 1;
+    
+    while (fgets(line, sizeof(line), in)) {
+        size_t len = strlen(line);
+        int too_long = 0;
+        if (len == sizeof(line) - 1 && line[len - 1] != '\n') {
+            // A full buffer: either the newline comes next or the line is too long
+            int c;
+            while ((c = getc(in)) == '\r') {}
+            too_long = c != '\n' && c != EOF;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        
+        char *cmd = line;
+        while (*cmd == ' ' || *cmd == '\t') cmd++;
+        if (!too_long && (*cmd == '\0' || *cmd == '#')) continue;
+        
+        int failed = 0;
+        if (too_long) {
+            // Sending it in pieces would run each piece as a command of its own
+            int c;
+            while ((c = getc(in)) != EOF && c != '\n') {}
+            if (*cmd != '#') {
+                printf("{\"cmd\":");
+                json_string(stdout, cmd, strlen(cmd));
+                printf(",\"status\":\"toolong\",\"final\":null,\"response\":null,\"ms\":0.000}\n");
+                failed = 1;
+            }
+        } else if (socket_path) {
+            uint64_t latency = 0;
+            status[0] = daemon_command(socket_path, cmd, relay, sizeof(relay), &latency);
+            if (status[0] > 0) huawei_result_parse(res[0], cmd, relay, (size_t)status[0]);
+            batch_emit(cmd, NULL, status[0], res[0], latency);
+            failed = strcmp(batch_status(status[0], res[0]), "ok") != 0;
+        } else {
+            huawei_command_all(modems, count, cmd, res, status);
+            for (int i = 0; i < count; i++) {
+                struct huawei_command_stats st;
+                huawei_port_stats(huawei_modem_port(modems[i], 0, NULL), &st);
+                batch_emit(cmd, count > 1 ? huawei_modem_path(modems[i]) : NULL, status[i], res[i], st.final_us);
+                if (strcmp(batch_status(status[i], res[i]), "ok") != 0) failed = 1;
+            }
+        }
+        fflush(stdout);
+        
+        if (failed) {
+            failures++;
+            if (stop_on_error) break;
+        }
+    }
+    
+    results_free(res, n);
+    return failures;
+}
+
+/*
+ * Monitor mode
+ *
+ * Keeps the modem claimed with its IN transfers queued the whole time and
+ * logs every unsolicited result code, timestamped (UTC) and classified:
+ *
+ *   2026-10-16T09:12:03.418Z signal ^HCSQ: "LTE",52,41,120,24
+ *   2026-10-16T09:12:07.002Z sms +CMTI: "SM",3
+ *
+ * Lines are parsed inside the libusb callbacks into a fixed ring of records
+ * that the main loop drains to stdout or the -o file, so memory stays the
+ * same however long it runs. If output falls more than URC_RING_SIZE
+ * records behind, the oldest are overwritten and a "lost <n>" line says so.
+ * AT commands read from stdin run on the same port in between; URCs that
+ * arrive while one is pending are still logged, not mixed into its reply.
+ * A modem that goes away is reopened on the same port path, SIGHUP reopens
+ * the log file (logrotate) and SIGINT/SIGTERM stop.
+ */
+
+#define URC_RING_SIZE       256     // records, power of two
+#define URC_TEXT_MAX        200     // longer URCs are cut
+#define MONITOR_TICK_MS     50      // stdin and signal latency
+#define MONITOR_REOPEN_MS   1000
+
+struct urc_record {
+    uint64_t wall_us;
+    enum huawei_urc_class cls;
+    size_t len;
+    char text[URC_TEXT_MAX];
+};
+
+struct urc_ring {
+    struct urc_record rec[URC_RING_SIZE];
+    uint64_t head;          // next slot written
+    uint64_t tail;          // next slot drained
+    uint64_t lost;          // overwritten since the last drain
+    uint64_t total;
+    uint64_t lost_total;
+    uint64_t count[HUAWEI_URC_CLASSES];
+};
+
+struct monitor {
+    struct huawei_ctx *hc;
+    struct huawei_filter filter;
+    char path[HUAWEI_PATH_MAX];
+    const char *log_path;
+    FILE *out;
+    int verbose;
+    int open;
+    struct huawei_modem *modem;
+    struct urc_ring ring;
+    struct huawei_result *result;
+    size_t len;
+    char line[HUAWEI_COMMAND_MAX];
+};
+
+static volatile sig_atomic_t monitor_stop = 0;
+static volatile sig_atomic_t monitor_hup = 0;
+
+static void monitor_signal(int sig) {
+    if (sig == SIGHUP) {
+        monitor_hup = 1;
+    } else {
+        monitor_stop = 1;
+    }
+}
+
+static uint64_t wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// "2026-10-16T09:12:03.418Z"
+static void format_wall(uint64_t us, char *buf, size_t size) {
+    time_t sec = (time_t)(us / 1000000);
+    struct tm tm;
+    
+    gmtime_r(&sec, &tm);
+    size_t n = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + n, size - n, ".%03uZ", (unsigned)(us % 1000000 / 1000));
+}
+
+// URC sink for the port: runs inside the event loop, never blocks
+static void urc_ring_push(void *opaque, const char *line, size_t len) {
+    struct urc_ring *ring = opaque;
+    
+    if (ring->head - ring->tail == URC_RING_SIZE) {
+        ring->tail++;
+        ring->lost++;
+        ring->lost_total++;
+    }
+    
+    struct urc_record *r = &ring->rec[ring->head & (URC_RING_SIZE - 1)];
+    if (len > sizeof(r->text)) len = sizeof(r->text);
+    r->wall_us = wall_us();
+    r->cls = huawei_at_urc_class(line, len);
+    r->len = len;
+    memcpy(r->text, line, len);
+    
+    ring->count[r->cls]++;
+    ring->total++;
+    ring->head++;
+}
+
+static void urc_ring_drain(struct urc_ring *ring, FILE *out) {
+    char ts[32];
+    
+    if (ring->lost) {
+        format_wall(wall_us(), ts, sizeof(ts));
+        fprintf(out, "%s lost %llu\n", ts, (unsigned long long)ring->lost);
+        ring->lost = 0;
+    }
+    while (ring->tail != ring->head) {
+        const struct urc_record *r = &ring->rec[ring->tail & (URC_RING_SIZE - 1)];
+        format_wall(r->wall_us, ts, sizeof(ts));
+        fprintf(out, "%s %s %.*s\n", ts, huawei_urc_class_name(r->cls), (int)r->len, r->text);
+        ring->tail++;
+    }
+    fflush(out);
+}
+
+// Modem attach/detach lines share the log with the URCs
+static void monitor_event(struct monitor *m, const char *what) {
+    char ts[32];
+    
+    urc_ring_drain(&m->ring, m->out);
+    format_wall(wall_us(), ts, sizeof(ts));
+    fprintf(m->out, "%s monitor %s %s\n", ts, what, m->path);
+    fflush(m->out);
+}
+
+static int monitor_attach(struct monitor *m) {
+    struct huawei_port *port;
+    enum huawei_role role;
+    
+    m->open = huawei_open_all(m->hc, &m->filter, &m->modem, 1, m->verbose);
+    if (!m->open) return 0;
+    
+    snprintf(m->path, sizeof(m->path), "%s", huawei_modem_path(m->modem));
+    
+    // URCs go to whichever AT port the firmware picks, so listen on all of them
+    for (int k = 0; (port = huawei_modem_port(m->modem, k, &role)) != NULL; k++) {
+        if (k == 0 || role != HUAWEI_ROLE_DIAG) huawei_port_set_urc(port, urc_ring_push, &m->ring);
+    }
+    monitor_event(m, "attached");
+    return 1;
+}
+
+static void monitor_command(struct monitor *m, const char *cmd) {
+    if (!m->open) {
+        fprintf(stderr, "%s: no modem\n", cmd);
+        return;
+    }
+    
+    int r = huawei_command(m->modem, cmd, m->result);
+    
+    // URCs that came in while it ran are older than the reply
+    urc_ring_drain(&m->ring, m->out);
+    if (r > 0) {
+        print_result(m->result, 0, 0);
+    } else if (r == 0) {
+        fprintf(stderr, "%s: no response\n", cmd);
+    }
+    fflush(stdout);
+}
+
+// Run complete lines from stdin; returns -1 at end of input
+static int monitor_input(struct monitor *m) {
+    ssize_t n = read(STDIN_FILENO, m->line + m->len, sizeof(m->line) - 1 - m->len);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    if (n == 0) return -1;
+    m->len += (size_t)n;
+    
+    char *start = m->line;
+    char *nl;
+    while ((nl = memchr(start, '\n', m->len - (size_t)(start - m->line))) != NULL) {
+        *nl = '\0';
+        if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+        if (*start) monitor_command(m, start);
+        start = nl + 1;
+    }
+    
+    m->len -= (size_t)(start - m->line);
+    memmove(m->line, start, m->len);
+    if (m->len == sizeof(m->line) - 1) {
+        fprintf(stderr, "Command too long, ignored\n");
+        m->len = 0;
+    }
+    return 0;
+}
+
+int run_monitor(struct huawei_ctx *hc, const struct huawei_filter *filter, const char *log_path, int verbose) {
+    static struct monitor m;
+    int input = 1;
+    uint64_t next_attach = 0;
+    
+    m.hc = hc;
+    m.filter = *filter;
+    m.filter.all = 0;
+    m.verbose = verbose;
+    m.log_path = log_path;
+    m.result = huawei_result_new();
+    if (!m.result) return 1;
+    m.out = log_path ? fopen(log_path, "a") : stdout;
+    if (!m.out) {
+        fprintf(stderr, "Cannot open %s: %s\n", log_path, strerror(errno));
+        huawei_result_free(m.result);
+        return 1;
+    }
+    
+    if (!monitor_attach(&m)) {
+        scan_huawei_devices(hc);
+        if (log_path) fclose(m.out);
+        huawei_result_free(m.result);
+        return 1;
+    }
+    // Reattach to the same physical stick
+    m.filter.path = m.path;
+    
+    signal(SIGINT, monitor_signal);
+    signal(SIGTERM, monitor_signal);
+    signal(SIGHUP, monitor_signal);
+    
+    while (!monitor_stop) {
+        if (monitor_hup) {
+            monitor_hup = 0;
+            FILE *f = log_path ? fopen(log_path, "a") : NULL;
+            if (f) {
+                fclose(m.out);
+                m.out = f;
+            }
+        }
+        
+        if (!m.open && now_us() >= next_attach) {
+            if (!monitor_attach(&m)) next_attach = now_us() + (uint64_t)MONITOR_REOPEN_MS * 1000;
+        }
+        
+        // With the modem open, libusb does the waiting below
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        int wait = m.open ? 0 : MONITOR_TICK_MS;
+        if (input) {
+            if (poll(&pfd, 1, wait) > 0 && monitor_input(&m) < 0) input = 0;
+        } else if (wait) {
+            poll(NULL, 0, wait);
+        }
+        
+        if (m.open) {
+            huawei_handle_events(hc, MONITOR_TICK_MS * 1000);
+            
+            // Every IN transfer failed and none can be resubmitted: the stick is gone
+            if (huawei_port_rearm(huawei_modem_port(m.modem, 0, NULL)) == 0) {
+                urc_ring_drain(&m.ring, m.out);
+                huawei_close(m.modem);
+                m.modem = NULL;
+                m.open = 0;
+                monitor_event(&m, "detached");
+            }
+        }
+        
+        urc_ring_drain(&m.ring, m.out);
+    }
+    
+    huawei_close(m.modem);
+    huawei_result_free(m.result);
+    urc_ring_drain(&m.ring, m.out);
+    if (log_path) fclose(m.out);
+    
+    fprintf(stderr, "monitor: %llu URCs", (unsigned long long)m.ring.total);
+    for (int i = 0; i < HUAWEI_URC_CLASSES; i++) {
+        if (m.ring.count[i]) {
+            fprintf(stderr, ", %s %llu", huawei_urc_class_name(i), (unsigned long long)m.ring.count[i]);
+        }
+    }
+    fprintf(stderr, ", %llu lost\n", (unsigned long long)m.ring.lost_total);
+    return 0;
+}
+
+/*
+ * SMS
+ *
+ * PDU mode throughout (AT+CMGF=0), with the codec in huawei_sms.h. Listings
+ * stream: each +CMGL header and PDU line is decoded as the parser hands it
+ * over, so a store of any size goes through without the reply being
+ * buffered. Only parts of concatenated messages wait, up to SMS_GROUPS
+ * messages at a time, for the rest of their message. Each message becomes
+ * one JSON line:
+ *
+ *   {"index":[3,4],"status":"unread","from":"Huawei","time":"2026-10-16T09:12:03+02:00","text":"...","parts":2}
+ *
+ * Sending runs AT+CMGS's two steps (length, "> " prompt, then the PDU and
+ * Ctrl-Z) back to back over the claimed port, one JSON line per message.
+ * With -a the messages are spread over every opened modem from one event
+ * loop, each modem taking the next message as soon as it is free; the parts
+ * of one message always go out through the same modem.
+ */
+
+#define SMS_GROUPS          32
+#define SMS_SEND_TIMEOUT_MS 60000   // PDU to +CMGS: includes the network round trip
+
+static const char *sms_status_names[] = {"unread", "read", "unsent", "sent", "all"};
+
+struct sms_group {
+    int used;
+    uint64_t age;
+    int stat;
+    int received;
+    struct sms_pdu head;            // first part that arrived: address, time, reference
+    int index[SMS_PARTS_MAX];
+    char *text[SMS_PARTS_MAX];
+    size_t len[SMS_PARTS_MAX];
+};
+
+struct sms_list {
+    int index;                      // store index of the PDU line expected next, -1 = none
+    int stat;
+    int read_index;                 // AT+CMGR's index, its header doesn't repeat it
+    int messages;
+    int bad;
+    uint64_t age;
+    struct sms_pdu pdu;
+    struct sms_group groups[SMS_GROUPS];
+};
+
+static int sms_status_code(const char *name) {
+    for (int i = 0; i < 5; i++) {
+        if (strcmp(name, sms_status_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+static void sms_emit(const int *index, int nindex, int stat, const struct sms_pdu *pdu, char *const *text,
+                     const size_t *len, int pieces, int parts) {
+    printf("{\"index\":[");
+    for (int i = 0; i < nindex; i++) {
+        printf("%s%d", i ? "," : "", index[i]);
+    }
+    printf("],\"status\":\"%s\",\"%s\":", stat >= 0 && stat < 4 ? sms_status_names[stat] : "unknown",
+           pdu->type == SMS_DELIVER ? "from" : "to");
+    json_string(stdout, pdu->addr, strlen(pdu->addr));
+    if (pdu->time[0]) printf(",\"time\":\"%s\"", pdu->time);
+    printf(",\"%s\":\"", pdu->alphabet == SMS_8BIT ? "data" : "text");
+    for (int i = 0; i < pieces; i++) {
+        json_chars(stdout, text[i], len[i]);
+    }
+    printf("\"");
+    if (parts > 1) printf(",\"parts\":%d", parts);
+    if (nindex < parts) printf(",\"missing\":%d", parts - nindex);
+    printf("}\n");
+}
+
+static void sms_group_flush(struct sms_list *l, struct sms_group *g) {
+    int index[SMS_PARTS_MAX] = {0};
+    char *text[SMS_PARTS_MAX] = {0};
+    size_t len[SMS_PARTS_MAX] = {0};
+    int n = 0;
+    
+    for (int i = 0; i < g->head.concat_total; i++) {
+        if (!g->text[i]) continue;
+        index[n] = g->index[i];
+        text[n] = g->text[i];
+        len[n] = g->len[i];
+        n++;
+    }
+    sms_emit(index, n, g->stat, &g->head, text, len, n, g->head.concat_total);
+    
+    for (int i = 0; i < n; i++) {
+        free(text[i]);
+    }
+    memset(g, 0, sizeof(*g));
+    l->messages++;
+}
+
+static void sms_list_add(struct sms_list *l, int index) {
+    const struct sms_pdu *p = &l->pdu;
+    struct sms_group *g = NULL;
+    
+    if (p->concat_total < 2 || p->concat_total > SMS_PARTS_MAX) {
+        char *text = (char *)p->text;
+        sms_emit(&index, 1, l->stat, p, &text, &p->text_len, 1, 1);
+        l->messages++;
+        return;
+    }
+    
+    for (int i = 0; i < SMS_GROUPS && !g; i++) {
+        struct sms_group *c = &l->groups[i];
+        if (c->used && c->head.concat_ref == p->concat_ref && c->head.concat_total == p->concat_total &&
+            strcmp(c->head.addr, p->addr) == 0) {
+            g = c;
+        }
+    }
+    // A second copy of a part means an older message with the same reference
+    if (g && g->text[p->concat_seq - 1]) {
+        sms_group_flush(l, g);
+        g = NULL;
+    }
+    
+    if (!g) {
+        struct sms_group *oldest = &l->groups[0];
+        for (int i = 0; i < SMS_GROUPS && !g; i++) {
+            if (!l->groups[i].used) g = &l->groups[i];
+            else if (l->groups[i].age < oldest->age) oldest = &l->groups[i];
+        }
+        if (!g) {
+            sms_group_flush(l, oldest);
+            g = oldest;
+        }
+        g->used = 1;
+        g->age = l->age++;
+        g->stat = l->stat;
+        g->head = *p;
+    }
+    
+    int seq = p->concat_seq - 1;
+    g->text[seq] = malloc(p->text_len + 1);
+    if (!g->text[seq]) return;
+    memcpy(g->text[seq], p->text, p->text_len + 1);
+    g->len[seq] = p->text_len;
+    g->index[seq] = index;
+    if (++g->received == g->head.concat_total) sms_group_flush(l, g);
+}
+
+// Streaming line callback for AT+CMGL and AT+CMGR
+static void sms_list_line(void *opaque, enum huawei_line_kind kind, const char *line, size_t len) {
+    struct sms_list *l = opaque;
+    int index = -1, stat = -1;
+    
+    if (kind != HUAWEI_LINE_INFO) return;
+    
+    // A header that does not parse drops the PDU line after it
+    if (huawei_at_starts_with(line, len, "+CMGL:")) {
+        l->index = -1;
+        if (sscanf(line + 6, "%d,%d", &index, &stat) != 2) return;
+        l->index = index;
+        l->stat = stat;
+        return;
+    }
+    if (huawei_at_starts_with(line, len, "+CMGR:")) {
+        l->index = -1;
+        if (sscanf(line + 6, "%d", &stat) != 1) return;
+        l->index = l->read_index;
+        l->stat = stat;
+        return;
+    }
+    if (l->index < 0) return;
+    
+    if (sms_decode(line, len, &l->pdu) == 0) {
+        sms_list_add(l, l->index);
+    } else {
+        printf("{\"index\":[%d],\"error\":\"undecodable PDU\",\"pdu\":", l->index);
+        json_string(stdout, line, len);
+        printf("}\n");
+        l->bad++;
+    }
+    l->index = -1;
+}
+
+// Run one command to completion; 0 if it ended in OK
+static int sms_command(struct huawei_modem *m, const char *cmd, struct huawei_result *res, huawei_line_fn fn,
+                       void *opaque) {
+    struct huawei_port *port = huawei_modem_port(m, 0, NULL);
+    const char *path = huawei_modem_path(m);
+    
+    if (huawei_port_stream(port, cmd, res, fn, opaque) == 0) {
+        huawei_run(&port, 1);
+    }
+    
+    int r = huawei_port_result(port);
+    if (r < 0) {
+        fprintf(stderr, "%s: error sending command: %s\n", path, libusb_strerror(huawei_port_error(port)));
+    } else if (r == 0) {
+        fprintf(stderr, "%s: %s: no response\n", path, cmd);
+    } else if (huawei_result_final(res) != HUAWEI_FINAL_OK) {
+        const char *final = huawei_result_final_line(res);
+        fprintf(stderr, "%s: %s: %s\n", path, cmd, final[0] ? final : "no result code");
+    }
+    return r > 0 && huawei_result_final(res) == HUAWEI_FINAL_OK ? 0 : -1;
+}
+
+// sms_command() for a reply nothing is wanted from
+static int sms_simple(struct huawei_modem *m, const char *cmd) {
+    struct huawei_result *res = huawei_result_new();
+    
+    if (!res) return -1;
+    int r = sms_command(m, cmd, res, NULL, NULL);
+    huawei_result_free(res);
+    return r;
+}
+
+// AT+CMGL=<stat>, or AT+CMGR=<index> when index >= 0
+static int sms_list(struct huawei_modem *m, int stat, int index, int verbose) {
+    static struct sms_list l;
+    struct huawei_result *res = huawei_result_new();
+    char cmd[32];
+    
+    if (!res) return 1;
+    memset(&l, 0, sizeof(l));
+    l.index = -1;
+    l.read_index = index;
+    if (index >= 0) {
+        snprintf(cmd, sizeof(cmd), "AT+CMGR=%d", index);
+    } else {
+        snprintf(cmd, sizeof(cmd), "AT+CMGL=%d", stat);
+    }
+    
+    uint64_t start = now_us();
+    int r = sms_command(m, cmd, res, sms_list_line, &l);
+    
+    // Concatenated messages still missing parts, oldest first
+    for (;;) {
+        struct sms_group *oldest = NULL;
+        for (int i = 0; i < SMS_GROUPS; i++) {
+            if (l.groups[i].used && (!oldest || l.groups[i].age < oldest->age)) oldest = &l.groups[i];
+        }
+        if (!oldest) break;
+        sms_group_flush(&l, oldest);
+    }
+    fflush(stdout);
+    
+    if (verbose) {
+        struct huawei_command_stats cs;
+        double secs = (now_us() - start) / 1e6;
+        huawei_port_stats(huawei_modem_port(m, 0, NULL), &cs);
+        fprintf(stderr, "sms: %d messages, %d undecodable, %llu bytes in %.3f s, %.0f msg/s\n", l.messages, l.bad,
+                (unsigned long long)cs.rx_bytes, secs, secs > 0 ? l.messages / secs : 0.0);
+    }
+    huawei_result_free(res);
+    return r < 0 ? 1 : 0;
+}
+
+/*
+ * Sending
+ */
+
+enum sms_step {
+    SMS_IDLE,
+    SMS_LENGTH,     // AT+CMGS=<length> sent, waiting for "> "
+    SMS_PDU         // PDU sent, waiting for +CMGS: <mr>
+};
+
+struct sms_source {
+    FILE *in;               // "<number> <text>" per line, or NULL for the one message below
+    const char *to;
+    const char *text;
+    int line;
+    int rejected;           // could not be encoded
+};
+
+struct sms_sender {
+    struct huawei_modem *modem;
+    enum sms_step step;
+    char to[SMS_ADDR_MAX];
+    int line;
+    int nparts;
+    int next;               // part in flight
+    int mr[SMS_PARTS_MAX];
+    uint64_t start_us;
+    struct sms_part parts[SMS_PARTS_MAX];
+    struct huawei_result *res;
+};
+
+struct sms_stats {
+    int sent;
+    int failed;
+    int parts;
+    int multi;              // several modems: add "dev" to the output
+};
+
+static unsigned sms_ref;
+
+// Next message from the source into s; 0 when there are no more
+static int sms_source_next(struct sms_source *src, struct sms_sender *s) {
+    char buf[1024];
+    const char *to, *text;
+    
+    for (;;) {
+        if (!src->in) {
+            if (!src->to) return 0;
+            to = src->to;
+            text = src->text;
+            src->to = NULL;
+        } else {
+            if (!fgets(buf, sizeof(buf), src->in)) return 0;
+            src->line++;
+            buf[strcspn(buf, "\r\n")] = '\0';
+            char *p = buf;
+            while (*p == ' ' || *p == '\t') p++;
+            if (*p == '\0' || *p == '#') continue;
+            to = p;
+            p += strcspn(p, " \t");
+            if (*p) *p++ = '\0';
+            text = p;
+        }
+        
+        snprintf(s->to, sizeof(s->to), "%.*s", (int)sizeof(s->to) - 1, to);
+        s->line = src->line;
+        s->nparts = sms_encode_submit(to, text, (int)(sms_ref++ & 0xFF), s->parts, SMS_PARTS_MAX);
+        if (s->nparts > 0) return 1;
+        
+        if (src->in) fprintf(stderr, "line %d: ", src->line);
+        fprintf(stderr, "cannot encode message to '%s' (bad number or more than %d parts)\n", to, SMS_PARTS_MAX);
+        src->rejected++;
+        if (!src->in) return 0;
+    }
+}
+
+static void sms_sender_done(struct sms_sender *s, struct sms_stats *st, const char *error) {
+    printf("{\"to\":");
+    json_string(stdout, s->to, strlen(s->to));
+    if (st->multi) {
+        printf(",\"dev\":");
+        const char *path = huawei_modem_path(s->modem);
+        json_string(stdout, path, strlen(path));
+    }
+    printf(",\"status\":\"%s\",\"parts\":%d,\"mr\":[", error ? "failed" : "ok", s->nparts);
+    for (int i = 0; i < s->next; i++) {
+        printf("%s%d", i ? "," : "", s->mr[i]);
+    }
+    printf("]");
+    if (error) {
+        printf(",\"error\":");
+        json_string(stdout, error, strlen(error));
+    }
+    printf(",\"ms\":%.3f}\n", (now_us() - s->start_us) / 1000.0);
+    fflush(stdout);
+    
+    if (error) st->failed++;
+    else st->sent++;
+    s->step = SMS_IDLE;
+}
+
+// AT+CMGS=<length> for the next part
+static void sms_sender_part(struct sms_sender *s, struct sms_stats *st) {
+    char cmd[32];
+    
+    snprintf(cmd, sizeof(cmd), "AT+CMGS=%d", s->parts[s->next].length);
+    s->step = SMS_LENGTH;
+    
+    // Every part starts on the default timeouts; only its PDU gets SMS_SEND_TIMEOUT_MS
+    struct huawei_port *port = huawei_modem_port(s->modem, 0, NULL);
+    huawei_port_set_timeout(port, 0);
+    huawei_port_set_deadline(port, 0);
+    if (huawei_port_command(port, cmd, s->res) < 0) {
+        huawei_port_result(port);
+        sms_sender_done(s, st, libusb_strerror(huawei_port_error(port)));
+    }
+}
+
+// The sender's command has finished: take the next step
+static void sms_sender_step(struct sms_sender *s, struct sms_stats *st) {
+    struct huawei_port *port = huawei_modem_port(s->modem, 0, NULL);
+    int r = huawei_port_result(port);
+    const char *final = huawei_result_final_line(s->res);
+    const char *error = r < 0 ? libusb_strerror(huawei_port_error(port))
+                      : r == 0 ? "no response"
+                      : final[0] ? final : "no result code";
+    
+    if (s->step == SMS_LENGTH) {
+        if (r <= 0 || huawei_result_final(s->res) != HUAWEI_FINAL_PROMPT) {
+            sms_sender_done(s, st, error);
+            return;
+        }
+        huawei_port_set_timeout(port, SMS_SEND_TIMEOUT_MS);
+        s->step = SMS_PDU;
+        if (huawei_port_text(port, "AT+CMGS", s->parts[s->next].hex, s->res) < 0) {
+            huawei_port_result(port);
+            sms_sender_done(s, st, libusb_strerror(huawei_port_error(port)));
+        }
+        return;
+    }
+    
+    if (r <= 0 || huawei_result_final(s->res) != HUAWEI_FINAL_OK) {
+        sms_sender_done(s, st, error);
+        return;
+    }
+    const char *mr = strstr(huawei_result_info(s->res), "+CMGS:");
+    s->mr[s->next++] = mr ? atoi(mr + 6) : -1;
+    st->parts++;
+    if (s->next < s->nparts) {
+        sms_sender_part(s, st);
+    } else {
+        sms_sender_done(s, st, NULL);
+    }
+}
+
+int sms_send(struct huawei_modem **modems, int count, struct sms_source *src) {
+    struct sms_sender *senders = calloc((size_t)count, sizeof(*senders));
+    struct huawei_result **res = results_new(count);
+    struct sms_stats st = {0, 0, 0, count > 1};
+    int more = 1;
+    
+    if (!senders || !res) {
+        results_free(res, count);
+        free(senders);
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        senders[i].modem = modems[i];
+        senders[i].res = res[i];
+    }
+    sms_ref = (unsigned)(now_us() ^ (uint64_t)getpid());
+    
+    uint64_t start = now_us();
+    for (;;) {
+        struct huawei_port *ports[HUAWEI_MODEMS_MAX];
+        int n = 0;
+        
+        for (int i = 0; i < count; i++) {
+            struct sms_sender *s = &senders[i];
+            struct huawei_port *port = huawei_modem_port(s->modem, 0, NULL);
+            
+            if (s->step != SMS_IDLE && !huawei_port_pending(port)) sms_sender_step(s, &st);
+            if (s->step == SMS_IDLE && more) {
+                more = sms_source_next(src, s);
+                if (more) {
+                    s->next = 0;
+                    s->start_us = now_us();
+                    sms_sender_part(s, &st);
+                }
+            }
+            if (s->step != SMS_IDLE) ports[n++] = port;
+        }
+        if (n == 0) break;
+        huawei_poll(ports, n);
+    }
+    
+    double secs = (now_us() - start) / 1e6;
+    st.failed += src->rejected;
+    fprintf(stderr, "sms: %d sent, %d failed, %d parts in %.3f s, %.1f msg/s\n", st.sent, st.failed, st.parts,
+            secs, secs > 0 ? st.sent / secs : 0.0);
+    results_free(res, count);
+    free(senders);
+    return st.failed > 0;
+}
+
+// A message index from the command line, -1 if it is not a number from 0 to 65535
+static int sms_index(const char *arg) {
+    char *end;
+    
+    if (!isdigit((unsigned char)arg[0])) return -1;
+    errno = 0;
+    long v = strtol(arg, &end, 10);
+    return *end || errno || v > 65535 ? -1 : (int)v;
+}
+
+static void sms_usage(void) {
+    fprintf(stderr, "Usage: huawei_at [options] sms list [unread|read|unsent|sent|all]\n"
+                    "       huawei_at [options] sms read <index>\n"
+                    "       huawei_at [options] sms delete <index>|all\n"
+                    "       huawei_at [options] sms send <number> <text>\n"
+                    "       huawei_at [options] sms send -f <file>   ('-' for stdin, \"<number> <text>\" per line)\n");
+}
+
+// "sms ..." subcommands; list, read and delete use the first modem, send all of them
+int run_sms(struct huawei_modem **modems, int count, int argc, char **argv, int verbose) {
+    const char *op = argc > 0 ? argv[0] : "";
+    int send = strcmp(op, "send") == 0;
+    
+    if (!send) count = 1;
+    for (int i = 0; i < count; i++) {
+        if (sms_simple(modems[i], "AT+CMGF=0") < 0) return 1;
+    }
+    
+    if (strcmp(op, "list") == 0 && argc <= 2) {
+        int stat = argc == 2 ? sms_status_code(argv[1]) : 4;
+        if (stat >= 0) return sms_list(modems[0], stat, -1, verbose);
+    } else if (strcmp(op, "read") == 0 && argc == 2 && sms_index(argv[1]) >= 0) {
+        return sms_list(modems[0], 0, sms_index(argv[1]), verbose);
+    } else if (strcmp(op, "delete") == 0 && argc == 2 && (strcmp(argv[1], "all") == 0 || sms_index(argv[1]) >= 0)) {
+        char cmd[32];
+        if (strcmp(argv[1], "all") == 0) {
+            snprintf(cmd, sizeof(cmd), "AT+CMGD=0,4");
+        } else {
+            snprintf(cmd, sizeof(cmd), "AT+CMGD=%d", sms_index(argv[1]));
+        }
+        return sms_simple(modems[0], cmd) < 0;
+    } else if (send && argc == 3) {
+        struct sms_source src = {NULL, argv[1], argv[2], 0, 0};
+        if (strcmp(argv[1], "-f") == 0) {
+            src.in = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+            if (!src.in) {
+                fprintf(stderr, "Cannot open %s: %s\n", argv[2], strerror(errno));
+                return 1;
+            }
+        }
+        int r = sms_send(modems, count, &src);
+        if (src.in && src.in != stdin) fclose(src.in);
+        return r;
+    }
+    
+    sms_usage();
+    return 1;
+}
+
+/*
+ * Signal sampler
+ *
+ * "sample" polls a set of metrics (AT+CSQ, AT^HCSQ?, AT^SYSINFOEX,
+ * AT+CREG?) on every opened modem at a fixed rate over the sessions opened
+ * once at startup, and appends the parsed values to a telemetry file (see
+ * huawei_telemetry.h; huawei_telemetry exports it). Ticks are scheduled at
+ * start + k * interval on the monotonic clock, so the rate does not drift
+ * however long a tick takes. All modems share one event loop and run their
+ * commands concurrently, each on a schedule of its own: a slow modem that
+ * is still busy at its next tick skips it (an overrun) and starts again at
+ * the first tick after it finishes, without holding back the others. A
+ * modem that goes away is dropped.
+ */
+
+#define SAMPLE_RATE_MAX     100     // Hz
+#define SAMPLE_FIELD_MAX    32
+
+static volatile sig_atomic_t sample_stop = 0;
+
+static void sample_signal(int sig) {
+    (void)sig;
+    sample_stop = 1;
+}
+
+// See tlm_metrics: stored as the index
+static const char *sample_hcsq_modes[] = {"NOSERVICE", "GSM", "WCDMA", "TD-SCDMA", "LTE", "CDMA", "EVDO", "NR", NULL};
+
+struct sampler {
+    struct huawei_modem *modem;
+    struct huawei_port *port;
+    int dev;                // index in the telemetry file
+    int next;               // index into the metric list, -1 = idle
+    int gone;
+    uint64_t tick_us;       // monotonic schedule time of the sample in progress
+    uint64_t next_us;       // schedule time of the next sample
+    unsigned long ticks;    // schedule slots passed, taken or skipped
+    struct tlm_sample sample;
+    struct huawei_result *res;
+    unsigned long samples;
+    unsigned long overruns;
+    unsigned long errors;
 };
 
-static libusb_device_handle *handle = NULL;
-static int ep_in = -1;
-static int ep_out = -1;
-static int claimed_interface = -1;
-
-const char* get_pid_name(uint16_t pid) {
-    switch(pid) {
-        // Classic 3G/HSPA
-        case 0x1001: return "E169/E620/E800/E1550";
-        case 0x1003: return "E1550 Modem";
-        case 0x140c: return "E180/E1550";
-        case 0x1406: return "E1750";
-        case 0x1436: return "E173/E1750";
-        case 0x1446: return "E1756/E173";
-        case 0x1465: return "K3765";
-        case 0x14AC: return "E1820";
-        case 0x14C6: return "K4605";
-        case 0x14C9: return "K4505";
-        case 0x1c05: return "E173";
-        case 0x1c07: return "E173s";
-        case 0x1c1b: return "E3531";
-        // E3xx Series
-        case 0x1506: return "E303/E3131/MS2372";
-        case 0x14db: return "E3131/E353 HiLink";
-        case 0x14fe: return "E303/E3131 Intermediate";
-        case 0x15ca: return "E3131h-2";
-        case 0x1f01: return "E353/E3131";
-        // E3372/E8372 LTE
-        case 0x1442: return "E3372 Stick";
-        case 0x14dc: return "E3372/E8372 HiLink";
-        case 0x155e: return "E8372 NCM";
-        case 0x157f: return "E8372 Alt";
-        case 0x1592: return "E8372h";
-        // K-Series LTE
-        case 0x1505: return "E398/K5005 LTE";
-        case 0x1520: return "K3765 HSPA";
-        case 0x1521: return "K4505 HSPA+";
-        case 0x1575: return "K5150 LTE";
-        case 0x15c1: return "ME906s LTE";
-        case 0x1f1e: return "K5160";
-        // Legacy/Other
-        case 0x1404: return "E1752";
-        case 0x1411: return "E510";
-        case 0x141b: return "E1752 Alt";
-        case 0x1464: return "K4510/K4511";
-        case 0x14ba: return "E173 Alt";
-        case 0x14d1: return "E173";
-        case 0x1c0b: return "E173s Off";
-        case 0x1da1: return "E3372";
-        default: return "Unknown Huawei";
-    }
-}
-
-int find_endpoints(libusb_device *dev) {
-    struct libusb_config_descriptor *config;
-    int r = libusb_get_active_config_descriptor(dev, &config);
-    if (r < 0) return r;
-    
-    // First pass: look for CDC/Modem class interface
-    for (int i = 0; i < config->bNumInterfaces; i++) {
-        const struct libusb_interface *iface = &config->interface[i];
-        for (int j = 0; j < iface->num_altsetting; j++) {
-            const struct libusb_interface_descriptor *setting = &iface->altsetting[j];
-            
-            // Prefer CDC Data (0x0A) or Vendor Specific (0xFF) with bulk endpoints
-            if (setting->bInterfaceClass != 0x0A && 
-                setting->bInterfaceClass != 0xFF &&
-                setting->bInterfaceClass != 0x02) {
-                continue;
-            }
-            
-            int found_in = -1, found_out = -1;
-            
-            for (int k = 0; k < setting->bNumEndpoints; k++) {
-                const struct libusb_endpoint_descriptor *ep = &setting->endpoint[k];
-                if ((ep->bmAttributes & 0x03) == LIBUSB_TRANSFER_TYPE_BULK) {
-                    if (ep->bEndpointAddress & 0x80) {
-                        found_in = ep->bEndpointAddress;
-                    } else {
-                        found_out = ep->bEndpointAddress;
-                    }
-                }
+// Split "2,\"LTE\",,41" into fields with the quotes removed
+static int sample_split(const char *s, char (*field)[SAMPLE_FIELD_MAX], int max) {
+    int n = 0;
+    
+    while (*s == ' ') s++;
+    while (n < max) {
+        size_t len = 0;
+        int quoted = 0;
+        for (; *s && *s != '\n' && (quoted || *s != ','); s++) {
+            if (*s == '"') {
+                quoted = !quoted;
+            } else if (len < SAMPLE_FIELD_MAX - 1) {
+                field[n][len++] = *s;
             }
-            
-            if (found_in >= 0 && found_out >= 0) {
-                ep_in = found_in;
-                ep_out = found_out;
-                claimed_interface = setting->bInterfaceNumber;
-                libusb_free_config_descriptor(config);
-                return 0;
+        }
+        field[n++][len] = '\0';
+        if (*s != ',') break;
+        s++;
+    }
+    return n;
+}
+
+static int32_t sample_int(char (*field)[SAMPLE_FIELD_MAX], int n, int i, int base) {
+    char *end;
+    
+    if (i >= n || !field[i][0]) return TLM_NONE;
+    long v = strtol(field[i], &end, base);
+    return *end ? TLM_NONE : (int32_t)v;
+}
+
+// Parse the reply of metric m into the sample; 0 if it had the expected line
+static int sample_parse(struct tlm_sample *s, enum tlm_metric m, const struct huawei_result *res) {
+    const struct tlm_metric_info *info = &tlm_metrics[m];
+    char field[10][SAMPLE_FIELD_MAX];
+    int32_t *v = s->value[m];
+    const char *line = huawei_result_info(res);
+    size_t plen = strlen(info->prefix);
+    
+    while (strncmp(line, info->prefix, plen) != 0) {
+        line = strchr(line, '\n');
+        if (!line++) return -1;
+    }
+    int n = sample_split(line + plen, field, 10);
+    
+    switch (m) {
+        case TLM_CSQ:
+            v[0] = sample_int(field, n, 0, 10);
+            v[1] = sample_int(field, n, 1, 10);
+            break;
+        case TLM_HCSQ:
+            v[0] = TLM_NONE;
+            for (int i = 0; sample_hcsq_modes[i]; i++) {
+                if (strcmp(field[0], sample_hcsq_modes[i]) == 0) v[0] = i;
             }
+            for (int i = 1; i < info->fields; i++) v[i] = sample_int(field, n, i, 10);
+            break;
+        case TLM_SYSINFOEX:
+            // srv_status,srv_domain,roam,sim_state,lock_state,sysmode,"name",submode,"name"
+            for (int i = 0; i < 4; i++) v[i] = sample_int(field, n, i, 10);
+            v[4] = sample_int(field, n, 5, 10);
+            v[5] = sample_int(field, n, 7, 10);
+            break;
+        case TLM_CREG:
+            // n,stat[,lac,ci[,act]] with lac and ci in hex
+            v[0] = sample_int(field, n, 1, 10);
+            v[1] = sample_int(field, n, 2, 16);
+            v[2] = sample_int(field, n, 3, 16);
+            v[3] = sample_int(field, n, 4, 10);
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+// Start the next metric that can be sent; -1 once the sample is complete
+static int sampler_issue(struct sampler *sp, const enum tlm_metric *list, int nlist) {
+    for (; sp->next < nlist; sp->next++) {
+        if (huawei_port_command(sp->port, tlm_metrics[list[sp->next]].cmd, sp->res) == 0) return 0;
+        sp->errors++;
+    }
+    return -1;
+}
+
+static void sampler_finish(struct sampler *sp, struct tlm_writer *w, uint64_t mono0, uint64_t wall0) {
+    sp->sample.wall_us = wall0 + (sp->tick_us - mono0);
+    tlm_writer_sample(w, &sp->sample);
+    sp->samples++;
+    sp->next = -1;
+}
+
+// Start the sample due at next_us, skipping the slots that passed while the modem was busy
+static void sampler_start(struct sampler *sp, const enum tlm_metric *list, int nlist, uint64_t interval,
+                          uint64_t now, struct tlm_writer *w, uint64_t mono0, uint64_t wall0) {
+    if (now >= sp->next_us + interval) {
+        uint64_t behind = (now - sp->next_us) / interval;
+        sp->next_us += behind * interval;
+        sp->ticks += behind;
+        sp->overruns += behind;
+    }
+    
+    memset(&sp->sample, 0, sizeof(sp->sample));
+    sp->sample.dev = sp->dev;
+    sp->tick_us = sp->next_us;
+    sp->next_us += interval;
+    sp->ticks++;
+    sp->next = 0;
+    if (sampler_issue(sp, list, nlist) < 0) sampler_finish(sp, w, mono0, wall0);
+}
+
+// Collect the finished command and send the next one
+static void sampler_step(struct sampler *sp, const enum tlm_metric *list, int nlist, struct tlm_writer *w,
+                         uint64_t mono0, uint64_t wall0) {
+    enum tlm_metric m = list[sp->next];
+    
+    if (huawei_port_result(sp->port) < 0) {
+        sp->errors++;
+        if (huawei_port_error(sp->port) == LIBUSB_ERROR_NO_DEVICE) {
+            fprintf(stderr, "%s: device gone, no longer sampled\n", huawei_modem_path(sp->modem));
+            sp->gone = 1;
+            sp->next = -1;
+            return;
         }
+    } else if (huawei_result_final(sp->res) == HUAWEI_FINAL_OK && sample_parse(&sp->sample, m, sp->res) == 0) {
+        sp->sample.mask |= 1u << m;
+    } else {
+        sp->errors++;
     }
     
-    // Second pass: any interface with bulk endpoints
-    for (int i = 0; i < config->bNumInterfaces; i++) {
-        const struct libusb_interface *iface = &config->interface[i];
-        for (int j = 0; j < iface->num_altsetting; j++) {
-            const struct libusb_interface_descriptor *setting = &iface->altsetting[j];
-            
-            int found_in = -1, found_out = -1;
+    sp->next++;
+    if (sampler_issue(sp, list, nlist) < 0) sampler_finish(sp, w, mono0, wall0);
+}
+
+static void sample_usage(void) {
+    fprintf(stderr, "Usage: huawei_at [options] sample [-r <hz>] [-m <metrics>] [-c <ticks>] <file>\n"
+                    "  -r <hz>       samples per second and modem (default 1, at most %d)\n"
+                    "  -m <metrics>  comma separated, from csq,hcsq,sysinfoex,creg (default all)\n"
+                    "  -c <ticks>    stop after this many ticks instead of at SIGINT/SIGTERM\n",
+            SAMPLE_RATE_MAX);
+}
+
+// "sample ..." subcommand, on every opened modem
+int run_sample(struct huawei_ctx *hc, struct huawei_modem **modems, int count, int argc, char **argv, int verbose) {
+    static struct tlm_writer w;
+    enum tlm_metric list[TLM_METRICS];
+    int nlist = 0;
+    double rate = 1;
+    unsigned long limit = 0;
+    const char *metrics = NULL;
+    const char *path = NULL;
+    
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            metrics = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            limit = strtoul(argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            sample_usage();
+            return 1;
+        }
+    }
+    if (!path || rate <= 0 || rate > SAMPLE_RATE_MAX) {
+        sample_usage();
+        return 1;
+    }
+    
+    for (int m = 0; m < TLM_METRICS; m++) {
+        const char *name = tlm_metrics[m].name;
+        size_t len = strlen(name);
+        const char *p = metrics;
+        
+        while (p && !(strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))) {
+            p = strchr(p, ',');
+            if (p) p++;
+        }
+        if (!metrics || p) list[nlist++] = (enum tlm_metric)m;
+    }
+    if (nlist == 0) {
+        fprintf(stderr, "No known metric in '%s'\n", metrics);
+        return 1;
+    }
+    
+    struct sampler *sp = calloc((size_t)count, sizeof(*sp));
+    struct huawei_result **res = results_new(count);
+    if (!sp || !res) {
+        results_free(res, count);
+        free(sp);
+        return 1;
+    }
+    
+    uint64_t interval = (uint64_t)(1e6 / rate);
+    uint64_t mono0 = now_us();
+    uint64_t wall0 = wall_us();
+    if (tlm_writer_open(&w, path, wall0, interval) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        results_free(res, count);
+        free(sp);
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        sp[i].modem = modems[i];
+        sp[i].res = res[i];
+        sp[i].port = huawei_modem_port(modems[i], 0, NULL);
+        sp[i].dev = i;
+        sp[i].next = -1;
+        tlm_writer_device(&w, i, huawei_modem_path(modems[i]), huawei_modem_serial(modems[i]));
+    }
+    // Same phase for all, from after the serial number reads
+    uint64_t start = now_us();
+    for (int i = 0; i < count; i++) sp[i].next_us = start;
+    
+    signal(SIGINT, sample_signal);
+    signal(SIGTERM, sample_signal);
+    
+    unsigned long ticks = 0;
+    int failed = 0;
+    
+    for (;;) {
+        struct huawei_port *ports[HUAWEI_MODEMS_MAX];
+        int n = 0;
+        uint64_t now = now_us();
+        uint64_t wake = UINT64_MAX;
+        
+        // Every modem on its own schedule: collect, then start the sample that is due
+        for (int i = 0; i < count; i++) {
+            struct sampler *s = &sp[i];
             
-            for (int k = 0; k < setting->bNumEndpoints; k++) {
-                const struct libusb_endpoint_descriptor *ep = &setting->endpoint[k];
-                if ((ep->bmAttributes & 0x03) == LIBUSB_TRANSFER_TYPE_BULK) {
-                    if (ep->bEndpointAddress & 0x80) {
-                        found_in = ep->bEndpointAddress;
-                    } else {
-                        found_out = ep->bEndpointAddress;
-                    }
-                }
+            if (s->gone) continue;
+            if (s->next >= 0 && !huawei_port_pending(s->port)) {
+                sampler_step(s, list, nlist, &w, mono0, wall0);
             }
-            
-            if (found_in >= 0 && found_out >= 0 && ep_in < 0) {
-                ep_in = found_in;
-                ep_out = found_out;
-                claimed_interface = setting->bInterfaceNumber;
+            if (s->next < 0 && !sample_stop && (!limit || s->ticks < limit)) {
+                if (now >= s->next_us) sampler_start(s, list, nlist, interval, now, &w, mono0, wall0);
+                if (s->next < 0 && (!limit || s->ticks < limit) && s->next_us < wake) wake = s->next_us;
             }
+            if (s->next >= 0) ports[n++] = s->port;
+            if (s->ticks > ticks) ticks = s->ticks;
+        }
+        if (w.len > 0 && tlm_writer_flush(&w) < 0) {
+            fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+            failed = 1;
+            break;
+        }
+        if (n == 0 && wake == UINT64_MAX) break;
+        
+        now = now_us();
+        uint64_t wait = wake == UINT64_MAX ? 100000 : wake > now ? wake - now : 0;
+        if (n > 0) {
+            huawei_poll_wait(ports, n, wait);
+        } else if (wait > 0) {
+            huawei_handle_events(hc, wait);
         }
     }
     
-    libusb_free_config_descriptor(config);
-    return (ep_in >= 0 && ep_out >= 0) ? 0 : -1;
+    if (tlm_writer_close(&w) < 0) failed = 1;
+    
+    double secs = (now_us() - mono0) / 1e6;
+    for (int i = 0; i < count; i++) {
+        if (verbose || count == 1 || sp[i].overruns || sp[i].errors || sp[i].gone) {
+            fprintf(stderr, "sample: %s %lu samples, %lu overruns, %lu errors%s\n", huawei_modem_path(modems[i]),
+                    sp[i].samples, sp[i].overruns, sp[i].errors, sp[i].gone ? ", gone" : "");
+        }
+    }
+    fprintf(stderr, "sample: %lu ticks on %d modem%s in %.3f s (%.2f Hz)\n", ticks, count, count == 1 ? "" : "s",
+            secs, secs > 0 ? ticks / secs : 0.0);
+    results_free(res, count);
+    free(sp);
+    return failed;
 }
 
-libusb_device_handle* find_huawei_modem(libusb_context *ctx, uint16_t force_pid, uint16_t *found_pid) {
-    libusb_device_handle *h = NULL;
+/*
+ * The host side: a TAP device carrying Ethernet frames, or with l3 a TUN
+ * carrying IP packets. macOS has only the latter (utun, a 4 byte address
+ * family in front of each packet). name is the wanted name on input, ""
+ * for any, and the one the kernel chose on return.
+ */
+int tun_open(char *name, size_t size, int *l3, int *af_header) {
+    int fd;
     
-    // If specific PID requested, try only that
-    if (force_pid != 0) {
-        h = libusb_open_device_with_vid_pid(ctx, HUAWEI_VENDOR_ID, force_pid);
-        if (h) {
-            *found_pid = force_pid;
-            return h;
-        }
-        return NULL;
+#if defined(__linux__)
+    struct ifreq ifr;
+    
+    fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = (short)((*l3 ? IFF_TUN : IFF_TAP) | IFF_NO_PI);
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", name);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        close(fd);
+        return -1;
     }
+    snprintf(name, size, "%s", ifr.ifr_name);
+    *af_header = 0;
+#elif defined(__APPLE__)
+    struct ctl_info info;
+    struct sockaddr_ctl addr;
+    socklen_t len = (socklen_t)size;
     
-    // Try supported PIDs in order
-    for (int i = 0; supported_pids[i] != 0; i++) {
-        h = libusb_open_device_with_vid_pid(ctx, HUAWEI_VENDOR_ID, supported_pids[i]);
-        if (h) {
-            *found_pid = supported_pids[i];
-            return h;
-        }
+    if (!*l3) fprintf(stderr, "No TAP devices on macOS, using utun\n");
+    *l3 = 1;
+    *af_header = 4;
+    fd = socket(PF_SYSTEM, SOCK_DGRAM, SYSPROTO_CONTROL);
+    if (fd < 0) return -1;
+    memset(&info, 0, sizeof(info));
+    snprintf(info.ctl_name, sizeof(info.ctl_name), "%s", UTUN_CONTROL_NAME);
+    memset(&addr, 0, sizeof(addr));
+    addr.sc_len = sizeof(addr);
+    addr.sc_family = AF_SYSTEM;
+    addr.ss_sysaddr = AF_SYS_CONTROL;
+    addr.sc_unit = strncmp(name, "utun", 4) == 0 ? (uint32_t)atoi(name + 4) + 1 : 0;
+    if (ioctl(fd, CTLIOCGINFO, &info) < 0 || (addr.sc_id = info.ctl_id,
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        getsockopt(fd, SYSPROTO_CONTROL, UTUN_OPT_IFNAME, name, &len) < 0) {
+        close(fd);
+        return -1;
     }
+#else
+    (void)name;
+    (void)size;
+    (void)l3;
+    (void)af_header;
+    errno = ENOTSUP;
+    return -1;
+#endif
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// A TAP device gets the address the stick was told to expect (iMACAddress)
+static void tun_set_mac(int fd, const uint8_t *mac) {
+#if defined(__linux__)
+    struct ifreq ifr;
     
-    return NULL;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
+    memcpy(ifr.ifr_hwaddr.sa_data, mac, 6);
+    if (ioctl(fd, SIOCSIFHWADDR, &ifr) < 0) {
+        // Keep the random one; the stick answers whatever it is asked from
+    }
+#else
+    (void)fd;
+    (void)mac;
+#endif
 }
 
-void scan_huawei_devices(libusb_context *ctx) {
-    libusb_device **devs;
-    ssize_t cnt = libusb_get_device_list(ctx, &devs);
+// "^DHCP: ip,mask,gateway,server,dns1,dns2,..." with each address in little-endian hex
+static int ncm_dhcp(const struct huawei_result *res, uint32_t *addr, int n) {
+    char field[8][SAMPLE_FIELD_MAX];
+    const char *line = strstr(huawei_result_info(res), "^DHCP:");
     
-    fprintf(stderr, "\nAvailable Huawei devices:\n");
-    int found = 0;
+    if (!line || sample_split(line + 6, field, 8) < n) return -1;
+    for (int i = 0; i < n; i++) {
+        uint32_t v = (uint32_t)strtoul(field[i], NULL, 16);
+        addr[i] = (v & 0xff) << 24 | (v >> 8 & 0xff) << 16 | (v >> 16 & 0xff) << 8 | v >> 24;
+    }
+    return 0;
+}
+
+static void ncm_usage(void) {
+    fprintf(stderr, "Usage: huawei_at [options] ncm [-A <apn>] [-t tap|tun] [-i <ifname>] [-3]\n"
+                    "  -A <apn>      connect with this APN (default: the profile the stick has)\n"
+                    "  -t tap|tun    host device: Ethernet frames (default) or IP packets; macOS: tun only\n"
+                    "  -i <ifname>   device name, e.g. wwan0 (default: picked by the kernel)\n"
+                    "  -3            use NTB32 blocks if the stick has them\n");
+}
+
+static struct huawei_ncm *ncm_running;
+
+static void ncm_signal(int sig) {
+    (void)sig;
+    if (ncm_running) huawei_ncm_shutdown(ncm_running);
+}
+
+static void ncm_print_stats(const struct huawei_ncm *s, double secs) {
+    struct huawei_link_stats rx, tx;
+    
+    huawei_ncm_stats(s, &rx, &tx);
+    fprintf(stderr, "ncm: rx %llu packets %llu bytes in %llu blocks (%.1f per block), %llu dropped, %llu errors\n",
+            (unsigned long long)rx.packets, (unsigned long long)rx.bytes, (unsigned long long)rx.transfers,
+            rx.transfers ? (double)rx.packets / rx.transfers : 0.0, (unsigned long long)rx.dropped,
+            (unsigned long long)rx.errors);
+    fprintf(stderr, "ncm: tx %llu packets %llu bytes in %llu blocks (%.1f per block), %llu errors, %.1f s\n",
+            (unsigned long long)tx.packets, (unsigned long long)tx.bytes, (unsigned long long)tx.transfers,
+            tx.transfers ? (double)tx.packets / tx.transfers : 0.0, (unsigned long long)tx.errors, secs);
+}
+
+// "ncm ..." subcommand: dial, bridge the NCM function to a TAP/TUN device, hang up
+int run_ncm(struct huawei_modem **modems, int count, int argc, char **argv, int verbose) {
+    struct huawei_ncm *s;
+    struct huawei_modem *m = modems[0];
+    const char *path = huawei_modem_path(m);
+    const char *apn = NULL;
+    char name[IFNAMSIZ] = "";
+    char cmd[HUAWEI_COMMAND_MAX];
+    int l3 = 0, af_header = 0, ntb32 = 0;
+    int r;
     
-    for (ssize_t i = 0; i < cnt; i++) {
-        struct libusb_device_descriptor desc;
-        libusb_get_device_descriptor(devs[i], &desc);
-        if (desc.idVendor == HUAWEI_VENDOR_ID) {
-            fprintf(stderr, "  12d1:%04x - %s\n", desc.idProduct, get_pid_name(desc.idProduct));
-            found++;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) {
+            apn = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc && strcmp(argv[i + 1], "tap") == 0) {
+            l3 = 0;
+            i++;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc && strcmp(argv[i + 1], "tun") == 0) {
+            l3 = 1;
+            i++;
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            snprintf(name, sizeof(name), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "-3") == 0) {
+            ntb32 = 1;
+        } else {
+            ncm_usage();
+            return 1;
         }
     }
+    if (count > 1) {
+        fprintf(stderr, "ncm: one modem at a time, pick it with -u or -s\n");
+        return 1;
+    }
     
-    if (!found) {
-        fprintf(stderr, "  No Huawei devices found\n");
+    struct huawei_result *res = huawei_result_new();
+    if (!res) return 1;
+    int fd = tun_open(name, sizeof(name), &l3, &af_header);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create a %s device: %s\n", l3 ? "TUN" : "TAP", strerror(errno));
+        huawei_result_free(res);
+        return 1;
+    }
+    if (huawei_ncm_open(&s, m, fd, &(struct huawei_ncm_options){l3, af_header, ntb32, verbose}) < 0) {
+        huawei_result_free(res);
+        close(fd);
+        return 1;
+    }
+    if (!l3) {
+        uint8_t mac[6];
+        huawei_ncm_host_mac(s, mac);
+        tun_set_mac(fd, mac);
+    }
+    
+    if (apn) {
+        snprintf(cmd, sizeof(cmd), "AT^NDISDUP=1,1,\"%s\"", apn);
+    } else {
+        snprintf(cmd, sizeof(cmd), "AT^NDISDUP=1,1");
+    }
+    if (huawei_command(m, cmd, res) <= 0 || huawei_result_final(res) != HUAWEI_FINAL_OK) {
+        const char *final = huawei_result_final_line(res);
+        fprintf(stderr, "%s: %s failed%s%s\n", path, cmd, final[0] ? ": " : "", final);
+        huawei_result_free(res);
+        huawei_ncm_close(s);
+        close(fd);
+        return 1;
+    }
+    
+    // The stick's DHCP server has the same answer; printed for setups without a client
+    uint32_t a[6];
+    if (huawei_command(m, "AT^DHCP?", res) > 0 && ncm_dhcp(res, a, 6) == 0) {
+        int prefix = 0;
+        while (prefix < 32 && (a[1] << prefix & 0x80000000u)) prefix++;
+        printf("ncm: %s ip=%u.%u.%u.%u/%d gateway=%u.%u.%u.%u dns=%u.%u.%u.%u,%u.%u.%u.%u\n", name,
+               a[0] >> 24, a[0] >> 16 & 0xff, a[0] >> 8 & 0xff, a[0] & 0xff, prefix,
+               a[2] >> 24, a[2] >> 16 & 0xff, a[2] >> 8 & 0xff, a[2] & 0xff,
+               a[4] >> 24, a[4] >> 16 & 0xff, a[4] >> 8 & 0xff, a[4] & 0xff,
+               a[5] >> 24, a[5] >> 16 & 0xff, a[5] >> 8 & 0xff, a[5] & 0xff);
+        fflush(stdout);
+    } else {
+        printf("ncm: %s\n", name);
+        fflush(stdout);
     }
     
-    libusb_free_device_list(devs, 1);
+    ncm_running = s;
+    signal(SIGINT, ncm_signal);
+    signal(SIGTERM, ncm_signal);
+    
+    uint64_t start = now_us();
+    r = huawei_ncm_run(s);
+    if (r < 0) fprintf(stderr, "%s: NCM transfers failed: %s\n", path, libusb_strerror(r));
+    ncm_print_stats(s, (now_us() - start) / 1e6);
+    ncm_running = NULL;
+    
+    // The AT port's IN transfers were serviced by the event thread; this one takes over again
+    huawei_command(m, "AT^NDISDUP=1,0", res);
+    huawei_result_free(res);
+    huawei_ncm_close(s);
+    close(fd);
+    return r < 0;
+}
+
+static void ppp_usage(void) {
+    fprintf(stderr, "Usage: huawei_at [options] ppp [-A <apn>] [-U <user>] [-W <password>] [-i <ifname>]\n"
+                    "  -A <apn>       set context 1 to this APN before dialing (default: as configured)\n"
+                    "  -U <user>      PAP user name, if the network asks (default: empty)\n"
+                    "  -W <password>  PAP password (default: empty)\n"
+                    "  -i <ifname>    TUN device name, e.g. ppp0 (default: picked by the kernel)\n");
+}
+
+static struct huawei_ppp *ppp_running;
+
+static void ppp_signal(int sig) {
+    (void)sig;
+    if (ppp_running) huawei_ppp_shutdown(ppp_running);
+}
+
+static void ppp_print_addr(FILE *out, const char *name, uint32_t a) {
+    fprintf(out, "%s%u.%u.%u.%u", name, a >> 24, a >> 16 & 0xff, a >> 8 & 0xff, a & 0xff);
+}
+
+// Announce the link once IPCP is up; opaque is the TUN device name
+static void ppp_up(void *opaque, const struct huawei_ppp_addrs *a) {
+    printf("ppp: %s ", (const char *)opaque);
+    ppp_print_addr(stdout, "ip=", a->addr);
+    ppp_print_addr(stdout, " peer=", a->peer);
+    ppp_print_addr(stdout, " dns=", a->dns[0]);
+    ppp_print_addr(stdout, ",", a->dns[1]);
+    printf("\n");
+    fflush(stdout);
+}
+
+static void ppp_print_stats(const struct huawei_ppp *s, double secs) {
+    struct huawei_link_stats rx, tx;
+    
+    huawei_ppp_stats(s, &rx, &tx);
+    fprintf(stderr, "ppp: rx %llu packets %llu bytes in %llu frames from %llu transfers, %llu bad frames, "
+            "%llu dropped\n", (unsigned long long)rx.packets, (unsigned long long)rx.bytes,
+            (unsigned long long)rx.frames, (unsigned long long)rx.transfers, (unsigned long long)rx.errors,
+            (unsigned long long)rx.dropped);
+    fprintf(stderr, "ppp: tx %llu packets %llu bytes in %llu transfers (%.1f per transfer), %llu dropped, %.1f s\n",
+            (unsigned long long)tx.packets, (unsigned long long)tx.bytes, (unsigned long long)tx.transfers,
+            tx.transfers ? (double)tx.packets / tx.transfers : 0.0, (unsigned long long)tx.dropped, secs);
 }
 
-int send_command(const char *cmd, char *response, size_t response_size) {
-    int transferred;
-    char buf[256];
-    unsigned char read_buf[512];
+// "ppp ..." subcommand: dial ATD*99#, run PPP on the modem port bridged to a TUN device, hang up
+int run_ppp(struct huawei_modem **modems, int count, int argc, char **argv, int verbose) {
+    struct huawei_ppp *s;
+    struct huawei_modem *m = modems[0];
+    const char *apn = NULL, *user = "", *password = "";
+    char name[IFNAMSIZ] = "";
+    int l3 = 1, af_header = 0;
     int r;
-    size_t total_read = 0;
     
-    // Prepare command with CR
-    snprintf(buf, sizeof(buf), "%s\r", cmd);
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) {
+            apn = argv[++i];
+        } else if (strcmp(argv[i], "-U") == 0 && i + 1 < argc) {
+            user = argv[++i];
+        } else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc) {
+            password = argv[++i];
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            snprintf(name, sizeof(name), "%s", argv[++i]);
+        } else {
+            ppp_usage();
+            return 1;
+        }
+    }
+    if (count > 1) {
+        fprintf(stderr, "ppp: one modem at a time, pick it with -u or -s\n");
+        return 1;
+    }
     
-    // Send command
-    r = libusb_bulk_transfer(handle, ep_out, (unsigned char*)buf, strlen(buf), &transferred, TIMEOUT_MS);
-    if (r != 0) {
-        fprintf(stderr, "Error sending command: %s\n", libusb_strerror(r));
-        return -1;
+    int fd = tun_open(name, sizeof(name), &l3, &af_header);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create a TUN device: %s\n", strerror(errno));
+        return 1;
+    }
+    struct huawei_ppp_options options = {apn, user, password, af_header, ppp_up, name, verbose};
+    if (huawei_ppp_dial(&s, m, fd, &options) < 0) {
+        close(fd);
+        return 1;
     }
     
-    // Read response
-    response[0] = '\0';
-    int empty_reads = 0;
+    ppp_running = s;
+    signal(SIGINT, ppp_signal);
+    signal(SIGTERM, ppp_signal);
     
-    while (total_read < response_size - 1 && empty_reads < 5) {
-        r = libusb_bulk_transfer(handle, ep_in, read_buf, sizeof(read_buf) - 1, &transferred, READ_TIMEOUT_MS);
-        
-        if (r == LIBUSB_ERROR_TIMEOUT) {
-            empty_reads++;
-            continue;
+    uint64_t start = now_us();
+    r = huawei_ppp_run(s);
+    if (r < 0) fprintf(stderr, "%s: PPP transfers failed: %s\n", huawei_modem_path(m), libusb_strerror(r));
+    const char *reason = huawei_ppp_reason(s);
+    if (reason) fprintf(stderr, "ppp: link down: %s\n", reason);
+    ppp_print_stats(s, (now_us() - start) / 1e6);
+    ppp_running = NULL;
+    
+    huawei_ppp_close(s);
+    close(fd);
+    return r < 0 || reason != NULL;
+}
+
+/*
+ * Diagnostic capture
+ *
+ * "diag" records everything the diagnostic interface next to the AT port
+ * sends into a capture file (huawei_diag.h) until SIGINT/SIGTERM or -t; see
+ * huawei_diag_open() for how.
+ */
+
+#define DIAG_RING_MB        64      // default capture size
+
+static struct huawei_diag *diag_running;
+
+static void diag_signal(int sig) {
+    (void)sig;
+    if (diag_running) huawei_diag_shutdown(diag_running);
+}
+
+void diag_print_stats(const struct huawei_diag *s, double secs) {
+    struct huawei_diag_stats st;
+    
+    huawei_diag_stats(s, &st);
+    fprintf(stderr, "diag: %llu packets, %llu bytes in %llu transfers (%.2f MB/s), %llu bad frames, "
+            "%llu bytes dropped, peak backlog %u of %u buffers, %.1f s\n", (unsigned long long)st.records,
+            (unsigned long long)st.bytes, (unsigned long long)st.transfers, secs > 0 ? st.bytes / secs / 1e6 : 0.0,
+            (unsigned long long)st.bad, (unsigned long long)st.dropped, st.peak, st.buffers, secs);
+    if (st.overwritten) {
+        fprintf(stderr, "diag: the capture wrapped, the oldest %.1f MB were overwritten\n", st.overwritten / 1e6);
+    }
+}
+
+static void diag_usage(void) {
+    fprintf(stderr, "Usage: huawei_at [options] diag [-s <MB>] [-t <sec>] [-c <file>] <capture file>\n"
+                    "  -s <MB>    capture size, allocated up front; the oldest packets give way (default %d)\n"
+                    "  -t <sec>   stop after this long (default: at SIGINT/SIGTERM)\n"
+                    "  -c <file>  send these requests first, one hex packet per line without CRC,\n"
+                    "             e.g. a log mask\n"
+                    "Read the capture with huawei_diag.\n", DIAG_RING_MB);
+}
+
+// -c: hex packets, blank lines and # comments skipped
+static int diag_send_file(struct huawei_diag *s, const char *path) {
+    static uint8_t packet[DIAG_PACKET_MAX];
+    char line[2 * DIAG_PACKET_MAX + 2], hex[2 * DIAG_PACKET_MAX + 2];
+    int count = 0, lineno = 0;
+    
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        size_t n = 0;
+        lineno++;
+        for (char *c = line; *c && *c != '#'; c++) {
+            if (!isspace((unsigned char)*c)) hex[n++] = *c;
         }
+        if (n == 0) continue;
         
-        if (r != 0) {
+        int len = sms_hex_decode(hex, n, packet, sizeof(packet));
+        if (len <= 0) {
+            fprintf(stderr, "%s:%d: not a hex packet\n", path, lineno);
+            count = -1;
             break;
         }
-        
-        if (transferred > 0) {
-            read_buf[transferred] = '\0';
-            
-            size_t to_copy = transferred;
-            if (total_read + to_copy >= response_size - 1) {
-                to_copy = response_size - 1 - total_read;
-            }
-            memcpy(response + total_read, read_buf, to_copy);
-            total_read += to_copy;
-            response[total_read] = '\0';
-            
-            // Check for final response markers
-            if (strstr(response, "\r\nOK\r\n") || 
-                strstr(response, "\r\nERROR\r\n") ||
-                strstr(response, "\r\n+CME ERROR:") ||
-                strstr(response, "\r\n+CMS ERROR:")) {
-                break;
-            }
-            
-            empty_reads = 0;
+        int r = huawei_diag_send(s, packet, (size_t)len);
+        if (r < 0) {
+            fprintf(stderr, "%s:%d: cannot send: %s\n", path, lineno, libusb_strerror(r));
+            count = -1;
+            break;
+        }
+        count++;
+    }
+    if (f != stdin) fclose(f);
+    return count;
+}
+
+// "diag ..." subcommand
+int run_diag(struct huawei_modem **modems, int count, int argc, char **argv, int verbose) {
+    struct huawei_diag *s;
+    struct huawei_modem *m = modems[0];
+    const char *path = NULL, *requests = NULL;
+    uint64_t ring_mb = DIAG_RING_MB, limit_us = 0;
+    int r;
+    
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            ring_mb = (uint64_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            limit_us = (uint64_t)(atof(argv[++i]) * 1e6);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            requests = argv[++i];
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
         } else {
-            empty_reads++;
+            diag_usage();
+            return 1;
         }
     }
+    if (!path) {
+        diag_usage();
+        return 1;
+    }
+    if (count > 1) {
+        fprintf(stderr, "diag: one modem at a time, pick it with -u or -s\n");
+        return 1;
+    }
     
-    return (int)total_read;
+    r = huawei_diag_open(&s, m, path, ring_mb << 20, verbose);
+    if (r == LIBUSB_ERROR_NOT_FOUND) fprintf(stderr, "diag: see -l, and leave diag out of -I\n");
+    if (r < 0) return 1;
+    diag_running = s;
+    signal(SIGINT, diag_signal);
+    signal(SIGTERM, diag_signal);
+    
+    uint64_t start = now_us();
+    if (requests) {
+        // Sent before the capture starts: their answers queue up on the port meanwhile
+        int sent = diag_send_file(s, requests);
+        if (sent < 0) {
+            diag_running = NULL;
+            huawei_diag_close(s);
+            return 1;
+        }
+        if (verbose) fprintf(stderr, "diag: sent %d requests\n", sent);
+    }
+    fprintf(stderr, "diag: capturing to %s (%llu MB)%s\n", path, (unsigned long long)ring_mb,
+            limit_us ? "" : ", stop with Ctrl-C");
+    r = huawei_diag_run(s, limit_us);
+    if (r < 0) fprintf(stderr, "%s: diagnostic port failed: %s\n", huawei_modem_path(m), libusb_strerror(r));
+    diag_print_stats(s, (now_us() - start) / 1e6);
+    diag_running = NULL;
+    if (huawei_diag_close(s) < 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+        r = -1;
+    }
+    return r < 0;
+}
+
+// Library messages go to stderr, as the tool's own do
+static void log_stderr(void *opaque, enum huawei_log_level level, const char *msg) {
+    (void)opaque;
+    (void)level;
+    fprintf(stderr, "%s\n", msg);
 }
 
 void print_usage(const char *prog) {
@@ -310,27 +3260,102 @@ void print_usage(const char *prog) {
     fprintf(stderr, "Usage: %s [options] <AT command>\n\n", prog);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -p <PID>   Force specific product ID (hex, e.g. 1506)\n");
+    fprintf(stderr, "  -u <path>  Select device by USB port path (e.g. 1-2.3, see -l)\n");
+    fprintf(stderr, "  -s <sn>    Select device by serial number\n");
+    fprintf(stderr, "  -a         All matching devices - command runs on each concurrently\n");
+    fprintf(stderr, "  -I <ports> Interfaces to claim by role or number, e.g. modem or pcui,modem (see -l);\n");
+    fprintf(stderr, "             the first one runs the command, a daemon uses all of them\n");
     fprintf(stderr, "  -r         Raw mode - no output processing\n");
     fprintf(stderr, "  -l         List available Huawei devices\n");
     fprintf(stderr, "  -v         Verbose mode\n");
+    fprintf(stderr, "  -d         Daemon mode - keep the modem claimed and serve commands\n");
+    fprintf(stderr, "  -S <path>  Daemon socket path (default $XDG_RUNTIME_DIR/" SOCKET_NAME ",\n");
+    fprintf(stderr, "             else /tmp/huawei_at-<uid>/" SOCKET_NAME ")\n");
+    fprintf(stderr, "  -M <addr>  Daemon mode: serve Prometheus metrics on [host:]port (loopback) or a socket path\n");
+    fprintf(stderr, "  -K <ttls>  Daemon mode: response cache TTLs in seconds, e.g. identity=inf,sim=3600,status=2\n");
+    fprintf(stderr, "             (default identity=inf,sim=inf; 'off' disables the cache)\n");
+    fprintf(stderr, "  -n         Don't use a running daemon, always open the device\n");
+    fprintf(stderr, "  -P <class> Via a daemon: priority high, normal (default) or bulk\n");
+    fprintf(stderr, "  -D <sec>   Via a daemon: give up after this long, queueing included\n");
+    fprintf(stderr, "  -b <file>  Batch mode - run commands from file ('-' for stdin), JSON output\n");
+    fprintf(stderr, "  -e         Batch mode: stop at the first failing command\n");
+    fprintf(stderr, "  -m         Monitor mode - log unsolicited results, run commands from stdin\n");
+    fprintf(stderr, "  -o <file>  Monitor mode: append the log to file instead of stdout\n");
+    fprintf(stderr, "  -t <sec>   Wait up to sec for the final result (slow commands like AT+COPS=?)\n");
+    fprintf(stderr, "  -C         Don't use the endpoint cache (~/.cache/huawei_at.endpoints)\n");
+    fprintf(stderr, "  --stream   Print reply lines as they arrive, no size limit\n");
+    fprintf(stderr, "  --timing   Print a per-phase startup/command timing report\n");
+    fprintf(stderr, "  --metrics[=kv|json]  Per-phase timings as one key=value or JSON line on stderr\n");
+    fprintf(stderr, "\nSMS (PDU mode, JSON output):\n");
+    fprintf(stderr, "  sms list [unread|read|unsent|sent|all]   sms read <index>   sms delete <index>|all\n");
+    fprintf(stderr, "  sms send <number> <text>                 sms send -f <file> (\"<number> <text>\" lines)\n");
+    fprintf(stderr, "\nSignal sampler (binary telemetry file, export with huawei_telemetry):\n");
+    fprintf(stderr, "  sample [-r <hz>] [-m csq,hcsq,sysinfoex,creg] [-c <ticks>] <file>\n");
+    fprintf(stderr, "\nNCM data (sticks in NCM mode, needs root for the TAP/TUN device):\n");
+    fprintf(stderr, "  ncm [-A <apn>] [-t tap|tun] [-i <ifname>] [-3]\n");
+    fprintf(stderr, "\nPPP data (sticks in modem mode, needs root for the TUN device):\n");
+    fprintf(stderr, "  ppp [-A <apn>] [-U <user>] [-W <password>] [-i <ifname>]\n");
+    fprintf(stderr, "\nDiagnostic capture (memory-mapped ring file, read it with huawei_diag):\n");
+    fprintf(stderr, "  diag [-s <MB>] [-t <sec>] [-c <requests>] <file>\n");
     fprintf(stderr, "\nExamples:\n");
     fprintf(stderr, "  %s AT\n", prog);
     fprintf(stderr, "  %s \"AT+CPIN?\"\n", prog);
     fprintf(stderr, "  %s -p 1506 \"ATI\"\n", prog);
     fprintf(stderr, "  %s -l\n", prog);
+    fprintf(stderr, "  %s -d &            # later commands go through the daemon\n", prog);
+    fprintf(stderr, "  %s -d -M 9101 &    # ... with metrics on http://127.0.0.1:9101/metrics\n", prog);
+    fprintf(stderr, "  %s -e -b provision.txt\n", prog);
+    fprintf(stderr, "  %s -a \"AT+CSQ\"     # every attached modem at once\n", prog);
+    fprintf(stderr, "  %s -m -o urc.log   # log URCs until interrupted\n", prog);
+    fprintf(stderr, "  %s --stream -t 180 \"AT+COPS=?\"\n", prog);
+    fprintf(stderr, "  %s sms list unread\n", prog);
+    fprintf(stderr, "  %s -a sms send -f outbox.txt   # spread over every attached modem\n", prog);
+    fprintf(stderr, "  %s -a sample -r 10 signal.tlm  # until interrupted\n", prog);
+    fprintf(stderr, "  %s ncm -A internet -i wwan0    # until interrupted\n", prog);
+    fprintf(stderr, "  %s ppp -A internet -i ppp0     # until interrupted\n", prog);
+    fprintf(stderr, "  %s diag -s 256 -c logmask.txt field.diag\n", prog);
 }
 
 int main(int argc, char **argv) {
-    libusb_context *ctx = NULL;
-    libusb_device *dev;
-    char response[MAX_RESPONSE_SIZE];
+    struct huawei_ctx *hc = NULL;
+    struct huawei_options opts = {0};
+    static struct huawei_modem *modems[HUAWEI_MODEMS_MAX];
+    struct huawei_result *result;
+    struct huawei_filter filter = {0, NULL, NULL, 0, NULL};
+    char response[HUAWEI_RESPONSE_MAX];
     int r;
     int raw_mode = 0;
     int verbose = 0;
     int list_only = 0;
-    uint16_t force_pid = 0;
-    uint16_t found_pid = 0;
+    int daemon_mode = 0;
+    int no_daemon = 0;
+    int stop_on_error = 0;
+    int timing = 0;
+    int stream = 0;
+    unsigned timeout_ms = 0;
+    int monitor = 0;
+    const char *monitor_log = NULL;
+    char **sms_argv = NULL;
+    int sms_argc = 0;
+    char **sample_argv = NULL;
+    int sample_argc = 0;
+    char **ncm_argv = NULL;
+    int ncm_argc = 0;
+    char **ppp_argv = NULL;
+    int ppp_argc = 0;
+    char **diag_argv = NULL;
+    int diag_argc = 0;
+    enum metrics_format metrics = METRICS_OFF;
+    int count;
     const char *command = NULL;
+    const char *batch_file = NULL;
+    FILE *batch_in = NULL;
+    const char *socket_path = getenv("HUAWEI_AT_SOCKET");
+    char default_socket[PATH_MAX];
+    const char *stats_addr = NULL;
+    const char *cache_spec = NULL;
+    const char *priority = NULL;
+    unsigned long deadline_ms = 0;
     
     // Parse arguments
     int i;
@@ -341,9 +3366,69 @@ int main(int argc, char **argv) {
             verbose = 1;
         } else if (strcmp(argv[i], "-l") == 0) {
             list_only = 1;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            daemon_mode = 1;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            no_daemon = 1;
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+            stats_addr = argv[++i];
+        } else if (strcmp(argv[i], "-K") == 0 && i + 1 < argc) {
+            cache_spec = argv[++i];
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            priority = argv[++i];
+        } else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc) {
+            deadline_ms = (unsigned long)(atof(argv[++i]) * 1000);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            batch_file = argv[++i];
+        } else if (strcmp(argv[i], "-e") == 0) {
+            stop_on_error = 1;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            monitor = 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            monitor_log = argv[++i];
+        } else if (strcmp(argv[i], "-C") == 0) {
+            opts.no_endpoint_cache = 1;
+        } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            filter.ports = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            timeout_ms = (unsigned)(atof(argv[++i]) * 1000);
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[i], "--timing") == 0) {
+            timing = 1;
+        } else if (metrics_option(argv[i]) != METRICS_OFF) {
+            metrics = metrics_option(argv[i]);
         } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
             i++;
-            force_pid = (uint16_t)strtol(argv[i], NULL, 16);
+            filter.pid = (uint16_t)strtol(argv[i], NULL, 16);
+        } else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            filter.path = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            filter.serial = argv[++i];
+        } else if (strcmp(argv[i], "-a") == 0) {
+            filter.all = 1;
+        } else if (strcmp(argv[i], "sample") == 0) {
+            sample_argv = argv + i + 1;
+            sample_argc = argc - i - 1;
+            break;
+        } else if (strcmp(argv[i], "ncm") == 0) {
+            ncm_argv = argv + i + 1;
+            ncm_argc = argc - i - 1;
+            break;
+        } else if (strcmp(argv[i], "ppp") == 0) {
+            ppp_argv = argv + i + 1;
+            ppp_argc = argc - i - 1;
+            break;
+        } else if (strcmp(argv[i], "diag") == 0) {
+            diag_argv = argv + i + 1;
+            diag_argc = argc - i - 1;
+            break;
+        } else if (strcmp(argv[i], "sms") == 0) {
+            sms_argv = argv + i + 1;
+            sms_argc = argc - i - 1;
+            break;
         } else if (argv[i][0] != '-') {
             command = argv[i];
             break;
@@ -353,94 +3438,235 @@ int main(int argc, char **argv) {
         }
     }
     
-    if (!list_only && !command) {
+    if (!list_only && !daemon_mode && !monitor && !batch_file && !command && !sms_argv && !sample_argv &&
+        !ncm_argv && !ppp_argv && !diag_argv) {
         print_usage(argv[0]);
         return 1;
     }
     
-    r = libusb_init(&ctx);
+    if (stream && raw_mode) {
+        fprintf(stderr, "--stream and -r cannot be combined\n");
+        return 1;
+    }
+    
+    if (!socket_path) {
+        if (default_socket_path(default_socket, sizeof(default_socket), daemon_mode) < 0) {
+            fprintf(stderr, "Cannot use a private socket directory: %s (use -S)\n", strerror(errno));
+            return 1;
+        }
+        socket_path = default_socket;
+    }
+    
+    if (priority || deadline_ms) {
+        int c = 0;
+        while (c < SCHED_CLASSES && (!priority || strcmp(priority, sched_class_names[c]) != 0)) c++;
+        if (priority && c == SCHED_CLASSES) {
+            fprintf(stderr, "Unknown priority '%s' (high, normal or bulk)\n", priority);
+            return 1;
+        }
+        int n = snprintf(daemon_options, sizeof(daemon_options), "@%s", priority ? priority : "");
+        if (deadline_ms) snprintf(daemon_options + n, sizeof(daemon_options) - (size_t)n, "/%lu", deadline_ms);
+        strcat(daemon_options, " ");
+    }
+    
+    if (batch_file) {
+        batch_in = strcmp(batch_file, "-") == 0 ? stdin : fopen(batch_file, "r");
+        if (!batch_in) {
+            fprintf(stderr, "Cannot open %s: %s\n", batch_file, strerror(errno));
+            return 1;
+        }
+        if (!no_daemon && !device_selected(&filter) && daemon_running(socket_path)) {
+            r = run_batch(batch_in, NULL, 0, socket_path, stop_on_error);
+            return r > 0 ? 1 : 0;
+        }
+        command = NULL;
+    }
+    
+    // A running daemon already holds the modem; picking a device with
+    // -p/-u/-s/-a or an interface with -I means going direct. Its replies are relayed whole and on
+    // its own timeouts, so --stream and -t go direct as well.
+    if (command && !list_only && !daemon_mode && !monitor && !no_daemon && !stream && !timeout_ms &&
+        !device_selected(&filter)) {
+        uint64_t latency = 0;
+        r = daemon_command(socket_path, command, response, sizeof(response), &latency);
+        if (r != -2) {
+            if (verbose) {
+                fprintf(stderr, "Via daemon %s: %.3f ms\n", socket_path, latency / 1000.0);
+            }
+            if (metrics) {
+                struct metric v[] = {{"final_us", latency}};
+                metrics_emit(stderr, metrics, "huawei_at", socket_path, v, 1);
+            }
+            if (r > 0) {
+                result = huawei_result_new();
+                if (!result) return 1;
+                huawei_result_parse(result, command, response, (size_t)r);
+                print_result(result, raw_mode, verbose);
+                huawei_result_free(result);
+            } else {
+                fprintf(stderr, "No response\n");
+            }
+            return r < 0 ? 1 : 0;
+        }
+    }
+    
+    opts.log = log_stderr;
+    r = huawei_init(&hc, &opts);
     if (r < 0) {
-        fprintf(stderr, "Failed to init libusb\n");
+        if (r != LIBUSB_ERROR_INVALID_PARAM) fprintf(stderr, "Failed to init libusb\n");
         return 1;
     }
     
     if (list_only) {
-        scan_huawei_devices(ctx);
-        libusb_exit(ctx);
+        scan_huawei_devices(hc);
+        huawei_exit(hc);
         return 0;
     }
     
-    handle = find_huawei_modem(ctx, force_pid, &found_pid);
-    if (!handle) {
-        if (force_pid) {
-            fprintf(stderr, "Device 12d1:%04x not found.\n", force_pid);
-        } else {
-            fprintf(stderr, "No supported Huawei modem found.\n");
-        }
-        scan_huawei_devices(ctx);
-        libusb_exit(ctx);
+    if (daemon_mode) {
+        r = run_daemon(hc, &filter, verbose, socket_path, stats_addr, cache_spec);
+        huawei_exit(hc);
+        return r;
+    }
+    
+    if (monitor) {
+        r = run_monitor(hc, &filter, monitor_log, verbose);
+        huawei_exit(hc);
+        return r;
+    }
+    
+    count = huawei_open_all(hc, &filter, modems, HUAWEI_MODEMS_MAX, verbose);
+    if (count == 0) {
+        scan_huawei_devices(hc);
+        huawei_exit(hc);
         return 1;
     }
     
-    if (verbose) {
-        fprintf(stderr, "Using device 12d1:%04x (%s)\n", found_pid, get_pid_name(found_pid));
+    if (sample_argv) {
+        r = run_sample(hc, modems, count, sample_argc, sample_argv, verbose);
+        modems_close(modems, count);
+        huawei_exit(hc);
+        return r;
     }
     
-    dev = libusb_get_device(handle);
+    if (ncm_argv) {
+        r = run_ncm(modems, count, ncm_argc, ncm_argv, verbose);
+        modems_close(modems, count);
+        huawei_exit(hc);
+        return r;
+    }
     
-    if (find_endpoints(dev) < 0) {
-        fprintf(stderr, "Could not find endpoints\n");
-        libusb_close(handle);
-        libusb_exit(ctx);
-        return 1;
+    if (ppp_argv) {
+        r = run_ppp(modems, count, ppp_argc, ppp_argv, verbose);
+        modems_close(modems, count);
+        huawei_exit(hc);
+        return r;
     }
     
-    if (verbose) {
-        fprintf(stderr, "Endpoints: IN=0x%02x OUT=0x%02x Interface=%d\n", ep_in, ep_out, claimed_interface);
+    if (diag_argv) {
+        r = run_diag(modems, count, diag_argc, diag_argv, verbose);
+        modems_close(modems, count);
+        huawei_exit(hc);
+        return r;
     }
     
-    // Detach kernel driver
-    for (int j = 0; j < 8; j++) {
-        if (libusb_kernel_driver_active(handle, j) == 1) {
-            libusb_detach_kernel_driver(handle, j);
-        }
+    if (sms_argv) {
+        r = run_sms(modems, count, sms_argc, sms_argv, verbose);
+        modems_close(modems, count);
+        huawei_exit(hc);
+        return r;
     }
     
-    r = libusb_claim_interface(handle, claimed_interface);
-    if (r < 0 && verbose) {
-        fprintf(stderr, "Warning: could not claim interface %d: %s\n", claimed_interface, libusb_strerror(r));
+    if (batch_in) {
+        r = run_batch(batch_in, modems, count, NULL, stop_on_error);
+        modems_close(modems, count);
+        huawei_exit(hc);
+        return r > 0 ? 1 : 0;
     }
     
-    // Send command and get response
-    r = send_command(command, response, sizeof(response));
+    for (int j = 0; j < count; j++) {
+        huawei_port_set_timeout(huawei_modem_port(modems[j], 0, NULL), timeout_ms);
+    }
     
-    if (r > 0) {
-        if (raw_mode) {
-            printf("%s", response);
-        } else {
-            // Clean up response
-            char *p = response;
-            
-            // Skip echo of command
-            char *echo_end = strstr(p, "\r\n");
-            if (echo_end && (echo_end - p) <= (int)strlen(command) + 2) {
-                p = echo_end + 2;
+    if (stream) {
+        struct huawei_result **results = results_new(count);
+        struct stream_out outs[HUAWEI_MODEMS_MAX];
+        int status[HUAWEI_MODEMS_MAX];
+        int failed = 0;
+        
+        if (!results) {
+            modems_close(modems, count);
+            huawei_exit(hc);
+            return 1;
+        }
+        stream_command_all(modems, count, command, results, outs, status);
+        
+        for (int j = 0; j < count; j++) {
+            if (status[j] > 0) {
+                stream_finish(&outs[j], results[j], verbose);
+            } else {
+                if (status[j] == 0 && count > 1) fprintf(stderr, "%s: No response\n", huawei_modem_path(modems[j]));
+                if (status[j] == 0 && count == 1) fprintf(stderr, "No response\n");
+                failed = 1;
             }
-            
-            printf("%s", p);
-            
-            size_t len = strlen(p);
-            if (len > 0 && p[len-1] != '\n') {
-                printf("\n");
+            if (timing) print_timing(hc, modems[j]);
+            if (metrics) print_metrics(metrics, hc, modems[j]);
+        }
+        
+        results_free(results, count);
+        modems_close(modems, count);
+        huawei_exit(hc);
+        return failed;
+    }
+    
+    if (count > 1) {
+        struct huawei_result **results = results_new(count);
+        int status[HUAWEI_MODEMS_MAX];
+        int failed = 0;
+        
+        if (!results) {
+            modems_close(modems, count);
+            huawei_exit(hc);
+            return 1;
+        }
+        huawei_command_all(modems, count, command, results, status);
+        
+        for (int j = 0; j < count; j++) {
+            struct huawei_command_stats cmd;
+            uint16_t pid = huawei_modem_pid(modems[j]);
+            huawei_port_stats(huawei_modem_port(modems[j], 0, NULL), &cmd);
+            printf("== %s 12d1:%04x (%s) %.3f ms ==\n", huawei_modem_path(modems[j]), pid, huawei_pid_name(pid),
+                   cmd.final_us / 1000.0);
+            if (status[j] > 0) {
+                print_result(results[j], raw_mode, verbose);
+            } else {
+                printf("No response\n");
+                failed = 1;
             }
+            if (metrics) print_metrics(metrics, hc, modems[j]);
         }
+        
+        results_free(results, count);
+        modems_close(modems, count);
+        huawei_exit(hc);
+        return failed;
+    }
+    
+    // Send command and get response
+    result = huawei_result_new();
+    r = result ? huawei_command(modems[0], command, result) : LIBUSB_ERROR_NO_MEM;
+    
+    if (r > 0) {
+        print_result(result, raw_mode, verbose);
     } else {
         fprintf(stderr, "No response\n");
     }
+    if (timing) print_timing(hc, modems[0]);
+    if (metrics) print_metrics(metrics, hc, modems[0]);
     
-    libusb_release_interface(handle, claimed_interface);
-    libusb_close(handle);
-    libusb_exit(ctx);
+    huawei_result_free(result);
+    modems_close(modems, count);
+    huawei_exit(hc);
     
     return 0;
 }
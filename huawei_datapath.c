@@ -0,0 +1,1726 @@
+/*
+ * libhuawei datapaths - NCM and PPP between a stick and a host device, and
+ * diagnostic capture
+ * See libhuawei.h for the API.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libhuawei_internal.h"
+#include "huawei_ncm.h"
+#include "huawei_hdlc.h"
+#include "huawei_diag.h"
+
+/*
+ * NCM datapath
+ *
+ * Sticks in NCM mode (E3372, E8372 and other "NDIS" firmware) carry IP
+ * traffic over a CDC-NCM function beside their serial ports: Ethernet frames
+ * packed into transfer blocks (NTBs, see huawei_ncm.h) on a bulk pair of
+ * their own. huawei_ncm_open() claims the function of a modem that has
+ * been (or is about to be) dialed with AT^NDISDUP, and huawei_ncm_run()
+ * bridges it to the caller's TAP or TUN device until huawei_ncm_shutdown().
+ *
+ * Receiving, NCM_RX_TRANSFERS blocks stay queued; a completed one is walked
+ * in place, each datagram written from it straight to the device, and the
+ * transfer resubmitted. Sending, frames are read from the device directly
+ * into the next free block until the device runs dry or the block is full,
+ * so a burst goes out as a few large transfers. libusb events run on a
+ * thread of their own; the main thread only moves frames into blocks.
+ */
+
+#define NCM_RX_TRANSFERS    8
+#define NCM_TX_TRANSFERS    8
+#define NCM_NTB_MAX         32768   // per transfer, both directions
+#define NCM_FRAME_MAX       HUAWEI_NCM_FRAME_MAX
+#define NCM_ETH_HLEN        14
+#define NCM_TX_TIMEOUT_MS   5000
+
+// The NCM function: communication interface, data interface and its running setting
+struct ncm_iface {
+    int ctrl;
+    int data;
+    int alt;
+    int ep_in;
+    int ep_out;
+    int max_packet;
+    int mac_index;          // iMACAddress string, 0 = none
+};
+
+struct huawei_ncm {
+    const struct usb_transport *usb;
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    struct ncm_iface iface;
+    struct ncm_params params;
+    int ntb32;
+    int fd;                 // TAP/TUN device or a stand-in, non-blocking
+    int l3;                 // fd carries IP packets rather than Ethernet frames
+    int af_header;          // bytes of address family before each packet (utun)
+    uint8_t host_mac[6];
+    uint8_t peer_mac[6];
+    atomic_int peer_known;
+    atomic_int stop;
+    atomic_int in_flight;
+    int error;
+    int wake[2];            // TX completions and stop wake the main thread
+    pthread_t events;
+    
+    struct libusb_transfer *rx[NCM_RX_TRANSFERS];
+    struct libusb_transfer *tx[NCM_TX_TRANSFERS];
+    uint8_t *rx_buf[NCM_RX_TRANSFERS];
+    uint8_t *tx_buf[NCM_TX_TRANSFERS];
+    size_t rx_size;
+    unsigned tx_next;       // slots are used in turn; completions come back in order
+    atomic_uint tx_done;
+    uint16_t seq;
+    
+    // L3: the device's ARP requests for our address, answered from the next block
+    atomic_int arp_pending;
+    uint8_t arp_reply[42];
+    
+    struct {
+        _Atomic uint64_t ntbs;
+        _Atomic uint64_t packets;
+        _Atomic uint64_t bytes;
+        _Atomic uint64_t dropped;
+        _Atomic uint64_t errors;
+    } rx_stats, tx_stats;
+};
+
+/*
+ * Find the NCM function: a CDC NCM communication interface (or Huawei's
+ * vendor flavour, ff/02/16, 46 or 76), its data interface from the union
+ * descriptor and the data setting that has the bulk pair. -1 if the current
+ * configuration has none.
+ */
+static int ncm_find(const struct usb_transport *usb, libusb_device *dev, struct ncm_iface *n) {
+    struct libusb_config_descriptor *config;
+    if (usb->get_active_config_descriptor(dev, &config) < 0) return -1;
+    
+    memset(n, 0, sizeof(*n));
+    n->ctrl = n->data = -1;
+    for (int i = 0; i < config->bNumInterfaces && n->ctrl < 0; i++) {
+        const struct libusb_interface_descriptor *s = &config->interface[i].altsetting[0];
+        int proto = s->bInterfaceProtocol;
+        
+        if (!(s->bInterfaceClass == 0x02 && s->bInterfaceSubClass == 0x0d) &&
+            !(s->bInterfaceClass == 0xff && s->bInterfaceSubClass == 0x02 &&
+              (proto == 0x16 || proto == 0x46 || proto == 0x76))) {
+            continue;
+        }
+        n->ctrl = s->bInterfaceNumber;
+        n->data = n->ctrl + 1;
+        for (int k = 0; k + 2 < s->extra_length && s->extra[k] >= 3; k += s->extra[k]) {
+            const unsigned char *f = s->extra + k;
+            if (f[1] != 0x24 || k + f[0] > s->extra_length) continue;
+            if (f[2] == 0x06 && f[0] >= 5) n->data = f[4];
+            if (f[2] == 0x0f && f[0] >= 13) n->mac_index = f[3];
+        }
+    }
+    
+    for (int i = 0; i < config->bNumInterfaces && n->ctrl >= 0 && !n->ep_in; i++) {
+        const struct libusb_interface *iface = &config->interface[i];
+        for (int j = 0; j < iface->num_altsetting && !n->ep_in; j++) {
+            const struct libusb_interface_descriptor *s = &iface->altsetting[j];
+            int in = 0, out = 0, packet = 0;
+            
+            if (s->bInterfaceNumber != n->data) break;
+            for (int k = 0; k < s->bNumEndpoints; k++) {
+                const struct libusb_endpoint_descriptor *ep = &s->endpoint[k];
+                if ((ep->bmAttributes & 0x03) != LIBUSB_TRANSFER_TYPE_BULK) continue;
+                if (ep->bEndpointAddress & 0x80) {
+                    in = ep->bEndpointAddress;
+                } else {
+                    out = ep->bEndpointAddress;
+                    packet = ep->wMaxPacketSize;
+                }
+            }
+            if (in && out) {
+                n->alt = s->bAlternateSetting;
+                n->ep_in = in;
+                n->ep_out = out;
+                n->max_packet = packet;
+            }
+        }
+    }
+    usb->free_config_descriptor(config);
+    return n->ep_in ? 0 : -1;
+}
+
+static void ncm_wake(struct huawei_ncm *s) {
+    char c = 0;
+    if (write(s->wake[1], &c, 1) < 0) {
+        // Pipe full: the main thread has wakeups pending anyway
+    }
+}
+
+static void ncm_fail(struct huawei_ncm *s, int error) {
+    if (!s->error) s->error = error;
+    atomic_store(&s->stop, 1);
+    ncm_wake(s);
+}
+
+// L3: who-has for any address but the asker's own gets our MAC
+static void ncm_arp(struct huawei_ncm *s, const uint8_t *f, size_t len) {
+    static const uint8_t request[8] = {0x00, 0x01, 0x08, 0x00, 6, 4, 0x00, 0x01};
+    uint8_t *r = s->arp_reply;
+    
+    if (len < 42 || memcmp(f + 14, request, 8) != 0 || memcmp(f + 28, f + 38, 4) == 0) return;
+    if (atomic_load(&s->arp_pending)) return;
+    memcpy(r, f + 6, 6);
+    memcpy(r + 6, s->host_mac, 6);
+    r[12] = 0x08;
+    r[13] = 0x06;
+    memcpy(r + 14, request, 7);
+    r[21] = 0x02;
+    memcpy(r + 22, s->host_mac, 6);
+    memcpy(r + 28, f + 38, 4);
+    memcpy(r + 32, f + 22, 10);
+    atomic_store(&s->arp_pending, 1);
+    ncm_wake(s);
+}
+
+// One datagram of a received block, written out from where it lies
+static void ncm_rx_datagram(void *opaque, uint8_t *data, size_t len) {
+    struct huawei_ncm *s = opaque;
+    
+    if (len < NCM_ETH_HLEN) {
+        atomic_fetch_add(&s->rx_stats.errors, 1);
+        return;
+    }
+    if (s->l3) {
+        int type = data[12] << 8 | data[13];
+        if (!atomic_load(&s->peer_known)) {
+            memcpy(s->peer_mac, data + 6, 6);
+            atomic_store(&s->peer_known, 1);
+        }
+        if (type == 0x0806) {
+            ncm_arp(s, data, len);
+            return;
+        }
+        if (type != 0x0800 && type != 0x86dd) {
+            atomic_fetch_add(&s->rx_stats.dropped, 1);
+            return;
+        }
+        // Step over the Ethernet header, leaving room for the family word if needed
+        data += NCM_ETH_HLEN - s->af_header;
+        len -= (size_t)(NCM_ETH_HLEN - s->af_header);
+        if (s->af_header) {
+            uint32_t af = htonl(type == 0x0800 ? AF_INET : AF_INET6);
+            memcpy(data, &af, 4);
+        }
+    }
+    if (write(s->fd, data, len) < 0) {
+        atomic_fetch_add(&s->rx_stats.dropped, 1);
+        return;
+    }
+    atomic_fetch_add(&s->rx_stats.packets, 1);
+    atomic_fetch_add(&s->rx_stats.bytes, len);
+}
+
+static void ncm_rx_callback(struct libusb_transfer *t) {
+    struct huawei_ncm *s = t->user_data;
+    
+    if (t->status == LIBUSB_TRANSFER_COMPLETED) {
+        atomic_fetch_add(&s->rx_stats.ntbs, 1);
+        if (ncm_parse(t->buffer, (size_t)t->actual_length, ncm_rx_datagram, s) < 0) {
+            atomic_fetch_add(&s->rx_stats.errors, 1);
+        }
+    } else if (t->status != LIBUSB_TRANSFER_CANCELLED && t->status != LIBUSB_TRANSFER_TIMED_OUT) {
+        ncm_fail(s, transfer_status_error(t->status));
+    }
+    if (!atomic_load(&s->stop) && s->usb->submit_transfer(t) == 0) return;
+    atomic_fetch_sub(&s->in_flight, 1);
+}
+
+static void ncm_tx_callback(struct libusb_transfer *t) {
+    struct huawei_ncm *s = t->user_data;
+    
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+        atomic_fetch_add(&s->tx_stats.errors, 1);
+        if (t->status != LIBUSB_TRANSFER_CANCELLED && t->status != LIBUSB_TRANSFER_TIMED_OUT) {
+            ncm_fail(s, transfer_status_error(t->status));
+        }
+    }
+    atomic_fetch_add(&s->tx_done, 1);
+    atomic_fetch_sub(&s->in_flight, 1);
+    ncm_wake(s);
+}
+
+static void *ncm_events(void *arg) {
+    struct huawei_ncm *s = arg;
+    
+    while (atomic_load(&s->in_flight) > 0) {
+        struct timeval tv = {0, 100000};
+        s->usb->handle_events_timeout_completed(s->ctx, &tv, NULL);
+    }
+    return NULL;
+}
+
+void huawei_ncm_close(struct huawei_ncm *s) {
+    const struct usb_transport *usb;
+    
+    if (!s) return;
+    usb = s->usb;
+    for (int i = 0; i < NCM_RX_TRANSFERS; i++) {
+        if (s->rx[i]) usb->free_transfer(s->rx[i]);
+        free(s->rx_buf[i]);
+    }
+    for (int i = 0; i < NCM_TX_TRANSFERS; i++) {
+        if (s->tx[i]) usb->free_transfer(s->tx[i]);
+        free(s->tx_buf[i]);
+    }
+    if (s->wake[0] >= 0) close(s->wake[0]);
+    if (s->wake[1] >= 0) close(s->wake[1]);
+    if (s->handle) {
+        usb->set_interface_alt_setting(s->handle, s->iface.data, 0);
+        usb->release_interface(s->handle, s->iface.data);
+        usb->release_interface(s->handle, s->iface.ctrl);
+    }
+    free(s);
+}
+
+/*
+ * Claim the NCM function and bring it up: read the NTB parameters, pick
+ * NTB32 if asked for and supported, size the receive blocks and select the
+ * data setting.
+ */
+int huawei_ncm_open(struct huawei_ncm **out, struct huawei_modem *m, int fd, const struct huawei_ncm_options *o) {
+    const struct usb_transport *usb = m->hc->usb;
+    struct huawei_ncm *s = calloc(1, sizeof(*s));
+    unsigned char buf[NCM_NTB_PARAMETERS_LEN];
+    int r;
+    
+    *out = NULL;
+    if (!s) return LIBUSB_ERROR_NO_MEM;
+    s->usb = usb;
+    s->wake[0] = s->wake[1] = -1;
+    if (ncm_find(usb, usb->get_device(m->handle), &s->iface) < 0) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: no NCM function in this mode", m->path);
+        free(s);
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    for (int i = 0; i < 2; i++) {
+        int iface = i ? s->iface.data : s->iface.ctrl;
+        if (usb->kernel_driver_active(m->handle, iface) == 1) usb->detach_kernel_driver(m->handle, iface);
+        r = usb->claim_interface(m->handle, iface);
+        if (r < 0) {
+            huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: could not claim NCM interface %d: %s", m->path, iface,
+                       libusb_strerror(r));
+            if (i) usb->release_interface(m->handle, s->iface.ctrl);
+            free(s);
+            return r;
+        }
+    }
+    s->handle = m->handle;
+    s->ctx = m->hc->usb_ctx;
+    s->fd = fd;
+    s->l3 = o->l3;
+    s->af_header = o->af_header;
+    
+    r = usb->control_transfer(s->handle, 0xA1, NCM_GET_NTB_PARAMETERS, 0, (uint16_t)s->iface.ctrl, buf,
+                              sizeof(buf), TIMEOUT_MS);
+    if (r < 0 || ncm_params_parse(&s->params, buf, r) < 0) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: cannot read NTB parameters: %s", m->path,
+                   r < 0 ? libusb_strerror(r) : "bad reply");
+        huawei_ncm_close(s);
+        return r < 0 ? r : LIBUSB_ERROR_IO;
+    }
+    if (o->ntb32 && (s->params.formats & 2)) {
+        r = usb->control_transfer(s->handle, 0x21, NCM_SET_NTB_FORMAT, 1, (uint16_t)s->iface.ctrl, NULL, 0,
+                                  TIMEOUT_MS);
+        s->ntb32 = r >= 0;
+    }
+    if (o->ntb32 && !s->ntb32) huawei_log(m->hc, HUAWEI_LOG_INFO, "%s: NTB32 not supported, using NTB16", m->path);
+    
+    // A device that ignores the input size may send blocks up to its own maximum
+    s->rx_size = s->params.in_max < NCM_NTB_MAX ? s->params.in_max : NCM_NTB_MAX;
+    ncm_put32(buf, (uint32_t)s->rx_size);
+    r = usb->control_transfer(s->handle, 0x21, NCM_SET_NTB_INPUT_SIZE, 0, (uint16_t)s->iface.ctrl, buf, 4,
+                              TIMEOUT_MS);
+    if (r < 0) s->rx_size = s->params.in_max;
+    
+    r = usb->set_interface_alt_setting(s->handle, s->iface.data, 0);
+    if (r == 0) r = usb->set_interface_alt_setting(s->handle, s->iface.data, s->iface.alt);
+    if (r < 0) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: cannot select the NCM data setting: %s", m->path,
+                   libusb_strerror(r));
+        huawei_ncm_close(s);
+        return r;
+    }
+    
+    if (s->iface.mac_index) {
+        char hex[16] = "";
+        usb->get_string_descriptor_ascii(s->handle, (uint8_t)s->iface.mac_index, (unsigned char *)hex, sizeof(hex));
+        for (int i = 0; i < 6 && isxdigit((unsigned char)hex[2 * i]) && isxdigit((unsigned char)hex[2 * i + 1]); i++) {
+            char byte[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+            s->host_mac[i] = (uint8_t)strtoul(byte, NULL, 16);
+        }
+    }
+    if (!s->host_mac[0] && !s->host_mac[5]) memcpy(s->host_mac, "\x02\x1e\x10\x1f\x00\x01", 6);
+    
+    r = pipe(s->wake);
+    for (int i = 0; i < NCM_RX_TRANSFERS && r == 0; i++) {
+        s->rx[i] = usb->alloc_transfer(0);
+        s->rx_buf[i] = malloc(s->rx_size);
+        if (!s->rx[i] || !s->rx_buf[i]) r = -1;
+    }
+    for (int i = 0; i < NCM_TX_TRANSFERS && r == 0; i++) {
+        s->tx[i] = usb->alloc_transfer(0);
+        s->tx_buf[i] = malloc(NCM_NTB_MAX);
+        if (!s->tx[i] || !s->tx_buf[i]) r = -1;
+    }
+    if (r < 0) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: out of memory", m->path);
+        huawei_ncm_close(s);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    fcntl(s->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(s->wake[1], F_SETFL, O_NONBLOCK);
+    
+    if (o->verbose) {
+        huawei_log(m->hc, HUAWEI_LOG_INFO, "NCM: interfaces %d/%d alt %d IN=0x%02x OUT=0x%02x %s, in %zu out %u "
+                   "bytes, datagrams at %u mod %u", s->iface.ctrl, s->iface.data, s->iface.alt, s->iface.ep_in,
+                   s->iface.ep_out, s->ntb32 ? "NTB32" : "NTB16", s->rx_size, s->params.out_max,
+                   s->params.out_remainder, s->params.out_divisor);
+    }
+    *out = s;
+    return 0;
+}
+
+int huawei_ncm_ntb32(const struct huawei_ncm *s) {
+    return s->ntb32;
+}
+
+void huawei_ncm_host_mac(const struct huawei_ncm *s, uint8_t mac[6]) {
+    memcpy(mac, s->host_mac, 6);
+}
+
+// L3: put an Ethernet header in front of the packet at f + NCM_ETH_HLEN
+static void ncm_eth_header(struct huawei_ncm *s, uint8_t *f) {
+    if (atomic_load(&s->peer_known)) {
+        memcpy(f, s->peer_mac, 6);
+    } else {
+        memset(f, 0xff, 6);
+    }
+    memcpy(f + 6, s->host_mac, 6);
+    f[12] = (f[NCM_ETH_HLEN] >> 4) == 6 ? 0x86 : 0x08;
+    f[13] = (f[NCM_ETH_HLEN] >> 4) == 6 ? 0xdd : 0x00;
+}
+
+// Fill the next free block from the device and send it. 1 = sent, 0 = nothing to send
+static int ncm_tx_fill(struct huawei_ncm *s) {
+    unsigned slot = s->tx_next % NCM_TX_TRANSFERS;
+    size_t skip = s->l3 ? (size_t)(NCM_ETH_HLEN - s->af_header) : 0;
+    struct ncm_tx tx;
+    uint8_t *p;
+    
+    ncm_tx_begin(&tx, s->tx_buf[slot], NCM_NTB_MAX, s->ntb32, &s->params);
+    if (atomic_load(&s->arp_pending) && (p = ncm_tx_reserve(&tx, sizeof(s->arp_reply)))) {
+        memcpy(p, s->arp_reply, sizeof(s->arp_reply));
+        ncm_tx_commit(&tx, sizeof(s->arp_reply));
+        atomic_store(&s->arp_pending, 0);
+    }
+    
+    while ((p = ncm_tx_reserve(&tx, NCM_FRAME_MAX))) {
+        ssize_t n = read(s->fd, p + skip, NCM_FRAME_MAX - skip);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            // Device gone (or the stand-in closed)
+            ncm_fail(s, n < 0 ? LIBUSB_ERROR_IO : 0);
+            break;
+        }
+        if (s->l3) {
+            if ((size_t)n <= (size_t)s->af_header) continue;
+            n += (ssize_t)skip;
+            ncm_eth_header(s, p);
+        }
+        if (n < NCM_ETH_HLEN) continue;
+        ncm_tx_commit(&tx, (size_t)n);
+        atomic_fetch_add(&s->tx_stats.packets, 1);
+        atomic_fetch_add(&s->tx_stats.bytes, (uint64_t)n);
+    }
+    if (tx.count == 0) return 0;
+    
+    struct libusb_transfer *t = s->tx[slot];
+    size_t len = ncm_tx_finish(&tx, s->seq++, (size_t)s->iface.max_packet);
+    libusb_fill_bulk_transfer(t, s->handle, (unsigned char)s->iface.ep_out, s->tx_buf[slot], (int)len,
+                              ncm_tx_callback, s, NCM_TX_TIMEOUT_MS);
+    atomic_fetch_add(&s->in_flight, 1);
+    int r = s->usb->submit_transfer(t);
+    if (r < 0) {
+        atomic_fetch_sub(&s->in_flight, 1);
+        ncm_fail(s, r);
+        return 0;
+    }
+    s->tx_next++;
+    atomic_fetch_add(&s->tx_stats.ntbs, 1);
+    return 1;
+}
+
+void huawei_ncm_shutdown(struct huawei_ncm *s) {
+    atomic_store(&s->stop, 1);
+    ncm_wake(s);
+}
+
+int huawei_ncm_run(struct huawei_ncm *s) {
+    sigset_t all, old;
+    char drain[64];
+    int r;
+    
+    for (int i = 0; i < NCM_RX_TRANSFERS; i++) {
+        libusb_fill_bulk_transfer(s->rx[i], s->handle, (unsigned char)s->iface.ep_in, s->rx_buf[i],
+                                  (int)s->rx_size, ncm_rx_callback, s, 0);
+        atomic_fetch_add(&s->in_flight, 1);
+        r = s->usb->submit_transfer(s->rx[i]);
+        if (r < 0) {
+            atomic_fetch_sub(&s->in_flight, 1);
+            ncm_fail(s, r);
+            break;
+        }
+    }
+    
+    // Signals stay with the calling thread, where they interrupt poll()
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    r = pthread_create(&s->events, NULL, ncm_events, s);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r != 0) ncm_fail(s, LIBUSB_ERROR_NO_MEM);
+    
+    while (!atomic_load(&s->stop)) {
+        int busy = s->tx_next - atomic_load(&s->tx_done) == NCM_TX_TRANSFERS;
+        if (!busy && ncm_tx_fill(s)) continue;
+        
+        struct pollfd fds[2] = {{s->wake[0], POLLIN, 0}, {s->fd, POLLIN, 0}};
+        if (poll(fds, busy ? 1 : 2, 100) > 0 && (fds[0].revents & POLLIN)) {
+            while (read(s->wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+    }
+    
+    // Only transfers that were filled in have a device to be cancelled on
+    atomic_store(&s->stop, 1);
+    for (int i = 0; i < NCM_RX_TRANSFERS; i++) {
+        if (s->rx[i]->dev_handle) s->usb->cancel_transfer(s->rx[i]);
+    }
+    for (int i = 0; i < NCM_TX_TRANSFERS; i++) {
+        if (s->tx[i]->dev_handle) s->usb->cancel_transfer(s->tx[i]);
+    }
+    if (r == 0) pthread_join(s->events, NULL);
+    return s->error;
+}
+
+void huawei_ncm_stats(const struct huawei_ncm *s, struct huawei_link_stats *rx, struct huawei_link_stats *tx) {
+    memset(rx, 0, sizeof(*rx));
+    memset(tx, 0, sizeof(*tx));
+    rx->packets = atomic_load(&s->rx_stats.packets);
+    rx->bytes = atomic_load(&s->rx_stats.bytes);
+    rx->dropped = atomic_load(&s->rx_stats.dropped);
+    rx->errors = atomic_load(&s->rx_stats.errors);
+    rx->transfers = atomic_load(&s->rx_stats.ntbs);
+    tx->packets = atomic_load(&s->tx_stats.packets);
+    tx->bytes = atomic_load(&s->tx_stats.bytes);
+    tx->errors = atomic_load(&s->tx_stats.errors);
+    tx->transfers = atomic_load(&s->tx_stats.ntbs);
+}
+
+/*
+ * PPP datapath
+ *
+ * Sticks in modem mode (0x1001, 0x1003, 0x1506 and the like) carry IP over
+ * the modem port itself: after ATD*99# answers CONNECT the port speaks PPP
+ * in asynchronous HDLC framing (huawei_hdlc.h) instead of AT. pppd would
+ * need a tty for that; huawei_ppp_dial() dials on the claimed bulk
+ * endpoints and switches the port to data mode, and huawei_ppp_run()
+ * bridges IPv4 to the caller's TUN device until huawei_ppp_shutdown().
+ *
+ * Only what the stick's PPP server needs is negotiated: LCP (we ask for an
+ * empty ACCM and a magic number; the peer's MRU, ACCM, magic number, PFC,
+ * ACFC and PAP are accepted, CHAP is answered with a Nak for PAP), PAP, and
+ * IPCP with our address and DNS servers taken from the peer's Nak
+ * (RFC 1877). Other protocols get a Protocol-Reject.
+ *
+ * Receiving, the port's IN transfers hand their bytes to the decoder through
+ * huawei_port_set_data() on a libusb event thread; IP packets go to the TUN from
+ * there, control packets are queued for the main thread, which runs the
+ * negotiation and packs packets read from the TUN into PPP_TX_TRANSFERS
+ * transfers of frames back to back.
+ */
+
+#define PPP_TX_TRANSFERS    8
+#define PPP_TX_MAX          16384   // encoded frames per transfer
+#define PPP_MRU             HUAWEI_PPP_MRU
+#define PPP_FRAME_MAX       2048    // one frame unescaped, header and FCS included
+#define PPP_CTRL_QUEUE      16      // control packets waiting for the main thread
+#define PPP_RESTART_MS      1000    // request retransmission (RFC 1661 restart timer)
+#define PPP_NEGOTIATE_MS    30000   // CONNECT to IPCP up
+#define PPP_TERMINATE_MS    3000
+#define PPP_ECHO_MS         10000   // LCP echo interval once up
+#define PPP_ECHO_FAILS      3       // unanswered echoes before the link counts as dead
+#define PPP_DIAL_TIMEOUT_MS 60000
+#define PPP_TX_TIMEOUT_MS   5000
+
+#define PPP_IP              0x0021
+#define PPP_IPCP            0x8021
+#define PPP_LCP             0xc021
+#define PPP_PAP             0xc023
+
+// LCP and IPCP codes; PAP uses 1-3 as request, ack and nak
+enum ppp_code {
+    PPP_CONF_REQ = 1,
+    PPP_CONF_ACK,
+    PPP_CONF_NAK,
+    PPP_CONF_REJ,
+    PPP_TERM_REQ,
+    PPP_TERM_ACK,
+    PPP_CODE_REJ,
+    PPP_PROTO_REJ,
+    PPP_ECHO_REQ,
+    PPP_ECHO_REP
+};
+
+enum ppp_phase {
+    PPP_PHASE_LCP,
+    PPP_PHASE_AUTH,
+    PPP_PHASE_IPCP,
+    PPP_PHASE_OPEN,
+    PPP_PHASE_TERMINATE,
+    PPP_PHASE_DONE
+};
+
+// One side of a Configure-Request exchange
+struct ppp_cp {
+    uint8_t id;             // of our last request
+    int acked;              // the peer acked ours
+    int peer_acked;         // we acked the peer's
+    uint64_t next_us;       // our request is due again, 0 = now
+};
+
+struct huawei_ppp {
+    const struct usb_transport *usb;
+    libusb_context *ctx;
+    struct huawei_modem *m;
+    struct huawei_port *port;
+    int fd;                 // TUN device or a stand-in, non-blocking
+    int af_header;          // bytes of address family before each packet (utun)
+    char user[256];
+    char password[256];
+    huawei_ppp_up_fn up;    // told the addresses once IPCP is up
+    void *up_opaque;
+    int verbose;
+    atomic_int hangup;      // huawei_ppp_shutdown() was called
+    atomic_int stop;
+    atomic_int events_stop;
+    atomic_int in_flight;
+    atomic_int open;        // IPCP is up: IP goes both ways
+    int error;
+    int wake[2];            // control packets, TX completions and stop wake the main thread
+    pthread_t events;
+    
+    // Receiving, on the event thread
+    struct hdlc_rx rx;
+    uint8_t rx_frame[PPP_FRAME_MAX];
+    
+    // Control packets on their way to the main thread
+    pthread_mutex_t lock;
+    unsigned ctrl_head;
+    unsigned ctrl_tail;
+    uint16_t ctrl_proto[PPP_CTRL_QUEUE];
+    size_t ctrl_len[PPP_CTRL_QUEUE];
+    uint8_t ctrl[PPP_CTRL_QUEUE][PPP_FRAME_MAX];
+    
+    // Sending, on the main thread
+    struct libusb_transfer *tx[PPP_TX_TRANSFERS];
+    uint8_t *tx_buf[PPP_TX_TRANSFERS];
+    unsigned tx_next;       // slots are used in turn; completions come back in order
+    size_t tx_fill;         // bytes already framed into slot tx_next
+    atomic_uint tx_done;
+    uint32_t tx_accm;       // the peer's map once LCP is up, every control character before
+    uint8_t frame[PPP_FRAME_MAX];
+    
+    // Negotiation, on the main thread
+    enum ppp_phase phase;
+    struct ppp_cp lcp;
+    struct ppp_cp pap;
+    struct ppp_cp ipcp;
+    unsigned lcp_rejected;  // our LCP options the peer rejected, bit per type
+    unsigned ipcp_rejected; // bit 0 primary DNS, bit 1 secondary DNS
+    uint32_t magic;
+    uint32_t peer_accm;
+    int peer_pap;           // the peer wants us to authenticate
+    uint32_t addr;
+    uint32_t peer_addr;
+    uint32_t dns[2];
+    uint8_t reject_id;
+    uint8_t echo_id;
+    int echo_missed;
+    uint64_t echo_next;
+    uint64_t deadline;      // negotiation or termination gives up
+    int term_acked;         // the peer knows the link is down and left data mode
+    const char *reason;     // why the link went down, NULL when asked to
+    
+    struct {
+        _Atomic uint64_t packets;
+        _Atomic uint64_t bytes;
+        _Atomic uint64_t dropped;
+        _Atomic uint64_t transfers;
+    } rx_stats, tx_stats;
+};
+
+static uint16_t ppp_get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t ppp_get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void ppp_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void ppp_wake(struct huawei_ppp *s) {
+    char c = 0;
+    if (write(s->wake[1], &c, 1) < 0) {
+        // Pipe full: the main thread has wakeups pending anyway
+    }
+}
+
+static void ppp_fail(struct huawei_ppp *s, int error) {
+    if (!s->error) s->error = error;
+    atomic_store(&s->stop, 1);
+    ppp_wake(s);
+}
+
+// One received frame with a good FCS, on the event thread
+static void ppp_rx_frame(void *opaque, uint8_t *f, size_t len) {
+    struct huawei_ppp *s = opaque;
+    uint16_t proto;
+    size_t h = 0;
+    
+    // Address and control field may be left out (ACFC), and a protocol of one byte (PFC)
+    if (len >= 2 && f[0] == 0xff && f[1] == 0x03) h = 2;
+    if (h < len && (f[h] & 1)) {
+        proto = f[h++];
+    } else if (h + 2 <= len && (f[h + 1] & 1)) {
+        proto = ppp_get16(f + h);
+        h += 2;
+    } else {
+        atomic_fetch_add(&s->rx_stats.dropped, 1);
+        return;
+    }
+    
+    if (proto == PPP_IP) {
+        uint32_t af = htonl(AF_INET);
+        struct iovec iov[2] = {{&af, (size_t)s->af_header}, {f + h, len - h}};
+        
+        if (!atomic_load(&s->open) || writev(s->fd, iov + !s->af_header, 2 - !s->af_header) < 0) {
+            atomic_fetch_add(&s->rx_stats.dropped, 1);
+            return;
+        }
+        atomic_fetch_add(&s->rx_stats.packets, 1);
+        atomic_fetch_add(&s->rx_stats.bytes, len - h);
+        return;
+    }
+    
+    pthread_mutex_lock(&s->lock);
+    if (s->ctrl_head - s->ctrl_tail < PPP_CTRL_QUEUE) {
+        unsigned slot = s->ctrl_head++ % PPP_CTRL_QUEUE;
+        s->ctrl_proto[slot] = proto;
+        s->ctrl_len[slot] = len - h;
+        memcpy(s->ctrl[slot], f + h, len - h);
+    } else {
+        atomic_fetch_add(&s->rx_stats.dropped, 1);
+    }
+    pthread_mutex_unlock(&s->lock);
+    ppp_wake(s);
+}
+
+// The port's data sink (huawei_port_set_data)
+static void ppp_rx_data(void *opaque, const unsigned char *data, size_t len) {
+    struct huawei_ppp *s = opaque;
+    
+    atomic_fetch_add(&s->rx_stats.transfers, 1);
+    hdlc_rx_feed(&s->rx, data, len, ppp_rx_frame, s);
+}
+
+static void ppp_tx_callback(struct libusb_transfer *t) {
+    struct huawei_ppp *s = t->user_data;
+    
+    if (t->status != LIBUSB_TRANSFER_COMPLETED && t->status != LIBUSB_TRANSFER_CANCELLED) {
+        ppp_fail(s, transfer_status_error(t->status));
+    }
+    atomic_fetch_add(&s->tx_done, 1);
+    atomic_fetch_sub(&s->in_flight, 1);
+    ppp_wake(s);
+}
+
+static void *ppp_events(void *arg) {
+    struct huawei_ppp *s = arg;
+    
+    while (!atomic_load(&s->events_stop) || atomic_load(&s->in_flight) > 0) {
+        struct timeval tv = {0, 100000};
+        s->usb->handle_events_timeout_completed(s->ctx, &tv, NULL);
+    }
+    return NULL;
+}
+
+static int ppp_tx_free(struct huawei_ppp *s) {
+    return s->tx_next - atomic_load(&s->tx_done) < PPP_TX_TRANSFERS;
+}
+
+// Send the frames collected in the current slot
+static void ppp_tx_flush(struct huawei_ppp *s) {
+    unsigned slot = s->tx_next % PPP_TX_TRANSFERS;
+    struct libusb_transfer *t = s->tx[slot];
+    
+    if (s->tx_fill == 0) return;
+    libusb_fill_bulk_transfer(t, s->port->handle, (unsigned char)s->port->ep_out, s->tx_buf[slot], (int)s->tx_fill,
+                              ppp_tx_callback, s, PPP_TX_TIMEOUT_MS);
+    s->tx_fill = 0;
+    atomic_fetch_add(&s->in_flight, 1);
+    int r = s->usb->submit_transfer(t);
+    if (r < 0) {
+        atomic_fetch_sub(&s->in_flight, 1);
+        ppp_fail(s, r);
+        return;
+    }
+    s->tx_next++;
+    atomic_fetch_add(&s->tx_stats.transfers, 1);
+}
+
+// Frame f into the current slot; -1 if every transfer is busy
+static int ppp_send_frame(struct huawei_ppp *s, const uint8_t *f, size_t len, uint32_t accm) {
+    if (s->tx_fill + HDLC_ENCODED_MAX(len) > PPP_TX_MAX) ppp_tx_flush(s);
+    if (!ppp_tx_free(s)) return -1;
+    s->tx_fill += hdlc_encode(s->tx_buf[s->tx_next % PPP_TX_TRANSFERS] + s->tx_fill, f, len, accm);
+    return 0;
+}
+
+// A control packet: code, id, length, data. LCP always has every control character escaped.
+static void ppp_send_cp(struct huawei_ppp *s, uint16_t proto, int code, uint8_t id, const uint8_t *data,
+                        size_t len) {
+    uint8_t f[PPP_FRAME_MAX];
+    
+    if (len > PPP_MRU - 4) len = PPP_MRU - 4;
+    f[0] = 0xff;
+    f[1] = 0x03;
+    f[2] = (uint8_t)(proto >> 8);
+    f[3] = (uint8_t)proto;
+    f[4] = (uint8_t)code;
+    f[5] = id;
+    f[6] = (uint8_t)((len + 4) >> 8);
+    f[7] = (uint8_t)(len + 4);
+    if (len) memcpy(f + 8, data, len);
+    if (ppp_send_frame(s, f, len + 8, proto == PPP_LCP ? HDLC_ACCM_ALL : s->tx_accm) < 0) {
+        atomic_fetch_add(&s->tx_stats.dropped, 1);     // requests go again, the peer repeats its own
+    }
+}
+
+// Take the link down: Terminate-Request, then wait a little for the ack
+static void ppp_down(struct huawei_ppp *s, const char *reason) {
+    if (s->phase >= PPP_PHASE_TERMINATE) return;
+    s->reason = reason;
+    s->phase = PPP_PHASE_TERMINATE;
+    s->deadline = now_us() + (uint64_t)PPP_TERMINATE_MS * 1000;
+    s->lcp.next_us = 0;
+    atomic_store(&s->open, 0);
+}
+
+static void ppp_lcp_request(struct huawei_ppp *s) {
+    uint8_t o[12];
+    size_t n = 0;
+    
+    if (!(s->lcp_rejected & (1u << 2))) {
+        // Nothing escaped towards us: the decoder copies whole runs
+        o[n++] = 2;
+        o[n++] = 6;
+        ppp_put32(o + n, 0);
+        n += 4;
+    }
+    if (!(s->lcp_rejected & (1u << 5))) {
+        o[n++] = 5;
+        o[n++] = 6;
+        ppp_put32(o + n, s->magic);
+        n += 4;
+    }
+    ppp_send_cp(s, PPP_LCP, PPP_CONF_REQ, ++s->lcp.id, o, n);
+}
+
+static void ppp_pap_request(struct huawei_ppp *s) {
+    uint8_t d[2 + 2 * 255];
+    size_t ulen = strlen(s->user), plen = strlen(s->password);
+    
+    if (ulen > 255) ulen = 255;
+    if (plen > 255) plen = 255;
+    d[0] = (uint8_t)ulen;
+    memcpy(d + 1, s->user, ulen);
+    d[1 + ulen] = (uint8_t)plen;
+    memcpy(d + 2 + ulen, s->password, plen);
+    ppp_send_cp(s, PPP_PAP, 1, ++s->pap.id, d, 2 + ulen + plen);
+}
+
+static void ppp_ipcp_request(struct huawei_ppp *s) {
+    uint8_t o[18];
+    size_t n = 0;
+    
+    o[n++] = 3;
+    o[n++] = 6;
+    ppp_put32(o + n, s->addr);
+    n += 4;
+    for (int i = 0; i < 2; i++) {
+        if (s->ipcp_rejected & (1u << i)) continue;
+        o[n++] = (uint8_t)(129 + 2 * i);
+        o[n++] = 6;
+        ppp_put32(o + n, s->dns[i]);
+        n += 4;
+    }
+    ppp_send_cp(s, PPP_IPCP, PPP_CONF_REQ, ++s->ipcp.id, o, n);
+}
+
+// Walk configuration options; -1 if they run past the end
+static int ppp_options_valid(const uint8_t *o, size_t len) {
+    for (size_t i = 0; i < len; i += o[i + 1]) {
+        if (i + 2 > len || o[i + 1] < 2 || i + o[i + 1] > len) return -1;
+    }
+    return 0;
+}
+
+// Answer the peer's Configure-Request: reject what we do not know, nak
+// what we want differently, otherwise ack. Returns 1 if acked.
+static int ppp_answer_request(struct huawei_ppp *s, uint16_t proto, uint8_t id, const uint8_t *o, size_t len) {
+    uint8_t nak[64], rej[PPP_FRAME_MAX];
+    size_t nnak = 0, nrej = 0;
+    
+    if (ppp_options_valid(o, len) < 0) return 0;
+    for (size_t i = 0; i < len; i += o[i + 1]) {
+        uint8_t type = o[i], olen = o[i + 1];
+        int ok;
+        
+        if (proto == PPP_LCP) {
+            // MRU, ACCM, authentication, magic number, PFC, ACFC
+            ok = type == 1 || (type == 2 && olen == 6) || type == 5 || type == 7 || type == 8;
+            if (type == 3 && olen >= 4 && ppp_get16(o + i + 2) == PPP_PAP) {
+                ok = 1;
+            } else if (type == 3 && nnak + 4 <= sizeof(nak)) {
+                // CHAP or anything else: PAP is all we do
+                memcpy(nak + nnak, "\x03\x04\xc0\x23", 4);
+                nnak += 4;
+                continue;
+            }
+        } else {
+            ok = type == 3 && olen == 6;
+        }
+        if (!ok) {
+            memcpy(rej + nrej, o + i, olen);
+            nrej += olen;
+        }
+    }
+    
+    if (nrej) {
+        ppp_send_cp(s, proto, PPP_CONF_REJ, id, rej, nrej);
+    } else if (nnak) {
+        ppp_send_cp(s, proto, PPP_CONF_NAK, id, nak, nnak);
+    } else {
+        ppp_send_cp(s, proto, PPP_CONF_ACK, id, o, len);
+        return 1;
+    }
+    return 0;
+}
+
+// The options of an acked request take effect
+static void ppp_apply_request(struct huawei_ppp *s, uint16_t proto, const uint8_t *o, size_t len) {
+    if (proto == PPP_LCP) {
+        s->peer_accm = HDLC_ACCM_ALL;
+        s->peer_pap = 0;
+    }
+    for (size_t i = 0; i < len; i += o[i + 1]) {
+        if (proto == PPP_LCP && o[i] == 2) s->peer_accm = ppp_get32(o + i + 2);
+        if (proto == PPP_LCP && o[i] == 3) s->peer_pap = 1;
+        if (proto == PPP_IPCP && o[i] == 3) s->peer_addr = ppp_get32(o + i + 2);
+    }
+}
+
+// The peer's Nak or Reject of our request
+static void ppp_adjust_request(struct huawei_ppp *s, uint16_t proto, int code, const uint8_t *o, size_t len) {
+    if (ppp_options_valid(o, len) < 0) return;
+    for (size_t i = 0; i < len; i += o[i + 1]) {
+        uint8_t type = o[i], olen = o[i + 1];
+        
+        if (proto == PPP_LCP && code == PPP_CONF_REJ && type < 32) {
+            s->lcp_rejected |= 1u << type;
+        } else if (proto == PPP_LCP && type == 5 && olen == 6) {
+            s->magic = ppp_get32(o + i + 2) ^ (uint32_t)now_us();
+        } else if (proto == PPP_IPCP && code == PPP_CONF_REJ && (type == 129 || type == 131)) {
+            s->ipcp_rejected |= 1u << ((type - 129) / 2);
+        } else if (proto == PPP_IPCP && code == PPP_CONF_REJ && type == 3) {
+            ppp_down(s, "the peer will not assign an address");
+        } else if (proto == PPP_IPCP && olen == 6 && type == 3) {
+            s->addr = ppp_get32(o + i + 2);
+        } else if (proto == PPP_IPCP && olen == 6 && (type == 129 || type == 131)) {
+            s->dns[(type - 129) / 2] = ppp_get32(o + i + 2);
+        }
+    }
+}
+
+// A new phase starts with its request right away
+static void ppp_advance(struct huawei_ppp *s) {
+    if (s->phase == PPP_PHASE_LCP && s->lcp.acked && s->lcp.peer_acked) {
+        s->tx_accm = s->peer_accm;
+        s->phase = s->peer_pap ? PPP_PHASE_AUTH : PPP_PHASE_IPCP;
+        s->echo_next = now_us() + (uint64_t)PPP_ECHO_MS * 1000;
+        if (s->verbose) {
+            huawei_log(s->m->hc, HUAWEI_LOG_INFO, "PPP: LCP up, ACCM %08x%s", s->tx_accm,
+                       s->peer_pap ? ", PAP" : "");
+        }
+    }
+    if (s->phase == PPP_PHASE_IPCP && s->ipcp.acked && s->ipcp.peer_acked) {
+        struct huawei_ppp_addrs a = {s->addr, s->peer_addr, {s->dns[0], s->dns[1]}};
+        
+        s->phase = PPP_PHASE_OPEN;
+        atomic_store(&s->open, 1);
+        if (s->up) s->up(s->up_opaque, &a);
+    }
+}
+
+// A control packet from the queue: proto, then code, id, length and data
+static void ppp_control(struct huawei_ppp *s, uint16_t proto, uint8_t *p, size_t len) {
+    if (len < 4 || ppp_get16(p + 2) < 4 || ppp_get16(p + 2) > len) return;
+    
+    int code = p[0];
+    uint8_t id = p[1];
+    uint8_t *d = p + 4;
+    size_t dlen = ppp_get16(p + 2) - 4u;
+    int lcp_up = s->phase > PPP_PHASE_LCP && s->phase < PPP_PHASE_TERMINATE;
+    
+    if (s->phase == PPP_PHASE_DONE) return;
+    if (proto == PPP_LCP) {
+        if (code == PPP_CONF_REQ && s->phase < PPP_PHASE_TERMINATE) {
+            if (s->phase != PPP_PHASE_LCP) {
+                // The peer starts over: so do we
+                s->phase = PPP_PHASE_LCP;
+                atomic_store(&s->open, 0);
+                memset(&s->lcp, 0, sizeof(s->lcp));
+                memset(&s->ipcp, 0, sizeof(s->ipcp));
+                s->tx_accm = HDLC_ACCM_ALL;
+            }
+            if (ppp_answer_request(s, proto, id, d, dlen)) {
+                ppp_apply_request(s, proto, d, dlen);
+                s->lcp.peer_acked = 1;
+            }
+        } else if (code == PPP_CONF_ACK && id == s->lcp.id && s->phase == PPP_PHASE_LCP) {
+            s->lcp.acked = 1;
+        } else if ((code == PPP_CONF_NAK || code == PPP_CONF_REJ) && id == s->lcp.id && s->phase == PPP_PHASE_LCP) {
+            ppp_adjust_request(s, proto, code, d, dlen);
+            s->lcp.next_us = 0;
+        } else if (code == PPP_TERM_REQ) {
+            ppp_send_cp(s, PPP_LCP, PPP_TERM_ACK, id, NULL, 0);
+            if (s->phase < PPP_PHASE_TERMINATE) s->reason = "the peer closed the link";
+            s->term_acked = 1;
+            s->phase = PPP_PHASE_DONE;
+        } else if (code == PPP_TERM_ACK && s->phase == PPP_PHASE_TERMINATE) {
+            s->term_acked = 1;
+            s->phase = PPP_PHASE_DONE;
+        } else if (code == PPP_ECHO_REQ && lcp_up && dlen >= 4) {
+            ppp_put32(d, s->magic);
+            ppp_send_cp(s, PPP_LCP, PPP_ECHO_REP, id, d, dlen);
+        } else if (code == PPP_ECHO_REP) {
+            s->echo_missed = 0;
+        } else if (code == PPP_PROTO_REJ && dlen >= 2 && ppp_get16(d) == PPP_IPCP) {
+            ppp_down(s, "the peer does not do IPCP");
+        }
+    } else if (proto == PPP_PAP && s->phase == PPP_PHASE_AUTH && id == s->pap.id) {
+        if (code == 2) {
+            s->phase = PPP_PHASE_IPCP;
+        } else if (code == 3) {
+            ppp_down(s, "PAP authentication failed");
+        }
+    } else if (proto == PPP_IPCP && s->phase == PPP_PHASE_IPCP) {
+        if (code == PPP_CONF_REQ) {
+            if (ppp_answer_request(s, proto, id, d, dlen)) {
+                ppp_apply_request(s, proto, d, dlen);
+                s->ipcp.peer_acked = 1;
+            }
+        } else if (code == PPP_CONF_ACK && id == s->ipcp.id) {
+            s->ipcp.acked = 1;
+        } else if ((code == PPP_CONF_NAK || code == PPP_CONF_REJ) && id == s->ipcp.id) {
+            ppp_adjust_request(s, proto, code, d, dlen);
+            s->ipcp.next_us = 0;
+        }
+    } else if (proto == PPP_IPCP && s->phase == PPP_PHASE_OPEN && code == PPP_TERM_REQ) {
+        ppp_send_cp(s, PPP_IPCP, PPP_TERM_ACK, id, NULL, 0);
+        ppp_down(s, "the peer closed IPCP");
+    } else if (proto != PPP_PAP && proto != PPP_IPCP && lcp_up) {
+        // IPv6CP, CCP and whatever else the peer tries: not here
+        uint8_t rej[PPP_FRAME_MAX];
+        rej[0] = (uint8_t)(proto >> 8);
+        rej[1] = (uint8_t)proto;
+        memcpy(rej + 2, p, len);
+        ppp_send_cp(s, PPP_LCP, PPP_PROTO_REJ, ++s->reject_id, rej, len + 2);
+    }
+    ppp_advance(s);
+}
+
+static void ppp_input(struct huawei_ppp *s) {
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        int empty = s->ctrl_head == s->ctrl_tail;
+        unsigned slot = s->ctrl_tail % PPP_CTRL_QUEUE;
+        pthread_mutex_unlock(&s->lock);
+        if (empty) return;
+        
+        // The event thread only writes slots that are free
+        ppp_control(s, s->ctrl_proto[slot], s->ctrl[slot], s->ctrl_len[slot]);
+        pthread_mutex_lock(&s->lock);
+        s->ctrl_tail++;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// Retransmissions, echoes and the give-up points
+static void ppp_timers(struct huawei_ppp *s, uint64_t now) {
+    uint64_t restart = (uint64_t)PPP_RESTART_MS * 1000;
+    
+    if (s->phase < PPP_PHASE_OPEN && now >= s->deadline) {
+        ppp_down(s, s->phase == PPP_PHASE_LCP ? "no LCP answer" : s->phase == PPP_PHASE_AUTH ? "no PAP answer" :
+                    "no IPCP answer");
+    }
+    switch (s->phase) {
+        case PPP_PHASE_LCP:
+            if (!s->lcp.acked && now >= s->lcp.next_us) {
+                ppp_lcp_request(s);
+                s->lcp.next_us = now + restart;
+            }
+            break;
+        case PPP_PHASE_AUTH:
+            if (now >= s->pap.next_us) {
+                ppp_pap_request(s);
+                s->pap.next_us = now + restart;
+            }
+            break;
+        case PPP_PHASE_IPCP:
+            if (!s->ipcp.acked && now >= s->ipcp.next_us) {
+                ppp_ipcp_request(s);
+                s->ipcp.next_us = now + restart;
+            }
+            break;
+        case PPP_PHASE_OPEN:
+            break;
+        case PPP_PHASE_TERMINATE:
+            if (now >= s->deadline) {
+                s->phase = PPP_PHASE_DONE;
+            } else if (now >= s->lcp.next_us) {
+                ppp_send_cp(s, PPP_LCP, PPP_TERM_REQ, ++s->lcp.id, NULL, 0);
+                s->lcp.next_us = now + restart;
+            }
+            break;
+        case PPP_PHASE_DONE:
+            break;
+    }
+    
+    if (s->phase > PPP_PHASE_LCP && s->phase < PPP_PHASE_TERMINATE && now >= s->echo_next) {
+        uint8_t d[4];
+        if (s->echo_missed == PPP_ECHO_FAILS) {
+            ppp_down(s, "the peer stopped answering LCP echoes");
+            return;
+        }
+        ppp_put32(d, s->magic);
+        ppp_send_cp(s, PPP_LCP, PPP_ECHO_REQ, ++s->echo_id, d, 4);
+        s->echo_missed++;
+        s->echo_next = now + (uint64_t)PPP_ECHO_MS * 1000;
+    }
+}
+
+// Read IPv4 packets from the TUN into frames until it runs dry or every transfer is busy
+static void ppp_tx_fill(struct huawei_ppp *s) {
+    uint8_t *f = s->frame;
+    
+    for (;;) {
+        // Only read what can go out right away
+        if (s->tx_fill + HDLC_ENCODED_MAX(PPP_MRU + 4) > PPP_TX_MAX) ppp_tx_flush(s);
+        if (!ppp_tx_free(s)) break;
+        ssize_t n = read(s->fd, f + 4 - s->af_header, PPP_MRU + (size_t)s->af_header);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            // Device gone (or the stand-in closed)
+            ppp_fail(s, n < 0 ? LIBUSB_ERROR_IO : 0);
+            break;
+        }
+        n -= s->af_header;
+        if (n < 20 || (f[4] >> 4) != 4) {
+            // IPv6 has no NCP here
+            atomic_fetch_add(&s->tx_stats.dropped, 1);
+            continue;
+        }
+        f[0] = 0xff;
+        f[1] = 0x03;
+        f[2] = PPP_IP >> 8;
+        f[3] = PPP_IP & 0xff;
+        if (ppp_send_frame(s, f, (size_t)n + 4, s->tx_accm) < 0) {
+            atomic_fetch_add(&s->tx_stats.dropped, 1);
+            break;
+        }
+        atomic_fetch_add(&s->tx_stats.packets, 1);
+        atomic_fetch_add(&s->tx_stats.bytes, (uint64_t)n);
+    }
+    ppp_tx_flush(s);
+}
+
+// The modem port, claimed beside the primary interface if that is another one
+static struct huawei_port *ppp_port(struct huawei_modem *m, int verbose) {
+    const struct usb_transport *usb = m->hc->usb;
+    struct huawei_iface ports[MODEM_PORTS_MAX];
+    int preferred, num_interfaces;
+    
+    if (m->role == HUAWEI_ROLE_MODEM) return &m->port;
+    for (int k = 0; k < m->nextra; k++) {
+        if (m->extra[k].iface.role == HUAWEI_ROLE_MODEM) return &m->extra[k].port;
+    }
+    
+    int n = huawei_find_ports(m->hc, usb->get_device(m->handle), m->pid, ports, MODEM_PORTS_MAX, &preferred,
+                              &num_interfaces);
+    for (int k = 0; k < n; k++) {
+        if (ports[k].role != HUAWEI_ROLE_MODEM) continue;
+        if (m->nextra == MODEM_CHANNELS - 1) {
+            huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: no room to claim the modem port as well, leave it out of the "
+                       "ports", m->path);
+            return NULL;
+        }
+        if (usb->kernel_driver_active(m->handle, ports[k].interface) == 1) {
+            usb->detach_kernel_driver(m->handle, ports[k].interface);
+        }
+        if (huawei_modem_attach(m, &ports[k], verbose) < 0) return NULL;
+        return &m->extra[m->nextra - 1].port;
+    }
+    
+    // Most firmware dials on the PC UI port too
+    if (verbose) {
+        huawei_log(m->hc, HUAWEI_LOG_INFO, "%s: no modem port, dialing on interface %d", m->path, m->interface);
+    }
+    return &m->port;
+}
+
+// Free a session whose port is not (or no longer) in data mode
+static void ppp_free(struct huawei_ppp *s) {
+    for (int i = 0; i < PPP_TX_TRANSFERS; i++) {
+        if (s->tx[i]) s->usb->free_transfer(s->tx[i]);
+        free(s->tx_buf[i]);
+    }
+    if (s->wake[0] >= 0) close(s->wake[0]);
+    if (s->wake[1] >= 0) close(s->wake[1]);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+void huawei_ppp_close(struct huawei_ppp *s) {
+    struct huawei_result res;
+    
+    if (!s) return;
+    
+    // Back to AT mode; a stick that missed the termination needs the escape sequence first
+    huawei_port_set_data(s->port, NULL, NULL);
+    if (!s->term_acked && !s->error) {
+        int sent;
+        sleep(1);
+        s->usb->bulk_transfer(s->port->handle, (unsigned char)s->port->ep_out, (unsigned char *)"+++", 3, &sent,
+                              TIMEOUT_MS);
+        sleep(1);
+    }
+    huawei_command_port(s->m, s->port, "ATH", &res);
+    ppp_free(s);
+}
+
+/*
+ * Set up a session on the modem port (or the PC UI port if there is none),
+ * set the APN if one is given and dial ATD*99#. On CONNECT the port is in
+ * data mode and the link negotiates in huawei_ppp_run().
+ */
+int huawei_ppp_dial(struct huawei_ppp **out, struct huawei_modem *m, int fd, const struct huawei_ppp_options *o) {
+    const struct usb_transport *usb = m->hc->usb;
+    struct huawei_ppp *s;
+    struct huawei_result res;
+    char cmd[AT_COMMAND_MAX];
+    int r;
+    
+    *out = NULL;
+    struct huawei_port *port = ppp_port(m, o->verbose);
+    if (!port) return LIBUSB_ERROR_NOT_FOUND;
+    s = calloc(1, sizeof(*s));
+    if (!s) return LIBUSB_ERROR_NO_MEM;
+    s->wake[0] = s->wake[1] = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    s->usb = usb;
+    s->m = m;
+    s->port = port;
+    s->ctx = port->ctx;
+    s->fd = fd;
+    s->af_header = o->af_header;
+    snprintf(s->user, sizeof(s->user), "%s", o->user ? o->user : "");
+    snprintf(s->password, sizeof(s->password), "%s", o->password ? o->password : "");
+    s->up = o->up;
+    s->up_opaque = o->opaque;
+    s->verbose = o->verbose;
+    s->tx_accm = HDLC_ACCM_ALL;
+    s->peer_accm = HDLC_ACCM_ALL;
+    s->magic = (uint32_t)(now_us() * 2654435761u) ^ (uint32_t)getpid();
+    hdlc_rx_init(&s->rx, s->rx_frame, sizeof(s->rx_frame));
+    
+    r = pipe(s->wake);
+    for (int i = 0; i < PPP_TX_TRANSFERS && r == 0; i++) {
+        s->tx[i] = usb->alloc_transfer(0);
+        s->tx_buf[i] = malloc(PPP_TX_MAX);
+        if (!s->tx[i] || !s->tx_buf[i]) r = -1;
+    }
+    if (r < 0) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: out of memory", m->path);
+        ppp_free(s);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    fcntl(s->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(s->wake[1], F_SETFL, O_NONBLOCK);
+    
+    if (o->apn) {
+        snprintf(cmd, sizeof(cmd), "AT+CGDCONT=1,\"IP\",\"%s\"", o->apn);
+        if (huawei_command_port(m, port, cmd, &res) <= 0 || res.final != HUAWEI_FINAL_OK) {
+            huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: %s failed%s%s", m->path, cmd, res.final_line[0] ? ": " : "",
+                       res.final_line);
+            ppp_free(s);
+            return LIBUSB_ERROR_OTHER;
+        }
+    }
+    
+    // The sink goes in first: the peer's first LCP request may come with the CONNECT
+    huawei_port_set_data(port, ppp_rx_data, s);
+    port->timeout_ms = PPP_DIAL_TIMEOUT_MS;
+    r = huawei_command_port(m, port, "ATD*99#", &res);
+    port->timeout_ms = 0;
+    if (r <= 0 || res.final != HUAWEI_FINAL_CONNECT) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: ATD*99# failed%s%s", m->path, res.final_line[0] ? ": " : "",
+                   res.final_line);
+        huawei_port_set_data(port, NULL, NULL);
+        ppp_free(s);
+        return LIBUSB_ERROR_OTHER;
+    }
+    if (o->verbose) huawei_log(m->hc, HUAWEI_LOG_INFO, "PPP: %s", res.final_line);
+    *out = s;
+    return 0;
+}
+
+void huawei_ppp_shutdown(struct huawei_ppp *s) {
+    atomic_store(&s->hangup, 1);
+    ppp_wake(s);
+}
+
+int huawei_ppp_run(struct huawei_ppp *s) {
+    sigset_t all, old;
+    char drain[64];
+    int r;
+    
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    r = pthread_create(&s->events, NULL, ppp_events, s);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r != 0) {
+        ppp_fail(s, LIBUSB_ERROR_NO_MEM);
+        return s->error;
+    }
+    
+    s->phase = PPP_PHASE_LCP;
+    s->deadline = now_us() + (uint64_t)PPP_NEGOTIATE_MS * 1000;
+    while (s->phase != PPP_PHASE_DONE && !atomic_load(&s->stop)) {
+        if (atomic_load(&s->hangup)) ppp_down(s, NULL);
+        ppp_input(s);
+        ppp_timers(s, now_us());
+        if (atomic_load(&s->open)) {
+            ppp_tx_fill(s);
+        } else {
+            ppp_tx_flush(s);
+        }
+        if (s->phase == PPP_PHASE_DONE) break;
+        
+        int reading = atomic_load(&s->open) && ppp_tx_free(s);
+        struct pollfd fds[2] = {{s->wake[0], POLLIN, 0}, {s->fd, POLLIN, 0}};
+        if (poll(fds, reading ? 2 : 1, 100) > 0 && (fds[0].revents & POLLIN)) {
+            while (read(s->wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+    }
+    ppp_tx_flush(s);
+    atomic_store(&s->open, 0);
+    
+    // Let what is queued (a Terminate-Ack) go out, then stop the event thread
+    uint64_t deadline = now_us() + (uint64_t)TIMEOUT_MS * 1000;
+    while (atomic_load(&s->in_flight) > 0 && now_us() < deadline) {
+        poll(NULL, 0, 10);
+    }
+    for (int i = 0; i < PPP_TX_TRANSFERS; i++) {
+        if (s->tx[i]->dev_handle) s->usb->cancel_transfer(s->tx[i]);
+    }
+    atomic_store(&s->events_stop, 1);
+    pthread_join(s->events, NULL);
+    return s->error;
+}
+
+int huawei_ppp_is_up(const struct huawei_ppp *s) {
+    return atomic_load(&s->open);
+}
+
+const char *huawei_ppp_reason(const struct huawei_ppp *s) {
+    return s->reason;
+}
+
+void huawei_ppp_stats(const struct huawei_ppp *s, struct huawei_link_stats *rx, struct huawei_link_stats *tx) {
+    memset(rx, 0, sizeof(*rx));
+    memset(tx, 0, sizeof(*tx));
+    rx->packets = atomic_load(&s->rx_stats.packets);
+    rx->bytes = atomic_load(&s->rx_stats.bytes);
+    rx->dropped = atomic_load(&s->rx_stats.dropped);
+    rx->errors = s->rx.errors;
+    rx->frames = s->rx.frames;
+    rx->transfers = atomic_load(&s->rx_stats.transfers);
+    tx->packets = atomic_load(&s->tx_stats.packets);
+    tx->bytes = atomic_load(&s->tx_stats.bytes);
+    tx->dropped = atomic_load(&s->tx_stats.dropped);
+    tx->transfers = atomic_load(&s->tx_stats.transfers);
+}
+
+/*
+ * Diagnostic capture
+ *
+ * huawei_diag_open() claims the diagnostic interface next to the AT port
+ * and huawei_diag_run() records everything it sends into a capture file
+ * (huawei_diag.h). A busy modem logs several MB/s in bursts, so the port
+ * always has DIAG_TRANSFERS IN transfers queued. Their completions, on the
+ * calling thread, only swap in a fresh buffer from a pool and hand the
+ * filled one to a writer thread, which deframes it and copies the packets
+ * into the mapped ring. The pool absorbs bursts the writer cannot keep up
+ * with for a moment; received bytes are dropped (and counted) only if it
+ * runs out.
+ */
+
+#define DIAG_TRANSFERS      32
+#define DIAG_TRANSFER_SIZE  16384
+#define DIAG_BUFFERS        512     // 8 MB of transfer buffers between the port and the writer
+#define DIAG_TX_TIMEOUT_MS  1000
+
+struct huawei_diag {
+    const struct usb_transport *usb;
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    struct huawei_iface iface;
+    struct libusb_transfer *xfer[DIAG_TRANSFERS];
+    uint8_t *pool;          // DIAG_BUFFERS buffers of DIAG_TRANSFER_SIZE
+    int in_flight;
+    int stopping;
+    int error;
+    atomic_int stop;
+    pthread_t writer;
+    
+    // Filled buffers to the writer and empty ones back, under lock
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int writer_stop;
+    unsigned fill_head;
+    unsigned fill_tail;
+    unsigned free_head;
+    unsigned free_tail;
+    unsigned peak;          // most buffers ever waiting for the writer
+    uint16_t fill_buf[DIAG_BUFFERS];
+    uint32_t fill_len[DIAG_BUFFERS];
+    uint64_t fill_us[DIAG_BUFFERS];
+    uint16_t free_buf[DIAG_BUFFERS];
+    uint64_t dropped;
+    uint64_t transfers;
+    
+    // Writer thread
+    struct diag_writer w;
+    struct diag_stats stats;
+    struct hdlc_rx rx;
+    uint64_t rx_us;         // completion time of the buffer being deframed
+    uint8_t frame[DIAG_PACKET_MAX];
+};
+
+// Wall clock (UTC) in microseconds: records are stamped with it
+static uint64_t diag_wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint8_t *diag_buffer(struct huawei_diag *s, unsigned i) {
+    return s->pool + (size_t)i * DIAG_TRANSFER_SIZE;
+}
+
+static void diag_in_callback(struct libusb_transfer *t) {
+    struct huawei_diag *s = t->user_data;
+    
+    if (t->status == LIBUSB_TRANSFER_COMPLETED && t->actual_length > 0) {
+        unsigned mine = (unsigned)((t->buffer - s->pool) / DIAG_TRANSFER_SIZE);
+        uint64_t now = diag_wall_us();
+        
+        pthread_mutex_lock(&s->lock);
+        s->transfers++;
+        if (s->free_head != s->free_tail) {
+            unsigned slot = s->fill_head++ % DIAG_BUFFERS;
+            s->fill_buf[slot] = (uint16_t)mine;
+            s->fill_len[slot] = (uint32_t)t->actual_length;
+            s->fill_us[slot] = now;
+            if (s->fill_head - s->fill_tail > s->peak) s->peak = s->fill_head - s->fill_tail;
+            t->buffer = diag_buffer(s, s->free_buf[s->free_tail++ % DIAG_BUFFERS]);
+            pthread_cond_signal(&s->ready);
+        } else {
+            // Every buffer is waiting for the writer: this one is lost, the transfer keeps its buffer
+            s->dropped += (uint64_t)t->actual_length;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    
+    if (!s->stopping && (t->status == LIBUSB_TRANSFER_COMPLETED || t->status == LIBUSB_TRANSFER_TIMED_OUT)) {
+        int r = s->usb->submit_transfer(t);
+        if (r == 0) return;
+        if (!s->error) s->error = r;
+    } else if (!s->stopping && t->status != LIBUSB_TRANSFER_CANCELLED && !s->error) {
+        s->error = transfer_status_error(t->status);
+    }
+    s->in_flight--;
+}
+
+static void diag_frame(void *opaque, uint8_t *frame, size_t len) {
+    struct huawei_diag *s = opaque;
+    
+    diag_writer_record(&s->w, 0, s->rx_us, frame, len);
+    s->stats.records++;
+}
+
+static void *diag_write(void *arg) {
+    struct huawei_diag *s = arg;
+    
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (s->fill_head == s->fill_tail && !s->writer_stop) pthread_cond_wait(&s->ready, &s->lock);
+        if (s->fill_head == s->fill_tail) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        unsigned slot = s->fill_tail % DIAG_BUFFERS;
+        unsigned buf = s->fill_buf[slot];
+        size_t len = s->fill_len[slot];
+        s->rx_us = s->fill_us[slot];
+        s->stats.transfers = s->transfers;
+        s->stats.dropped = s->dropped;
+        pthread_mutex_unlock(&s->lock);
+        
+        hdlc_rx_feed(&s->rx, diag_buffer(s, buf), len, diag_frame, s);
+        s->stats.bytes += len;
+        s->stats.bad = s->rx.errors;
+        diag_writer_publish(&s->w, &s->stats, s->rx_us);
+        
+        pthread_mutex_lock(&s->lock);
+        s->fill_tail++;
+        s->free_buf[s->free_head++ % DIAG_BUFFERS] = (uint16_t)buf;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+// The diagnostic interface, unless it is already claimed as an AT port (-I)
+static int diag_find(struct huawei_modem *m, struct huawei_iface *iface) {
+    struct huawei_iface ports[MODEM_PORTS_MAX];
+    int preferred, num_interfaces;
+    
+    int n = huawei_find_ports(m->hc, m->hc->usb->get_device(m->handle), m->pid, ports, MODEM_PORTS_MAX, &preferred,
+                              &num_interfaces);
+    for (int k = 0; k < n; k++) {
+        if (ports[k].role != HUAWEI_ROLE_DIAG) continue;
+        if (ports[k].interface == m->interface) return -1;
+        for (int e = 0; e < m->nextra; e++) {
+            if (m->extra[e].iface.interface == ports[k].interface) return -1;
+        }
+        *iface = ports[k];
+        return 0;
+    }
+    return -1;
+}
+
+int huawei_diag_close(struct huawei_diag *s) {
+    const struct usb_transport *usb;
+    int r, saved;
+    
+    if (!s) return 0;
+    usb = s->usb;
+    r = diag_writer_close(&s->w);
+    saved = errno;
+    for (int i = 0; i < DIAG_TRANSFERS; i++) {
+        if (s->xfer[i]) usb->free_transfer(s->xfer[i]);
+    }
+    free(s->pool);
+    if (s->handle) {
+        usb->release_interface(s->handle, s->iface.interface);
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->ready);
+    }
+    free(s);
+    errno = saved;
+    return r;
+}
+
+/*
+ * Claim the diagnostic interface of m and create the capture file, ring_size
+ * bytes of records, stamped with the modem's path and serial number.
+ */
+int huawei_diag_open(struct huawei_diag **out, struct huawei_modem *m, const char *path, uint64_t ring_size,
+                     int verbose) {
+    const struct usb_transport *usb = m->hc->usb;
+    struct huawei_diag *s = calloc(1, sizeof(*s));
+    int r;
+    
+    *out = NULL;
+    if (!s) return LIBUSB_ERROR_NO_MEM;
+    s->usb = usb;
+    if (diag_find(m, &s->iface) < 0) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: no diagnostic port free in this mode", m->path);
+        free(s);
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    if (usb->kernel_driver_active(m->handle, s->iface.interface) == 1) {
+        usb->detach_kernel_driver(m->handle, s->iface.interface);
+    }
+    r = usb->claim_interface(m->handle, s->iface.interface);
+    if (r < 0) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: could not claim the diagnostic interface %d: %s", m->path,
+                   s->iface.interface, libusb_strerror(r));
+        free(s);
+        return r;
+    }
+    s->handle = m->handle;
+    s->ctx = m->hc->usb_ctx;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->ready, NULL);
+    if (verbose) {
+        huawei_log(m->hc, HUAWEI_LOG_INFO, "Diagnostic port: IN=0x%02x OUT=0x%02x Interface=%d", s->iface.ep_in,
+                   s->iface.ep_out, s->iface.interface);
+    }
+    
+    s->pool = malloc((size_t)DIAG_BUFFERS * DIAG_TRANSFER_SIZE);
+    for (int i = 0; i < DIAG_TRANSFERS && s->pool; i++) {
+        s->xfer[i] = usb->alloc_transfer(0);
+        if (!s->xfer[i]) break;
+        libusb_fill_bulk_transfer(s->xfer[i], s->handle, (unsigned char)s->iface.ep_in, diag_buffer(s, (unsigned)i),
+                                  DIAG_TRANSFER_SIZE, diag_in_callback, s, 0);
+    }
+    if (!s->pool || !s->xfer[DIAG_TRANSFERS - 1]) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: out of memory", m->path);
+        huawei_diag_close(s);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    for (unsigned i = DIAG_TRANSFERS; i < DIAG_BUFFERS; i++) {
+        s->free_buf[s->free_head++ % DIAG_BUFFERS] = (uint16_t)i;
+    }
+    
+    huawei_modem_read_serial(m);
+    if (diag_writer_open(&s->w, path, ring_size, diag_wall_us(), m->path, m->serial, s->iface.interface) < 0) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "Cannot create %s: %s", path, strerror(errno));
+        huawei_diag_close(s);
+        return LIBUSB_ERROR_IO;
+    }
+    hdlc_rx_init(&s->rx, s->frame, sizeof(s->frame));
+    *out = s;
+    return 0;
+}
+
+int huawei_diag_send(struct huawei_diag *s, const uint8_t *p, size_t len) {
+    uint8_t out[HDLC_ENCODED_MAX(DIAG_PACKET_MAX)];
+    int sent;
+    
+    // The port escapes flag and escape bytes only, and frames have no opening flag
+    size_t n = hdlc_encode(out, p, len, 0);
+    int r = s->usb->bulk_transfer(s->handle, (unsigned char)s->iface.ep_out, out + 1, (int)n - 1, &sent,
+                                  DIAG_TX_TIMEOUT_MS);
+    if (r < 0) return r;
+    
+    diag_writer_record(&s->w, DIAG_REC_TX, diag_wall_us(), p, len);
+    s->stats.records++;
+    return 0;
+}
+
+void huawei_diag_shutdown(struct huawei_diag *s) {
+    atomic_store(&s->stop, 1);
+}
+
+int huawei_diag_run(struct huawei_diag *s, uint64_t limit_us) {
+    sigset_t all, old;
+    uint64_t end = limit_us ? now_us() + limit_us : UINT64_MAX;
+    int r;
+    
+    // Signals stay with the calling thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    r = pthread_create(&s->writer, NULL, diag_write, s);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r != 0) return LIBUSB_ERROR_NO_MEM;
+    
+    for (int i = 0; i < DIAG_TRANSFERS && !s->error; i++) {
+        r = s->usb->submit_transfer(s->xfer[i]);
+        if (r < 0) {
+            s->error = r;
+        } else {
+            s->in_flight++;
+        }
+    }
+    while (!atomic_load(&s->stop) && !s->error && now_us() < end) {
+        struct timeval tv = {0, 100000};
+        s->usb->handle_events_timeout_completed(s->ctx, &tv, NULL);
+    }
+    
+    // Reap every transfer, keeping what the last ones brought
+    s->stopping = 1;
+    for (int i = 0; i < DIAG_TRANSFERS; i++) {
+        s->usb->cancel_transfer(s->xfer[i]);
+    }
+    uint64_t deadline = now_us() + (uint64_t)TIMEOUT_MS * 1000;
+    while (s->in_flight > 0 && now_us() < deadline) {
+        struct timeval tv = {0, 100000};
+        s->usb->handle_events_timeout_completed(s->ctx, &tv, NULL);
+    }
+    
+    pthread_mutex_lock(&s->lock);
+    s->writer_stop = 1;
+    pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->writer, NULL);
+    s->stats.transfers = s->transfers;
+    s->stats.dropped = s->dropped;
+    diag_writer_publish(&s->w, &s->stats, diag_wall_us());
+    return s->error;
+}
+
+void huawei_diag_stats(const struct huawei_diag *s, struct huawei_diag_stats *st) {
+    st->records = s->stats.records;
+    st->bytes = s->stats.bytes;
+    st->transfers = s->stats.transfers;
+    st->bad = s->stats.bad;
+    st->dropped = s->stats.dropped;
+    st->peak = s->peak;
+    st->buffers = DIAG_BUFFERS - DIAG_TRANSFERS;
+    st->overwritten = s->w.head > s->w.ring_size ? s->w.head - s->w.ring_size : 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * Huawei diagnostic capture reader
+ * Indexes the ring files written by "huawei_at diag" as CSV or JSON lines and
+ * splits them into HDLC-framed .qmdl pieces by time or size for offline
+ * decoders
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "huawei_hdlc.h"
+#include "huawei_diag.h"
+
+#define DIAG_LOG_F          0x10    // log packets carry their log code at offset 6
+
+struct options {
+    int json;
+    int summary;            // -S: header and totals only
+    int cmd;                // -c: only this command code, -1 = all
+    const char *split;      // -s: output prefix
+    uint64_t split_us;      // -t: new piece after this long, 0 = no limit
+    uint64_t split_bytes;   // -b: new piece after this many bytes, 0 = no limit
+};
+
+// The .qmdl piece being written
+struct piece {
+    FILE *f;
+    int index;
+    char name[512];
+    uint64_t first_us;
+    uint64_t last_us;
+    unsigned long records;
+    uint64_t bytes;
+};
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Huawei Diagnostic Capture Reader\n\n");
+    fprintf(stderr, "Usage: %s [options] <file>\n\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -j            JSON lines instead of CSV\n");
+    fprintf(stderr, "  -S            Summary: device, counters and time span\n");
+    fprintf(stderr, "  -c <cmd>      Only packets with this command code (e.g. 0x10 for logs)\n");
+    fprintf(stderr, "  -s <prefix>   Split received packets into <prefix>.NNN.qmdl, HDLC framed\n");
+    fprintf(stderr, "  -t <sec>      With -s: start a new piece after this many seconds\n");
+    fprintf(stderr, "  -b <MB>       With -s: start a new piece after this many megabytes\n");
+    fprintf(stderr, "\nExamples:\n");
+    fprintf(stderr, "  %s field.diag > field.csv\n", prog);
+    fprintf(stderr, "  %s -S field.diag\n", prog);
+    fprintf(stderr, "  %s -s field -t 600 field.diag   # 10-minute .qmdl pieces\n", prog);
+}
+
+static void format_time(uint64_t wall_us, char *buf, size_t size) {
+    time_t secs = (time_t)(wall_us / 1000000);
+    struct tm tm;
+    
+    gmtime_r(&secs, &tm);
+    size_t n = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + n, size - n, ".%06uZ", (unsigned)(wall_us % 1000000));
+}
+
+static int record_cmd(const struct diag_record *rec) {
+    return rec->len ? rec->data[0] : -1;
+}
+
+static int record_code(const struct diag_record *rec) {
+    if (record_cmd(rec) != DIAG_LOG_F || rec->len < 8) return -1;
+    return rec->data[6] | rec->data[7] << 8;
+}
+
+static void print_header(const struct options *o) {
+    if (!o->json) printf("n,time,offset,len,dir,cmd,code\n");
+}
+
+static void print_record(const struct options *o, unsigned long n, const struct diag_record *rec) {
+    char when[40], code[8] = "";
+    const char *dir = rec->flags & DIAG_REC_TX ? "tx" : "rx";
+    
+    format_time(rec->time_us, when, sizeof(when));
+    if (record_code(rec) >= 0) snprintf(code, sizeof(code), "0x%04x", record_code(rec));
+    if (o->json) {
+        printf("{\"n\":%lu,\"time\":\"%s\",\"offset\":%llu,\"len\":%zu,\"dir\":\"%s\",\"cmd\":%d", n, when,
+               (unsigned long long)rec->offset, rec->len, dir, record_cmd(rec));
+        if (*code) printf(",\"code\":\"%s\"", code);
+        printf("}\n");
+    } else {
+        printf("%lu,%s,%llu,%zu,%s,%d,%s\n", n, when, (unsigned long long)rec->offset, rec->len, dir,
+               record_cmd(rec), code);
+    }
+}
+
+static void print_summary(const struct diag_reader *r, const char *file, unsigned long records, uint64_t first_us,
+                          uint64_t last_us) {
+    const uint8_t *h = r->map;
+    char start[40], end[40];
+    
+    format_time(diag_get64(h + DIAG_H_START_US), start, sizeof(start));
+    format_time(diag_get64(h + DIAG_H_END_US), end, sizeof(end));
+    printf("file:       %s\n", file);
+    printf("device:     %.31s interface %u serial %.31s\n", (const char *)h + DIAG_H_PATH,
+           diag_get32(h + DIAG_H_INTERFACE), (const char *)h + DIAG_H_SERIAL);
+    printf("capture:    %s to %s%s\n", start, end, diag_get32(h + DIAG_H_FLAGS) & DIAG_CLOSED ? "" : " (not closed)");
+    printf("ring:       %llu bytes, head %llu%s\n", (unsigned long long)r->ring_size, (unsigned long long)r->head,
+           r->head > r->ring_size ? " (wrapped)" : "");
+    printf("received:   %llu bytes in %llu transfers, %llu bad frames, %llu bytes dropped\n",
+           (unsigned long long)diag_get64(h + DIAG_H_BYTES), (unsigned long long)diag_get64(h + DIAG_H_TRANSFERS),
+           (unsigned long long)diag_get64(h + DIAG_H_BAD), (unsigned long long)diag_get64(h + DIAG_H_DROPPED));
+    printf("records:    %lu readable of %llu written\n", records, (unsigned long long)diag_get64(h + DIAG_H_RECORDS));
+    if (records) {
+        format_time(first_us, start, sizeof(start));
+        format_time(last_us, end, sizeof(end));
+        printf("span:       %s to %s (%.3f s)\n", start, end, (last_us - first_us) / 1e6);
+    }
+}
+
+static int piece_close(struct piece *p) {
+    char first[40], last[40];
+    int r = 0;
+    
+    if (!p->f) return 0;
+    if (fclose(p->f) != 0) {
+        perror(p->name);
+        r = -1;
+    }
+    p->f = NULL;
+    format_time(p->first_us, first, sizeof(first));
+    format_time(p->last_us, last, sizeof(last));
+    printf("%s,%s,%s,%lu,%llu\n", p->name, first, last, p->records, (unsigned long long)p->bytes);
+    return r;
+}
+
+// Append one received packet, framed the way the port sent it
+static int piece_add(const struct options *o, struct piece *p, const struct diag_record *rec) {
+    static uint8_t frame[HDLC_ENCODED_MAX(DIAG_PACKET_MAX)];
+    
+    if (p->f && ((o->split_us && rec->time_us - p->first_us >= o->split_us) ||
+                 (o->split_bytes && p->bytes >= o->split_bytes))) {
+        if (piece_close(p) < 0) return -1;
+    }
+    if (!p->f) {
+        snprintf(p->name, sizeof(p->name), "%s.%03d.qmdl", o->split, p->index++);
+        p->f = fopen(p->name, "wb");
+        if (!p->f) {
+            perror(p->name);
+            return -1;
+        }
+        p->first_us = rec->time_us;
+        p->records = 0;
+        p->bytes = 0;
+    }
+    
+    // hdlc_encode() opens with a flag, the diagnostic port does not
+    size_t len = hdlc_encode(frame, rec->data, rec->len, 0) - 1;
+    if (fwrite(frame + 1, 1, len, p->f) != len) {
+        perror(p->name);
+        return -1;
+    }
+    p->last_us = rec->time_us;
+    p->records++;
+    p->bytes += len;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static struct diag_reader reader;
+    struct options o = {0, 0, -1, NULL, 0, 0};
+    struct piece piece = {0};
+    struct diag_record rec;
+    const char *file = NULL;
+    unsigned long n = 0, records = 0;
+    uint64_t first_us = 0, last_us = 0;
+    int r = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0) {
+            o.json = 1;
+        } else if (strcmp(argv[i], "-S") == 0) {
+            o.summary = 1;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            o.cmd = (int)strtol(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            o.split = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            o.split_us = (uint64_t)(atof(argv[++i]) * 1e6);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            o.split_bytes = (uint64_t)(atof(argv[++i]) * 1048576);
+        } else if (argv[i][0] != '-' && !file) {
+            file = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!file) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(file);
+        return 1;
+    }
+    const uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror(file);
+        return 1;
+    }
+    if (diag_reader_init(&reader, map, (size_t)st.st_size) < 0) {
+        fprintf(stderr, "%s: not a diagnostic capture\n", file);
+        return 1;
+    }
+    
+    if (!o.summary && !o.split) print_header(&o);
+    while (diag_read(&reader, &rec)) {
+        n++;
+        if (o.cmd >= 0 && record_cmd(&rec) != o.cmd) continue;
+        if (!records++) first_us = rec.time_us;
+        last_us = rec.time_us;
+        if (o.summary) continue;
+        if (!o.split) {
+            print_record(&o, n, &rec);
+        } else if (!(rec.flags & DIAG_REC_TX) && piece_add(&o, &piece, &rec) < 0) {
+            r = 1;
+            break;
+        }
+    }
+    if (piece_close(&piece) < 0) r = 1;
+    if (o.summary) print_summary(&reader, file, records, first_us, last_us);
+    
+    if (reader.skipped) {
+        fprintf(stderr, "%s: skipped %llu bytes of overwritten or damaged records\n", file,
+                (unsigned long long)reader.skipped);
+    }
+    munmap((void *)map, (size_t)st.st_size);
+    close(fd);
+    return r || records == 0;
+}
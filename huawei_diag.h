@@ -0,0 +1,320 @@
+/*
+ * Diagnostic capture file format, written by libhuawei's diag capture
+ * (huawei_at diag) and read back by huawei_diag
+ *
+ * The diagnostic port carries DIAG packets (requests, responses, logs and
+ * events) in asynchronous HDLC framing (huawei_hdlc.h) with only the flag
+ * and escape bytes escaped; frames end with a flag but do not start with
+ * one. A capture keeps them deframed and timestamped in a ring inside a
+ * file of fixed size, allocated up front and mapped into memory:
+ *
+ *   header  DIAG_HEADER_SIZE bytes: magic, ring size, write position,
+ *           counters and the device, little-endian at fixed offsets
+ *   ring    ring_size bytes of records
+ *
+ * A record is a 16-byte header followed by the packet, padded to a multiple
+ * of 8 bytes:
+ *
+ *   sync(2) flags(1) check(1) len(2) fcs(2) time_us(8)
+ *
+ * check is the sum of the other 15 header bytes, fcs the HDLC FCS-16 of the
+ * packet and time_us the wall clock (UTC, microseconds) when the USB
+ * transfer holding the end of the packet completed. sync is the commit
+ * word: the writer clears it, writes the packet and the rest of the header,
+ * and stores it last, so a record torn by a crash or overwritten while it
+ * is read fails the sync, check or fcs test and is skipped. Records sit at
+ * logical offsets: the write position "head" only grows and offset o lives
+ * at o % ring_size, so a record may wrap around the end. Once head passes
+ * ring_size the oldest records are overwritten; what is left starts at
+ * head - ring_size, inside some record, and a reader finds the first whole
+ * one by its sync and check. head moves only once the records before it are
+ * complete, so a capture cut short by a crash reads back up to its last
+ * update.
+ */
+
+#ifndef HUAWEI_DIAG_H
+#define HUAWEI_DIAG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "huawei_hdlc.h"
+
+#define DIAG_MAGIC          "HWDIAG2\n"
+#define DIAG_MAGIC_LEN      8
+#define DIAG_HEADER_SIZE    4096
+#define DIAG_RECORD_HDR     16
+#define DIAG_SYNC           0xd1a9
+#define DIAG_PACKET_MAX     16384       // longer packets are cut at the next flag and counted as bad
+#define DIAG_RING_MIN       65536
+
+// Record flags
+#define DIAG_REC_TX         0x01        // sent to the modem (-c requests), not received
+
+// Header flags
+#define DIAG_CLOSED         0x01        // the capture ended cleanly
+
+// Header offsets
+#define DIAG_H_FLAGS        12          // u32, after magic and header size
+#define DIAG_H_RING_SIZE    16          // u64
+#define DIAG_H_HEAD         24          // u64, logical write position
+#define DIAG_H_START_US     32          // u64, wall clock at the start
+#define DIAG_H_END_US       40          // u64, wall clock at the last update
+#define DIAG_H_RECORDS      48          // u64, records ever written
+#define DIAG_H_BYTES        56          // u64, bytes received from the port
+#define DIAG_H_TRANSFERS    64          // u64, completed IN transfers
+#define DIAG_H_BAD          72          // u64, frames with a bad FCS, aborted or too long
+#define DIAG_H_DROPPED      80          // u64, received bytes lost because the writer fell behind
+#define DIAG_H_INTERFACE    88          // u32
+#define DIAG_H_PATH         96          // char[32], USB port path
+#define DIAG_H_SERIAL       128         // char[32]
+
+struct diag_stats {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t transfers;
+    uint64_t bad;
+    uint64_t dropped;
+};
+
+static inline uint32_t diag_get32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t diag_get64(const uint8_t *p) {
+    return (uint64_t)diag_get32(p) | (uint64_t)diag_get32(p + 4) << 32;
+}
+
+static inline void diag_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline void diag_put64(uint8_t *p, uint64_t v) {
+    diag_put32(p, (uint32_t)v);
+    diag_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint8_t diag_check(const uint8_t *h) {
+    uint8_t sum = 0;
+    
+    for (int i = 0; i < DIAG_RECORD_HDR; i++) {
+        if (i != 3) sum = (uint8_t)(sum + h[i]);
+    }
+    return sum;
+}
+
+static inline uint64_t diag_padded(uint64_t len) {
+    return (DIAG_RECORD_HDR + len + 7) & ~(uint64_t)7;
+}
+
+// Copy between a flat buffer and the ring at a logical offset, wrapping as needed
+static inline void diag_ring_put(uint8_t *ring, uint64_t size, uint64_t off, const uint8_t *p, size_t len) {
+    size_t at = (size_t)(off % size), first = len < size - at ? len : (size_t)(size - at);
+    
+    memcpy(ring + at, p, first);
+    memcpy(ring, p + first, len - first);
+}
+
+static inline void diag_ring_get(const uint8_t *ring, uint64_t size, uint64_t off, uint8_t *p, size_t len) {
+    size_t at = (size_t)(off % size), first = len < size - at ? len : (size_t)(size - at);
+    
+    memcpy(p, ring + at, first);
+    memcpy(p + first, ring, len - first);
+}
+
+/*
+ * Writer
+ *
+ * Records go straight into the mapping; diag_writer_publish() makes them
+ * part of the capture by moving head, together with the counters. Nothing
+ * here blocks on the disk: the kernel writes the pages back on its own.
+ */
+
+struct diag_writer {
+    int fd;
+    uint8_t *map;
+    uint8_t *ring;
+    uint64_t ring_size;
+    uint64_t head;
+    size_t map_len;
+};
+
+// Create (or replace) path with a ring of ring_size bytes, a multiple of 8
+static inline int diag_writer_open(struct diag_writer *w, const char *path, uint64_t ring_size, uint64_t start_us,
+                                   const char *dev_path, const char *serial, int interface) {
+    memset(w, 0, sizeof(*w));
+    w->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) return -1;
+    w->map_len = (size_t)(DIAG_HEADER_SIZE + ring_size);
+    
+    // Blocks are allocated now, so a full disk shows up here rather than as SIGBUS mid-capture
+#ifdef __linux__
+    int r = posix_fallocate(w->fd, 0, (off_t)w->map_len);
+    if (r != 0) errno = r;
+#else
+    int r = ftruncate(w->fd, (off_t)w->map_len);
+#endif
+    if (r != 0) {
+        close(w->fd);
+        return -1;
+    }
+    w->map = mmap(NULL, w->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if (w->map == MAP_FAILED) {
+        close(w->fd);
+        return -1;
+    }
+    w->ring = w->map + DIAG_HEADER_SIZE;
+    w->ring_size = ring_size;
+    
+    memset(w->map, 0, DIAG_HEADER_SIZE);
+    memcpy(w->map, DIAG_MAGIC, DIAG_MAGIC_LEN);
+    diag_put32(w->map + DIAG_MAGIC_LEN, DIAG_HEADER_SIZE);
+    diag_put64(w->map + DIAG_H_RING_SIZE, ring_size);
+    diag_put64(w->map + DIAG_H_START_US, start_us);
+    diag_put64(w->map + DIAG_H_END_US, start_us);
+    diag_put32(w->map + DIAG_H_INTERFACE, (uint32_t)interface);
+    memcpy(w->map + DIAG_H_PATH, dev_path, strnlen(dev_path, 31));
+    memcpy(w->map + DIAG_H_SERIAL, serial, strnlen(serial, 31));
+    return 0;
+}
+
+static inline void diag_writer_record(struct diag_writer *w, int flags, uint64_t time_us, const uint8_t *p,
+                                      size_t len) {
+    uint8_t h[DIAG_RECORD_HDR];
+    
+    uint16_t fcs = hdlc_fcs16(HDLC_INITFCS, p, len);
+    
+    h[0] = DIAG_SYNC & 0xff;
+    h[1] = DIAG_SYNC >> 8;
+    h[2] = (uint8_t)flags;
+    h[4] = (uint8_t)len;
+    h[5] = (uint8_t)(len >> 8);
+    h[6] = (uint8_t)fcs;
+    h[7] = (uint8_t)(fcs >> 8);
+    diag_put64(h + 8, time_us);
+    h[3] = diag_check(h);
+    
+    // Commit word last: sync cleared, packet and header written, then sync
+    uint8_t none[2] = {0, 0};
+    diag_ring_put(w->ring, w->ring_size, w->head, none, sizeof(none));
+    diag_ring_put(w->ring, w->ring_size, w->head + DIAG_RECORD_HDR, p, len);
+    diag_ring_put(w->ring, w->ring_size, w->head + 2, h + 2, sizeof(h) - 2);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    diag_ring_put(w->ring, w->ring_size, w->head, h, 2);
+    w->head += diag_padded(len);
+}
+
+static inline void diag_writer_publish(struct diag_writer *w, const struct diag_stats *st, uint64_t time_us) {
+    uint8_t *h = w->map;
+    
+    diag_put64(h + DIAG_H_RECORDS, st->records);
+    diag_put64(h + DIAG_H_BYTES, st->bytes);
+    diag_put64(h + DIAG_H_TRANSFERS, st->transfers);
+    diag_put64(h + DIAG_H_BAD, st->bad);
+    diag_put64(h + DIAG_H_DROPPED, st->dropped);
+    diag_put64(h + DIAG_H_END_US, time_us);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    diag_put64(h + DIAG_H_HEAD, w->head);
+}
+
+// Mark the capture complete and flush it; returns -1 if the data did not reach the disk
+static inline int diag_writer_close(struct diag_writer *w) {
+    int r = 0;
+    
+    if (!w->map) return 0;
+    diag_put32(w->map + DIAG_H_FLAGS, DIAG_CLOSED);
+    if (msync(w->map, w->map_len, MS_SYNC) < 0) r = -1;
+    munmap(w->map, w->map_len);
+    if (close(w->fd) < 0) r = -1;
+    w->map = NULL;
+    w->fd = -1;
+    return r;
+}
+
+/*
+ * Reader
+ */
+
+struct diag_record {
+    uint64_t offset;        // logical, in the ring
+    uint64_t time_us;
+    int flags;
+    size_t len;
+    const uint8_t *data;    // valid until the next diag_read()
+};
+
+struct diag_reader {
+    const uint8_t *map;
+    const uint8_t *ring;
+    uint64_t ring_size;
+    uint64_t head;
+    uint64_t pos;
+    uint64_t skipped;       // bytes before the first whole record, or damaged
+    uint8_t buf[DIAG_PACKET_MAX];
+};
+
+// map is the whole file, len bytes; -1 if it is not a capture
+static inline int diag_reader_init(struct diag_reader *r, const uint8_t *map, size_t len) {
+    memset(r, 0, sizeof(*r));
+    if (len < DIAG_HEADER_SIZE || memcmp(map, DIAG_MAGIC, DIAG_MAGIC_LEN) != 0) return -1;
+    uint32_t header = diag_get32(map + DIAG_MAGIC_LEN);
+    r->ring_size = diag_get64(map + DIAG_H_RING_SIZE);
+    r->head = diag_get64(map + DIAG_H_HEAD);
+    if (header < DIAG_HEADER_SIZE || r->ring_size < DIAG_RING_MIN || r->ring_size % 8 ||
+        r->ring_size > len || header > len - r->ring_size) {
+        return -1;
+    }
+    r->map = map;
+    r->ring = map + header;
+    r->pos = r->head > r->ring_size ? (r->head - r->ring_size + 7) & ~(uint64_t)7 : 0;
+    r->skipped = r->pos - (r->head > r->ring_size ? r->head - r->ring_size : 0);
+    return 0;
+}
+
+// Next record, oldest first: 1, or 0 at the end
+static inline int diag_read(struct diag_reader *r, struct diag_record *rec) {
+    uint8_t h[DIAG_RECORD_HDR];
+    
+    while (r->pos + DIAG_RECORD_HDR <= r->head) {
+        diag_ring_get(r->ring, r->ring_size, r->pos, h, sizeof(h));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        size_t len = (size_t)h[4] | (size_t)h[5] << 8;
+        if (h[0] != (DIAG_SYNC & 0xff) || h[1] != DIAG_SYNC >> 8 || h[3] != diag_check(h) || len > DIAG_PACKET_MAX ||
+            r->pos + diag_padded(len) > r->head) {
+            r->pos += 8;
+            r->skipped += 8;
+            continue;
+        }
+        
+        uint64_t at = (r->pos + DIAG_RECORD_HDR) % r->ring_size;
+        if (at + len <= r->ring_size) {
+            rec->data = r->ring + at;
+        } else {
+            diag_ring_get(r->ring, r->ring_size, r->pos + DIAG_RECORD_HDR, r->buf, len);
+            rec->data = r->buf;
+        }
+        // A valid header over a torn or half overwritten packet
+        if (hdlc_fcs16(HDLC_INITFCS, rec->data, len) != (uint16_t)(h[6] | h[7] << 8)) {
+            r->pos += 8;
+            r->skipped += 8;
+            continue;
+        }
+        rec->offset = r->pos;
+        rec->flags = h[2];
+        rec->len = len;
+        rec->time_us = diag_get64(h + 8);
+        r->pos += diag_padded(len);
+        return 1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,366 @@
+/*
+ * Asynchronous HDLC framing (RFC 1662)
+ * Used by huawei_at's ppp datapath, the simulator and bench/bench_ppp.c
+ *
+ * A frame goes out as a flag (0x7e), the payload and its 16-bit FCS with
+ * every flag, escape (0x7d) and control character in the async control
+ * character map sent as 0x7d followed by the byte XOR 0x20, and a closing
+ * flag. The receiver undoes the escaping, cuts frames at flags and keeps
+ * those whose FCS checks out.
+ *
+ * Most bytes of a frame are ordinary, so both directions look at 16 bytes
+ * at a time (GCC/Clang vector extensions, which become SSE2 or NEON) and
+ * copy clean runs whole; only the bytes that need work go one at a time.
+ * The FCS (CRC-16/X.25) folds 64 bytes per step with carry-less multiplies
+ * (PCLMULQDQ, or PMULL on ARMv8 with the crypto extension) and finishes
+ * with the RFC 1662 table. The _scalar variants are the byte-at-a-time
+ * reference the benchmark compares against.
+ */
+
+#ifndef HUAWEI_HDLC_H
+#define HUAWEI_HDLC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HDLC_FLAG               0x7e
+#define HDLC_ESCAPE             0x7d
+#define HDLC_INITFCS            0xffff
+#define HDLC_GOODFCS            0xf0b8      // FCS over a frame including its own FCS
+#define HDLC_ACCM_ALL           0xffffffffu // escape every control character (LCP, diag)
+
+// Worst case size of an encoded frame: everything escaped, two flags
+#define HDLC_ENCODED_MAX(len)   (2 * (size_t)(len) + 6)
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HDLC_VECTOR 1
+#else
+#define HDLC_VECTOR 0
+#endif
+
+#if HDLC_VECTOR && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HDLC_CLMUL 1
+#define HDLC_CLMUL_TARGET __attribute__((target("pclmul,sse2")))
+#elif HDLC_VECTOR && defined(__aarch64__) && (defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO))
+#include <arm_neon.h>
+#define HDLC_CLMUL 1
+#define HDLC_CLMUL_TARGET
+#else
+#define HDLC_CLMUL 0
+#endif
+
+static const uint16_t hdlc_fcstab[256] = {
+    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78,
+};
+
+static inline uint16_t hdlc_fcs16_scalar(uint16_t fcs, const uint8_t *p, size_t len) {
+    while (len--) fcs = (uint16_t)((fcs >> 8) ^ hdlc_fcstab[(fcs ^ *p++) & 0xff]);
+    return fcs;
+}
+
+#if HDLC_CLMUL
+/*
+ * Folding: a 16 byte block A followed by D more bits contributes A(x)·x^D
+ * to the remainder. With A's first 8 bytes H and last 8 bytes L (bits
+ * taken least significant first, as the FCS does), that is congruent to
+ * H·(x^(63+D) mod P) + L·(x^(D-1) mod P), one bit short of the block
+ * layout, which the bit-reflected multiply makes up. Both products fit in
+ * 128 bits and are XORed into the block D bits further on. Constants are
+ * the 16-bit remainders bit-reflected into the top of a 64-bit word.
+ */
+#define HDLC_K512_H             0x9822000000000000ull   // x^575 mod P
+#define HDLC_K512_L             0x7f90000000000000ull   // x^511 mod P
+#define HDLC_K128_H             0xa95d000000000000ull   // x^191 mod P
+#define HDLC_K128_L             0x7eea000000000000ull   // x^127 mod P
+
+#if defined(__x86_64__) || defined(__i386__)
+typedef __m128i hdlc_x;
+
+HDLC_CLMUL_TARGET static inline hdlc_x hdlc_x_load(const uint8_t *p) {
+    return _mm_loadu_si128((const __m128i *)(const void *)p);
+}
+
+HDLC_CLMUL_TARGET static inline hdlc_x hdlc_x_xor(hdlc_x a, hdlc_x b) {
+    return _mm_xor_si128(a, b);
+}
+
+HDLC_CLMUL_TARGET static inline hdlc_x hdlc_x_fold(hdlc_x a, uint64_t kh, uint64_t kl) {
+    hdlc_x k = _mm_set_epi64x((long long)kl, (long long)kh);
+    return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x00), _mm_clmulepi64_si128(a, k, 0x11));
+}
+
+HDLC_CLMUL_TARGET static inline hdlc_x hdlc_x_word(uint16_t v) {
+    return _mm_cvtsi32_si128(v);
+}
+
+HDLC_CLMUL_TARGET static inline void hdlc_x_store(uint8_t *p, hdlc_x a) {
+    _mm_storeu_si128((__m128i *)(void *)p, a);
+}
+
+static inline int hdlc_have_clmul(void) {
+    return __builtin_cpu_supports("pclmul") != 0;
+}
+#else
+typedef uint8x16_t hdlc_x;
+
+static inline hdlc_x hdlc_x_load(const uint8_t *p) {
+    return vld1q_u8(p);
+}
+
+static inline hdlc_x hdlc_x_xor(hdlc_x a, hdlc_x b) {
+    return veorq_u8(a, b);
+}
+
+static inline hdlc_x hdlc_x_fold(hdlc_x a, uint64_t kh, uint64_t kl) {
+    uint64x2_t v = vreinterpretq_u64_u8(a);
+    poly128_t h = vmull_p64((poly64_t)vgetq_lane_u64(v, 0), (poly64_t)kh);
+    poly128_t l = vmull_p64((poly64_t)vgetq_lane_u64(v, 1), (poly64_t)kl);
+    return veorq_u8(vreinterpretq_u8_p128(h), vreinterpretq_u8_p128(l));
+}
+
+static inline hdlc_x hdlc_x_word(uint16_t v) {
+    return vreinterpretq_u8_u64(vsetq_lane_u64(v, vdupq_n_u64(0), 0));
+}
+
+static inline void hdlc_x_store(uint8_t *p, hdlc_x a) {
+    vst1q_u8(p, a);
+}
+
+static inline int hdlc_have_clmul(void) {
+    return 1;
+}
+#endif
+
+// len >= 64. The initial FCS is linear in the first two bytes, so it goes in there.
+HDLC_CLMUL_TARGET static inline uint16_t hdlc_fcs16_clmul(uint16_t fcs, const uint8_t *p, size_t len) {
+    hdlc_x x0 = hdlc_x_xor(hdlc_x_load(p), hdlc_x_word(fcs));
+    hdlc_x x1 = hdlc_x_load(p + 16);
+    hdlc_x x2 = hdlc_x_load(p + 32);
+    hdlc_x x3 = hdlc_x_load(p + 48);
+    uint8_t rest[16];
+    
+    for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+        x0 = hdlc_x_xor(hdlc_x_fold(x0, HDLC_K512_H, HDLC_K512_L), hdlc_x_load(p));
+        x1 = hdlc_x_xor(hdlc_x_fold(x1, HDLC_K512_H, HDLC_K512_L), hdlc_x_load(p + 16));
+        x2 = hdlc_x_xor(hdlc_x_fold(x2, HDLC_K512_H, HDLC_K512_L), hdlc_x_load(p + 32));
+        x3 = hdlc_x_xor(hdlc_x_fold(x3, HDLC_K512_H, HDLC_K512_L), hdlc_x_load(p + 48));
+    }
+    x1 = hdlc_x_xor(x1, hdlc_x_fold(x0, HDLC_K128_H, HDLC_K128_L));
+    x2 = hdlc_x_xor(x2, hdlc_x_fold(x1, HDLC_K128_H, HDLC_K128_L));
+    x3 = hdlc_x_xor(x3, hdlc_x_fold(x2, HDLC_K128_H, HDLC_K128_L));
+    for (; len >= 16; p += 16, len -= 16) {
+        x3 = hdlc_x_xor(hdlc_x_fold(x3, HDLC_K128_H, HDLC_K128_L), hdlc_x_load(p));
+    }
+    
+    // The last block has the same remainder as the whole message so far
+    hdlc_x_store(rest, x3);
+    return hdlc_fcs16_scalar(hdlc_fcs16_scalar(0, rest, 16), p, len);
+}
+#endif
+
+// FCS over p, continuing from fcs (HDLC_INITFCS to start); not yet complemented
+static inline uint16_t hdlc_fcs16(uint16_t fcs, const uint8_t *p, size_t len) {
+#if HDLC_CLMUL
+    if (len >= 64 && hdlc_have_clmul()) return hdlc_fcs16_clmul(fcs, p, len);
+#endif
+    return hdlc_fcs16_scalar(fcs, p, len);
+}
+
+#if HDLC_VECTOR
+typedef uint8_t hdlc_v16 __attribute__((vector_size(16)));
+typedef int8_t hdlc_m16 __attribute__((vector_size(16)));
+
+// Index of the first marked byte of a comparison result, 16 if none
+static inline size_t hdlc_m16_first(hdlc_m16 m) {
+    uint64_t lane[2];
+    
+    memcpy(lane, &m, sizeof(lane));
+    if (lane[0]) return (size_t)__builtin_ctzll(lane[0]) >> 3;
+    if (lane[1]) return 8 + ((size_t)__builtin_ctzll(lane[1]) >> 3);
+    return 16;
+}
+
+// Bytes that may need escaping: always flag and escape, control characters if any are mapped
+static inline hdlc_m16 hdlc_special(hdlc_v16 v, uint32_t accm) {
+    hdlc_m16 m = (hdlc_m16)(v == HDLC_FLAG) | (hdlc_m16)(v == HDLC_ESCAPE);
+    if (accm) m |= (hdlc_m16)(v < 0x20);
+    return m;
+}
+#endif
+
+static inline uint8_t *hdlc_stuff_byte(uint8_t *out, uint8_t c, uint32_t accm) {
+    if (c == HDLC_FLAG || c == HDLC_ESCAPE || (c < 0x20 && (accm >> c & 1))) {
+        *out++ = HDLC_ESCAPE;
+        *out++ = c ^ 0x20;
+    } else {
+        *out++ = c;
+    }
+    return out;
+}
+
+static inline uint8_t *hdlc_stuff_scalar(uint8_t *out, const uint8_t *p, size_t len, uint32_t accm) {
+    while (len--) out = hdlc_stuff_byte(out, *p++, accm);
+    return out;
+}
+
+// Clean runs are stored 16 bytes at a time; out has room for twice len anyway
+static inline uint8_t *hdlc_stuff(uint8_t *out, const uint8_t *p, size_t len, uint32_t accm) {
+#if HDLC_VECTOR
+    while (len >= 16) {
+        hdlc_v16 v;
+        memcpy(&v, p, 16);
+        size_t clean = hdlc_m16_first(hdlc_special(v, accm));
+        memcpy(out, p, 16);
+        out += clean;
+        p += clean;
+        len -= clean;
+        if (clean < 16) {
+            out = hdlc_stuff_byte(out, *p++, accm);
+            len--;
+        }
+    }
+#endif
+    return hdlc_stuff_scalar(out, p, len, accm);
+}
+
+static inline size_t hdlc_encode_with(uint8_t *out, const uint8_t *p, size_t len, uint32_t accm, int vector) {
+    uint16_t fcs = (uint16_t)~(vector ? hdlc_fcs16(HDLC_INITFCS, p, len) : hdlc_fcs16_scalar(HDLC_INITFCS, p, len));
+    uint8_t *o = out;
+    
+    *o++ = HDLC_FLAG;
+    o = vector ? hdlc_stuff(o, p, len, accm) : hdlc_stuff_scalar(o, p, len, accm);
+    o = hdlc_stuff_byte(o, (uint8_t)fcs, accm);
+    o = hdlc_stuff_byte(o, (uint8_t)(fcs >> 8), accm);
+    *o++ = HDLC_FLAG;
+    return (size_t)(o - out);
+}
+
+// Frame len bytes of p into out, which holds HDLC_ENCODED_MAX(len); returns the bytes written
+static inline size_t hdlc_encode(uint8_t *out, const uint8_t *p, size_t len, uint32_t accm) {
+    return hdlc_encode_with(out, p, len, accm, 1);
+}
+
+static inline size_t hdlc_encode_scalar(uint8_t *out, const uint8_t *p, size_t len, uint32_t accm) {
+    return hdlc_encode_with(out, p, len, accm, 0);
+}
+
+// A received frame with a good FCS, FCS stripped; may be modified in place
+typedef void (*hdlc_frame_fn)(void *opaque, uint8_t *frame, size_t len);
+
+// Receive state; frames are collected in a caller supplied buffer
+struct hdlc_rx {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    int escape;
+    int overflow;           // frame longer than buf: dropped at the next flag
+    uint64_t frames;
+    uint64_t errors;        // bad FCS, aborted or too long
+};
+
+static inline void hdlc_rx_init(struct hdlc_rx *rx, uint8_t *buf, size_t size) {
+    memset(rx, 0, sizeof(*rx));
+    rx->buf = buf;
+    rx->size = size;
+}
+
+// Nothing but an FCS, or less, is inter-frame fill rather than an error
+static inline void hdlc_rx_end(struct hdlc_rx *rx, hdlc_frame_fn fn, void *opaque, int vector) {
+    if (rx->escape || rx->overflow) {
+        rx->errors++;
+    } else if (rx->len > 2) {
+        uint16_t fcs = vector ? hdlc_fcs16(HDLC_INITFCS, rx->buf, rx->len) :
+                                hdlc_fcs16_scalar(HDLC_INITFCS, rx->buf, rx->len);
+        if (fcs == HDLC_GOODFCS) {
+            rx->frames++;
+            fn(opaque, rx->buf, rx->len - 2);
+        } else {
+            rx->errors++;
+        }
+    }
+    rx->len = 0;
+    rx->escape = 0;
+    rx->overflow = 0;
+}
+
+static inline void hdlc_rx_byte(struct hdlc_rx *rx, uint8_t c, hdlc_frame_fn fn, void *opaque, int vector) {
+    if (c == HDLC_FLAG) {
+        hdlc_rx_end(rx, fn, opaque, vector);
+    } else if (c == HDLC_ESCAPE) {
+        rx->escape = 1;
+    } else if (rx->len == rx->size) {
+        rx->overflow = 1;
+        rx->escape = 0;
+    } else {
+        rx->buf[rx->len++] = rx->escape ? c ^ 0x20 : c;
+        rx->escape = 0;
+    }
+}
+
+static inline void hdlc_rx_feed_with(struct hdlc_rx *rx, const uint8_t *p, size_t len, hdlc_frame_fn fn,
+                                     void *opaque, int vector) {
+    while (len > 0) {
+#if HDLC_VECTOR
+        // Runs without flags or escapes go over 16 bytes at a time
+        while (vector && len >= 16 && !rx->escape && rx->len + 16 <= rx->size) {
+            hdlc_v16 v;
+            memcpy(&v, p, 16);
+            size_t clean = hdlc_m16_first(hdlc_special(v, 0));
+            memcpy(rx->buf + rx->len, p, 16);
+            rx->len += clean;
+            p += clean;
+            len -= clean;
+            if (clean < 16) break;
+        }
+        if (len == 0) break;
+#endif
+        hdlc_rx_byte(rx, *p++, fn, opaque, vector);
+        len--;
+    }
+}
+
+// Feed received bytes; fn gets every complete frame with a good FCS
+static inline void hdlc_rx_feed(struct hdlc_rx *rx, const uint8_t *p, size_t len, hdlc_frame_fn fn, void *opaque) {
+    hdlc_rx_feed_with(rx, p, len, fn, opaque, 1);
+}
+
+static inline void hdlc_rx_feed_scalar(struct hdlc_rx *rx, const uint8_t *p, size_t len, hdlc_frame_fn fn,
+                                       void *opaque) {
+    hdlc_rx_feed_with(rx, p, len, fn, opaque, 0);
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Phase timing metrics shared by huawei_at and huawei_modeswitch
+ *
+ * Both tools stamp their phases with the monotonic clock as they go (a few
+ * clock reads per run). With --metrics the collected values are written
+ * as one line per device, either key=value pairs or a JSON object, so
+ * scripts can pick out which step was slow. The JSON string escaping here
+ * is used for every JSON line the tools write.
+ */
+
+#ifndef HUAWEI_METRICS_H
+#define HUAWEI_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+enum metrics_format {
+    METRICS_OFF,
+    METRICS_KV,
+    METRICS_JSON
+};
+
+// Durations end in _us; anything else is a count
+struct metric {
+    const char *key;
+    uint64_t value;
+};
+
+// "--metrics", "--metrics=kv" or "--metrics=json"; METRICS_OFF if arg is something else
+static inline enum metrics_format metrics_option(const char *arg) {
+    if (strcmp(arg, "--metrics") == 0 || strcmp(arg, "--metrics=kv") == 0) return METRICS_KV;
+    if (strcmp(arg, "--metrics=json") == 0) return METRICS_JSON;
+    return METRICS_OFF;
+}
+
+// String contents without the quotes, so pieces can be written one after another
+static inline void json_chars(FILE *out, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        switch (c) {
+            case '"':  fputs("\\\"", out); break;
+            case '\\': fputs("\\\\", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\r': fputs("\\r", out); break;
+            case '\t': fputs("\\t", out); break;
+            default:
+                if (c < 0x20) {
+                    fprintf(out, "\\u%04x", c);
+                } else {
+                    fputc(c, out);
+                }
+        }
+    }
+}
+
+static inline void json_string(FILE *out, const char *s, size_t len) {
+    fputc('"', out);
+    json_chars(out, s, len);
+    fputc('"', out);
+}
+
+// Microseconds from start to end, 0 if either end was never reached
+static inline uint64_t metric_span(uint64_t start, uint64_t end) {
+    return start && end > start ? end - start : 0;
+}
+
+static inline void metrics_emit(FILE *out, enum metrics_format format, const char *tool, const char *device,
+                                const struct metric *m, int n) {
+    if (format == METRICS_JSON) {
+        fprintf(out, "{\"tool\":\"%s\",\"device\":", tool);
+        json_string(out, device, strlen(device));
+        for (int i = 0; i < n; i++) {
+            fprintf(out, ",\"%s\":%llu", m[i].key, (unsigned long long)m[i].value);
+        }
+        fprintf(out, "}\n");
+    } else if (format == METRICS_KV) {
+        fprintf(out, "tool=%s device=%s", tool, device);
+        for (int i = 0; i < n; i++) {
+            fprintf(out, " %s=%llu", m[i].key, (unsigned long long)m[i].value);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+#endif
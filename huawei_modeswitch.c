@@ -2,430 +2,630 @@
  * Huawei Mode Switch (Universal)
  * Switches Huawei modems from ZeroCD/Storage mode to Modem mode
  * Supports multiple PIDs: 0x1446, 0x14FE, and others
+ * The switch methods are in libhuawei (libhuawei.h)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <libusb-1.0/libusb.h>
-
-#define HUAWEI_VENDOR_ID    0x12D1
-
-// ZeroCD/Storage mode PIDs that need switching
-static uint16_t zerocd_pids[] = {
-    // === Classic 3G ZeroCD ===
-    0x1446,  // E1550/E1756/E173 ZeroCD
-    0x14fe,  // E303/E3131/E1550 Intermediate
-    0x1520,  // K3765 ZeroCD
-    0x1505,  // E3131/E398 ZeroCD
-    0x14D1,  // E173 ZeroCD
-    0x1c0b,  // E3531/E173s ZeroCD
-    
-    // === LTE ZeroCD ===
-    0x1f01,  // E3131/E353/E3372/E8372 ZeroCD (common)
-    0x1da1,  // E3372 ZeroCD
-    0x1f1e,  // K5160 ZeroCD
-    0x15ca,  // E3131h-2 ZeroCD
-    
-    // === Other ZeroCD modes ===
-    0x1521,  // K4505 ZeroCD
-    0x1575,  // K5150 ZeroCD
-    0x157c,  // E3276 ZeroCD
-    0x157d,  // E3276 ZeroCD alternate
-    0x1582,  // E8278 ZeroCD
-    0x1583,  // E8278 ZeroCD alternate
-    0x1588,  // E3372 variant ZeroCD
-    0x15b6,  // E3331 ZeroCD
-    0x1c1b,  // E3531 (sometimes ZeroCD)
-    0
-};
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "huawei_pids.h"
+#include "libhuawei.h"
+#include "huawei_metrics.h"
+
+// Progress output of the switch itself; silenced while switching in parallel
+static int quiet = 0;
+
+#define MAX_TRACKED         64      // sticks listed, switched or watched at once
+
+static enum metrics_format metrics = METRICS_OFF;
+static uint64_t init_us;    // libusb init, shared by every switch in this run
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Switch progress goes to stdout, a blank line before each "[step]"
+static void log_print(void *opaque, enum huawei_log_level level, const char *msg) {
+    (void)opaque;
+    if (level == HUAWEI_LOG_ERROR) {
+        fprintf(stderr, "%s\n", msg);
+    } else if (!quiet) {
+        printf("%s%s\n", msg[0] == '[' ? "\n" : "", msg);
+    }
+}
+
+void scan_huawei_devices(struct huawei_ctx *hc, int *found_zerocd, int *found_modem) {
+    struct huawei_device_info list[MAX_TRACKED];
+    int cnt = huawei_list_devices(hc, list, MAX_TRACKED);
+    
+    *found_zerocd = 0;
+    *found_modem = 0;
+    
+    printf("\nHuawei devices found:\n");
+    for (int i = 0; i < cnt; i++) {
+        const char* mode = "";
+        if (huawei_is_zerocd_pid(list[i].pid)) {
+            mode = " [ZeroCD/Storage]";
+            (*found_zerocd)++;
+        } else if (huawei_is_modem_pid(list[i].pid)) {
+            mode = " [Modem Mode]";
+            (*found_modem)++;
+        }
+        printf("  12d1:%04x - %s%s\n", list[i].pid, huawei_pid_name(list[i].pid), mode);
+    }
+    
+    if (cnt <= 0) {
+        printf("  No Huawei devices found\n");
+    }
+}
+
+// One --metrics line per stick
+static void print_switch_metrics(const char *path, const struct huawei_switch_timing *t) {
+    struct metric v[] = {
+        {"init_us", init_us},
+        {"discover_us", t->discover_us},
+        {"open_us", t->open_us},
+        {"descriptors_us", t->descriptors_us},
+        {"detach_us", t->detach_us},
+        {"claim_us", t->claim_us},
+        {"tx_us", t->tx_us},
+        {"gone_us", t->gone_us},
+        {"reenum_us", t->reenum_us},
+        {"methods", (uint64_t)t->methods},
+    };
+    
+    metrics_emit(stderr, metrics, "huawei_modeswitch", path, v, (int)(sizeof(v) / sizeof(v[0])));
+}
 
-// Target modem mode PIDs (for verification after switch)
-static uint16_t modem_pids[] = {
-    // === Classic 3G/HSPA Modem ===
-    0x1001,  // E169/E620/E800/E1550 HSDPA Modem
-    0x1003,  // E1550 Modem
-    0x140c,  // E180/E1550 Modem
-    0x1406,  // E1750 Modem
-    0x1436,  // E173/E1750 Modem
-    0x1465,  // K3765 Modem
-    0x14AC,  // E1820 Modem
-    0x14C6,  // K4605 Modem
-    0x14C9,  // K4505 Modem
-    0x1c05,  // E173 Modem
-    0x1c07,  // E173s Modem
-    
-    // === E3xx Series Modem ===
-    0x1506,  // E303/E3131/MS2372 Modem
-    0x14db,  // E3131/E353 HiLink/NCM
-    
-    // === LTE Modem ===
-    0x1442,  // E3372 Stick mode
-    0x14dc,  // E3372/E8372 HiLink
-    0x155e,  // E8372 NCM/Stick mode
-    0x157f,  // E8372 alternate
-    0x1592,  // E8372h mode
-    0x15c1,  // ME906s LTE M.2
-    0x1573,  // K5150 Modem
-    0x1576,  // K5160 Modem
-    
-    // === Legacy ===
-    0x1404,  // E1752 Modem
-    0x1411,  // E510 Modem
-    0x141b,  // E1752 alternate
-    0x1464,  // K4510/K4511 Modem
-    0x14ba,  // E173 alternate
-    0
+/*
+ * Switch workers
+ *
+ * huawei_switch_at() blocks until the stick drops off the bus or every method
+ * has been tried, so each stick is switched on a thread of its own, by -a
+ * and by the service alike.
+ */
+
+struct switch_job {
+    struct huawei_ctx *hc;
+    pthread_t thread;
+    char path[HUAWEI_PATH_MAX];
+    uint16_t pid;
+    uint16_t new_pid;
+    int error;              // libusb error opening the device, 0 if opened
+    atomic_int done;
+    uint64_t start_us;
+    uint64_t switched_us;
+    uint64_t modem_us;
+    struct huawei_switch_timing timing;
 };
 
-// Standard SCSI commands wrapped in USB Mass Storage CBW
-static unsigned char huawei_switch_msg[] = {
-    0x55, 0x53, 0x42, 0x43,  // "USBC" signature
-    0x12, 0x34, 0x56, 0x78,  // Tag
-    0x00, 0x00, 0x00, 0x00,  // Data transfer length
-    0x00,                     // Flags (OUT)
-    0x00,                     // LUN
-    0x11,                     // Command length
-    // Huawei specific SCSI command
-    0x11, 0x06, 0x20, 0x00, 0x00, 0x01, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+static void *switch_worker(void *arg) {
+    struct switch_job *job = arg;
+    
+    job->start_us = now_us();
+    int r = huawei_switch_at(job->hc, job->path, &job->timing);
+    job->error = r < 0 ? r : 0;
+    job->switched_us = now_us();
+    atomic_store(&job->done, 1);
+    return NULL;
+}
+
+static void start_worker(struct switch_job *job) {
+    if (pthread_create(&job->thread, NULL, switch_worker, job) != 0) {
+        // Out of threads: do this one inline
+        job->thread = 0;
+        switch_worker(job);
+    }
+}
+
+/*
+ * Service mode (-w)
+ *
+ * Runs until interrupted. Hotplug callbacks report every Huawei
+ * arrival and departure. ZeroCD devices are handed to a switch worker the
+ * moment they show up, and each stick is tracked by its bus/port path, so
+ * the modem that appears afterwards is matched to the stick that was
+ * switched and the measured time-to-modem-mode is reported. Events are
+ * timestamped when they are queued; those of a stick whose worker is still
+ * running wait until it is done. Without hotplug support the bus is polled
+ * and diffed instead.
+ */
+
+#define EVENT_QUEUE_SIZE    256
+#define POLL_INTERVAL_MS    250
+#define SWITCH_TIMEOUT_MS   30000
+#define SWITCH_ATTEMPTS     3
+
+enum stick_state {
+    STICK_NEW,
+    STICK_SWITCHING,    // worker running or switch sent, still on the bus
+    STICK_GONE,         // dropped off the bus, waiting for it to come back
+    STICK_MODEM,
+    STICK_FAILED
 };
 
-// Alternative Huawei command
-static unsigned char huawei_switch_msg2[] = {
-    0x55, 0x53, 0x42, 0x43,  // "USBC"
-    0x12, 0x34, 0x56, 0x79,  // Tag
-    0x00, 0x00, 0x00, 0x00,  // Transfer length
-    0x00, 0x00, 0x11,        // Flags, LUN, CDB length
-    0x11, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+struct stick {
+    char path[HUAWEI_PATH_MAX];
+    uint16_t zerocd_pid;
+    uint16_t pid;
+    enum stick_state state;
+    int attempts;
+    int working;            // job has a worker that has not been joined
+    uint64_t seen_us;       // ZeroCD device arrived
+    uint64_t switched_us;   // switch messages sent
+    uint64_t left_us;       // disconnected for re-enumeration
+    uint64_t modem_us;      // modem-mode device arrived
+    struct huawei_switch_timing timing;
+    struct switch_job job;
 };
 
-// Standard "Eject Media" SCSI command
-static unsigned char eject_msg[] = {
-    0x55, 0x53, 0x42, 0x43,  // "USBC"
-    0x12, 0x34, 0x56, 0x7A,  // Tag
-    0x00, 0x00, 0x00, 0x00,  // Transfer length
-    0x00, 0x00, 0x06,        // Flags, LUN, CDB length
-    0x1b, 0x00, 0x00, 0x00, 0x02, 0x00,  // START STOP UNIT with eject
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+struct usb_event {
+    int arrived;
+    uint16_t pid;
+    char path[HUAWEI_PATH_MAX];
+    uint64_t time_us;       // when it was reported, not when it was handled
 };
 
-const char* get_pid_name(uint16_t pid) {
-    switch(pid) {
-        // ZeroCD modes
-        case 0x1446: return "E1550/E1756/E173 ZeroCD";
-        case 0x14FE: return "E303/E3131 Intermediate";
-        case 0x1f01: return "E3131/E3372/E8372 ZeroCD";
-        case 0x1520: return "K3765 ZeroCD";
-        case 0x1505: return "E3131/E398 ZeroCD";
-        case 0x14D1: return "E173 ZeroCD";
-        case 0x1c0b: return "E3531 ZeroCD";
-        case 0x1da1: return "E3372 ZeroCD";
-        case 0x1f1e: return "K5160 ZeroCD";
-        case 0x15ca: return "E3131h-2 ZeroCD";
-        case 0x1521: return "K4505 ZeroCD";
-        case 0x1575: return "K5150 ZeroCD";
-        case 0x157c: return "E3276 ZeroCD";
-        case 0x157d: return "E3276 ZeroCD Alt";
-        case 0x1582: return "E8278 ZeroCD";
-        case 0x1583: return "E8278 ZeroCD Alt";
-        case 0x1588: return "E3372 Variant ZeroCD";
-        case 0x15b6: return "E3331 ZeroCD";
-        // Modem modes
-        case 0x1001: return "E169/E620/E800/E1550 Modem";
-        case 0x1003: return "E1550 Modem";
-        case 0x140c: return "E180/E1550 Modem";
-        case 0x1406: return "E1750 Modem";
-        case 0x1436: return "E173/E1750 Modem";
-        case 0x1465: return "K3765 Modem";
-        case 0x14AC: return "E1820 Modem";
-        case 0x14C6: return "K4605 Modem";
-        case 0x14C9: return "K4505 Modem";
-        case 0x1c05: return "E173 Modem";
-        case 0x1c07: return "E173s Modem";
-        case 0x1c1b: return "E3531 Modem";
-        case 0x1506: return "E303/E3131/MS2372 Modem";
-        case 0x14db: return "E3131/E353 HiLink";
-        case 0x1442: return "E3372 Stick";
-        case 0x14dc: return "E3372/E8372 HiLink";
-        case 0x155e: return "E8372 NCM";
-        case 0x157f: return "E8372 Alt";
-        case 0x1592: return "E8372h";
-        case 0x15c1: return "ME906s LTE";
-        case 0x1573: return "K5150 Modem";
-        case 0x1576: return "K5160 Modem";
-        case 0x1404: return "E1752 Modem";
-        case 0x1411: return "E510 Modem";
-        case 0x141b: return "E1752 Alt";
-        case 0x1464: return "K4510/K4511 Modem";
-        case 0x14ba: return "E173 Alt";
-        default: return "Unknown Huawei";
-    }
+// Hotplug callbacks run wherever USB events are handled, worker threads included
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usb_event event_queue[EVENT_QUEUE_SIZE];
+static int event_head;
+static int event_count;
+static unsigned long events_dropped;
+
+// Events of sticks with a worker still running, oldest first
+static struct usb_event held[EVENT_QUEUE_SIZE];
+static int nheld;
+
+static struct stick sticks[MAX_TRACKED];
+static int nsticks;
+static volatile sig_atomic_t service_stop;
+
+static void service_signal(int sig) {
+    (void)sig;
+    service_stop = 1;
 }
 
-int is_zerocd_pid(uint16_t pid) {
-    for (int i = 0; zerocd_pids[i] != 0; i++) {
-        if (zerocd_pids[i] == pid) return 1;
+// Returns 0 if the queue is full; the loss is counted and the bus rescanned
+static int push_event(const struct usb_event *ev) {
+    int queued = 0;
+    
+    pthread_mutex_lock(&event_lock);
+    if (event_count < EVENT_QUEUE_SIZE) {
+        event_queue[(event_head + event_count) % EVENT_QUEUE_SIZE] = *ev;
+        event_count++;
+        queued = 1;
+    } else {
+        events_dropped++;
     }
-    return 0;
+    pthread_mutex_unlock(&event_lock);
+    return queued;
 }
 
-int is_modem_pid(uint16_t pid) {
-    for (int i = 0; modem_pids[i] != 0; i++) {
-        if (modem_pids[i] == pid) return 1;
-    }
-    return 0;
+static int queue_event(int arrived, uint16_t pid, const char *path) {
+    struct usb_event ev;
+    
+    ev.time_us = now_us();
+    ev.arrived = arrived;
+    ev.pid = pid;
+    size_t len = strnlen(path, sizeof(ev.path) - 1);
+    memcpy(ev.path, path, len);
+    ev.path[len] = '\0';
+    return push_event(&ev);
 }
 
-void print_hex(const char* label, unsigned char* data, int len) {
-    printf("%s: ", label);
-    for (int i = 0; i < len && i < 31; i++) {
-        printf("%02x ", data[i]);
-    }
-    printf("\n");
+// Runs inside USB event handling: no I/O here, just queue the event
+static void hotplug_callback(void *opaque, int arrived, uint16_t pid, const char *path) {
+    (void)opaque;
+    queue_event(arrived, pid, path);
 }
 
-int find_bulk_out_endpoint(libusb_device *dev, int *out_interface) {
-    struct libusb_config_descriptor *config;
-    int r = libusb_get_active_config_descriptor(dev, &config);
-    if (r < 0) return -1;
-    
-    int ep_out = -1;
-    *out_interface = 0;
-    
-    // First look for Mass Storage interface (class 0x08)
-    for (int i = 0; i < config->bNumInterfaces && ep_out < 0; i++) {
-        const struct libusb_interface *iface = &config->interface[i];
-        for (int j = 0; j < iface->num_altsetting && ep_out < 0; j++) {
-            const struct libusb_interface_descriptor *setting = &iface->altsetting[j];
-            
-            if (setting->bInterfaceClass == 0x08) {  // Mass Storage
-                for (int k = 0; k < setting->bNumEndpoints; k++) {
-                    const struct libusb_endpoint_descriptor *ep = &setting->endpoint[k];
-                    if ((ep->bmAttributes & 0x03) == LIBUSB_TRANSFER_TYPE_BULK) {
-                        if (!(ep->bEndpointAddress & 0x80)) {
-                            ep_out = ep->bEndpointAddress;
-                            *out_interface = setting->bInterfaceNumber;
-                            break;
-                        }
-                    }
-                }
-            }
+// Fallback for platforms without hotplug: diff successive bus scans
+static void poll_bus(struct huawei_ctx *hc) {
+    static struct {
+        char path[HUAWEI_PATH_MAX];
+        uint16_t pid;
+        int seen;
+    } known[MAX_TRACKED];
+    static int nknown;
+    static struct huawei_device_info list[MAX_TRACKED + 1];    // one more tells a full table from a full bus
+    
+    int cnt = huawei_scan_devices(hc, list, MAX_TRACKED + 1);
+    if (cnt < 0) return;
+    
+    for (int k = 0; k < nknown; k++) known[k].seen = 0;
+    
+    for (int i = 0; i < cnt; i++) {
+        const char *path = list[i].path;
+        
+        int k = 0;
+        while (k < nknown && (known[k].pid != list[i].pid || strcmp(known[k].path, path) != 0)) k++;
+        if (k < nknown) {
+            known[k].seen = 1;
+        } else if (nknown == MAX_TRACKED) {
+            static int warned;
+            if (!warned++) fprintf(stderr, "More than %d Huawei devices on the bus, ignoring the rest\n", MAX_TRACKED);
+        } else if (queue_event(1, list[i].pid, path)) {
+            // Only once queued, so an arrival that did not fit shows up again next time
+            memcpy(known[nknown].path, path, sizeof(known[nknown].path));    // both HUAWEI_PATH_MAX, terminated
+            known[nknown].pid = list[i].pid;
+            known[nknown].seen = 1;
+            nknown++;
         }
     }
     
-    // Fallback: any bulk OUT endpoint
-    if (ep_out < 0) {
-        for (int i = 0; i < config->bNumInterfaces && ep_out < 0; i++) {
-            const struct libusb_interface *iface = &config->interface[i];
-            for (int j = 0; j < iface->num_altsetting && ep_out < 0; j++) {
-                const struct libusb_interface_descriptor *setting = &iface->altsetting[j];
-                for (int k = 0; k < setting->bNumEndpoints; k++) {
-                    const struct libusb_endpoint_descriptor *ep = &setting->endpoint[k];
-                    if ((ep->bmAttributes & 0x03) == LIBUSB_TRANSFER_TYPE_BULK) {
-                        if (!(ep->bEndpointAddress & 0x80)) {
-                            ep_out = ep->bEndpointAddress;
-                            *out_interface = setting->bInterfaceNumber;
-                            break;
-                        }
-                    }
-                }
-            }
+    int kept = 0;
+    for (int k = 0; k < nknown; k++) {
+        if (!known[k].seen) {
+            struct usb_event ev;
+            ev.arrived = 0;
+            ev.pid = known[k].pid;
+            memcpy(ev.path, known[k].path, sizeof(ev.path));     // both HUAWEI_PATH_MAX, terminated
+            ev.time_us = now_us();
+            if (push_event(&ev)) continue;
         }
+        known[kept++] = known[k];
     }
-    
-    libusb_free_config_descriptor(config);
-    return ep_out;
+    nknown = kept;
 }
 
-int try_bulk_transfer(libusb_device_handle *handle, int ep_out, unsigned char* msg, int msg_len, const char* desc) {
-    int transferred;
-    int r;
-    
-    printf("\n[%s]\n", desc);
-    print_hex("Sending", msg, msg_len);
+static struct stick *find_stick(const char *path) {
+    for (int i = 0; i < nsticks; i++) {
+        if (strcmp(sticks[i].path, path) == 0) return &sticks[i];
+    }
+    return NULL;
+}
+
+static struct stick *stick_for_path(const char *path) {
+    struct stick *st = find_stick(path);
     
-    r = libusb_bulk_transfer(handle, ep_out, msg, msg_len, &transferred, 2000);
-    if (r == 0) {
-        printf("Success! Sent %d bytes\n", transferred);
-        return 0;
+    if (st) return st;
+    if (nsticks < MAX_TRACKED) {
+        st = &sticks[nsticks++];
     } else {
-        printf("Failed: %s\n", libusb_strerror(r));
-        return -1;
+        // Table full: reuse the slot of a stick that is done (it drops out of the summary)
+        for (int i = 0; i < nsticks && !st; i++) {
+            if (!sticks[i].working && (sticks[i].state == STICK_MODEM || sticks[i].state == STICK_FAILED)) {
+                st = &sticks[i];
+            }
+        }
+        if (!st) {
+            fprintf(stderr, "[%s] ignored, already tracking %d sticks that are being switched\n", path, MAX_TRACKED);
+            return NULL;
+        }
     }
+    memset(st, 0, sizeof(*st));
+    snprintf(st->path, sizeof(st->path), "%s", path);
+    return st;
 }
 
-int try_control_transfer(libusb_device_handle *handle) {
-    int r;
+static double ms_between(uint64_t from, uint64_t to) {
+    return (double)(to - from) / 1000.0;
+}
+
+static void stick_switch(struct huawei_ctx *hc, struct stick *st) {
+    struct switch_job *job = &st->job;
     
-    printf("\n[Trying USB Control Transfers]\n");
-    
-    // Method 1: Huawei specific control message
-    printf("Method 1: Huawei control message...\n");
-    r = libusb_control_transfer(handle,
-        LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
-        LIBUSB_REQUEST_SET_FEATURE,
-        0x0001,
-        0x0000,
-        NULL, 0,
-        1000);
-    printf("  Result: %s\n", r < 0 ? libusb_strerror(r) : "OK");
-    
-    // Method 2: Set configuration
-    printf("Method 2: Set configuration...\n");
-    r = libusb_set_configuration(handle, 1);
-    printf("  Result: %s\n", r < 0 ? libusb_strerror(r) : "OK");
-    
-    // Method 3: Device reset
-    printf("Method 3: USB device reset...\n");
-    r = libusb_reset_device(handle);
-    if (r == LIBUSB_ERROR_NOT_FOUND) {
-        printf("  Device disconnected (mode switch may have worked!)\n");
-        return 1;
+    if (st->attempts == SWITCH_ATTEMPTS) {
+        printf("[%s] still in ZeroCD mode after %d attempts, giving up\n", st->path, st->attempts);
+        st->state = STICK_FAILED;
+        return;
     }
-    printf("  Result: %s\n", r < 0 ? libusb_strerror(r) : "OK");
     
-    return 0;
+    memset(job, 0, sizeof(*job));
+    job->hc = hc;
+    job->pid = st->pid;
+    job->timing = st->timing;
+    memcpy(job->path, st->path, sizeof(job->path));
+    st->state = STICK_SWITCHING;
+    st->working = 1;
+    start_worker(job);
+}
+
+// The worker is done (or the service stops): collect its result
+static void stick_switched(struct stick *st) {
+    struct switch_job *job = &st->job;
+    
+    if (job->thread) pthread_join(job->thread, NULL);
+    st->working = 0;
+    st->timing = job->timing;
+    
+    if (job->error) {
+        printf("[%s] cannot open 12d1:%04x: %s\n", st->path, job->pid, libusb_strerror(job->error));
+        st->state = STICK_FAILED;
+        return;
+    }
+    st->attempts++;
+    st->switched_us = job->switched_us;
+    printf("[%s] switch sent in %.0f ms, waiting for re-enumeration\n", st->path,
+           ms_between(st->seen_us, st->switched_us));
+}
+
+static void reap_workers(int wait) {
+    for (int i = 0; i < nsticks; i++) {
+        struct stick *st = &sticks[i];
+        if (st->working && (wait || atomic_load(&st->job.done))) stick_switched(st);
+    }
 }
 
-void scan_huawei_devices(libusb_context *ctx, int *found_zerocd, int *found_modem) {
-    libusb_device **devs;
-    ssize_t cnt = libusb_get_device_list(ctx, &devs);
+static void handle_event(struct huawei_ctx *hc, struct stick *st, struct usb_event *ev) {
+    uint64_t at = ev->time_us;
     
-    *found_zerocd = 0;
-    *found_modem = 0;
+    if (!ev->arrived) {
+        if (st->state == STICK_SWITCHING) {
+            st->state = STICK_GONE;
+            st->left_us = at;
+        }
+        return;
+    }
     
-    printf("\nHuawei devices found:\n");
-    int found = 0;
-    
-    for (ssize_t i = 0; i < cnt; i++) {
-        struct libusb_device_descriptor desc;
-        libusb_get_device_descriptor(devs[i], &desc);
-        if (desc.idVendor == HUAWEI_VENDOR_ID) {
-            const char* mode = "";
-            if (is_zerocd_pid(desc.idProduct)) {
-                mode = " [ZeroCD/Storage]";
-                (*found_zerocd)++;
-            } else if (is_modem_pid(desc.idProduct)) {
-                mode = " [Modem Mode]";
-                (*found_modem)++;
-            }
-            printf("  12d1:%04x - %s%s\n", desc.idProduct, get_pid_name(desc.idProduct), mode);
-            found++;
+    st->pid = ev->pid;
+    
+    if (huawei_is_zerocd_pid(ev->pid)) {
+        if (st->state != STICK_SWITCHING && st->state != STICK_GONE) {
+            // Fresh plug-in (or a stick that fell back to storage mode)
+            st->zerocd_pid = ev->pid;
+            st->seen_us = at;
+            st->attempts = 0;
+            memset(&st->timing, 0, sizeof(st->timing));
         }
+        printf("\n[%s] 12d1:%04x (%s) arrived in ZeroCD mode\n", st->path, ev->pid, huawei_pid_name(ev->pid));
+        stick_switch(hc, st);
+    } else if (st->state == STICK_SWITCHING || st->state == STICK_GONE) {
+        st->modem_us = at;
+        st->state = STICK_MODEM;
+        printf("[%s] 12d1:%04x -> 12d1:%04x (%s) in %.0f ms (switch %.0f ms, re-enumeration %.0f ms)\n",
+               st->path, st->zerocd_pid, ev->pid, huawei_pid_name(ev->pid),
+               ms_between(st->seen_us, at), ms_between(st->seen_us, st->switched_us),
+               ms_between(st->switched_us, at));
+        st->timing.reenum_us = metric_span(st->left_us ? st->left_us : st->timing.left_at, at);
+        huawei_switch_confirm(hc, &st->timing, ev->pid);
+        if (metrics) print_switch_metrics(st->path, &st->timing);
+    } else {
+        st->state = STICK_MODEM;
+        printf("[%s] 12d1:%04x (%s) present%s\n", st->path, ev->pid, huawei_pid_name(ev->pid),
+               huawei_is_modem_pid(ev->pid) ? " in modem mode" : "");
     }
+}
+
+// Held events first, then the new ones; a stick's events stay in order
+static void drain_events(struct huawei_ctx *hc) {
+    static struct usb_event batch[2 * EVENT_QUEUE_SIZE];
+    int n = nheld;
+    
+    memcpy(batch, held, (size_t)nheld * sizeof(held[0]));
+    nheld = 0;
+    pthread_mutex_lock(&event_lock);
+    for (; event_count > 0; event_count--) {
+        batch[n++] = event_queue[event_head];
+        event_head = (event_head + 1) % EVENT_QUEUE_SIZE;
+    }
+    pthread_mutex_unlock(&event_lock);
     
-    if (!found) {
-        printf("  No Huawei devices found\n");
+    for (int i = 0; i < n; i++) {
+        struct usb_event *ev = &batch[i];
+        struct stick *st = ev->arrived ? stick_for_path(ev->path) : find_stick(ev->path);
+        
+        if (st && st->working && nheld < EVENT_QUEUE_SIZE) {
+            held[nheld++] = *ev;
+            continue;
+        }
+        if (st && st->working) {
+            pthread_mutex_lock(&event_lock);
+            events_dropped++;
+            pthread_mutex_unlock(&event_lock);
+        } else if (st) {
+            handle_event(hc, st, ev);
+        }
     }
+}
+
+// After lost events: queue an arrival for every Huawei device the tracking does not account for
+static void rescan_bus(struct huawei_ctx *hc) {
+    static struct huawei_device_info list[MAX_TRACKED];
+    int cnt = huawei_scan_devices(hc, list, MAX_TRACKED);
+    
+    for (int i = 0; i < cnt; i++) {
+        struct stick *st = find_stick(list[i].path);
+        if (st && (st->working || (st->pid == list[i].pid && st->state != STICK_GONE))) continue;
+        queue_event(1, list[i].pid, list[i].path);
+    }
+}
+
+static void check_timeouts(void) {
+    uint64_t now = now_us();
     
-    libusb_free_device_list(devs, 1);
+    for (int i = 0; i < nsticks; i++) {
+        struct stick *st = &sticks[i];
+        if (st->working || (st->state != STICK_SWITCHING && st->state != STICK_GONE)) continue;
+        if (now - st->switched_us < (uint64_t)SWITCH_TIMEOUT_MS * 1000) continue;
+        
+        printf("[%s] no modem-mode device after %d s (%s)\n", st->path, SWITCH_TIMEOUT_MS / 1000,
+               st->state == STICK_GONE ? "disconnected, never came back" : "never disconnected");
+        st->state = STICK_FAILED;
+    }
+}
+
+static void print_service_summary(void) {
+    static const char *state_names[] = {"seen", "switching", "re-enumerating", "modem", "failed"};
+    
+    printf("\n%-12s %-10s %-10s %-15s %10s\n", "Port", "ZeroCD", "Now", "State", "To modem");
+    for (int i = 0; i < nsticks; i++) {
+        struct stick *st = &sticks[i];
+        char zerocd[16] = "-";
+        char total[16] = "-";
+        
+        if (st->zerocd_pid) snprintf(zerocd, sizeof(zerocd), "12d1:%04x", st->zerocd_pid);
+        if (st->zerocd_pid && st->modem_us) snprintf(total, sizeof(total), "%.0f ms", ms_between(st->seen_us, st->modem_us));
+        printf("%-12s %-10s 12d1:%04x %-15s %10s\n", st->path, zerocd, st->pid, state_names[st->state], total);
+    }
 }
 
-libusb_device_handle* find_zerocd_device(libusb_context *ctx, uint16_t *found_pid) {
-    for (int i = 0; zerocd_pids[i] != 0; i++) {
-        libusb_device_handle *h = libusb_open_device_with_vid_pid(ctx, HUAWEI_VENDOR_ID, zerocd_pids[i]);
-        if (h) {
-            *found_pid = zerocd_pids[i];
-            return h;
+int run_service(struct huawei_ctx *hc) {
+    int r = huawei_hotplug_register(hc, hotplug_callback, NULL);
+    int hotplug = r == 0;
+    
+    if (r < 0 && r != LIBUSB_ERROR_NOT_SUPPORTED) {
+        printf("Hotplug registration failed (%s), polling instead\n", libusb_strerror(r));
+    }
+    
+    signal(SIGINT, service_signal);
+    signal(SIGTERM, service_signal);
+    
+    printf("Watching for Huawei devices (%s), Ctrl-C to stop...\n", hotplug ? "hotplug" : "polling");
+    
+    // Several switches can run at once, so their step-by-step output is left out
+    quiet = 1;
+    while (!service_stop) {
+        if (hotplug) {
+            huawei_handle_events(hc, POLL_INTERVAL_MS * 1000);
+        } else {
+            poll_bus(hc);
         }
+        
+        reap_workers(0);
+        drain_events(hc);
+        
+        pthread_mutex_lock(&event_lock);
+        unsigned long dropped = events_dropped;
+        events_dropped = 0;
+        pthread_mutex_unlock(&event_lock);
+        if (dropped) {
+            // Polling picks the lost ones up by itself on the next scan
+            fprintf(stderr, "Event queue full, %lu USB event%s lost%s\n", dropped, dropped == 1 ? "" : "s",
+                    hotplug ? ", rescanning the bus" : "");
+            if (hotplug) rescan_bus(hc);
+        }
+        
+        check_timeouts();
+        fflush(stdout);
+        
+        if (!hotplug && !service_stop) usleep(POLL_INTERVAL_MS * 1000);
     }
-    return NULL;
+    
+    if (hotplug) huawei_hotplug_deregister(hc);
+    reap_workers(1);
+    quiet = 0;
+    print_service_summary();
+    return 0;
 }
 
-int switch_device(libusb_context *ctx, libusb_device_handle *handle, uint16_t pid) {
-    libusb_device *dev = libusb_get_device(handle);
-    int interface_num = 0;
-    int r;
+/*
+ * Parallel mode (-a)
+ *
+ * Every ZeroCD device on the bus gets its own switch worker, then all of
+ * them are watched by port path until they come back in modem mode. Total
+ * time follows the slowest stick rather than the number of sticks.
+ */
+
+#define REENUM_POLL_MS      100
+#define REENUM_WAIT_MS      3000    // single-device mode
+
+// Poll the bus until every switched stick is back in modem mode or times out
+static void wait_for_modems(struct huawei_ctx *hc, struct switch_job *jobs, int njobs, uint64_t start) {
+    struct huawei_device_info list[MAX_TRACKED];
+    int pending = 0;
     
-    printf("Switching device 12d1:%04x (%s)...\n\n", pid, get_pid_name(pid));
-    
-    // Get device info
-    struct libusb_device_descriptor desc;
-    libusb_get_device_descriptor(dev, &desc);
-    printf("bNumConfigurations: %d\n", desc.bNumConfigurations);
-    
-    struct libusb_config_descriptor *config;
-    libusb_get_active_config_descriptor(dev, &config);
-    printf("bNumInterfaces: %d\n\n", config->bNumInterfaces);
-    
-    // Print interface info
-    for (int i = 0; i < config->bNumInterfaces; i++) {
-        const struct libusb_interface *iface = &config->interface[i];
-        for (int j = 0; j < iface->num_altsetting; j++) {
-            const struct libusb_interface_descriptor *setting = &iface->altsetting[j];
-            printf("Interface %d: class=0x%02x subclass=0x%02x protocol=0x%02x endpoints=%d\n",
-                   setting->bInterfaceNumber,
-                   setting->bInterfaceClass,
-                   setting->bInterfaceSubClass,
-                   setting->bInterfaceProtocol,
-                   setting->bNumEndpoints);
+    for (int i = 0; i < njobs; i++) {
+        if (jobs[i].error == 0) pending++;
+    }
+    
+    while (pending > 0 && now_us() - start < (uint64_t)SWITCH_TIMEOUT_MS * 1000) {
+        int cnt = huawei_scan_devices(hc, list, MAX_TRACKED);
+        
+        for (int d = 0; d < cnt; d++) {
+            if (huawei_is_zerocd_pid(list[d].pid)) continue;
             
-            for (int k = 0; k < setting->bNumEndpoints; k++) {
-                const struct libusb_endpoint_descriptor *ep = &setting->endpoint[k];
-                printf("  Endpoint 0x%02x: type=%d\n", 
-                       ep->bEndpointAddress,
-                       ep->bmAttributes & 0x03);
+            for (int i = 0; i < njobs; i++) {
+                struct switch_job *job = &jobs[i];
+                if (job->error || job->modem_us || strcmp(job->path, list[d].path) != 0) continue;
+                job->new_pid = list[d].pid;
+                job->modem_us = now_us();
+                pending--;
             }
         }
+        
+        if (pending > 0) usleep(REENUM_POLL_MS * 1000);
+    }
+}
+
+int switch_all(struct huawei_ctx *hc) {
+    struct switch_job jobs[MAX_TRACKED];
+    struct huawei_device_info list[MAX_TRACKED];
+    int njobs = 0;
+    int ok = 0;
+    
+    uint64_t t = now_us();
+    int cnt = huawei_scan_devices(hc, list, MAX_TRACKED);
+    uint64_t discover_us = now_us() - t;
+    for (int i = 0; i < cnt; i++) {
+        if (!huawei_is_zerocd_pid(list[i].pid)) continue;
+        
+        struct switch_job *job = &jobs[njobs++];
+        memset(job, 0, sizeof(*job));
+        job->hc = hc;
+        job->pid = list[i].pid;
+        job->timing.discover_us = discover_us;
+        memcpy(job->path, list[i].path, sizeof(job->path));
     }
     
-    libusb_free_config_descriptor(config);
+    if (njobs == 0) {
+        printf("\nNo ZeroCD devices found.\n");
+        return 1;
+    }
     
-    // Find bulk OUT endpoint
-    int ep_out = find_bulk_out_endpoint(dev, &interface_num);
-    if (ep_out >= 0) {
-        printf("\nFound bulk OUT endpoint: 0x%02x on interface %d\n", ep_out, interface_num);
+    printf("\nSwitching %d device%s in parallel...\n", njobs, njobs == 1 ? "" : "s");
+    quiet = 1;
+    uint64_t start = now_us();
+    
+    for (int i = 0; i < njobs; i++) start_worker(&jobs[i]);
+    for (int i = 0; i < njobs; i++) {
+        if (jobs[i].thread) pthread_join(jobs[i].thread, NULL);
     }
+    quiet = 0;
     
-    // Detach kernel drivers
-    printf("\n[Detaching kernel drivers]\n");
-    for (int i = 0; i < 8; i++) {
-        r = libusb_kernel_driver_active(handle, i);
-        if (r == 1) {
-            printf("Detaching driver from interface %d...\n", i);
-            libusb_detach_kernel_driver(handle, i);
-        }
+    wait_for_modems(hc, jobs, njobs, start);
+    for (int i = 0; i < njobs; i++) {
+        if (jobs[i].modem_us) huawei_switch_confirm(hc, &jobs[i].timing, jobs[i].new_pid);
     }
     
-    // Claim interface
-    printf("\n[Claiming interface %d]\n", interface_num);
-    r = libusb_claim_interface(handle, interface_num);
-    if (r < 0) {
-        printf("Cannot claim interface: %s\n", libusb_strerror(r));
-        printf("Trying without claiming...\n");
-    } else {
-        printf("Interface claimed successfully\n");
+    printf("\n%-12s %-10s %-10s %10s %10s  %s\n", "Port", "From", "To", "Switch", "Total", "Result");
+    for (int i = 0; i < njobs; i++) {
+        struct switch_job *job = &jobs[i];
+        char to[16] = "-";
+        char total[16] = "-";
+        const char *result;
         
-        if (ep_out >= 0) {
-            // Try bulk transfers
-            try_bulk_transfer(handle, ep_out, huawei_switch_msg, sizeof(huawei_switch_msg), "Huawei switch message 1");
-            usleep(500000);
-            try_bulk_transfer(handle, ep_out, huawei_switch_msg2, sizeof(huawei_switch_msg2), "Huawei switch message 2");
-            usleep(500000);
-            try_bulk_transfer(handle, ep_out, eject_msg, sizeof(eject_msg), "Eject message");
+        if (job->error) {
+            result = libusb_strerror(job->error);
+        } else if (job->modem_us) {
+            snprintf(to, sizeof(to), "12d1:%04x", job->new_pid);
+            snprintf(total, sizeof(total), "%.0f ms", (job->modem_us - job->start_us) / 1000.0);
+            result = "modem mode";
+            ok++;
         } else {
-            // Try common endpoints
-            printf("\nNo bulk endpoint found, trying common endpoints...\n");
-            int endpoints[] = {0x01, 0x02, 0x03, 0x04, 0x05};
-            for (int i = 0; i < 5; i++) {
-                int transferred;
-                r = libusb_bulk_transfer(handle, endpoints[i], huawei_switch_msg, 
-                                        sizeof(huawei_switch_msg), &transferred, 1000);
-                if (r == 0) {
-                    printf("Success on endpoint 0x%02x\n", endpoints[i]);
-                    break;
-                }
-            }
+            result = "timed out";
         }
-        
-        libusb_release_interface(handle, interface_num);
+        printf("%-12s 12d1:%04x  %-10s %7.0f ms %10s  %s\n", job->path, job->pid, to,
+               (job->switched_us - job->start_us) / 1000.0, total, result);
     }
+    printf("\n%d/%d switched in %.0f ms\n", ok, njobs, (now_us() - start) / 1000.0);
     
-    // Try control transfers
-    return try_control_transfer(handle);
+    for (int i = 0; i < njobs && metrics; i++) {
+        jobs[i].timing.reenum_us = metric_span(jobs[i].timing.left_at, jobs[i].modem_us);
+        print_switch_metrics(jobs[i].path, &jobs[i].timing);
+    }
+    
+    return ok == njobs ? 0 : 1;
 }
 
 void print_usage(const char *prog) {
@@ -434,25 +634,41 @@ void print_usage(const char *prog) {
     printf("Options:\n");
     printf("  -p <PID>   Force specific product ID (hex, e.g. 14fe)\n");
     printf("  -l         List devices only, don't switch\n");
+    printf("  -w         Service mode: switch ZeroCD sticks as they are plugged in\n");
+    printf("  -a         Switch all ZeroCD devices at once and print a summary\n");
+    printf("  -n         Ignore learned switch methods, always try the full sequence\n");
+    printf("  --metrics[=kv|json]  Per-phase timings as one key=value or JSON line per stick on stderr\n");
     printf("  -h         Show this help\n");
     printf("\nSupported ZeroCD PIDs:\n");
-    for (int i = 0; zerocd_pids[i] != 0; i++) {
-        printf("  0x%04x - %s\n", zerocd_pids[i], get_pid_name(zerocd_pids[i]));
+    for (int i = 0; i < HUAWEI_PID_COUNT; i++) {
+        if (huawei_pids[i].mode & PID_ZEROCD) {
+            printf("  0x%04x - %s\n", huawei_pids[i].pid, huawei_pids[i].name);
+        }
     }
 }
 
 int main(int argc, char **argv) {
-    libusb_context *ctx = NULL;
-    libusb_device_handle *handle = NULL;
+    struct huawei_ctx *hc = NULL;
+    struct huawei_options opts = {0};
+    struct huawei_startup startup;
     int r;
     int list_only = 0;
+    int service = 0;
+    int all = 0;
     uint16_t force_pid = 0;
-    uint16_t found_pid = 0;
     
     // Parse arguments
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-l") == 0) {
             list_only = 1;
+        } else if (strcmp(argv[i], "-w") == 0) {
+            service = 1;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            all = 1;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            opts.no_strategies = 1;
+        } else if (metrics_option(argv[i]) != METRICS_OFF) {
+            metrics = metrics_option(argv[i]);
         } else if (strcmp(argv[i], "-h") == 0) {
             print_usage(argv[0]);
             return 0;
@@ -464,54 +680,63 @@ int main(int argc, char **argv) {
     
     printf("=== Huawei Mode Switch (Universal) ===\n\n");
     
-    r = libusb_init(&ctx);
+    opts.log = log_print;
+    r = huawei_init(&hc, &opts);
     if (r < 0) {
-        fprintf(stderr, "Failed to init libusb\n");
+        if (r != LIBUSB_ERROR_INVALID_PARAM) fprintf(stderr, "Failed to init libusb\n");
         return 1;
     }
+    huawei_get_startup(hc, &startup);
+    init_us = startup.init_us;
+    
+    if (service) {
+        r = run_service(hc);
+        huawei_exit(hc);
+        return r;
+    }
     
     int found_zerocd, found_modem;
-    scan_huawei_devices(ctx, &found_zerocd, &found_modem);
+    scan_huawei_devices(hc, &found_zerocd, &found_modem);
     
     if (list_only) {
-        libusb_exit(ctx);
+        huawei_exit(hc);
         return 0;
     }
     
-    // Find device to switch
-    if (force_pid != 0) {
-        handle = libusb_open_device_with_vid_pid(ctx, HUAWEI_VENDOR_ID, force_pid);
-        if (handle) {
-            found_pid = force_pid;
-        }
-    } else {
-        handle = find_zerocd_device(ctx, &found_pid);
+    if (all) {
+        r = switch_all(hc);
+        huawei_exit(hc);
+        return r;
     }
     
-    if (!handle) {
-        if (force_pid) {
-            printf("\nDevice 12d1:%04x not found.\n", force_pid);
+    // Find the device and switch it
+    struct huawei_switch_timing timing = {0};
+    printf("\n");
+    r = huawei_switch(hc, force_pid, &timing);
+    
+    if (r < 0) {
+        if (r != LIBUSB_ERROR_NOT_FOUND) {
+            printf("Cannot open the device: %s\n", libusb_strerror(r));
+        } else if (force_pid) {
+            printf("Device 12d1:%04x not found.\n", force_pid);
         } else if (found_modem > 0) {
-            printf("\nNo ZeroCD device found. Device may already be in modem mode.\n");
+            printf("No ZeroCD device found. Device may already be in modem mode.\n");
         } else {
-            printf("\nNo Huawei device found to switch.\n");
+            printf("No Huawei device found to switch.\n");
         }
-        libusb_exit(ctx);
+        huawei_exit(hc);
         return 1;
     }
     
-    printf("\n");
-    int switched = switch_device(ctx, handle, found_pid);
-    
-    if (!switched) {
-        libusb_close(handle);
-    }
-    
     printf("\n=== Waiting for device to re-enumerate... ===\n");
-    sleep(3);
+    uint16_t modem_pid = 0;
+    uint64_t modem_at = huawei_wait_modem(hc, timing.path, REENUM_WAIT_MS, &modem_pid) > 0 ? now_us() : 0;
+    if (modem_at) huawei_switch_confirm(hc, &timing, modem_pid);
+    timing.reenum_us = metric_span(timing.left_at, modem_at);
+    if (metrics) print_switch_metrics(timing.path, &timing);
     
     // Check result
-    scan_huawei_devices(ctx, &found_zerocd, &found_modem);
+    scan_huawei_devices(hc, &found_zerocd, &found_modem);
     
     if (found_modem > 0) {
         printf("\n*** SUCCESS! Device is now in modem mode ***\n");
@@ -524,6 +749,6 @@ int main(int argc, char **argv) {
     printf("  ./huawei_at \"ATI\"           # Get modem info\n");
     printf("  ls /dev/tty.* /dev/cu.*     # Check serial ports\n");
     
-    libusb_exit(ctx);
+    huawei_exit(hc);
     return 0;
 }
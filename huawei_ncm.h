@@ -0,0 +1,250 @@
+/*
+ * CDC-NCM transfer block codec (USB CDC NCM 1.0)
+ * Used by huawei_at's ncm datapath and bench/bench_ncm.c
+ *
+ * An NTB packs any number of Ethernet frames into one bulk transfer: a
+ * transfer header (NTH16/NTH32), the datagrams, and one or more datagram
+ * pointer tables (NDP16/NDP32) giving each datagram's offset and length.
+ * Both layouts are handled; received blocks are recognised by signature.
+ *
+ * Nothing is copied. ncm_parse() hands out pointers into the received
+ * block, and the builder tells the caller where the next datagram goes so
+ * it can be read there directly (e.g. straight from a TUN/TAP device); the
+ * NDP is written behind the datagrams once the block is full.
+ */
+
+#ifndef HUAWEI_NCM_H
+#define HUAWEI_NCM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define NCM_NTH16_SIGN          0x484D434E  // "NCMH"
+#define NCM_NTH32_SIGN          0x686D636E  // "ncmh"
+#define NCM_NDP16_SIGN          0x304D434E  // "NCM0", no CRC
+#define NCM_NDP32_SIGN          0x306D636E  // "ncm0", no CRC
+#define NCM_NTH16_LEN           12
+#define NCM_NTH32_LEN           16
+#define NCM_NDP16_LEN           8
+#define NCM_NDP32_LEN           16
+#define NCM_NDP_CHAIN_MAX       16          // NDPs walked per block, against pointer loops
+#define NCM_TX_DATAGRAMS        64          // datagrams one built block carries at most
+
+// Class requests on the communication interface
+#define NCM_GET_NTB_PARAMETERS  0x80
+#define NCM_SET_NTB_FORMAT      0x84
+#define NCM_SET_NTB_INPUT_SIZE  0x86
+#define NCM_NTB_PARAMETERS_LEN  28
+
+// GET_NTB_PARAMETERS reply; "in" is device to host
+struct ncm_params {
+    uint16_t formats;           // bit 0 NTB16, bit 1 NTB32
+    uint32_t in_max;
+    uint32_t out_max;
+    uint16_t out_divisor;       // datagrams start at offsets = out_remainder modulo out_divisor
+    uint16_t out_remainder;
+    uint16_t out_align;         // NDP alignment
+    uint16_t out_datagrams;     // datagrams per block at most, 0 = no limit
+};
+
+static inline uint16_t ncm_get16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static inline uint32_t ncm_get32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void ncm_put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void ncm_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+// Returns -1 if the reply is too short or makes no sense
+static inline int ncm_params_parse(struct ncm_params *p, const uint8_t *buf, int len) {
+    if (len < NCM_NTB_PARAMETERS_LEN || ncm_get16(buf) < NCM_NTB_PARAMETERS_LEN) return -1;
+    p->formats = ncm_get16(buf + 2);
+    p->in_max = ncm_get32(buf + 4);
+    p->out_max = ncm_get32(buf + 16);
+    p->out_divisor = ncm_get16(buf + 20);
+    p->out_remainder = ncm_get16(buf + 22);
+    p->out_align = ncm_get16(buf + 24);
+    p->out_datagrams = ncm_get16(buf + 26);
+    
+    // Zero or non power of two means "no constraint" in practice
+    if (p->out_divisor == 0 || (p->out_divisor & (p->out_divisor - 1))) p->out_divisor = 4;
+    p->out_remainder %= p->out_divisor;
+    if (p->out_align < 4 || (p->out_align & (p->out_align - 1))) p->out_align = 4;
+    if (!(p->formats & 1) || p->in_max < NCM_NTH32_LEN + NCM_NDP32_LEN || p->out_max < 2048) return -1;
+    return 0;
+}
+
+// One datagram of a received block; data may be modified in place
+typedef void (*ncm_datagram_fn)(void *opaque, uint8_t *data, size_t len);
+
+// Walk a received block, NTB16 or NTB32. Returns the number of datagrams
+// handed to fn, -1 if the block is malformed (datagrams before the damage
+// have been delivered).
+static inline int ncm_parse(uint8_t *ntb, size_t len, ncm_datagram_fn fn, void *opaque) {
+    int ntb32;
+    size_t block, ndp;
+    int count = 0;
+    
+    if (len < NCM_NTH16_LEN) return -1;
+    uint32_t sign = ncm_get32(ntb);
+    if (sign == NCM_NTH16_SIGN && ncm_get16(ntb + 4) == NCM_NTH16_LEN) {
+        ntb32 = 0;
+        block = ncm_get16(ntb + 8);
+        ndp = ncm_get16(ntb + 10);
+    } else if (sign == NCM_NTH32_SIGN && len >= NCM_NTH32_LEN && ncm_get16(ntb + 4) == NCM_NTH32_LEN) {
+        ntb32 = 1;
+        block = ncm_get32(ntb + 8);
+        ndp = ncm_get32(ntb + 12);
+    } else {
+        return -1;
+    }
+    // Some devices send the whole buffer with a block length of zero or more
+    if (block == 0 || block > len) block = len;
+    
+    for (int chain = 0; ndp != 0; chain++) {
+        size_t hdr = ntb32 ? NCM_NDP32_LEN : NCM_NDP16_LEN;
+        size_t entry = ntb32 ? 8 : 4;
+        
+        if (chain == NCM_NDP_CHAIN_MAX || ndp % 4 || ndp + hdr > block) return -1;
+        const uint8_t *t = ntb + ndp;
+        size_t ndp_len = ncm_get16(t + 4);
+        if (ncm_get32(t) != (ntb32 ? NCM_NDP32_SIGN : NCM_NDP16_SIGN) || ndp_len < hdr + 2 * entry ||
+            ndp + ndp_len > block) {
+            return -1;
+        }
+        
+        for (size_t e = hdr; e + entry <= ndp_len; e += entry) {
+            size_t index = ntb32 ? ncm_get32(t + e) : ncm_get16(t + e);
+            size_t dlen = ntb32 ? ncm_get32(t + e + 4) : ncm_get16(t + e + 2);
+            if (index == 0 || dlen == 0) break;
+            if (index > block || dlen > block - index) return -1;
+            fn(opaque, ntb + index, dlen);
+            count++;
+        }
+        ndp = ntb32 ? ncm_get32(t + 8) : ncm_get16(t + 6);
+    }
+    return count;
+}
+
+// A block being built in a caller supplied buffer
+struct ncm_tx {
+    uint8_t *buf;
+    size_t size;
+    int ntb32;
+    const struct ncm_params *p;
+    size_t end;                 // end of the last datagram
+    size_t next;                // where the next one would start
+    int count;
+    int max;
+    uint32_t index[NCM_TX_DATAGRAMS];
+    uint32_t length[NCM_TX_DATAGRAMS];
+};
+
+// First offset at or after off that is out_remainder modulo out_divisor
+static inline size_t ncm_tx_place(const struct ncm_params *p, size_t off) {
+    size_t mask = p->out_divisor - 1;
+    size_t at = (off & ~mask) + p->out_remainder;
+    return at < off ? at + p->out_divisor : at;
+}
+
+// NDP after the datagrams, with room for count entries plus the terminator
+static inline size_t ncm_tx_ndp_len(const struct ncm_tx *tx, int count) {
+    return tx->ntb32 ? NCM_NDP32_LEN + (size_t)(count + 1) * 8 : NCM_NDP16_LEN + (size_t)(count + 1) * 4;
+}
+
+static inline void ncm_tx_begin(struct ncm_tx *tx, uint8_t *buf, size_t size, int ntb32,
+                                const struct ncm_params *p) {
+    tx->buf = buf;
+    tx->size = size < p->out_max ? size : p->out_max;
+    if (!ntb32 && tx->size > 0xFFFF) tx->size = 0xFFFF;
+    tx->ntb32 = ntb32;
+    tx->p = p;
+    tx->end = ntb32 ? NCM_NTH32_LEN : NCM_NTH16_LEN;
+    tx->next = ncm_tx_place(p, tx->end);
+    tx->count = 0;
+    tx->max = p->out_datagrams && p->out_datagrams < NCM_TX_DATAGRAMS ? p->out_datagrams : NCM_TX_DATAGRAMS;
+}
+
+// Where the next datagram of up to need bytes goes, NULL if the block
+// cannot take it any more
+static inline uint8_t *ncm_tx_reserve(struct ncm_tx *tx, size_t need) {
+    if (tx->count == tx->max) return NULL;
+    size_t ndp = (tx->next + need + tx->p->out_align - 1) & ~(size_t)(tx->p->out_align - 1);
+    if (ndp + ncm_tx_ndp_len(tx, tx->count + 1) > tx->size) return NULL;
+    return tx->buf + tx->next;
+}
+
+// The datagram at the reserved place is len bytes long
+static inline void ncm_tx_commit(struct ncm_tx *tx, size_t len) {
+    tx->index[tx->count] = (uint32_t)tx->next;
+    tx->length[tx->count] = (uint32_t)len;
+    tx->count++;
+    tx->end = tx->next + len;
+    tx->next = ncm_tx_place(tx->p, tx->end);
+}
+
+// Write the NTH and the NDP; returns the block length. A block that would
+// end on a multiple of packet (the endpoint's wMaxPacketSize) gets one
+// byte of padding, so the device sees the end without a zero length packet.
+static inline size_t ncm_tx_finish(struct ncm_tx *tx, uint16_t seq, size_t packet) {
+    uint8_t *b = tx->buf;
+    size_t ndp = (tx->end + tx->p->out_align - 1) & ~(size_t)(tx->p->out_align - 1);
+    size_t ndp_len = ncm_tx_ndp_len(tx, tx->count);
+    size_t len = ndp + ndp_len;
+    uint8_t *t = b + ndp;
+    
+    memset(b + tx->end, 0, ndp - tx->end);
+    if (tx->ntb32) {
+        ncm_put32(t, NCM_NDP32_SIGN);
+        ncm_put16(t + 4, (uint16_t)ndp_len);
+        ncm_put16(t + 6, 0);
+        ncm_put32(t + 8, 0);
+        ncm_put32(t + 12, 0);
+        for (int i = 0; i < tx->count; i++) {
+            ncm_put32(t + NCM_NDP32_LEN + i * 8, tx->index[i]);
+            ncm_put32(t + NCM_NDP32_LEN + i * 8 + 4, tx->length[i]);
+        }
+        memset(t + NCM_NDP32_LEN + tx->count * 8, 0, 8);
+    } else {
+        ncm_put32(t, NCM_NDP16_SIGN);
+        ncm_put16(t + 4, (uint16_t)ndp_len);
+        ncm_put16(t + 6, 0);
+        for (int i = 0; i < tx->count; i++) {
+            ncm_put16(t + NCM_NDP16_LEN + i * 4, (uint16_t)tx->index[i]);
+            ncm_put16(t + NCM_NDP16_LEN + i * 4 + 2, (uint16_t)tx->length[i]);
+        }
+        memset(t + NCM_NDP16_LEN + tx->count * 4, 0, 4);
+    }
+    
+    if (packet && len % packet == 0 && len < tx->size) b[len++] = 0;
+    
+    if (tx->ntb32) {
+        ncm_put32(b, NCM_NTH32_SIGN);
+        ncm_put16(b + 4, NCM_NTH32_LEN);
+        ncm_put16(b + 6, seq);
+        ncm_put32(b + 8, (uint32_t)len);
+        ncm_put32(b + 12, (uint32_t)ndp);
+    } else {
+        ncm_put32(b, NCM_NTH16_SIGN);
+        ncm_put16(b + 4, NCM_NTH16_LEN);
+        ncm_put16(b + 6, seq);
+        ncm_put16(b + 8, (uint16_t)len);
+        ncm_put16(b + 10, (uint16_t)ndp);
+    }
+    return len;
+}
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Huawei USB product ID table
+ * Shared by huawei_at and huawei_modeswitch
+ *
+ * The table is written once as an X-macro list and expanded at compile time
+ * into the entry array plus a direct-mapped index over the 0x1000-0x1fff
+ * PID range, so classifying a device is a single array load instead of a
+ * walk over PID lists. A PID listed twice fails to compile.
+ */
+
+#ifndef HUAWEI_PIDS_H
+#define HUAWEI_PIDS_H
+
+#include <stdint.h>
+
+#define HUAWEI_VENDOR_ID    0x12D1
+
+// Mode flags
+#define PID_ZEROCD          0x01    // Mass storage/ZeroCD, needs switching
+#define PID_MODEM           0x02    // Modem/network mode (switch target)
+
+/*
+ * X(pid, mode, priority, name)
+ *
+ * priority is the order in which huawei_at prefers a PID when several
+ * candidates are attached (1 = first); 0 means huawei_at does not treat the
+ * PID as an AT device.
+ */
+#define HUAWEI_PID_TABLE(X) \
+    /* === Classic 3G/HSPA === */ \
+    X(0x1001, PID_MODEM,   1, "E169/E620/E800/E1550") \
+    X(0x1003, PID_MODEM,   2, "E1550") \
+    X(0x1404, PID_MODEM,  29, "E1752") \
+    X(0x1406, PID_MODEM,   4, "E1750") \
+    X(0x140c, PID_MODEM,   3, "E180/E1550") \
+    X(0x1411, PID_MODEM,  30, "E510") \
+    X(0x141b, PID_MODEM,  31, "E1752 Alt") \
+    X(0x1436, PID_MODEM,   5, "E173/E1750") \
+    X(0x1446, PID_ZEROCD, 32, "E1550/E1756/E173") \
+    X(0x1464, PID_MODEM,  33, "K4510/K4511") \
+    X(0x1465, PID_MODEM,   6, "K3765") \
+    X(0x14ac, PID_MODEM,   7, "E1820") \
+    X(0x14ba, PID_MODEM,  34, "E173 Alt") \
+    X(0x14c6, PID_MODEM,   8, "K4605") \
+    X(0x14c9, PID_MODEM,   9, "K4505") \
+    X(0x14d1, PID_ZEROCD, 35, "E173") \
+    X(0x1c05, PID_MODEM,  10, "E173") \
+    X(0x1c07, PID_MODEM,  11, "E173s") \
+    X(0x1c0b, PID_ZEROCD, 36, "E3531/E173s") \
+    X(0x1c1b, PID_ZEROCD, 12, "E3531") \
+    /* === E3xx Series === */ \
+    X(0x14db, PID_MODEM,  14, "E3131/E353 HiLink") \
+    X(0x14fe, PID_ZEROCD, 15, "E303/E3131 Intermediate") \
+    X(0x1506, PID_MODEM,  13, "E303/E3131/MS2372") \
+    X(0x15ca, PID_ZEROCD, 16, "E3131h-2") \
+    X(0x1f01, PID_ZEROCD, 17, "E353/E3131/E3372/E8372") \
+    /* === E3372/E8372 LTE === */ \
+    X(0x1442, PID_MODEM,  18, "E3372 Stick") \
+    X(0x14dc, PID_MODEM,  19, "E3372/E8372 HiLink") \
+    X(0x155e, PID_MODEM,  20, "E8372 NCM") \
+    X(0x157f, PID_MODEM,  21, "E8372 Alt") \
+    X(0x1588, PID_ZEROCD,  0, "E3372 Variant") \
+    X(0x1592, PID_MODEM,  22, "E8372h") \
+    X(0x1da1, PID_ZEROCD, 37, "E3372") \
+    /* === K-Series / other LTE === */ \
+    X(0x1505, PID_ZEROCD, 23, "E3131/E398/K5005") \
+    X(0x1520, PID_ZEROCD, 24, "K3765") \
+    X(0x1521, PID_ZEROCD, 25, "K4505") \
+    X(0x1573, PID_MODEM,   0, "K5150") \
+    X(0x1575, PID_ZEROCD, 26, "K5150") \
+    X(0x1576, PID_MODEM,   0, "K5160") \
+    X(0x157c, PID_ZEROCD,  0, "E3276") \
+    X(0x157d, PID_ZEROCD,  0, "E3276 Alt") \
+    X(0x1582, PID_ZEROCD,  0, "E8278") \
+    X(0x1583, PID_ZEROCD,  0, "E8278 Alt") \
+    X(0x15b6, PID_ZEROCD,  0, "E3331") \
+    X(0x15c1, PID_MODEM,  27, "ME906s LTE") \
+    X(0x1f1e, PID_ZEROCD, 28, "K5160")
+
+struct huawei_pid {
+    uint16_t pid;
+    uint8_t mode;
+    uint8_t priority;
+    const char *name;
+};
+
+#define HUAWEI_PID_ENUM(pid, mode, prio, name)  HUAWEI_PID_IDX_##pid,
+enum {
+    HUAWEI_PID_TABLE(HUAWEI_PID_ENUM)
+    HUAWEI_PID_COUNT
+};
+#undef HUAWEI_PID_ENUM
+
+#define HUAWEI_PID_ENTRY(pid, mode, prio, name) {pid, mode, prio, name},
+static const struct huawei_pid huawei_pids[HUAWEI_PID_COUNT] = {
+    HUAWEI_PID_TABLE(HUAWEI_PID_ENTRY)
+};
+#undef HUAWEI_PID_ENTRY
+
+// All known PIDs live in 0x1000-0x1fff; slot holds table index + 1
+#define HUAWEI_PID_BASE     0x1000
+#define HUAWEI_PID_SPAN     0x1000
+
+#define HUAWEI_PID_SLOT(pid, mode, prio, name)  [(pid) - HUAWEI_PID_BASE] = HUAWEI_PID_IDX_##pid + 1,
+static const uint8_t huawei_pid_index[HUAWEI_PID_SPAN] = {
+    HUAWEI_PID_TABLE(HUAWEI_PID_SLOT)
+};
+#undef HUAWEI_PID_SLOT
+
+static inline const struct huawei_pid *huawei_pid_lookup(uint16_t pid) {
+    unsigned slot = (unsigned)pid - HUAWEI_PID_BASE;
+    if (slot >= HUAWEI_PID_SPAN || huawei_pid_index[slot] == 0) return NULL;
+    return &huawei_pids[huawei_pid_index[slot] - 1];
+}
+
+static inline const char *huawei_pid_name(uint16_t pid) {
+    const struct huawei_pid *p = huawei_pid_lookup(pid);
+    return p ? p->name : "Unknown Huawei";
+}
+
+static inline int huawei_pid_has_mode(uint16_t pid, uint8_t mode) {
+    const struct huawei_pid *p = huawei_pid_lookup(pid);
+    return p && (p->mode & mode);
+}
+
+#endif
@@ -0,0 +1,1678 @@
+/*
+ * Simulated Huawei modem
+ *
+ * An in-process stand-in for libusb behind struct usb_transport, so both
+ * tools can be run, regression-tested and benchmarked without a stick.
+ * The virtual bus (bus 0) carries one or more sticks. A stick in ZeroCD
+ * mode shows a mass storage interface and drops off the bus when it gets
+ * the switch method it accepts, then comes back as a modem with three
+ * vendor interfaces: the PC UI port (0) and the modem port (1) each answer
+ * AT commands on their own, the diagnostic port (2) stays silent unless
+ * diag=N asks for a stream of DIAG log packets.
+ * Unsolicited results go to the PC UI port. With ncm=1 the modem also has
+ * a CDC-NCM function (communication interface 3, data interface 4) that
+ * sends every transfer block it receives straight back once the host has
+ * selected the data interface's alternate setting 1, so the datapath can
+ * be benchmarked without a network behind it. ATD*99# on either AT port
+ * answers CONNECT and switches it to PPP: the stick negotiates LCP, PAP and
+ * IPCP like a network would (handing out 10.64.0.2 and up) and sends every
+ * IP packet back with source and destination swapped, until an LCP
+ * Terminate-Request or "+++".
+ *
+ * Selected with HUAWEI_TRANSPORT=sim and configured with
+ * HUAWEI_SIM="key=value,...":
+ *
+ *   sticks=N       sticks on the bus (1, at most 8)
+ *   start=MODE     zerocd or modem (modem)
+ *   zerocd=PID     ZeroCD product ID, hex (1f01)
+ *   modem=PID      modem product ID, hex (1506)
+ *   method=NAME    switch method the stick accepts: huawei-msg, huawei-msg2,
+ *                  eject, set-feature, set-config, reset or any (huawei-msg)
+ *   switch=MS      switch message to leaving the bus (50)
+ *   enum=MS        leaving the bus to the modem showing up (500)
+ *   latency=MS     command to first reply byte (0)
+ *   chunk=N        reply bytes per IN transfer at most (512)
+ *   urc=MS         emit an unsolicited result every MS, 0 = never (0)
+ *   sms=N          messages in the SMS store, at most SIM_SMS_MAX (0)
+ *   submit=MS      AT+CMGS text to +CMGS: reply, the network round trip (0)
+ *   ncm=1          add the NCM loopback function (0)
+ *   diag=N         log packets per second on the diagnostic port, 0 = silent (0)
+ *
+ * The signal (AT+CSQ, AT^HCSQ?) wanders by a step with every query.
+ *
+ * Every context gets a bus of its own from huawei_usb_sim_open(), so several
+ * contexts in one process each see their own sticks. huawei_usb_sim_script() adds
+ * canned answers on top of the built-in ones, e.g. large multi-line
+ * responses for benchmarks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <libusb-1.0/libusb.h>
+
+#include "huawei_pids.h"
+#include "huawei_usb.h"
+#include "huawei_ncm.h"
+#include "huawei_hdlc.h"
+
+#define SIM_MAX_STICKS      8
+#define SIM_MAX_TRANSFERS   128
+#define SIM_CMD_MAX         512
+#define SIM_REPLY_MAX       65536
+#define SIM_SCRIPT_MAX      32
+#define SIM_SMS_MAX         4096
+#define SIM_CHANNELS        2       // AT interfaces: PC UI, modem; the diagnostic one stays silent
+#define SIM_SMS_FREE        0xFF    // sms_stat of an empty slot
+#define SIM_IDLE_WAIT_US    100000  // longest sleep when nothing is scheduled
+#define SIM_NCM_IF          3       // communication interface; data is the next one
+#define SIM_NCM_IN          0x85
+#define SIM_NCM_OUT         0x05
+#define SIM_NCM_RING        32      // blocks waiting to be sent back
+#define SIM_NCM_IN_MAX      32768
+#define SIM_NCM_OUT_MAX     16384
+#define SIM_PPP_FRAME_MAX   2048
+#define SIM_PPP_MAGIC       0x5349574d
+#define SIM_DIAG_IN         0x83
+#define SIM_DIAG_PACKET_MAX 1024
+#define SIM_DIAG_BACKLOG_US 1000000 // a stalled reader finds at most this much waiting
+
+enum sim_method {
+    SIM_HUAWEI_MSG,
+    SIM_HUAWEI_MSG2,
+    SIM_EJECT,
+    SIM_SET_FEATURE,
+    SIM_SET_CONFIG,
+    SIM_RESET,
+    SIM_ANY,
+    SIM_METHOD_COUNT
+};
+
+// Same spelling as huawei_modeswitch's learned methods
+static const char *sim_method_names[SIM_METHOD_COUNT] = {
+    "huawei-msg", "huawei-msg2", "eject", "set-feature", "set-config", "reset", "any"
+};
+
+struct sim_options {
+    int sticks;
+    int start_zerocd;
+    uint16_t zerocd_pid;
+    uint16_t modem_pid;
+    enum sim_method method;
+    uint64_t switch_us;
+    uint64_t enum_us;
+    uint64_t latency_us;
+    uint64_t urc_us;
+    int chunk;
+    int sms;
+    uint64_t submit_us;
+    int ncm;
+    int diag;
+};
+
+static const struct sim_options sim_defaults = {1, 0, 0x1f01, 0x1506, SIM_HUAWEI_MSG, 50000, 500000, 0, 0, 512, 0, 0,
+                                                0, 0};
+
+struct sim_bus;
+struct sim_stick;
+
+// One personality of a stick, what the tools see as a libusb_device
+struct sim_device {
+    struct sim_stick *stick;
+    int modem;
+    unsigned drivers;       // interfaces with a kernel driver bound
+    struct libusb_device_descriptor desc;
+    const struct libusb_config_descriptor *config;
+};
+
+struct sim_handle {
+    struct sim_device *dev;
+    unsigned claimed;
+};
+
+// One AT interface of a stick: each keeps its own command line, reply and settings
+struct sim_channel {
+    struct sim_stick *stick;
+    int urcs;               // unsolicited results go out here (the PC UI port)
+    int echo;
+    int numeric;            // ATV0
+    char cmd[SIM_CMD_MAX];
+    size_t cmd_len;
+    char reply[SIM_REPLY_MAX];
+    size_t reply_len;
+    size_t reply_pos;
+    uint64_t reply_at;      // when the pending reply becomes readable
+    uint64_t next_urc;
+    unsigned urc_seq;
+    
+    // The two SMS commands that span several transfers
+    int listing;            // AT+CMGL output still being produced
+    int list_stat;
+    int list_next;
+    int text_len;           // AT+CMGS: TPDU length announced, -1 = not at a prompt
+    
+    // PPP after ATD*99#: the reply buffer carries frames instead of text
+    int ppp;
+    uint32_t ppp_accm;      // the host's, once its LCP request is acked
+    uint8_t ppp_id;
+    struct hdlc_rx ppp_rx;
+    uint8_t ppp_frame[SIM_PPP_FRAME_MAX];
+};
+
+// NCM loopback: blocks from the host, queued to go back out
+struct sim_ncm {
+    int alt;                // data interface alternate setting, 1 = running
+    int ntb32;              // SET_NTB_FORMAT
+    uint32_t in_size;       // SET_NTB_INPUT_SIZE
+    unsigned head;
+    unsigned tail;
+    size_t len[SIM_NCM_RING];
+    uint8_t *ring[SIM_NCM_RING];
+};
+
+struct sim_stick {
+    struct sim_bus *bus;
+    int port;
+    char serial[16];
+    char imei[16];
+    uint64_t switched_us;   // when the accepted switch method arrived, 0 = never
+    struct sim_device zerocd;
+    struct sim_device modem;
+    
+    // AT side, shared by the interfaces
+    struct sim_channel chan[SIM_CHANNELS];
+    int rssi;               // AT+CSQ scale, wanders a little with every query
+    unsigned rand;
+    unsigned char sms_stat[SIM_SMS_MAX];    // SMS store (PDU mode)
+    unsigned mr;
+    
+    struct sim_ncm ncm;
+    
+    // Diagnostic stream: packet n is due at diag_start + n / rate, framed the way the port sends it
+    uint64_t diag_start;
+    uint64_t diag_seq;
+    uint8_t diag_out[HDLC_ENCODED_MAX(SIM_DIAG_PACKET_MAX)];
+    size_t diag_len;
+    size_t diag_pos;
+};
+
+// A virtual bus, what a context gets as its libusb_context
+struct sim_bus {
+    struct sim_options opt;
+    struct sim_stick sticks[SIM_MAX_STICKS];
+    pthread_mutex_t lock;
+    
+    // Canned answers from huawei_usb_sim_script(), checked before the built-in ones
+    struct {
+        char *cmd;
+        char *info;
+    } script[SIM_SCRIPT_MAX];
+    int nscript;
+    
+    // Queued asynchronous transfers, completed by handle_events
+    struct libusb_transfer *queue[SIM_MAX_TRANSFERS];
+    uint64_t queue_deadline[SIM_MAX_TRANSFERS];
+    unsigned char queue_cancel[SIM_MAX_TRANSFERS];
+    int nqueue;
+    
+    // Wakes a thread waiting in sim_sleep_until() when a transfer is submitted
+    int wake[2];
+    int sleepers;
+};
+
+/*
+ * Descriptors
+ */
+
+#define SIM_EP(addr) {7, LIBUSB_DT_ENDPOINT, addr, LIBUSB_TRANSFER_TYPE_BULK, 512, 0, 0, 0, NULL, 0}
+
+static const struct libusb_endpoint_descriptor storage_eps[] = {SIM_EP(0x81), SIM_EP(0x01)};
+static const struct libusb_endpoint_descriptor modem_eps[3][2] = {
+    {SIM_EP(0x81), SIM_EP(0x01)},
+    {SIM_EP(0x82), SIM_EP(0x02)},
+    {SIM_EP(0x83), SIM_EP(0x03)},
+};
+
+static const struct libusb_interface_descriptor storage_if[] = {
+    {9, LIBUSB_DT_INTERFACE, 0, 0, 2, 0x08, 0x06, 0x50, 0, storage_eps, NULL, 0},
+};
+static const struct libusb_interface_descriptor modem_if[] = {
+    {9, LIBUSB_DT_INTERFACE, 0, 0, 2, 0xff, 0x02, 0x12, 0, modem_eps[0], NULL, 0},
+    {9, LIBUSB_DT_INTERFACE, 1, 0, 2, 0xff, 0x02, 0x11, 0, modem_eps[1], NULL, 0},
+    {9, LIBUSB_DT_INTERFACE, 2, 0, 2, 0xff, 0x02, 0x13, 0, modem_eps[2], NULL, 0},
+};
+
+// CDC header, union (3 -> 4), Ethernet networking (iMACAddress 4, 1514 byte
+// segments) and NCM functional descriptors
+static const unsigned char ncm_functional[] = {
+    5, 0x24, 0x00, 0x10, 0x01,
+    5, 0x24, 0x06, SIM_NCM_IF, SIM_NCM_IF + 1,
+    13, 0x24, 0x0f, 4, 0, 0, 0, 0, 0xea, 0x05, 0, 0, 0,
+    6, 0x24, 0x1a, 0x00, 0x01, 0x00,
+};
+static const struct libusb_endpoint_descriptor ncm_notify_ep[] = {
+    {7, LIBUSB_DT_ENDPOINT, 0x86, LIBUSB_TRANSFER_TYPE_INTERRUPT, 16, 9, 0, 0, NULL, 0},
+};
+static const struct libusb_endpoint_descriptor ncm_data_eps[] = {SIM_EP(SIM_NCM_IN), SIM_EP(SIM_NCM_OUT)};
+static const struct libusb_interface_descriptor ncm_comm_if[] = {
+    {9, LIBUSB_DT_INTERFACE, SIM_NCM_IF, 0, 1, 0x02, 0x0d, 0x00, 0, ncm_notify_ep, ncm_functional,
+     (int)sizeof(ncm_functional)},
+};
+static const struct libusb_interface_descriptor ncm_data_if[] = {
+    {9, LIBUSB_DT_INTERFACE, SIM_NCM_IF + 1, 0, 0, 0x0a, 0x00, 0x01, 0, NULL, NULL, 0},
+    {9, LIBUSB_DT_INTERFACE, SIM_NCM_IF + 1, 1, 2, 0x0a, 0x00, 0x01, 0, ncm_data_eps, NULL, 0},
+};
+
+static const struct libusb_interface storage_ifaces[] = {{&storage_if[0], 1}};
+static const struct libusb_interface modem_ifaces[] = {
+    {&modem_if[0], 1}, {&modem_if[1], 1}, {&modem_if[2], 1}, {&ncm_comm_if[0], 1}, {&ncm_data_if[0], 2}
+};
+
+static const struct libusb_config_descriptor storage_config = {
+    9, LIBUSB_DT_CONFIG, 32, 1, 1, 0, 0x80, 250, storage_ifaces, NULL, 0
+};
+static const struct libusb_config_descriptor modem_config = {
+    9, LIBUSB_DT_CONFIG, 78, 3, 1, 0, 0x80, 250, modem_ifaces, NULL, 0
+};
+static const struct libusb_config_descriptor modem_ncm_config = {
+    9, LIBUSB_DT_CONFIG, 155, 5, 1, 0, 0x80, 250, modem_ifaces, NULL, 0
+};
+
+// Kernel drivers that bind on a fresh modem: option on the serial ports, cdc_ncm on the NCM pair
+static unsigned sim_modem_drivers(const struct sim_bus *bus) {
+    return bus->opt.ncm ? 0x1F : 0x7;
+}
+
+static void sim_device_init(struct sim_device *d, struct sim_stick *s, int modem) {
+    const struct sim_options *opt = &s->bus->opt;
+    
+    memset(d, 0, sizeof(*d));
+    d->stick = s;
+    d->modem = modem;
+    d->config = !modem ? &storage_config : opt->ncm ? &modem_ncm_config : &modem_config;
+    // usb-storage and option bind to everything they recognise
+    d->drivers = modem ? sim_modem_drivers(s->bus) : 0x1;
+    
+    d->desc.bLength = 18;
+    d->desc.bDescriptorType = LIBUSB_DT_DEVICE;
+    d->desc.bcdUSB = 0x0200;
+    d->desc.bMaxPacketSize0 = 64;
+    d->desc.idVendor = HUAWEI_VENDOR_ID;
+    d->desc.idProduct = modem ? opt->modem_pid : opt->zerocd_pid;
+    d->desc.bcdDevice = 0x0000;
+    d->desc.iManufacturer = 1;
+    d->desc.iProduct = 2;
+    d->desc.iSerialNumber = 3;
+    d->desc.bNumConfigurations = 1;
+}
+
+static void sim_modem_reset(struct sim_stick *s, uint64_t now) {
+    for (int i = 0; i < SIM_CHANNELS; i++) {
+        struct sim_channel *c = &s->chan[i];
+        c->stick = s;
+        c->urcs = i == 0;
+        c->echo = 1;
+        c->numeric = 0;
+        c->cmd_len = 0;
+        c->reply_len = 0;
+        c->reply_pos = 0;
+        c->next_urc = now + s->bus->opt.urc_us;
+        c->listing = 0;
+        c->text_len = -1;
+        c->ppp = 0;
+    }
+    s->rssi = 20;
+    s->rand = (unsigned)s->port * 2654435761u;
+    s->ncm.alt = 0;
+    s->ncm.ntb32 = 0;
+    s->ncm.in_size = SIM_NCM_IN_MAX;
+    s->ncm.head = s->ncm.tail = 0;
+    s->diag_start = now;
+    s->diag_seq = 0;
+    s->diag_len = s->diag_pos = 0;
+}
+
+static void sim_bus_reset(struct sim_bus *bus) {
+    uint64_t now = now_us();
+    
+    memset(bus->sticks, 0, sizeof(bus->sticks));
+    for (int i = 0; i < bus->opt.sticks; i++) {
+        struct sim_stick *s = &bus->sticks[i];
+        s->bus = bus;
+        s->port = i + 1;
+        snprintf(s->serial, sizeof(s->serial), "SIM%04d", i + 1);
+        snprintf(s->imei, sizeof(s->imei), "86000000000%04u", (unsigned)(i + 1) % 10000);
+        sim_device_init(&s->zerocd, s, 0);
+        sim_device_init(&s->modem, s, 1);
+        sim_modem_reset(s, now);
+        // Stored messages start out unread
+        memset(s->sms_stat, SIM_SMS_FREE, sizeof(s->sms_stat));
+        memset(s->sms_stat, 0, (size_t)bus->opt.sms);
+    }
+}
+
+// Parse "key=value,..." over the defaults; -1 with the reason in err
+static int sim_configure(struct sim_options *sim, const char *spec, char *err, size_t err_size) {
+    char buf[256];
+    char *save = NULL;
+    
+    *sim = sim_defaults;
+    snprintf(buf, sizeof(buf), "%s", spec ? spec : "");
+    for (char *key = strtok_r(buf, ",", &save); key; key = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(key, '=');
+        int bad = 0;
+        
+        if (!value) {
+            snprintf(err, err_size, "HUAWEI_SIM: expected key=value, got '%s'", key);
+            return -1;
+        }
+        *value++ = '\0';
+        
+        if (strcmp(key, "sticks") == 0) {
+            sim->sticks = atoi(value);
+            bad = sim->sticks < 1 || sim->sticks > SIM_MAX_STICKS;
+        } else if (strcmp(key, "start") == 0) {
+            sim->start_zerocd = strcmp(value, "zerocd") == 0;
+            bad = !sim->start_zerocd && strcmp(value, "modem") != 0;
+        } else if (strcmp(key, "zerocd") == 0) {
+            sim->zerocd_pid = (uint16_t)strtol(value, NULL, 16);
+        } else if (strcmp(key, "modem") == 0) {
+            sim->modem_pid = (uint16_t)strtol(value, NULL, 16);
+        } else if (strcmp(key, "method") == 0) {
+            int m = 0;
+            while (m < SIM_METHOD_COUNT && strcmp(sim_method_names[m], value) != 0) m++;
+            bad = m == SIM_METHOD_COUNT;
+            if (!bad) sim->method = (enum sim_method)m;
+        } else if (strcmp(key, "switch") == 0) {
+            sim->switch_us = (uint64_t)(atof(value) * 1000);
+        } else if (strcmp(key, "enum") == 0) {
+            sim->enum_us = (uint64_t)(atof(value) * 1000);
+        } else if (strcmp(key, "latency") == 0) {
+            sim->latency_us = (uint64_t)(atof(value) * 1000);
+        } else if (strcmp(key, "urc") == 0) {
+            sim->urc_us = (uint64_t)(atof(value) * 1000);
+        } else if (strcmp(key, "sms") == 0) {
+            sim->sms = atoi(value);
+            bad = sim->sms < 0 || sim->sms > SIM_SMS_MAX;
+        } else if (strcmp(key, "submit") == 0) {
+            sim->submit_us = (uint64_t)(atof(value) * 1000);
+        } else if (strcmp(key, "ncm") == 0) {
+            sim->ncm = atoi(value);
+            bad = sim->ncm != 0 && sim->ncm != 1;
+        } else if (strcmp(key, "diag") == 0) {
+            sim->diag = atoi(value);
+            bad = sim->diag < 0;
+        } else if (strcmp(key, "chunk") == 0) {
+            sim->chunk = atoi(value);
+            bad = sim->chunk < 1;
+        } else {
+            bad = 1;
+        }
+        
+        if (bad) {
+            snprintf(err, err_size, "HUAWEI_SIM: bad option '%s=%s'", key, value);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Answer cmd with info (NULL for none) and OK; a later call for the same command replaces it
+int huawei_usb_sim_script(libusb_context *ctx, const char *cmd, const char *info) {
+    struct sim_bus *bus = (struct sim_bus *)(void *)ctx;
+    int i = 0;
+    
+    pthread_mutex_lock(&bus->lock);
+    while (i < bus->nscript && strcasecmp(bus->script[i].cmd, cmd) != 0) i++;
+    if (i == SIM_SCRIPT_MAX) {
+        pthread_mutex_unlock(&bus->lock);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    if (i == bus->nscript) {
+        bus->script[bus->nscript++].cmd = strdup(cmd);
+    } else {
+        free(bus->script[i].info);
+    }
+    bus->script[i].info = info ? strdup(info) : NULL;
+    pthread_mutex_unlock(&bus->lock);
+    return 0;
+}
+
+/*
+ * Bus
+ */
+
+// The personality currently on the bus, NULL while the stick re-enumerates
+static struct sim_device *sim_present(struct sim_stick *s, uint64_t now) {
+    const struct sim_options *opt = &s->bus->opt;
+    
+    if (!opt->start_zerocd) return &s->modem;
+    if (!s->switched_us || now < s->switched_us + opt->switch_us) return &s->zerocd;
+    if (now >= s->switched_us + opt->switch_us + opt->enum_us) return &s->modem;
+    return NULL;
+}
+
+static int sim_attached(struct sim_device *d, uint64_t now) {
+    return sim_present(d->stick, now) == d;
+}
+
+// Returns 1 if the stick accepted the method and is now leaving the bus
+static int sim_switch(struct sim_device *d, enum sim_method method, uint64_t now) {
+    struct sim_stick *s = d->stick;
+    const struct sim_options *opt = &s->bus->opt;
+    
+    if (d->modem || s->switched_us) return 0;
+    if (opt->method != SIM_ANY && opt->method != method) return 0;
+    
+    s->switched_us = now;
+    s->modem.drivers = sim_modem_drivers(s->bus);
+    sim_modem_reset(s, now + opt->switch_us + opt->enum_us);
+    return 1;
+}
+
+// Called with the bus locked: the next sim_sleep_until() returns early
+static void sim_wake_sleepers(struct sim_bus *bus) {
+    char c = 0;
+    if (bus->sleepers > 0 && write(bus->wake[1], &c, 1) < 0) {
+        // Pipe full: a wakeup is pending anyway
+    }
+}
+
+// Sleep until when or until a transfer is submitted from another thread
+static void sim_sleep_until(struct sim_bus *bus, uint64_t when) {
+    uint64_t now = now_us();
+    char drain[64];
+    
+    if (when <= now) return;
+    pthread_mutex_lock(&bus->lock);
+    if (bus->wake[0] < 0 && pipe(bus->wake) == 0) {
+        fcntl(bus->wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(bus->wake[1], F_SETFL, O_NONBLOCK);
+    }
+    bus->sleepers++;
+    pthread_mutex_unlock(&bus->lock);
+    
+    if (bus->wake[0] < 0) {
+        usleep((useconds_t)(when - now));
+    } else {
+        fd_set fds;
+        struct timeval tv = {(time_t)((when - now) / 1000000), (suseconds_t)((when - now) % 1000000)};
+        FD_ZERO(&fds);
+        FD_SET(bus->wake[0], &fds);
+        if (select(bus->wake[0] + 1, &fds, NULL, NULL, &tv) > 0) {
+            while (read(bus->wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+    }
+    
+    pthread_mutex_lock(&bus->lock);
+    bus->sleepers--;
+    pthread_mutex_unlock(&bus->lock);
+}
+
+/*
+ * Modem AT dialogue
+ */
+
+static void sim_reply_data(struct sim_channel *c, const void *data, size_t len) {
+    if (c->reply_pos == c->reply_len) c->reply_len = c->reply_pos = 0;
+    if (len > sizeof(c->reply) - c->reply_len && c->reply_pos > 0) {
+        // A data mode stream never drains completely: move what is left to the front
+        memmove(c->reply, c->reply + c->reply_pos, c->reply_len - c->reply_pos);
+        c->reply_len -= c->reply_pos;
+        c->reply_pos = 0;
+    }
+    if (len > sizeof(c->reply) - c->reply_len) len = sizeof(c->reply) - c->reply_len;
+    memcpy(c->reply + c->reply_len, data, len);
+    c->reply_len += len;
+}
+
+static void sim_reply_add(struct sim_channel *c, const char *text) {
+    sim_reply_data(c, text, strlen(text));
+}
+
+static void sim_reply_info(struct sim_channel *c, const char *info) {
+    if (!c->numeric) sim_reply_add(c, "\r\n");
+    sim_reply_add(c, info);
+    sim_reply_add(c, "\r\n");
+}
+
+static void sim_reply_final(struct sim_channel *c, int ok) {
+    if (c->numeric) {
+        sim_reply_add(c, ok ? "0\r" : "4\r");
+    } else {
+        sim_reply_add(c, ok ? "\r\nOK\r\n" : "\r\nERROR\r\n");
+    }
+}
+
+// Fixed answers, matched case-insensitively against the whole command
+static const struct {
+    const char *cmd;
+    const char *info;
+} sim_answers[] = {
+    {"AT", NULL},
+    {"ATZ", NULL},
+    {"AT+CGMI", "huawei"},
+    {"AT+GMI", "huawei"},
+    {"AT+CGMR", "21.180.01.00.00"},
+    {"AT+GMR", "21.180.01.00.00"},
+    {"AT+CIMI", "262011234567890"},
+    {"AT+CPIN?", "+CPIN: READY"},
+    {"AT+CREG?", "+CREG: 0,1"},
+    {"AT+CGREG?", "+CGREG: 0,1"},
+    {"AT+CEREG?", "+CEREG: 0,1"},
+    {"AT+COPS?", "+COPS: 0,0,\"Simulated\",7"},
+    {"AT+CFUN?", "+CFUN: 1"},
+    {"AT^SYSINFOEX", "^SYSINFOEX: 2,3,0,1,,6,\"LTE\",101,\"LTE\""},
+    {"AT^DHCP?", "^DHCP: 8c6a0a0a,f8ffffff,896a0a0a,896a0a0a,0201a8c0,0401a8c0,150000000,50000000"},
+    {"AT^NDISSTATQRY?", "^NDISSTATQRY: 1,,,\"IPV4\""},
+};
+
+// Set commands that are accepted and ignored
+static const char *sim_settable[] = {
+    "AT+CMEE=", "AT+CREG=", "AT+CGREG=", "AT+CEREG=", "AT+CFUN=", "AT^CURC=", "AT+CMGF=", "AT+CNMI=",
+    "AT^NDISDUP=", "AT+CGDCONT=", NULL
+};
+
+static void sim_reply_cms(struct sim_channel *c, int code) {
+    char text[32];
+    
+    snprintf(text, sizeof(text), c->numeric ? "+CMS ERROR: %d\r" : "\r\n+CMS ERROR: %d\r\n", code);
+    sim_reply_add(c, text);
+}
+
+/*
+ * SMS store
+ *
+ * Slot i holds one of four canned SMS-DELIVER PDUs (i % 4): GSM 7-bit with
+ * extension characters, UCS2 with a surrogate pair, and the two halves of a
+ * concatenated message whose reference changes every four slots. Only the
+ * status of each slot is stored.
+ */
+
+static const char *sim_sms_pdus[4] = {
+    "07911326040000F0040C9194711032547600006201619021308042C8329BFD0699E5EF36888E2E83E6E9769D1DA697C9A0F69B5C"
+    "6EEB40B54D19B441BDD79B14C82B2ECB411B9E581E1EAFCBF4F9C607DA50221B0A",
+    "07911326040000F0040B919700214365F70008620161902130802E041F04400438043204350442002004380437002004410438043C"
+    "0443043B044F0442043E044004300020D83DDC4B",
+    "07911326040000F0440CD0C87AF85E4E03000062016190213080A0050003%02X0201A8E8F41C949E83C2A0F1DB3D0ED3CBEE30BD"
+    "4C06B5CBF379F85C0699E5EF36888E2E83E6E9769D1DA697C9A0F69B5C6EBB40493A283D07B1DFEE33A8EC7ED7CF6810FD0D7297"
+    "CB6410FDFE06C1C372FA9C059ABF41747419C44ECFE969F719840ECF41F437085EA783E8E8721B240E8FD720FAFB5CA6A3CB7250"
+    "DA0D7ACBC96539485C36BFE5",
+    "07911326040000F0440CD0C87AF85E4E030000620161902130805D050003%02X0202CA20B83CEDA6A7DD6717888A2E83E6E5F1DB"
+    "4D06C1C3723A684E0FCBE973D0FCDD2EDFD16579191496BFEB6E32085D969741613719547693E7A07B9A8E068541E5BAFC0D9AA7"
+    "CF6E1D685306"
+};
+
+// TPDU octets of a hex PDU, the SMSC address not counted
+static int sim_sms_tpdu_len(const char *hex) {
+    unsigned smsc = 0;
+    
+    if (sscanf(hex, "%2x", &smsc) != 1) return -1;
+    return (int)(strlen(hex) / 2) - 1 - (int)smsc;
+}
+
+// "+CMGL: <index>,<stat>,,<length>" or "+CMGR: <stat>,,<length>", then the PDU
+static void sim_sms_entry(struct sim_channel *c, int slot, int listing) {
+    char pdu[SIM_CMD_MAX];
+    char info[SIM_CMD_MAX + 64];
+    
+    snprintf(pdu, sizeof(pdu), sim_sms_pdus[slot % 4], (slot / 4) & 0xFF);
+    if (listing) {
+        snprintf(info, sizeof(info), "+CMGL: %d,%d,,%d\r\n%s", slot, c->stick->sms_stat[slot], sim_sms_tpdu_len(pdu),
+                 pdu);
+    } else {
+        snprintf(info, sizeof(info), "+CMGR: %d,,%d\r\n%s", c->stick->sms_stat[slot], sim_sms_tpdu_len(pdu), pdu);
+    }
+    sim_reply_info(c, info);
+    if (c->stick->sms_stat[slot] == 0) c->stick->sms_stat[slot] = 1;     // REC UNREAD -> REC READ
+}
+
+// Queue the next stretch of AT+CMGL output; the store may not fit the reply buffer
+static void sim_sms_list_more(struct sim_channel *c) {
+    if (c->reply_pos == c->reply_len) c->reply_len = c->reply_pos = 0;
+    
+    while (c->list_next < SIM_SMS_MAX && c->reply_len + 1024 < sizeof(c->reply)) {
+        int slot = c->list_next++;
+        int stat = c->stick->sms_stat[slot];
+        if (stat != SIM_SMS_FREE && (c->list_stat == 4 || c->list_stat == stat)) sim_sms_entry(c, slot, 1);
+    }
+    if (c->list_next == SIM_SMS_MAX) {
+        c->listing = 0;
+        sim_reply_final(c, 1);
+    }
+}
+
+// AT+CMGD=<index>[,<flag>]: flags 1-4 delete read, +sent, +unsent, everything
+static int sim_sms_delete(struct sim_channel *c, const char *args) {
+    const char *comma = strchr(args, ',');
+    int slot = atoi(args);
+    int flag = comma ? atoi(comma + 1) : 0;
+    
+    if (flag == 0) {
+        if (slot < 0 || slot >= SIM_SMS_MAX) return 0;
+        c->stick->sms_stat[slot] = SIM_SMS_FREE;
+        return 1;
+    }
+    for (int i = 0; i < SIM_SMS_MAX; i++) {
+        int stat = c->stick->sms_stat[i];
+        if (flag >= 4 || stat == 1 || (flag >= 2 && stat == 3) || (flag >= 3 && stat == 2)) {
+            c->stick->sms_stat[i] = SIM_SMS_FREE;
+        }
+    }
+    return 1;
+}
+
+// Ctrl-Z after the "> " prompt submits the PDU collected in cmd, ESC drops it
+static void sim_sms_submit(struct sim_channel *c, int send, uint64_t now) {
+    const struct sim_options *opt = &c->stick->bus->opt;
+    char info[32];
+    int expected = c->text_len;
+    
+    c->text_len = -1;
+    c->cmd[c->cmd_len] = '\0';
+    if (c->reply_pos == c->reply_len) c->reply_at = now + opt->latency_us + (send ? opt->submit_us : 0);
+    if (c->echo) sim_reply_add(c, c->cmd);
+    
+    if (!send) {
+        sim_reply_final(c, 1);
+    } else if (c->cmd_len % 2 || strspn(c->cmd, "0123456789ABCDEFabcdef") != c->cmd_len ||
+               sim_sms_tpdu_len(c->cmd) != expected) {
+        sim_reply_cms(c, 304);      // invalid PDU mode parameter
+    } else {
+        snprintf(info, sizeof(info), "+CMGS: %u", c->stick->mr++ & 0xFF);
+        sim_reply_info(c, info);
+        sim_reply_final(c, 1);
+    }
+}
+
+/*
+ * PPP peer
+ */
+
+static void sim_ppp_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t sim_ppp_get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Frame a packet (protocol, then the rest) into the reply; LCP with every control character escaped
+static void sim_ppp_send(struct sim_channel *c, uint16_t proto, const uint8_t *data, size_t len) {
+    uint8_t f[SIM_PPP_FRAME_MAX + 4], out[HDLC_ENCODED_MAX(SIM_PPP_FRAME_MAX + 4)];
+    
+    if (len > SIM_PPP_FRAME_MAX) return;
+    f[0] = 0xff;
+    f[1] = 0x03;
+    f[2] = (uint8_t)(proto >> 8);
+    f[3] = (uint8_t)proto;
+    memcpy(f + 4, data, len);
+    sim_reply_data(c, out, hdlc_encode(out, f, len + 4, proto == 0xc021 ? HDLC_ACCM_ALL : c->ppp_accm));
+}
+
+static void sim_ppp_cp(struct sim_channel *c, uint16_t proto, uint8_t code, uint8_t id, const uint8_t *data,
+                       size_t len) {
+    uint8_t p[SIM_PPP_FRAME_MAX];
+    
+    if (len > sizeof(p) - 4) return;
+    p[0] = code;
+    p[1] = id;
+    p[2] = (uint8_t)((len + 4) >> 8);
+    p[3] = (uint8_t)(len + 4);
+    if (len) memcpy(p + 4, data, len);
+    sim_ppp_send(c, proto, p, len + 4);
+}
+
+// ATD*99#: CONNECT, then our LCP request (empty ACCM, PAP, magic number)
+static void sim_ppp_connect(struct sim_channel *c) {
+    static const uint8_t lcp[] = {2, 6, 0, 0, 0, 0, 3, 4, 0xc0, 0x23, 5, 6, 0x53, 0x49, 0x57, 0x4d};
+    
+    sim_reply_add(c, "\r\nCONNECT 150000000\r\n");
+    c->ppp = 1;
+    c->ppp_accm = HDLC_ACCM_ALL;
+    hdlc_rx_init(&c->ppp_rx, c->ppp_frame, sizeof(c->ppp_frame));
+    sim_ppp_cp(c, 0xc021, 1, ++c->ppp_id, lcp, sizeof(lcp));
+}
+
+static void sim_ppp_hangup(struct sim_channel *c) {
+    c->ppp = 0;
+    c->cmd_len = 0;
+    sim_reply_add(c, "\r\nNO CARRIER\r\n");
+}
+
+// Address or DNS server options left at 0.0.0.0 get a Nak with ours; anything else is rejected
+static void sim_ppp_ipcp_request(struct sim_channel *c, uint8_t id, const uint8_t *o, size_t len) {
+    uint8_t nak[SIM_PPP_FRAME_MAX], rej[SIM_PPP_FRAME_MAX];
+    size_t nnak = 0, nrej = 0;
+    
+    for (size_t i = 0; i + 2 <= len && o[i + 1] >= 2 && i + o[i + 1] <= len; i += o[i + 1]) {
+        uint8_t type = o[i], olen = o[i + 1];
+        uint32_t want = type == 3 ? 0x0a400001u + (uint32_t)c->stick->port : type == 129 ? 0x0a0b0c0du :
+                        0x0a0b0c0eu;
+        
+        if ((type != 3 && type != 129 && type != 131) || olen != 6) {
+            memcpy(rej + nrej, o + i, olen);
+            nrej += olen;
+        } else if (sim_ppp_get32(o + i + 2) == 0) {
+            nak[nnak] = type;
+            nak[nnak + 1] = 6;
+            sim_ppp_put32(nak + nnak + 2, want);
+            nnak += 6;
+        }
+    }
+    if (nrej) {
+        sim_ppp_cp(c, 0x8021, 4, id, rej, nrej);
+    } else if (nnak) {
+        sim_ppp_cp(c, 0x8021, 3, id, nak, nnak);
+    } else {
+        sim_ppp_cp(c, 0x8021, 2, id, o, len);
+    }
+}
+
+// A frame from the host with a good FCS
+static void sim_ppp_frame(void *opaque, uint8_t *f, size_t len) {
+    struct sim_channel *c = opaque;
+    static const uint8_t ipcp[] = {3, 6, 10, 64, 0, 1};
+    
+    if (len >= 2 && f[0] == 0xff && f[1] == 0x03) {
+        f += 2;
+        len -= 2;
+    }
+    if (len < 2 || !c->ppp) return;
+    uint16_t proto = (uint16_t)(f[0] << 8 | f[1]);
+    uint8_t *p = f + 2;
+    size_t plen = len - 2;
+    
+    if (proto == 0x0021 && plen >= 20) {
+        // Back where it came from: swapping addresses leaves the header checksum as it is
+        uint8_t a[4];
+        memcpy(a, p + 12, 4);
+        memcpy(p + 12, p + 16, 4);
+        memcpy(p + 16, a, 4);
+        sim_ppp_send(c, proto, p, plen);
+        return;
+    }
+    if (plen < 4) return;
+    
+    uint8_t code = p[0], id = p[1];
+    size_t dlen = (size_t)(p[2] << 8 | p[3]);
+    if (dlen < 4 || dlen > plen) return;
+    uint8_t *d = p + 4;
+    dlen -= 4;
+    
+    if (proto == 0xc021) {
+        if (code == 1) {
+            c->ppp_accm = HDLC_ACCM_ALL;
+            for (size_t i = 0; i + 6 <= dlen && d[i + 1] >= 2; i += d[i + 1]) {
+                if (d[i] == 2 && d[i + 1] == 6) c->ppp_accm = sim_ppp_get32(d + i + 2);
+            }
+            sim_ppp_cp(c, proto, 2, id, d, dlen);
+        } else if (code == 5) {
+            sim_ppp_cp(c, proto, 6, id, NULL, 0);
+            sim_ppp_hangup(c);
+        } else if (code == 9 && dlen >= 4) {
+            sim_ppp_put32(d, SIM_PPP_MAGIC);
+            sim_ppp_cp(c, proto, 10, id, d, dlen);
+        }
+    } else if (proto == 0xc023 && code == 1) {
+        // Any user name and password will do; IPCP follows
+        sim_ppp_cp(c, proto, 2, id, (const uint8_t *)"", 1);
+        sim_ppp_cp(c, 0x8021, 1, ++c->ppp_id, ipcp, sizeof(ipcp));
+    } else if (proto == 0x8021 && code == 1) {
+        sim_ppp_ipcp_request(c, id, d, dlen);
+    } else if (proto == 0x8021 && code == 5) {
+        sim_ppp_cp(c, proto, 6, id, NULL, 0);
+    }
+}
+
+static void sim_modem_command(struct sim_channel *c, const char *cmd, uint64_t now) {
+    struct sim_bus *bus = c->stick->bus;
+    char info[256];
+    int ok = 1;
+    
+    if (c->reply_pos == c->reply_len) c->reply_at = now + bus->opt.latency_us;
+    if (c->echo) {
+        sim_reply_add(c, cmd);
+        sim_reply_add(c, "\r");
+    }
+    
+    for (int i = 0; i < bus->nscript; i++) {
+        if (strcasecmp(cmd, bus->script[i].cmd) == 0) {
+            if (bus->script[i].info) sim_reply_info(c, bus->script[i].info);
+            sim_reply_final(c, 1);
+            return;
+        }
+    }
+    
+    if (strcasecmp(cmd, "ATE0") == 0 || strcasecmp(cmd, "ATE1") == 0) {
+        c->echo = cmd[3] == '1';
+    } else if (strcasecmp(cmd, "ATV0") == 0 || strcasecmp(cmd, "ATV1") == 0) {
+        c->numeric = cmd[3] == '0';
+    } else if (strcasecmp(cmd, "ATI") == 0) {
+        snprintf(info, sizeof(info), "Manufacturer: huawei\r\nModel: %s\r\nRevision: 21.180.01.00.00\r\n"
+                 "IMEI: %s\r\n+GCAP: +CGSM,+DS,+ES", huawei_pid_name(bus->opt.modem_pid), c->stick->imei);
+        sim_reply_info(c, info);
+    } else if (strcasecmp(cmd, "AT+CGMM") == 0 || strcasecmp(cmd, "AT+GMM") == 0) {
+        sim_reply_info(c, huawei_pid_name(bus->opt.modem_pid));
+    } else if (strcasecmp(cmd, "AT+CGSN") == 0 || strcasecmp(cmd, "AT+GSN") == 0) {
+        sim_reply_info(c, c->stick->imei);
+    } else if (strcasecmp(cmd, "AT+CSQ") == 0 || strcasecmp(cmd, "AT^HCSQ?") == 0) {
+        struct sim_stick *s = c->stick;
+        s->rand = s->rand * 1103515245 + 12345;
+        s->rssi += (int)((s->rand >> 16) % 3) - 1;
+        if (s->rssi < 10 || s->rssi > 28) s->rssi = 20;
+        if (cmd[3] == 'C' || cmd[3] == 'c') {
+            snprintf(info, sizeof(info), "+CSQ: %d,99", s->rssi);
+        } else {
+            snprintf(info, sizeof(info), "^HCSQ: \"LTE\",%d,%d,%d,%d", s->rssi * 2 + 12, s->rssi * 2 + 1,
+                     120 + (s->rssi - 20) * 5, 24 + (s->rssi - 20) / 2);
+        }
+        sim_reply_info(c, info);
+    } else if (strncasecmp(cmd, "AT+CMGL", 7) == 0) {
+        c->list_stat = cmd[7] == '=' ? atoi(cmd + 8) : 0;
+        if (c->list_stat < 0 || c->list_stat > 4) {
+            sim_reply_cms(c, 302);
+            return;
+        }
+        c->listing = 1;
+        c->list_next = 0;
+        sim_sms_list_more(c);
+        return;
+    } else if (strncasecmp(cmd, "AT+CMGR=", 8) == 0) {
+        int slot = atoi(cmd + 8);
+        if (slot < 0 || slot >= SIM_SMS_MAX || c->stick->sms_stat[slot] == SIM_SMS_FREE) {
+            sim_reply_cms(c, 321);  // invalid memory index
+            return;
+        }
+        sim_sms_entry(c, slot, 0);
+    } else if (strncasecmp(cmd, "AT+CMGD=", 8) == 0) {
+        ok = sim_sms_delete(c, cmd + 8);
+    } else if (strncasecmp(cmd, "ATD", 3) == 0 && strstr(cmd, "*99")) {
+        sim_ppp_connect(c);
+        return;
+    } else if (strncasecmp(cmd, "AT+CMGS=", 8) == 0) {
+        c->text_len = atoi(cmd + 8);
+        sim_reply_add(c, "\r\n> ");
+        return;
+    } else {
+        size_t i;
+        for (i = 0; i < sizeof(sim_answers) / sizeof(sim_answers[0]); i++) {
+            if (strcasecmp(cmd, sim_answers[i].cmd) == 0) break;
+        }
+        if (i < sizeof(sim_answers) / sizeof(sim_answers[0])) {
+            if (sim_answers[i].info) sim_reply_info(c, sim_answers[i].info);
+        } else {
+            ok = 0;
+            for (i = 0; sim_settable[i] && !ok; i++) {
+                ok = strncasecmp(cmd, sim_settable[i], strlen(sim_settable[i])) == 0;
+            }
+        }
+    }
+    
+    sim_reply_final(c, ok);
+}
+
+static void sim_modem_write(struct sim_channel *c, const unsigned char *data, int len, uint64_t now) {
+    if (c->ppp) {
+        // The escape sequence on its own goes back to AT mode with the call still up; hang up as well
+        if (len == 3 && memcmp(data, "+++", 3) == 0) {
+            sim_ppp_hangup(c);
+        } else {
+            hdlc_rx_feed(&c->ppp_rx, data, (size_t)len, sim_ppp_frame, c);
+        }
+        return;
+    }
+    for (int i = 0; i < len; i++) {
+        if (c->text_len >= 0) {
+            if (data[i] == 0x1A || data[i] == 0x1B) {
+                sim_sms_submit(c, data[i] == 0x1A, now);
+                c->cmd_len = 0;
+            } else if (data[i] != '\r' && data[i] != '\n' && c->cmd_len < sizeof(c->cmd) - 1) {
+                c->cmd[c->cmd_len++] = (char)data[i];
+            }
+        } else if (data[i] == '\r') {
+            c->cmd[c->cmd_len] = '\0';
+            if (c->cmd_len > 0) sim_modem_command(c, c->cmd, now);
+            c->cmd_len = 0;
+        } else if (data[i] != '\n' && c->cmd_len < sizeof(c->cmd) - 1) {
+            c->cmd[c->cmd_len++] = (char)data[i];
+        }
+    }
+}
+
+// Unsolicited results go out between replies, never inside one
+static void sim_modem_urc(struct sim_channel *c, uint64_t now) {
+    static const char *urcs[] = {"^RSSI: 20", "^HCSQ: \"LTE\",52,41,120,24", "+CREG: 1", "^MODE: 7,17"};
+    uint64_t urc_us = c->stick->bus->opt.urc_us;
+    
+    if (!c->urcs || !urc_us || now < c->next_urc || c->reply_pos != c->reply_len || c->listing ||
+        c->text_len >= 0 || c->ppp) {
+        return;
+    }
+    
+    sim_reply_info(c, urcs[c->urc_seq++ % (sizeof(urcs) / sizeof(urcs[0]))]);
+    c->reply_at = now;
+    c->next_urc = now + urc_us;
+}
+
+// Copy out up to one chunk of reply that is due; returns the bytes copied
+static int sim_modem_read(struct sim_channel *c, unsigned char *buf, int len, uint64_t now) {
+    sim_modem_urc(c, now);
+    if (c->listing && c->reply_pos == c->reply_len) sim_sms_list_more(c);
+    if (c->reply_pos == c->reply_len || now < c->reply_at) return 0;
+    
+    size_t n = c->reply_len - c->reply_pos;
+    if (n > (size_t)len) n = (size_t)len;
+    if (n > (size_t)c->stick->bus->opt.chunk) n = (size_t)c->stick->bus->opt.chunk;
+    memcpy(buf, c->reply + c->reply_pos, n);
+    c->reply_pos += n;
+    return (int)n;
+}
+
+// When sim_modem_read() will next have something, UINT64_MAX if never
+static uint64_t sim_modem_next(struct sim_channel *c) {
+    uint64_t next = UINT64_MAX;
+    
+    if (c->reply_pos != c->reply_len || c->listing) next = c->reply_at;
+    else if (c->urcs && c->stick->bus->opt.urc_us) next = c->next_urc;
+    return next;
+}
+
+// Which switch method a mass storage CBW carries, -1 if none
+static int sim_cbw_method(const unsigned char *d, int len) {
+    if (len < 31 || memcmp(d, "USBC", 4) != 0) return -1;
+    
+    const unsigned char *cdb = d + 15;
+    if (cdb[0] == 0x11 && cdb[1] == 0x06) return cdb[2] == 0x20 ? SIM_HUAWEI_MSG : SIM_HUAWEI_MSG2;
+    if (cdb[0] == 0x1b && (cdb[4] & 0x02)) return SIM_EJECT;
+    return -1;
+}
+
+static int sim_has_endpoint(struct sim_device *d, unsigned char endpoint) {
+    for (int i = 0; i < d->config->bNumInterfaces; i++) {
+        const struct libusb_interface *iface = &d->config->interface[i];
+        for (int j = 0; j < iface->num_altsetting; j++) {
+            const struct libusb_interface_descriptor *setting = &iface->altsetting[j];
+            for (int k = 0; k < setting->bNumEndpoints; k++) {
+                if (setting->endpoint[k].bEndpointAddress == endpoint) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * NCM loopback
+ */
+
+static int sim_ncm_endpoint(struct sim_device *d, unsigned char endpoint) {
+    return d->modem && d->stick->bus->opt.ncm && (endpoint == SIM_NCM_IN || endpoint == SIM_NCM_OUT);
+}
+
+static void sim_ncm_count(void *opaque, uint8_t *data, size_t len) {
+    (void)opaque;
+    (void)data;
+    (void)len;
+}
+
+// A block from the host: 1 = taken (queued, or dropped as a real function
+// would drop garbage or a block too big to send back), 0 = no room yet, the
+// transfer stays pending
+static int sim_ncm_push(struct sim_ncm *n, const unsigned char *data, int len) {
+    uint32_t sign = len >= 4 ? ncm_get32(data) : 0;
+    
+    if (n->head - n->tail == SIM_NCM_RING) return 0;
+    if (sign != (n->ntb32 ? NCM_NTH32_SIGN : NCM_NTH16_SIGN) || (size_t)len > n->in_size ||
+        ncm_parse((uint8_t *)(uintptr_t)data, (size_t)len, sim_ncm_count, NULL) <= 0) {
+        return 1;
+    }
+    
+    unsigned slot = n->head % SIM_NCM_RING;
+    if (!n->ring[slot]) n->ring[slot] = malloc(SIM_NCM_IN_MAX);
+    if (!n->ring[slot]) return 1;
+    memcpy(n->ring[slot], data, (size_t)len);
+    n->len[slot] = (size_t)len;
+    n->head++;
+    return 1;
+}
+
+// Next block back to the host, 0 if none is waiting
+static int sim_ncm_pop(struct sim_ncm *n, unsigned char *buf, int len) {
+    if (n->head == n->tail) return 0;
+    
+    unsigned slot = n->tail++ % SIM_NCM_RING;
+    size_t copy = n->len[slot] < (size_t)len ? n->len[slot] : (size_t)len;
+    memcpy(buf, n->ring[slot], copy);
+    return (int)copy;
+}
+
+/*
+ * Diagnostic stream
+ */
+
+static int sim_diag_endpoint(struct sim_device *d, unsigned char endpoint) {
+    return d->modem && d->stick->bus->opt.diag && endpoint == SIM_DIAG_IN;
+}
+
+static uint64_t sim_diag_due(struct sim_stick *s) {
+    return s->diag_start + s->diag_seq * 1000000 / (uint64_t)s->bus->opt.diag;
+}
+
+// The next log packet (DIAG_LOG_F: command, more, length twice, log code,
+// timestamp, then a sequence number and filler), framed
+static void sim_diag_packet(struct sim_stick *s) {
+    static const uint16_t codes[] = {0xb0c0, 0xb193, 0xb063, 0x4127};
+    uint8_t p[SIM_DIAG_PACKET_MAX];
+    
+    s->rand = s->rand * 1103515245 + 12345;
+    size_t len = 24 + (s->rand >> 16) % (SIM_DIAG_PACKET_MAX - 24);
+    uint64_t ts = s->diag_seq * 52429;
+    
+    p[0] = 0x10;
+    p[1] = 0;
+    p[2] = p[4] = (uint8_t)(len - 4);
+    p[3] = p[5] = (uint8_t)((len - 4) >> 8);
+    p[6] = (uint8_t)codes[s->diag_seq % 4];
+    p[7] = (uint8_t)(codes[s->diag_seq % 4] >> 8);
+    for (int i = 0; i < 8; i++) p[8 + i] = (uint8_t)(ts >> (8 * i));
+    for (int i = 0; i < 4; i++) p[16 + i] = (uint8_t)(s->diag_seq >> (8 * i));
+    for (size_t i = 20; i < len; i++) p[i] = (uint8_t)(i * 7 + s->diag_seq);
+    
+    // No opening flag on this port
+    s->diag_len = hdlc_encode(s->diag_out, p, len, 0) - 1;
+    memmove(s->diag_out, s->diag_out + 1, s->diag_len);
+    s->diag_pos = 0;
+    s->diag_seq++;
+}
+
+// Copy out the packets that are due; returns the bytes copied
+static int sim_diag_read(struct sim_stick *s, unsigned char *buf, int len, uint64_t now) {
+    int n = 0;
+    
+    if (now > sim_diag_due(s) + SIM_DIAG_BACKLOG_US) {
+        s->diag_start = now - SIM_DIAG_BACKLOG_US - s->diag_seq * 1000000 / (uint64_t)s->bus->opt.diag;
+    }
+    while (n < len) {
+        if (s->diag_pos == s->diag_len) {
+            if (now < sim_diag_due(s)) break;
+            sim_diag_packet(s);
+        }
+        size_t copy = s->diag_len - s->diag_pos;
+        if (copy > (size_t)(len - n)) copy = (size_t)(len - n);
+        memcpy(buf + n, s->diag_out + s->diag_pos, copy);
+        s->diag_pos += copy;
+        n += (int)copy;
+    }
+    return n;
+}
+
+static uint64_t sim_diag_next(struct sim_stick *s) {
+    return s->diag_pos != s->diag_len ? 0 : sim_diag_due(s);
+}
+
+// The AT channel behind a modem endpoint: interface n has endpoints n + 1;
+// NULL for the diagnostic interface and in ZeroCD mode
+static struct sim_channel *sim_channel(struct sim_device *d, unsigned char endpoint) {
+    int i = (endpoint & 0x0F) - 1;
+    return d->modem && i >= 0 && i < SIM_CHANNELS ? &d->stick->chan[i] : NULL;
+}
+
+static void sim_write(struct sim_device *d, unsigned char endpoint, const unsigned char *data, int len,
+                      uint64_t now) {
+    if (d->modem) {
+        struct sim_channel *c = sim_channel(d, endpoint);
+        if (c) sim_modem_write(c, data, len, now);
+    } else {
+        int m = sim_cbw_method(data, len);
+        if (m >= 0) sim_switch(d, (enum sim_method)m, now);
+    }
+}
+
+/*
+ * usb_transport entry points
+ */
+
+#define SIM_BUS(ctx)        ((struct sim_bus *)(void *)(ctx))
+#define SIM_DEV(dev)        ((struct sim_device *)(void *)(dev))
+#define SIM_HANDLE(h)       ((struct sim_handle *)(void *)(h))
+
+int huawei_usb_sim_open(libusb_context **ctx, const char *spec, char *err, size_t err_size) {
+    struct sim_options opt;
+    
+    *ctx = NULL;
+    if (sim_configure(&opt, spec, err, err_size) < 0) return LIBUSB_ERROR_INVALID_PARAM;
+    
+    struct sim_bus *bus = calloc(1, sizeof(*bus));
+    if (!bus) return LIBUSB_ERROR_NO_MEM;
+    bus->opt = opt;
+    bus->wake[0] = bus->wake[1] = -1;
+    pthread_mutex_init(&bus->lock, NULL);
+    sim_bus_reset(bus);
+    *ctx = (libusb_context *)(void *)bus;
+    return 0;
+}
+
+// The transport's own init: a bus with the default options
+static int sim_init(libusb_context **ctx) {
+    return huawei_usb_sim_open(ctx, NULL, NULL, 0);
+}
+
+static void sim_exit(libusb_context *ctx) {
+    struct sim_bus *bus = SIM_BUS(ctx);
+    
+    if (!bus) return;
+    for (int i = 0; i < bus->nscript; i++) {
+        free(bus->script[i].cmd);
+        free(bus->script[i].info);
+    }
+    for (int i = 0; i < SIM_MAX_STICKS; i++) {
+        for (int j = 0; j < SIM_NCM_RING; j++) free(bus->sticks[i].ncm.ring[j]);
+    }
+    if (bus->wake[0] >= 0) {
+        close(bus->wake[0]);
+        close(bus->wake[1]);
+    }
+    pthread_mutex_destroy(&bus->lock);
+    free(bus);
+}
+
+static ssize_t sim_get_device_list(libusb_context *ctx, libusb_device ***list) {
+    struct sim_bus *bus = SIM_BUS(ctx);
+    uint64_t now = now_us();
+    ssize_t n = 0;
+    
+    *list = calloc(SIM_MAX_STICKS + 1, sizeof(**list));
+    if (!*list) return LIBUSB_ERROR_NO_MEM;
+    
+    pthread_mutex_lock(&bus->lock);
+    for (int i = 0; i < bus->opt.sticks; i++) {
+        struct sim_device *d = sim_present(&bus->sticks[i], now);
+        if (d) (*list)[n++] = (libusb_device *)(void *)d;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return n;
+}
+
+static void sim_free_device_list(libusb_device **list, int unref) {
+    (void)unref;
+    free(list);
+}
+
+static libusb_device *sim_ref_device(libusb_device *dev) {
+    return dev;
+}
+
+static void sim_unref_device(libusb_device *dev) {
+    (void)dev;
+}
+
+static int sim_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) {
+    *desc = SIM_DEV(dev)->desc;
+    return 0;
+}
+
+static int sim_get_active_config_descriptor(libusb_device *dev, struct libusb_config_descriptor **config) {
+    *config = (struct libusb_config_descriptor *)SIM_DEV(dev)->config;
+    return 0;
+}
+
+static void sim_free_config_descriptor(struct libusb_config_descriptor *config) {
+    (void)config;
+}
+
+static uint8_t sim_get_bus_number(libusb_device *dev) {
+    (void)dev;
+    return 0;
+}
+
+static int sim_get_port_numbers(libusb_device *dev, uint8_t *ports, int len) {
+    if (len < 2) return LIBUSB_ERROR_OVERFLOW;
+    ports[0] = 1;
+    ports[1] = (uint8_t)SIM_DEV(dev)->stick->port;
+    return 2;
+}
+
+static int sim_open(libusb_device *dev, libusb_device_handle **handle) {
+    struct sim_handle *h;
+    
+    if (!sim_attached(SIM_DEV(dev), now_us())) return LIBUSB_ERROR_NO_DEVICE;
+    h = calloc(1, sizeof(*h));
+    if (!h) return LIBUSB_ERROR_NO_MEM;
+    h->dev = SIM_DEV(dev);
+    *handle = (libusb_device_handle *)(void *)h;
+    return 0;
+}
+
+static void sim_close(libusb_device_handle *handle) {
+    free(handle);
+}
+
+static libusb_device *sim_get_device(libusb_device_handle *handle) {
+    return (libusb_device *)(void *)SIM_HANDLE(handle)->dev;
+}
+
+static int sim_claim_interface(libusb_device_handle *handle, int interface) {
+    struct sim_handle *h = SIM_HANDLE(handle);
+    struct sim_bus *bus = h->dev->stick->bus;
+    int r = 0;
+    
+    pthread_mutex_lock(&bus->lock);
+    if (!sim_attached(h->dev, now_us())) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (interface < 0 || interface >= h->dev->config->bNumInterfaces) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else if (h->dev->drivers & (1u << interface)) {
+        r = LIBUSB_ERROR_BUSY;
+    } else {
+        h->claimed |= 1u << interface;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return r;
+}
+
+static int sim_release_interface(libusb_device_handle *handle, int interface) {
+    struct sim_handle *h = SIM_HANDLE(handle);
+    
+    if (interface < 0 || !(h->claimed & (1u << interface))) return LIBUSB_ERROR_NOT_FOUND;
+    h->claimed &= ~(1u << interface);
+    return 0;
+}
+
+static int sim_set_interface_alt_setting(libusb_device_handle *handle, int interface, int alt_setting) {
+    struct sim_handle *h = SIM_HANDLE(handle);
+    struct sim_bus *bus = h->dev->stick->bus;
+    int r = 0;
+    
+    pthread_mutex_lock(&bus->lock);
+    if (!sim_attached(h->dev, now_us())) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (interface < 0 || !(h->claimed & (1u << interface))) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else if (interface == SIM_NCM_IF + 1 && h->dev->modem && bus->opt.ncm && (alt_setting == 0 || alt_setting == 1)) {
+        // Leaving the running setting resets the function
+        struct sim_ncm *n = &h->dev->stick->ncm;
+        n->alt = alt_setting;
+        n->head = n->tail = 0;
+    } else if (alt_setting != 0) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return r;
+}
+
+static int sim_kernel_driver_active(libusb_device_handle *handle, int interface) {
+    struct sim_handle *h = SIM_HANDLE(handle);
+    
+    if (!sim_attached(h->dev, now_us())) return LIBUSB_ERROR_NO_DEVICE;
+    if (interface < 0 || interface >= h->dev->config->bNumInterfaces) return LIBUSB_ERROR_NOT_FOUND;
+    return (h->dev->drivers >> interface) & 1;
+}
+
+static int sim_detach_kernel_driver(libusb_device_handle *handle, int interface) {
+    struct sim_handle *h = SIM_HANDLE(handle);
+    struct sim_bus *bus = h->dev->stick->bus;
+    int r = LIBUSB_ERROR_NOT_FOUND;
+    
+    pthread_mutex_lock(&bus->lock);
+    if (!sim_attached(h->dev, now_us())) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (interface >= 0 && (h->dev->drivers & (1u << interface))) {
+        h->dev->drivers &= ~(1u << interface);
+        r = 0;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return r;
+}
+
+static int sim_set_configuration(libusb_device_handle *handle, int config) {
+    struct sim_handle *h = SIM_HANDLE(handle);
+    struct sim_bus *bus = h->dev->stick->bus;
+    uint64_t now = now_us();
+    int r = 0;
+    
+    pthread_mutex_lock(&bus->lock);
+    if (!sim_attached(h->dev, now)) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (config != 1) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else {
+        sim_switch(h->dev, SIM_SET_CONFIG, now);
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return r;
+}
+
+static int sim_reset_device(libusb_device_handle *handle) {
+    struct sim_handle *h = SIM_HANDLE(handle);
+    struct sim_bus *bus = h->dev->stick->bus;
+    uint64_t now = now_us();
+    int r = 0;
+    
+    pthread_mutex_lock(&bus->lock);
+    if (!sim_attached(h->dev, now)) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else {
+        // libusb reports a device that came back different as gone
+        if (sim_switch(h->dev, SIM_RESET, now)) r = LIBUSB_ERROR_NOT_FOUND;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return r;
+}
+
+static int sim_get_string_descriptor_ascii(libusb_device_handle *handle, uint8_t index, unsigned char *data,
+                                           int len) {
+    struct sim_handle *h = SIM_HANDLE(handle);
+    const char *s;
+    
+    if (!sim_attached(h->dev, now_us())) return LIBUSB_ERROR_NO_DEVICE;
+    switch (index) {
+        case 1:  s = "HUAWEI"; break;
+        case 2:  s = "HUAWEI Mobile"; break;
+        case 3:  s = h->dev->stick->serial; break;
+        case 4:  s = NULL; break;
+        default: return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    if (s) {
+        snprintf((char *)data, (size_t)len, "%s", s);
+    } else {
+        // iMACAddress of the NCM function, locally administered
+        snprintf((char *)data, (size_t)len, "0A1E101F00%02X", h->dev->stick->port);
+    }
+    return (int)strlen((char *)data);
+}
+
+static int sim_control_transfer(libusb_device_handle *handle, uint8_t request_type, uint8_t request,
+                                uint16_t value, uint16_t index, unsigned char *data, uint16_t len,
+                                unsigned int timeout) {
+    struct sim_handle *h = SIM_HANDLE(handle);
+    struct sim_bus *bus = h->dev->stick->bus;
+    uint64_t now = now_us();
+    struct sim_ncm *n = &h->dev->stick->ncm;
+    int r = len;
+    
+    (void)timeout;
+    
+    pthread_mutex_lock(&bus->lock);
+    if (!sim_attached(h->dev, now)) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (request_type == 0 && request == LIBUSB_REQUEST_SET_FEATURE && value == 1) {
+        sim_switch(h->dev, SIM_SET_FEATURE, now);
+    } else if ((request_type & 0x7F) == 0x21 && (index != SIM_NCM_IF || !bus->opt.ncm || !h->dev->modem)) {
+        r = LIBUSB_ERROR_PIPE;
+    } else if (request_type == 0xA1 && request == NCM_GET_NTB_PARAMETERS && len >= NCM_NTB_PARAMETERS_LEN) {
+        // NTB16 and NTB32; datagrams at 4n + 2 so the IP header after the Ethernet one is aligned
+        memset(data, 0, NCM_NTB_PARAMETERS_LEN);
+        ncm_put16(data, NCM_NTB_PARAMETERS_LEN);
+        ncm_put16(data + 2, 0x0003);
+        ncm_put32(data + 4, SIM_NCM_IN_MAX);
+        ncm_put16(data + 8, 4);
+        ncm_put16(data + 12, 4);
+        ncm_put32(data + 16, SIM_NCM_OUT_MAX);
+        ncm_put16(data + 20, 4);
+        ncm_put16(data + 22, 2);
+        ncm_put16(data + 24, 4);
+        ncm_put16(data + 26, 0);
+        r = NCM_NTB_PARAMETERS_LEN;
+    } else if (request_type == 0x21 && request == NCM_SET_NTB_FORMAT && value <= 1 && n->alt == 0) {
+        n->ntb32 = value;
+    } else if (request_type == 0x21 && request == NCM_SET_NTB_INPUT_SIZE && len >= 4 && n->alt == 0) {
+        n->in_size = ncm_get32(data);
+        if (n->in_size > SIM_NCM_IN_MAX) n->in_size = SIM_NCM_IN_MAX;
+    } else if ((request_type & 0x7F) == 0x21) {
+        r = LIBUSB_ERROR_PIPE;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return r;
+}
+
+static int sim_bulk_transfer(libusb_device_handle *handle, unsigned char endpoint, unsigned char *data, int len,
+                             int *transferred, unsigned int timeout) {
+    struct sim_handle *h = SIM_HANDLE(handle);
+    struct sim_bus *bus = h->dev->stick->bus;
+    uint64_t deadline = timeout ? now_us() + (uint64_t)timeout * 1000 : UINT64_MAX;
+    
+    *transferred = 0;
+    for (;;) {
+        uint64_t now = now_us();
+        uint64_t next = UINT64_MAX;
+        int r = 0;
+        
+        pthread_mutex_lock(&bus->lock);
+        if (!sim_attached(h->dev, now)) {
+            r = LIBUSB_ERROR_NO_DEVICE;
+        } else if (!sim_has_endpoint(h->dev, endpoint)) {
+            r = LIBUSB_ERROR_NOT_FOUND;
+        } else if (sim_ncm_endpoint(h->dev, endpoint)) {
+            struct sim_ncm *n = &h->dev->stick->ncm;
+            if (n->alt != 1) {
+                r = LIBUSB_ERROR_PIPE;
+            } else if (!(endpoint & 0x80)) {
+                if (sim_ncm_push(n, data, len)) *transferred = len;
+            } else {
+                *transferred = sim_ncm_pop(n, data, len);
+            }
+        } else if (!(endpoint & 0x80)) {
+            sim_write(h->dev, endpoint, data, len, now);
+            *transferred = len;
+        } else if (sim_diag_endpoint(h->dev, endpoint)) {
+            *transferred = sim_diag_read(h->dev->stick, data, len, now);
+            next = sim_diag_next(h->dev->stick);
+        } else if (sim_channel(h->dev, endpoint)) {
+            *transferred = sim_modem_read(sim_channel(h->dev, endpoint), data, len, now);
+            next = sim_modem_next(sim_channel(h->dev, endpoint));
+        }
+        pthread_mutex_unlock(&bus->lock);
+        
+        if (r < 0 || *transferred > 0 || (!(endpoint & 0x80) && !sim_ncm_endpoint(h->dev, endpoint))) return r;
+        if (now >= deadline) return LIBUSB_ERROR_TIMEOUT;
+        
+        if (next > deadline) next = deadline;
+        if (next > now + SIM_IDLE_WAIT_US) next = now + SIM_IDLE_WAIT_US;
+        sim_sleep_until(bus, next);
+    }
+}
+
+static struct libusb_transfer *sim_alloc_transfer(int iso_packets) {
+    return calloc(1, sizeof(struct libusb_transfer) +
+                  (size_t)iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+}
+
+static void sim_free_transfer(struct libusb_transfer *transfer) {
+    free(transfer);
+}
+
+static int sim_submit_transfer(struct libusb_transfer *transfer) {
+    struct sim_handle *h = SIM_HANDLE(transfer->dev_handle);
+    struct sim_bus *bus = h->dev->stick->bus;
+    uint64_t now = now_us();
+    int r = 0;
+    
+    pthread_mutex_lock(&bus->lock);
+    if (!sim_attached(h->dev, now)) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (!sim_has_endpoint(h->dev, transfer->endpoint)) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else if (bus->nqueue == SIM_MAX_TRANSFERS) {
+        r = LIBUSB_ERROR_BUSY;
+    } else {
+        bus->queue[bus->nqueue] = transfer;
+        bus->queue_deadline[bus->nqueue] = transfer->timeout ? now + (uint64_t)transfer->timeout * 1000 : UINT64_MAX;
+        bus->queue_cancel[bus->nqueue] = 0;
+        bus->nqueue++;
+        sim_wake_sleepers(bus);
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return r;
+}
+
+static int sim_cancel_transfer(struct libusb_transfer *transfer) {
+    struct sim_bus *bus = SIM_HANDLE(transfer->dev_handle)->dev->stick->bus;
+    int r = LIBUSB_ERROR_NOT_FOUND;
+    
+    pthread_mutex_lock(&bus->lock);
+    for (int i = 0; i < bus->nqueue; i++) {
+        if (bus->queue[i] == transfer && !bus->queue_cancel[i]) {
+            bus->queue_cancel[i] = 1;
+            sim_wake_sleepers(bus);
+            r = 0;
+        }
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return r;
+}
+
+// Complete whatever is due, calling back outside the lock like libusb does
+static int sim_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed) {
+    struct sim_bus *bus = SIM_BUS(ctx);
+    uint64_t deadline = now_us() + (tv ? (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec : 0);
+    
+    for (;;) {
+        struct libusb_transfer *done[SIM_MAX_TRANSFERS];
+        int ndone = 0;
+        uint64_t now = now_us();
+        uint64_t next = now + SIM_IDLE_WAIT_US;
+        
+        pthread_mutex_lock(&bus->lock);
+        for (int i = 0; i < bus->nqueue;) {
+            struct libusb_transfer *t = bus->queue[i];
+            struct sim_device *d = SIM_HANDLE(t->dev_handle)->dev;
+            struct sim_channel *c = sim_channel(d, t->endpoint);
+            int n;
+            
+            t->actual_length = 0;
+            if (bus->queue_cancel[i]) {
+                t->status = LIBUSB_TRANSFER_CANCELLED;
+            } else if (!sim_attached(d, now)) {
+                t->status = LIBUSB_TRANSFER_NO_DEVICE;
+            } else if (sim_ncm_endpoint(d, t->endpoint) && d->stick->ncm.alt != 1) {
+                t->status = LIBUSB_TRANSFER_STALL;
+            } else if (sim_ncm_endpoint(d, t->endpoint) && !(t->endpoint & 0x80)) {
+                if (!sim_ncm_push(&d->stick->ncm, t->buffer, t->length)) {
+                    i++;
+                    continue;
+                }
+                t->actual_length = t->length;
+                t->status = LIBUSB_TRANSFER_COMPLETED;
+            } else if (sim_ncm_endpoint(d, t->endpoint) &&
+                       (n = sim_ncm_pop(&d->stick->ncm, t->buffer, t->length)) > 0) {
+                t->actual_length = n;
+                t->status = LIBUSB_TRANSFER_COMPLETED;
+            } else if (c && c->ppp && !(t->endpoint & 0x80) &&
+                       sizeof(c->reply) - (c->reply_len - c->reply_pos) < HDLC_ENCODED_MAX(t->length) + 64) {
+                // Data mode: frames wait until the ones going back have room
+                i++;
+                continue;
+            } else if (!(t->endpoint & 0x80)) {
+                sim_write(d, t->endpoint, t->buffer, t->length, now);
+                t->actual_length = t->length;
+                t->status = LIBUSB_TRANSFER_COMPLETED;
+            } else if (sim_diag_endpoint(d, t->endpoint) &&
+                       (n = sim_diag_read(d->stick, t->buffer, t->length, now)) > 0) {
+                t->actual_length = n;
+                t->status = LIBUSB_TRANSFER_COMPLETED;
+            } else if (c && (n = sim_modem_read(c, t->buffer, t->length, now)) > 0) {
+                t->actual_length = n;
+                t->status = LIBUSB_TRANSFER_COMPLETED;
+            } else if (now >= bus->queue_deadline[i]) {
+                t->status = LIBUSB_TRANSFER_TIMED_OUT;
+            } else {
+                if (c && sim_modem_next(c) < next) next = sim_modem_next(c);
+                if (sim_diag_endpoint(d, t->endpoint) && sim_diag_next(d->stick) < next) {
+                    next = sim_diag_next(d->stick);
+                }
+                if (bus->queue_deadline[i] < next) next = bus->queue_deadline[i];
+                i++;
+                continue;
+            }
+            
+            done[ndone++] = t;
+            size_t rest = (size_t)(--bus->nqueue - i);
+            memmove(&bus->queue[i], &bus->queue[i + 1], rest * sizeof(bus->queue[0]));
+            memmove(&bus->queue_deadline[i], &bus->queue_deadline[i + 1], rest * sizeof(bus->queue_deadline[0]));
+            memmove(&bus->queue_cancel[i], &bus->queue_cancel[i + 1], rest * sizeof(bus->queue_cancel[0]));
+        }
+        pthread_mutex_unlock(&bus->lock);
+        
+        for (int i = 0; i < ndone; i++) {
+            done[i]->callback(done[i]);
+        }
+        if (ndone > 0 || (completed && *completed)) return 0;
+        
+        now = now_us();
+        if (now >= deadline) return 0;
+        sim_sleep_until(bus, next < deadline ? next : deadline);
+    }
+}
+
+// No hotplug on the virtual bus: huawei_modeswitch -w polls it instead
+static int sim_has_capability(uint32_t capability) {
+    (void)capability;
+    return 0;
+}
+
+static int sim_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id,
+                                         int product_id, int dev_class, libusb_hotplug_callback_fn cb,
+                                         void *user_data, libusb_hotplug_callback_handle *handle) {
+    (void)ctx;
+    (void)events;
+    (void)flags;
+    (void)vendor_id;
+    (void)product_id;
+    (void)dev_class;
+    (void)cb;
+    (void)user_data;
+    (void)handle;
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static void sim_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle handle) {
+    (void)ctx;
+    (void)handle;
+}
+
+const struct usb_transport huawei_usb_sim = {
+    "sim",
+    sim_init,
+    sim_exit,
+    sim_get_device_list,
+    sim_free_device_list,
+    sim_ref_device,
+    sim_unref_device,
+    sim_get_device_descriptor,
+    sim_get_active_config_descriptor,
+    sim_free_config_descriptor,
+    sim_get_bus_number,
+    sim_get_port_numbers,
+    sim_open,
+    sim_close,
+    sim_get_device,
+    sim_claim_interface,
+    sim_release_interface,
+    sim_set_interface_alt_setting,
+    sim_kernel_driver_active,
+    sim_detach_kernel_driver,
+    sim_set_configuration,
+    sim_reset_device,
+    sim_get_string_descriptor_ascii,
+    sim_control_transfer,
+    sim_bulk_transfer,
+    sim_alloc_transfer,
+    sim_free_transfer,
+    sim_submit_transfer,
+    sim_cancel_transfer,
+    sim_handle_events_timeout_completed,
+    sim_has_capability,
+    sim_hotplug_register_callback,
+    sim_hotplug_deregister_callback,
+};
@@ -0,0 +1,579 @@
+/*
+ * SMS PDU codec (3GPP TS 23.040 / 23.038)
+ * Used by huawei_at's sms subcommands
+ *
+ * Decodes SMS-DELIVER and SMS-SUBMIT PDUs in the hex form AT+CMGL and
+ * AT+CMGR print them (SMSC prefix included) to UTF-8, and splits UTF-8 text
+ * into SMS-SUBMIT PDUs for AT+CMGS. Covers the GSM 7-bit default alphabet
+ * and its extension table, UCS2 (with surrogate pairs) and 8-bit data, plus
+ * concatenated messages with 8-bit or 16-bit references.
+ *
+ * Everything is table driven and single pass: hex digits and GSM characters
+ * are array lookups, septets go through a shift register, and nothing is
+ * allocated.
+ */
+
+#ifndef HUAWEI_SMS_H
+#define HUAWEI_SMS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SMS_TEXT_MAX        512     // one part as UTF-8: 160 characters of up to 3 bytes
+#define SMS_ADDR_MAX        48
+#define SMS_PDU_MAX         180     // octets, SMSC included
+#define SMS_PDU_HEX_MAX     (SMS_PDU_MAX * 2 + 1)
+#define SMS_PARTS_MAX       16      // longest message sms_encode_submit() splits
+
+enum sms_type {
+    SMS_DELIVER,
+    SMS_SUBMIT
+};
+
+enum sms_alphabet {
+    SMS_GSM7,
+    SMS_8BIT,
+    SMS_UCS2
+};
+
+struct sms_pdu {
+    enum sms_type type;
+    enum sms_alphabet alphabet;
+    char addr[SMS_ADDR_MAX];    // originator (DELIVER) or destination (SUBMIT)
+    char time[32];              // service centre time stamp, DELIVER only
+    int concat_ref;
+    int concat_total;           // 0 = not part of a concatenated message
+    int concat_seq;
+    size_t text_len;
+    char text[SMS_TEXT_MAX];    // UTF-8, or hex for 8-bit data
+};
+
+// One SMS-SUBMIT ready for AT+CMGS=<length>
+struct sms_part {
+    int length;                 // TPDU octets, SMSC byte not counted
+    char hex[SMS_PDU_HEX_MAX];
+};
+
+// GSM 7-bit default alphabet; 0x1B is the escape to the extension table
+static const uint16_t sms_gsm7_basic[128] = {
+    0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+    0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+    0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+    0x03A3, 0x0398, 0x039E, 0x00A0, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+    0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0
+};
+
+static const uint16_t sms_gsm7_ext[128] = {
+    [0x0A] = 0x000C, [0x14] = 0x005E, [0x28] = 0x007B, [0x29] = 0x007D, [0x2F] = 0x005C,
+    [0x3C] = 0x005B, [0x3D] = 0x007E, [0x3E] = 0x005D, [0x40] = 0x007C, [0x65] = 0x20AC
+};
+
+// Hex digit value + 1, 0 for anything else
+static const uint8_t sms_hex_value[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8,
+    ['8'] = 9, ['9'] = 10, ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16
+};
+
+// Returns the number of octets, -1 for an odd length, a bad digit or overflow
+static inline int sms_hex_decode(const char *hex, size_t len, uint8_t *out, size_t size) {
+    if (len % 2 || len / 2 > size) return -1;
+    
+    for (size_t i = 0; i < len; i += 2) {
+        unsigned hi = sms_hex_value[(unsigned char)hex[i]];
+        unsigned lo = sms_hex_value[(unsigned char)hex[i + 1]];
+        if (!hi || !lo) return -1;
+        out[i / 2] = (uint8_t)((hi - 1) << 4 | (lo - 1));
+    }
+    return (int)(len / 2);
+}
+
+static inline void sms_hex_encode(const uint8_t *in, size_t len, char *out) {
+    static const char digits[] = "0123456789ABCDEF";
+    
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[in[i] >> 4];
+        out[2 * i + 1] = digits[in[i] & 0x0F];
+    }
+    out[2 * len] = '\0';
+}
+
+static inline size_t sms_utf8_put(char *out, uint32_t cp) {
+    if (cp >= 0xD800 && cp < 0xE000) cp = 0xFFFD;     // lone surrogate
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | cp >> 6);
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | cp >> 12);
+        out[1] = (char)(0x80 | (cp >> 6 & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | cp >> 18);
+    out[1] = (char)(0x80 | (cp >> 12 & 0x3F));
+    out[2] = (char)(0x80 | (cp >> 6 & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+// Next code point of a UTF-8 string; malformed input comes back as U+FFFD
+static inline uint32_t sms_utf8_next(const unsigned char **s) {
+    const unsigned char *p = *s;
+    uint32_t cp = *p++;
+    int more = cp >= 0xF0 ? 3 : cp >= 0xE0 ? 2 : cp >= 0xC0 ? 1 : 0;
+    
+    if (cp < 0x80) {
+        *s = p;
+        return cp;
+    }
+    if (!more) {
+        *s = p;
+        return 0xFFFD;
+    }
+    cp &= 0x3F >> more;
+    for (int i = 0; i < more; i++, p++) {
+        if ((*p & 0xC0) != 0x80) {
+            *s = p;
+            return 0xFFFD;
+        }
+        cp = cp << 6 | (*p & 0x3F);
+    }
+    *s = p;
+    return cp;
+}
+
+/*
+ * GSM 7-bit
+ */
+
+// Septets are packed LSB first; fill is the number of padding bits in front
+static inline size_t sms_pack7(const uint8_t *septets, size_t n, int fill, uint8_t *out) {
+    uint32_t acc = 0;
+    int bits = fill;
+    size_t o = 0;
+    
+    for (size_t i = 0; i < n; i++) {
+        acc |= (uint32_t)(septets[i] & 0x7F) << bits;
+        bits += 7;
+        while (bits >= 8) {
+            out[o++] = (uint8_t)acc;
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+    if (bits > 0) out[o++] = (uint8_t)acc;
+    return o;
+}
+
+// Returns the number of septets unpacked, fewer than n if data runs out
+static inline size_t sms_unpack7(const uint8_t *data, size_t octets, int fill, uint8_t *septets, size_t n) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t i = 0, o = 0;
+    
+    if (fill && octets) {
+        acc = data[i++] >> fill;
+        bits = 8 - fill;
+    }
+    while (o < n) {
+        if (bits < 7) {
+            if (i == octets) break;
+            acc |= (uint32_t)data[i++] << bits;
+            bits += 8;
+        }
+        septets[o++] = (uint8_t)(acc & 0x7F);
+        acc >>= 7;
+        bits -= 7;
+    }
+    return o;
+}
+
+static inline size_t sms_gsm7_to_utf8(const uint8_t *septets, size_t n, char *out, size_t size) {
+    size_t o = 0;
+    
+    for (size_t i = 0; i < n && o + 4 < size; i++) {
+        uint32_t cp;
+        if (septets[i] == 0x1B && i + 1 < n) {
+            uint8_t c = septets[++i];
+            // Unknown extension codes show the default character
+            cp = sms_gsm7_ext[c] ? sms_gsm7_ext[c] : sms_gsm7_basic[c];
+        } else {
+            cp = sms_gsm7_basic[septets[i]];
+        }
+        o += sms_utf8_put(out + o, cp);
+    }
+    out[o] = '\0';
+    return o;
+}
+
+// Code point -> 0x100 | code (default alphabet) or 0x200 | code (extension), 0 if none;
+// the two tables above turned around
+static const uint16_t sms_gsm7_reverse[0x400] = {
+    [0x000A] = 0x10A, [0x000C] = 0x20A, [0x000D] = 0x10D, [0x0020] = 0x120, [0x0021] = 0x121,
+    [0x0022] = 0x122, [0x0023] = 0x123, [0x0024] = 0x102, [0x0025] = 0x125, [0x0026] = 0x126,
+    [0x0027] = 0x127, [0x0028] = 0x128, [0x0029] = 0x129, [0x002A] = 0x12A, [0x002B] = 0x12B,
+    [0x002C] = 0x12C, [0x002D] = 0x12D, [0x002E] = 0x12E, [0x002F] = 0x12F, [0x0030] = 0x130,
+    [0x0031] = 0x131, [0x0032] = 0x132, [0x0033] = 0x133, [0x0034] = 0x134, [0x0035] = 0x135,
+    [0x0036] = 0x136, [0x0037] = 0x137, [0x0038] = 0x138, [0x0039] = 0x139, [0x003A] = 0x13A,
+    [0x003B] = 0x13B, [0x003C] = 0x13C, [0x003D] = 0x13D, [0x003E] = 0x13E, [0x003F] = 0x13F,
+    [0x0040] = 0x100, [0x0041] = 0x141, [0x0042] = 0x142, [0x0043] = 0x143, [0x0044] = 0x144,
+    [0x0045] = 0x145, [0x0046] = 0x146, [0x0047] = 0x147, [0x0048] = 0x148, [0x0049] = 0x149,
+    [0x004A] = 0x14A, [0x004B] = 0x14B, [0x004C] = 0x14C, [0x004D] = 0x14D, [0x004E] = 0x14E,
+    [0x004F] = 0x14F, [0x0050] = 0x150, [0x0051] = 0x151, [0x0052] = 0x152, [0x0053] = 0x153,
+    [0x0054] = 0x154, [0x0055] = 0x155, [0x0056] = 0x156, [0x0057] = 0x157, [0x0058] = 0x158,
+    [0x0059] = 0x159, [0x005A] = 0x15A, [0x005B] = 0x23C, [0x005C] = 0x22F, [0x005D] = 0x23E,
+    [0x005E] = 0x214, [0x005F] = 0x111, [0x0061] = 0x161, [0x0062] = 0x162, [0x0063] = 0x163,
+    [0x0064] = 0x164, [0x0065] = 0x165, [0x0066] = 0x166, [0x0067] = 0x167, [0x0068] = 0x168,
+    [0x0069] = 0x169, [0x006A] = 0x16A, [0x006B] = 0x16B, [0x006C] = 0x16C, [0x006D] = 0x16D,
+    [0x006E] = 0x16E, [0x006F] = 0x16F, [0x0070] = 0x170, [0x0071] = 0x171, [0x0072] = 0x172,
+    [0x0073] = 0x173, [0x0074] = 0x174, [0x0075] = 0x175, [0x0076] = 0x176, [0x0077] = 0x177,
+    [0x0078] = 0x178, [0x0079] = 0x179, [0x007A] = 0x17A, [0x007B] = 0x228, [0x007C] = 0x240,
+    [0x007D] = 0x229, [0x007E] = 0x23D, [0x00A1] = 0x140, [0x00A3] = 0x101, [0x00A4] = 0x124,
+    [0x00A5] = 0x103, [0x00A7] = 0x15F, [0x00BF] = 0x160, [0x00C4] = 0x15B, [0x00C5] = 0x10E,
+    [0x00C6] = 0x11C, [0x00C7] = 0x109, [0x00C9] = 0x11F, [0x00D1] = 0x15D, [0x00D6] = 0x15C,
+    [0x00D8] = 0x10B, [0x00DC] = 0x15E, [0x00DF] = 0x11E, [0x00E0] = 0x17F, [0x00E4] = 0x17B,
+    [0x00E5] = 0x10F, [0x00E6] = 0x11D, [0x00E8] = 0x104, [0x00E9] = 0x105, [0x00EC] = 0x107,
+    [0x00F1] = 0x17D, [0x00F2] = 0x108, [0x00F6] = 0x17C, [0x00F8] = 0x10C, [0x00F9] = 0x106,
+    [0x00FC] = 0x17E, [0x0393] = 0x113, [0x0394] = 0x110, [0x0398] = 0x119, [0x039B] = 0x114,
+    [0x039E] = 0x11A, [0x03A0] = 0x116, [0x03A3] = 0x118, [0x03A6] = 0x112, [0x03A8] = 0x117,
+    [0x03A9] = 0x115
+};
+
+// Septets for a code point (1, or 2 with the escape), 0 if it has no GSM code
+static inline int sms_gsm7_encode(uint32_t cp, uint8_t *out) {
+    if (cp == 0x20AC) {
+        out[0] = 0x1B;
+        out[1] = 0x65;
+        return 2;
+    }
+    uint16_t v = cp < 0x400 ? sms_gsm7_reverse[cp] : 0;
+    if (v & 0x100) {
+        out[0] = (uint8_t)(v & 0x7F);
+        return 1;
+    }
+    if (v & 0x200) {
+        out[0] = 0x1B;
+        out[1] = (uint8_t)(v & 0x7F);
+        return 2;
+    }
+    return 0;
+}
+
+static inline size_t sms_ucs2_to_utf8(const uint8_t *data, size_t octets, char *out, size_t size) {
+    size_t o = 0;
+    
+    for (size_t i = 0; i + 1 < octets && o + 4 < size; i += 2) {
+        uint32_t cp = (uint32_t)data[i] << 8 | data[i + 1];
+        if (cp >= 0xD800 && cp < 0xDC00 && i + 3 < octets) {
+            uint32_t lo = (uint32_t)data[i + 2] << 8 | data[i + 3];
+            if (lo >= 0xDC00 && lo < 0xE000) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            }
+        }
+        o += sms_utf8_put(out + o, cp);
+    }
+    out[o] = '\0';
+    return o;
+}
+
+/*
+ * PDU fields
+ */
+
+// TP-OA/TP-DA at pdu[*pos]; digits (with + for international) or decoded alphanumeric text
+static inline int sms_addr_decode(const uint8_t *pdu, size_t len, size_t *pos, char *out, size_t size) {
+    static const char digits[] = "0123456789*#abc";
+    
+    if (*pos + 2 > len) return -1;
+    size_t semi = pdu[*pos];
+    uint8_t toa = pdu[*pos + 1];
+    size_t octets = (semi + 1) / 2;
+    const uint8_t *a = pdu + *pos + 2;
+    
+    if (*pos + 2 + octets > len || size < 2) return -1;
+    *pos += 2 + octets;
+    
+    if ((toa & 0x70) == 0x50) {
+        uint8_t septets[SMS_ADDR_MAX];
+        size_t n = sms_unpack7(a, octets, 0, septets, semi * 4 / 7 < sizeof(septets) ? semi * 4 / 7 : sizeof(septets));
+        sms_gsm7_to_utf8(septets, n, out, size);
+        return 0;
+    }
+    
+    size_t o = 0;
+    if ((toa & 0x70) == 0x10) out[o++] = '+';
+    for (size_t i = 0; i < semi && o + 1 < size; i++) {
+        unsigned d = i % 2 ? a[i / 2] >> 4 : a[i / 2] & 0x0F;
+        if (d == 0x0F) break;
+        out[o++] = digits[d];
+    }
+    out[o] = '\0';
+    return 0;
+}
+
+// "+491701234567" -> length, type and swapped BCD digits; returns octets written, -1 if not a number
+static inline int sms_addr_encode(const char *number, uint8_t *out) {
+    int international = *number == '+';
+    int n = 0;
+    
+    if (international) number++;
+    out[1] = international ? 0x91 : 0x81;
+    for (const char *p = number; *p; p++) {
+        if (*p < '0' || *p > '9' || n == 20) return -1;
+        if (n % 2) {
+            out[2 + n / 2] = (uint8_t)((out[2 + n / 2] & 0x0F) | (*p - '0') << 4);
+        } else {
+            out[2 + n / 2] = (uint8_t)(0xF0 | (*p - '0'));
+        }
+        n++;
+    }
+    if (n == 0) return -1;
+    out[0] = (uint8_t)n;
+    return 2 + (n + 1) / 2;
+}
+
+#define SMS_BCD(b)  (((b) & 0x0F) * 10 + ((b) >> 4))
+
+// TP-SCTS as "2026-10-16T09:12:03+02:00"
+static inline void sms_time_decode(const uint8_t *t, char *out, size_t size) {
+    int quarters = (t[6] & 0x07) * 10 + (t[6] >> 4);
+    
+    snprintf(out, size, "20%02d-%02d-%02dT%02d:%02d:%02d%c%02d:%02d", SMS_BCD(t[0]), SMS_BCD(t[1]),
+             SMS_BCD(t[2]), SMS_BCD(t[3]), SMS_BCD(t[4]), SMS_BCD(t[5]), t[6] & 0x08 ? '-' : '+',
+             quarters / 4, quarters % 4 * 15);
+}
+
+static inline enum sms_alphabet sms_dcs_alphabet(uint8_t dcs) {
+    if ((dcs & 0x80) == 0x00) {
+        // General data coding (and its automatic deletion group)
+        unsigned a = (dcs >> 2) & 0x03;
+        return a == 1 ? SMS_8BIT : a == 2 ? SMS_UCS2 : SMS_GSM7;
+    }
+    if ((dcs & 0xF0) == 0xF0) return dcs & 0x04 ? SMS_8BIT : SMS_GSM7;
+    if ((dcs & 0xF0) == 0xE0) return SMS_UCS2;
+    return SMS_GSM7;
+}
+
+// Returns 0, or -1 for a malformed PDU or a type other than DELIVER/SUBMIT
+static inline int sms_decode(const char *hex, size_t len, struct sms_pdu *sms) {
+    uint8_t pdu[SMS_PDU_MAX];
+    int n = sms_hex_decode(hex, len, pdu, sizeof(pdu));
+    
+    memset(sms, 0, offsetof(struct sms_pdu, text) + 1);
+    if (n < 1) return -1;
+    
+    size_t end = (size_t)n;
+    size_t pos = 1 + (size_t)pdu[0];    // SMSC address
+    if (pos >= end) return -1;
+    
+    uint8_t first = pdu[pos++];
+    uint8_t dcs;
+    
+    switch (first & 0x03) {
+        case 0:
+            sms->type = SMS_DELIVER;
+            if (sms_addr_decode(pdu, end, &pos, sms->addr, sizeof(sms->addr)) < 0) return -1;
+            if (pos + 2 + 7 > end) return -1;
+            dcs = pdu[pos + 1];
+            sms_time_decode(pdu + pos + 2, sms->time, sizeof(sms->time));
+            pos += 2 + 7;
+            break;
+        case 1: {
+            static const int vp_octets[4] = {0, 7, 1, 7};
+            sms->type = SMS_SUBMIT;
+            pos++;      // message reference
+            if (sms_addr_decode(pdu, end, &pos, sms->addr, sizeof(sms->addr)) < 0) return -1;
+            if (pos + 2 > end) return -1;
+            dcs = pdu[pos + 1];
+            pos += 2 + (size_t)vp_octets[(first >> 3) & 0x03];
+            break;
+        }
+        default:
+            return -1;
+    }
+    if (pos >= end) return -1;
+    
+    size_t udl = pdu[pos++];
+    const uint8_t *ud = pdu + pos;
+    size_t avail = end - pos;
+    size_t udh = 0;     // header octets, length byte included
+    
+    if (first & 0x40) {
+        if (avail < 1 || (size_t)ud[0] + 1 > avail) return -1;
+        udh = (size_t)ud[0] + 1;
+        for (size_t i = 1; i + 2 <= udh; ) {
+            uint8_t iei = ud[i], iel = ud[i + 1];
+            if (i + 2 + iel > udh) break;
+            if (iei == 0x00 && iel == 3) {
+                sms->concat_ref = ud[i + 2];
+                sms->concat_total = ud[i + 3];
+                sms->concat_seq = ud[i + 4];
+            } else if (iei == 0x08 && iel == 4) {
+                sms->concat_ref = ud[i + 2] << 8 | ud[i + 3];
+                sms->concat_total = ud[i + 4];
+                sms->concat_seq = ud[i + 5];
+            }
+            i += 2 + (size_t)iel;
+        }
+        if (sms->concat_seq < 1 || sms->concat_seq > sms->concat_total) sms->concat_total = 0;
+    }
+    
+    sms->alphabet = sms_dcs_alphabet(dcs);
+    if (sms->alphabet == SMS_GSM7) {
+        // The text starts on the first septet boundary after the header
+        size_t skip = (udh * 8 + 6) / 7;
+        int fill = (int)(skip * 7 - udh * 8);
+        uint8_t septets[160];
+        size_t count = udl > skip ? udl - skip : 0;
+        
+        if (count > sizeof(septets)) count = sizeof(septets);
+        count = sms_unpack7(ud + udh, avail - udh, fill, septets, count);
+        sms->text_len = sms_gsm7_to_utf8(septets, count, sms->text, sizeof(sms->text));
+    } else {
+        size_t octets = udl > udh ? udl - udh : 0;
+        if (octets > avail - udh) octets = avail - udh;
+        if (sms->alphabet == SMS_UCS2) {
+            sms->text_len = sms_ucs2_to_utf8(ud + udh, octets, sms->text, sizeof(sms->text));
+        } else {
+            sms_hex_encode(ud + udh, octets, sms->text);
+            sms->text_len = octets * 2;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Encoding
+ */
+
+static inline void sms_build_submit(struct sms_part *part, const uint8_t *addr, int addr_len, int ucs2,
+                                    const uint8_t *udh, size_t udh_len, const void *body, size_t count) {
+    uint8_t pdu[SMS_PDU_MAX];
+    size_t o = 0;
+    
+    pdu[o++] = 0x00;                            // SMSC from the SIM
+    pdu[o++] = (uint8_t)(0x11 | (udh_len ? 0x40 : 0));  // SUBMIT, relative validity, UDHI
+    pdu[o++] = 0x00;                            // message reference, set by the modem
+    memcpy(pdu + o, addr, (size_t)addr_len);
+    o += (size_t)addr_len;
+    pdu[o++] = 0x00;                            // protocol identifier
+    pdu[o++] = ucs2 ? 0x08 : 0x00;
+    pdu[o++] = 0xAA;                            // valid for 4 days
+    
+    size_t udl_at = o++;
+    if (udh_len) memcpy(pdu + o, udh, udh_len);
+    o += udh_len;
+    
+    if (ucs2) {
+        const uint16_t *units = body;
+        for (size_t i = 0; i < count; i++) {
+            pdu[o++] = (uint8_t)(units[i] >> 8);
+            pdu[o++] = (uint8_t)units[i];
+        }
+        pdu[udl_at] = (uint8_t)(udh_len + count * 2);
+    } else {
+        size_t skip = (udh_len * 8 + 6) / 7;
+        o += sms_pack7(body, count, (int)(skip * 7 - udh_len * 8), pdu + o);
+        pdu[udl_at] = (uint8_t)(skip + count);
+    }
+    
+    part->length = (int)o - 1;
+    sms_hex_encode(pdu, o, part->hex);
+}
+
+/*
+ * Split UTF-8 text into SMS-SUBMIT PDUs to number: GSM 7-bit if every
+ * character has a code, UCS2 otherwise. Longer texts become a concatenated
+ * message tagged with ref. Returns the number of parts, -1 for a bad number
+ * or a text needing more than max (at most SMS_PARTS_MAX) parts.
+ */
+static inline int sms_encode_submit(const char *number, const char *text, int ref, struct sms_part *parts, int max) {
+    uint8_t addr[12];
+    uint8_t septets[SMS_PARTS_MAX * 153];
+    uint16_t units[SMS_PARTS_MAX * 67];
+    size_t n = 0;
+    int ucs2 = 0;
+    int addr_len = sms_addr_encode(number, addr);
+    
+    if (addr_len < 0) return -1;
+    if (max > SMS_PARTS_MAX) max = SMS_PARTS_MAX;
+    
+    for (const unsigned char *p = (const unsigned char *)text; *p; ) {
+        if (n + 2 > sizeof(septets)) return -1;
+        int k = sms_gsm7_encode(sms_utf8_next(&p), septets + n);
+        if (k == 0) {
+            ucs2 = 1;
+            break;
+        }
+        n += (size_t)k;
+    }
+    
+    if (ucs2) {
+        n = 0;
+        for (const unsigned char *p = (const unsigned char *)text; *p; ) {
+            uint32_t cp = sms_utf8_next(&p);
+            if (n + 2 > sizeof(units) / sizeof(units[0])) return -1;
+            if (cp >= 0x10000) {
+                cp -= 0x10000;
+                units[n++] = (uint16_t)(0xD800 | cp >> 10);
+                units[n++] = (uint16_t)(0xDC00 | (cp & 0x3FF));
+            } else {
+                units[n++] = (uint16_t)cp;
+            }
+        }
+    }
+    
+    size_t single = ucs2 ? 70 : 160;
+    size_t chunk = ucs2 ? 67 : 153;     // room left next to the concatenation header
+    
+    if (n <= single) {
+        if (max < 1) return -1;
+        sms_build_submit(&parts[0], addr, addr_len, ucs2, NULL, 0, ucs2 ? (const void *)units : septets, n);
+        return 1;
+    }
+    
+    // Never split an escape sequence or a surrogate pair
+    size_t cuts[SMS_PARTS_MAX + 1];
+    int total = 0;
+    cuts[0] = 0;
+    for (size_t at = 0; at < n; total++) {
+        size_t len = n - at < chunk ? n - at : chunk;
+        if (at + len < n) {
+            if (ucs2 && units[at + len - 1] >= 0xD800 && units[at + len - 1] < 0xDC00) len--;
+            if (!ucs2 && septets[at + len - 1] == 0x1B) len--;
+        }
+        if (total == max) return -1;
+        at += len;
+        cuts[total + 1] = at;
+    }
+    
+    for (int i = 0; i < total; i++) {
+        uint8_t udh[6] = {5, 0x00, 3, (uint8_t)ref, (uint8_t)total, (uint8_t)(i + 1)};
+        size_t at = cuts[i], len = cuts[i + 1] - cuts[i];
+        sms_build_submit(&parts[i], addr, addr_len, ucs2, udh, sizeof(udh),
+                         ucs2 ? (const void *)(units + at) : (const void *)(septets + at), len);
+    }
+    return total;
+}
+
+#endif
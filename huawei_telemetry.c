@@ -0,0 +1,258 @@
+/*
+ * Huawei signal telemetry reader
+ * Exports the files written by "huawei_at sample" as CSV or JSON lines,
+ * optionally downsampled to one row per device and interval
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "huawei_metrics.h"
+#include "huawei_telemetry.h"
+
+struct options {
+    int json;
+    int extremes;           // -x: min and max next to the mean
+    uint64_t bucket_us;     // 0 = every sample
+    const char *path;       // -u: only this device
+    unsigned mask;          // metrics to print
+};
+
+// One device's current downsampling interval
+struct bucket {
+    char path[64];
+    char serial[64];
+    uint64_t start_us;
+    unsigned long samples;
+    int count[TLM_METRICS][TLM_FIELDS_MAX];
+    int64_t sum[TLM_METRICS][TLM_FIELDS_MAX];
+    int32_t min[TLM_METRICS][TLM_FIELDS_MAX];
+    int32_t max[TLM_METRICS][TLM_FIELDS_MAX];
+    int32_t last[TLM_METRICS][TLM_FIELDS_MAX];
+};
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Huawei Signal Telemetry Reader\n\n");
+    fprintf(stderr, "Usage: %s [options] <file>\n\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -j            JSON lines instead of CSV\n");
+    fprintf(stderr, "  -i <sec>      Downsample: one row per device and interval (mean, last for state codes)\n");
+    fprintf(stderr, "  -x            With -i: add the minimum and maximum of every field\n");
+    fprintf(stderr, "  -u <path>     Only the device on this USB port path\n");
+    fprintf(stderr, "  -m <metrics>  Only these, comma separated: csq,hcsq,sysinfoex,creg\n");
+    fprintf(stderr, "\nExamples:\n");
+    fprintf(stderr, "  %s signal.tlm > signal.csv\n", prog);
+    fprintf(stderr, "  %s -i 60 -x -m csq,hcsq signal.tlm   # per-minute mean/min/max\n", prog);
+}
+
+static void format_time(uint64_t wall_us, char *buf, size_t size) {
+    time_t secs = (time_t)(wall_us / 1000000);
+    struct tm tm;
+    
+    gmtime_r(&secs, &tm);
+    size_t n = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + n, size - n, ".%03uZ", (unsigned)(wall_us / 1000 % 1000));
+}
+
+static void print_header(const struct options *o) {
+    if (o->json) return;
+    printf("time,dev,serial%s", o->bucket_us ? ",samples" : "");
+    for (int m = 0; m < TLM_METRICS; m++) {
+        if (!(o->mask & (1u << m))) continue;
+        for (int f = 0; f < tlm_metrics[m].fields; f++) {
+            const char *name = tlm_metrics[m].field[f];
+            printf(",%s.%s", tlm_metrics[m].name, name);
+            if (o->bucket_us && o->extremes) printf(",%s.%s_min,%s.%s_max", tlm_metrics[m].name, name,
+                                                    tlm_metrics[m].name, name);
+        }
+    }
+    printf("\n");
+}
+
+static void print_row_start(const struct options *o, uint64_t wall_us, const char *path, const char *serial,
+                            unsigned long samples) {
+    char when[40];
+    
+    format_time(wall_us, when, sizeof(when));
+    if (o->json) {
+        printf("{\"time\":\"%s\",\"dev\":", when);
+        json_string(stdout, path, strlen(path));
+        printf(",\"serial\":");
+        json_string(stdout, serial, strlen(serial));
+        if (o->bucket_us) printf(",\"samples\":%lu", samples);
+    } else {
+        printf("%s,%s,%s", when, path, serial);
+        if (o->bucket_us) printf(",%lu", samples);
+    }
+}
+
+// One value; have == 0 prints an empty CSV cell or a JSON null
+static void print_value(const struct options *o, int m, int f, const char *suffix, int have, double v, int whole) {
+    if (o->json) {
+        printf(",\"%s.%s%s\":", tlm_metrics[m].name, tlm_metrics[m].field[f], suffix);
+    } else {
+        printf(",");
+    }
+    if (!have) {
+        if (o->json) printf("null");
+    } else if (whole) {
+        printf("%.0f", v);
+    } else {
+        printf("%.2f", v);
+    }
+}
+
+static void print_sample(const struct options *o, const struct tlm_reader *r, const struct tlm_sample *s) {
+    print_row_start(o, s->wall_us, r->path[s->dev], r->serial[s->dev], 0);
+    for (int m = 0; m < TLM_METRICS; m++) {
+        if (!(o->mask & (1u << m))) continue;
+        for (int f = 0; f < tlm_metrics[m].fields; f++) {
+            int32_t v = s->value[m][f];
+            print_value(o, m, f, "", (s->mask & (1u << m)) && v != TLM_NONE, v, 1);
+        }
+    }
+    printf(o->json ? "}\n" : "\n");
+}
+
+static void bucket_flush(const struct options *o, struct bucket *b) {
+    if (b->samples == 0) return;
+    
+    print_row_start(o, b->start_us, b->path, b->serial, b->samples);
+    for (int m = 0; m < TLM_METRICS; m++) {
+        if (!(o->mask & (1u << m))) continue;
+        for (int f = 0; f < tlm_metrics[m].fields; f++) {
+            int n = b->count[m][f];
+            if (tlm_metrics[m].codes & (1u << f)) {
+                print_value(o, m, f, "", n > 0, b->last[m][f], 1);
+            } else {
+                print_value(o, m, f, "", n > 0, n ? (double)b->sum[m][f] / n : 0, 0);
+            }
+            if (o->extremes) {
+                print_value(o, m, f, "_min", n > 0, b->min[m][f], 1);
+                print_value(o, m, f, "_max", n > 0, b->max[m][f], 1);
+            }
+        }
+    }
+    printf(o->json ? "}\n" : "\n");
+    
+    b->samples = 0;
+    memset(b->count, 0, sizeof(b->count));
+    memset(b->sum, 0, sizeof(b->sum));
+}
+
+static void bucket_add(const struct options *o, struct bucket *b, const struct tlm_sample *s) {
+    uint64_t start = s->wall_us - s->wall_us % o->bucket_us;
+    
+    if (b->samples > 0 && start != b->start_us) bucket_flush(o, b);
+    b->start_us = start;
+    b->samples++;
+    
+    for (int m = 0; m < TLM_METRICS; m++) {
+        if (!(s->mask & (1u << m))) continue;
+        for (int f = 0; f < tlm_metrics[m].fields; f++) {
+            int32_t v = s->value[m][f];
+            if (v == TLM_NONE) continue;
+            if (b->count[m][f] == 0 || v < b->min[m][f]) b->min[m][f] = v;
+            if (b->count[m][f] == 0 || v > b->max[m][f]) b->max[m][f] = v;
+            b->count[m][f]++;
+            b->sum[m][f] += v;
+            b->last[m][f] = v;
+        }
+    }
+}
+
+// Buckets are kept by port path, which stays the same across sampler runs
+static struct bucket *bucket_find(struct bucket *buckets, int *nbuckets, const char *path, const char *serial) {
+    for (int i = 0; i < *nbuckets; i++) {
+        if (strcmp(buckets[i].path, path) == 0) return &buckets[i];
+    }
+    if (*nbuckets == TLM_DEVICES) return NULL;
+    
+    struct bucket *b = &buckets[(*nbuckets)++];
+    memset(b, 0, sizeof(*b));
+    snprintf(b->path, sizeof(b->path), "%s", path);
+    snprintf(b->serial, sizeof(b->serial), "%s", serial);
+    return b;
+}
+
+static unsigned parse_metrics(const char *list) {
+    unsigned mask = 0;
+    char copy[128];
+    
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (char *name = strtok(copy, ","); name; name = strtok(NULL, ",")) {
+        int m = 0;
+        while (m < TLM_METRICS && strcmp(name, tlm_metrics[m].name) != 0) m++;
+        if (m == TLM_METRICS) {
+            fprintf(stderr, "Unknown metric '%s'\n", name);
+            return 0;
+        }
+        mask |= 1u << m;
+    }
+    return mask;
+}
+
+int main(int argc, char **argv) {
+    static struct tlm_reader reader;
+    static struct bucket buckets[TLM_DEVICES];
+    struct options o = {0, 0, 0, NULL, (1u << TLM_METRICS) - 1};
+    struct tlm_sample s;
+    const char *file = NULL;
+    int nbuckets = 0;
+    unsigned long samples = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0) {
+            o.json = 1;
+        } else if (strcmp(argv[i], "-x") == 0) {
+            o.extremes = 1;
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            o.bucket_us = (uint64_t)(atof(argv[++i]) * 1e6);
+        } else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            o.path = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            o.mask = parse_metrics(argv[++i]);
+            if (!o.mask) return 1;
+        } else if (argv[i][0] != '-' && !file) {
+            file = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!file) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    FILE *f = fopen(file, "rb");
+    if (!f) {
+        perror(file);
+        return 1;
+    }
+    tlm_reader_init(&reader, f);
+    
+    print_header(&o);
+    while (tlm_read(&reader, &s)) {
+        const char *path = reader.path[s.dev];
+        if (o.path && strcmp(path, o.path) != 0) continue;
+        samples++;
+        if (!o.bucket_us) {
+            print_sample(&o, &reader, &s);
+            continue;
+        }
+        struct bucket *b = bucket_find(buckets, &nbuckets, path, reader.serial[s.dev]);
+        if (b) bucket_add(&o, b, &s);
+    }
+    for (int i = 0; i < nbuckets; i++) {
+        bucket_flush(&o, &buckets[i]);
+    }
+    
+    if (reader.skipped) {
+        fprintf(stderr, "%s: skipped %llu bytes of damaged records\n", file, (unsigned long long)reader.skipped);
+    }
+    fclose(f);
+    return samples == 0;
+}
@@ -0,0 +1,324 @@
+/*
+ * Signal telemetry file format, written by huawei_at's sampler (sample) and
+ * read back by huawei_telemetry
+ *
+ * The file is an append-only stream of records. Every sampler run appends a
+ * START record, one DEVICE record per modem and then one SAMPLE record per
+ * modem and tick. Numbers are LEB128 varints; sample values are zigzag
+ * deltas against the same device's previous sample, so a value that did not
+ * change costs one byte and a sample of all four metrics about 25.
+ *
+ *   START   ff "HWTLM1\n" wall_us interval_us      resets times and deltas
+ *   DEVICE  'D' len dev path_len path serial_len serial check
+ *   SAMPLE  'V' len dev dt_us mask delta... check
+ *
+ * wall_us is UTC in microseconds, dt_us (zigzag) the time since the previous
+ * START or SAMPLE, mask has a bit per metric the sample holds and check is
+ * the sum of the payload bytes. START doubles as a sync marker: a reader
+ * that meets a damaged or cut-off record, e.g. after a power loss halfway
+ * through a write, skips ahead to the next run.
+ */
+
+#ifndef HUAWEI_TELEMETRY_H
+#define HUAWEI_TELEMETRY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define TLM_MAGIC           "\xffHWTLM1\n"
+#define TLM_MAGIC_LEN       8
+#define TLM_DEVICES         256
+#define TLM_FIELDS_MAX      6
+#define TLM_RECORD_MAX      128         // payload bytes; a full sample stays well below
+#define TLM_WRITE_BUF       65536
+#define TLM_NONE            (-1)        // field missing from the reply
+
+enum tlm_metric {
+    TLM_CSQ,
+    TLM_HCSQ,
+    TLM_SYSINFOEX,
+    TLM_CREG,
+    TLM_METRICS
+};
+
+struct tlm_metric_info {
+    const char *name;
+    const char *cmd;
+    const char *prefix;     // of the reply line
+    int fields;
+    unsigned codes;         // bit per field holding a state code rather than a level
+    const char *field[TLM_FIELDS_MAX];
+};
+
+// hcsq.mode is the index of the ^HCSQ mode string: 0 NOSERVICE, 1 GSM,
+// 2 WCDMA, 3 TD-SCDMA, 4 LTE, 5 CDMA, 6 EVDO, 7 NR. The level fields follow
+// the mode: rssi only for GSM, rssi,rscp,ecio for WCDMA and rssi,rsrp,sinr,
+// rsrq for LTE. creg.lac and creg.ci need AT+CREG=2.
+static const struct tlm_metric_info tlm_metrics[TLM_METRICS] = {
+    {"csq", "AT+CSQ", "+CSQ:", 2, 0x0, {"rssi", "ber"}},
+    {"hcsq", "AT^HCSQ?", "^HCSQ:", 5, 0x1, {"mode", "rssi", "rsrp_rscp", "sinr_ecio", "rsrq"}},
+    {"sysinfoex", "AT^SYSINFOEX", "^SYSINFOEX:", 6, 0x3F,
+     {"srv_status", "srv_domain", "roam", "sim_state", "sysmode", "submode"}},
+    {"creg", "AT+CREG?", "+CREG:", 4, 0xF, {"stat", "lac", "ci", "act"}},
+};
+
+struct tlm_sample {
+    int dev;
+    uint64_t wall_us;
+    unsigned mask;          // bit per enum tlm_metric
+    int32_t value[TLM_METRICS][TLM_FIELDS_MAX];
+};
+
+static inline size_t tlm_put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static inline int tlm_get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+    return -1;
+}
+
+static inline uint64_t tlm_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t tlm_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline unsigned char tlm_check(const unsigned char *p, size_t len) {
+    unsigned char sum = 0;
+    
+    for (size_t i = 0; i < len; i++) sum = (unsigned char)(sum + p[i]);
+    return sum;
+}
+
+/*
+ * Writer
+ *
+ * Records collect in buf and go out with one write() per tlm_writer_flush(),
+ * which the sampler calls once per tick, so a crash loses at most the tick
+ * being written.
+ */
+
+struct tlm_writer {
+    int fd;
+    uint64_t last_us;       // time of the last START or SAMPLE
+    size_t len;
+    unsigned char buf[TLM_WRITE_BUF];
+    int32_t prev[TLM_DEVICES][TLM_METRICS][TLM_FIELDS_MAX];
+};
+
+static inline int tlm_writer_flush(struct tlm_writer *w) {
+    size_t done = 0;
+    
+    while (done < w->len) {
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (size_t)n;
+    }
+    w->len = 0;
+    return 0;
+}
+
+static inline int tlm_writer_record(struct tlm_writer *w, char kind, const unsigned char *payload, size_t len) {
+    if (w->len + len + 16 > sizeof(w->buf) && tlm_writer_flush(w) < 0) return -1;
+    w->buf[w->len++] = (unsigned char)kind;
+    w->len += tlm_put_varint(w->buf + w->len, len);
+    memcpy(w->buf + w->len, payload, len);
+    w->len += len;
+    w->buf[w->len++] = tlm_check(payload, len);
+    return 0;
+}
+
+// Open path for appending and start a run; the START record goes out with the first flush
+static inline int tlm_writer_open(struct tlm_writer *w, const char *path, uint64_t wall_us, uint64_t interval_us) {
+    memset(w->prev, 0, sizeof(w->prev));
+    w->len = 0;
+    w->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (w->fd < 0) return -1;
+    
+    memcpy(w->buf, TLM_MAGIC, TLM_MAGIC_LEN);
+    w->len = TLM_MAGIC_LEN;
+    w->len += tlm_put_varint(w->buf + w->len, wall_us);
+    w->len += tlm_put_varint(w->buf + w->len, interval_us);
+    w->last_us = wall_us;
+    return 0;
+}
+
+static inline int tlm_writer_device(struct tlm_writer *w, int dev, const char *path, const char *serial) {
+    unsigned char p[TLM_RECORD_MAX];
+    size_t path_len = strnlen(path, 60), serial_len = strnlen(serial, 60);
+    size_t n = 0;
+    
+    p[n++] = (unsigned char)dev;
+    p[n++] = (unsigned char)path_len;
+    memcpy(p + n, path, path_len);
+    n += path_len;
+    p[n++] = (unsigned char)serial_len;
+    memcpy(p + n, serial, serial_len);
+    n += serial_len;
+    memset(w->prev[dev], 0, sizeof(w->prev[dev]));
+    return tlm_writer_record(w, 'D', p, n);
+}
+
+static inline int tlm_writer_sample(struct tlm_writer *w, const struct tlm_sample *s) {
+    unsigned char p[TLM_RECORD_MAX];
+    size_t n = 0;
+    
+    p[n++] = (unsigned char)s->dev;
+    n += tlm_put_varint(p + n, tlm_zigzag((int64_t)(s->wall_us - w->last_us)));
+    p[n++] = (unsigned char)s->mask;
+    for (int m = 0; m < TLM_METRICS; m++) {
+        if (!(s->mask & (1u << m))) continue;
+        for (int f = 0; f < tlm_metrics[m].fields; f++) {
+            n += tlm_put_varint(p + n, tlm_zigzag((int64_t)s->value[m][f] - w->prev[s->dev][m][f]));
+            w->prev[s->dev][m][f] = s->value[m][f];
+        }
+    }
+    w->last_us = s->wall_us;
+    return tlm_writer_record(w, 'V', p, n);
+}
+
+static inline int tlm_writer_close(struct tlm_writer *w) {
+    int r = tlm_writer_flush(w);
+    
+    if (close(w->fd) < 0) r = -1;
+    w->fd = -1;
+    return r;
+}
+
+/*
+ * Reader
+ */
+
+struct tlm_reader {
+    FILE *f;
+    int started;            // inside a run; otherwise looking for START
+    uint64_t last_us;
+    uint64_t interval_us;
+    uint64_t runs;
+    uint64_t skipped;       // bytes of damaged or cut-off records
+    char path[TLM_DEVICES][64];
+    char serial[TLM_DEVICES][64];
+    int32_t prev[TLM_DEVICES][TLM_METRICS][TLM_FIELDS_MAX];
+};
+
+static inline void tlm_reader_init(struct tlm_reader *r, FILE *f) {
+    memset(r, 0, sizeof(*r));
+    r->f = f;
+}
+
+static inline int tlm_read_varint(FILE *f, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(f);
+        if (c == EOF) return -1;
+        *v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+
+// The rest of a START record after its 0xff
+static inline int tlm_read_start(struct tlm_reader *r) {
+    char magic[TLM_MAGIC_LEN - 1];
+    
+    if (fread(magic, 1, sizeof(magic), r->f) != sizeof(magic)) return -1;
+    if (memcmp(magic, TLM_MAGIC + 1, sizeof(magic)) != 0) return -1;
+    if (tlm_read_varint(r->f, &r->last_us) < 0 || tlm_read_varint(r->f, &r->interval_us) < 0) return -1;
+    memset(r->prev, 0, sizeof(r->prev));
+    memset(r->path, 0, sizeof(r->path));
+    memset(r->serial, 0, sizeof(r->serial));
+    r->started = 1;
+    r->runs++;
+    return 0;
+}
+
+static inline int tlm_decode_device(struct tlm_reader *r, const unsigned char *p, const unsigned char *end) {
+    if (end - p < 2) return -1;
+    int dev = *p++;
+    size_t path_len = *p++;
+    if ((size_t)(end - p) < path_len + 1 || path_len >= sizeof(r->path[0])) return -1;
+    memcpy(r->path[dev], p, path_len);
+    r->path[dev][path_len] = '\0';
+    p += path_len;
+    size_t serial_len = *p++;
+    if ((size_t)(end - p) != serial_len || serial_len >= sizeof(r->serial[0])) return -1;
+    memcpy(r->serial[dev], p, serial_len);
+    r->serial[dev][serial_len] = '\0';
+    memset(r->prev[dev], 0, sizeof(r->prev[dev]));
+    return 0;
+}
+
+static inline int tlm_decode_sample(struct tlm_reader *r, const unsigned char *p, const unsigned char *end,
+                                    struct tlm_sample *s) {
+    uint64_t v;
+    
+    if (end - p < 3) return -1;
+    s->dev = *p++;
+    if (!r->path[s->dev][0] || tlm_get_varint(&p, end, &v) < 0 || p == end) return -1;
+    s->wall_us = r->last_us + (uint64_t)tlm_unzigzag(v);
+    s->mask = *p++;
+    if (s->mask >> TLM_METRICS) return -1;
+    
+    for (int m = 0; m < TLM_METRICS; m++) {
+        for (int f = 0; f < TLM_FIELDS_MAX; f++) s->value[m][f] = TLM_NONE;
+        if (!(s->mask & (1u << m))) continue;
+        for (int f = 0; f < tlm_metrics[m].fields; f++) {
+            if (tlm_get_varint(&p, end, &v) < 0) return -1;
+            r->prev[s->dev][m][f] = (int32_t)(r->prev[s->dev][m][f] + tlm_unzigzag(v));
+            s->value[m][f] = r->prev[s->dev][m][f];
+        }
+    }
+    if (p != end) return -1;
+    r->last_us = s->wall_us;
+    return 0;
+}
+
+// Next sample into s: 1, or 0 at the end of the file. Damaged records are
+// skipped up to the next START and counted in r->skipped.
+static inline int tlm_read(struct tlm_reader *r, struct tlm_sample *s) {
+    unsigned char p[TLM_RECORD_MAX + 1];
+    
+    for (;;) {
+        long at = ftell(r->f);
+        int c = getc(r->f);
+        uint64_t len;
+        
+        if (c == EOF) return 0;
+        if (c == 0xFF) {
+            if (tlm_read_start(r) == 0) continue;
+        } else if (r->started && (c == 'D' || c == 'V') && tlm_read_varint(r->f, &len) == 0 &&
+                   len <= TLM_RECORD_MAX && fread(p, 1, (size_t)len + 1, r->f) == len + 1 &&
+                   tlm_check(p, (size_t)len) == p[len]) {
+            if (c == 'D' && tlm_decode_device(r, p, p + len) == 0) continue;
+            if (c == 'V' && tlm_decode_sample(r, p, p + len, s) == 0) return 1;
+        }
+        
+        // Not a valid record: resume at the next START, which may well be
+        // inside the bytes just read
+        r->started = 0;
+        r->skipped++;
+        if (at >= 0 && ftell(r->f) != at + 1) fseek(r->f, at + 1, SEEK_SET);
+    }
+}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Small libusb helpers shared by libhuawei and the tools
+ *
+ * Everything reaches USB only through a struct usb_transport, the one a
+ * libhuawei context picked (struct huawei_ctx, usb). It is libusb itself
+ * unless HUAWEI_TRANSPORT=sim swaps in the simulated modem from
+ * huawei_sim.c, so the command and switch paths can be run and benchmarked
+ * without a stick attached.
+ */
+
+#ifndef HUAWEI_USB_H
+#define HUAWEI_USB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+
+#define USB_PATH_MAX        32
+
+// The libusb calls the tools make, with libusb's signatures
+struct usb_transport {
+    const char *name;
+    int (*init)(libusb_context **ctx);
+    void (*exit)(libusb_context *ctx);
+    ssize_t (*get_device_list)(libusb_context *ctx, libusb_device ***list);
+    void (*free_device_list)(libusb_device **list, int unref);
+    libusb_device *(*ref_device)(libusb_device *dev);
+    void (*unref_device)(libusb_device *dev);
+    int (*get_device_descriptor)(libusb_device *dev, struct libusb_device_descriptor *desc);
+    int (*get_active_config_descriptor)(libusb_device *dev, struct libusb_config_descriptor **config);
+    void (*free_config_descriptor)(struct libusb_config_descriptor *config);
+    uint8_t (*get_bus_number)(libusb_device *dev);
+    int (*get_port_numbers)(libusb_device *dev, uint8_t *ports, int len);
+    int (*open)(libusb_device *dev, libusb_device_handle **handle);
+    void (*close)(libusb_device_handle *handle);
+    libusb_device *(*get_device)(libusb_device_handle *handle);
+    int (*claim_interface)(libusb_device_handle *handle, int interface);
+    int (*release_interface)(libusb_device_handle *handle, int interface);
+    int (*set_interface_alt_setting)(libusb_device_handle *handle, int interface, int alt_setting);
+    int (*kernel_driver_active)(libusb_device_handle *handle, int interface);
+    int (*detach_kernel_driver)(libusb_device_handle *handle, int interface);
+    int (*set_configuration)(libusb_device_handle *handle, int config);
+    int (*reset_device)(libusb_device_handle *handle);
+    int (*get_string_descriptor_ascii)(libusb_device_handle *handle, uint8_t index, unsigned char *data, int len);
+    int (*control_transfer)(libusb_device_handle *handle, uint8_t request_type, uint8_t request, uint16_t value,
+                            uint16_t index, unsigned char *data, uint16_t len, unsigned int timeout);
+    int (*bulk_transfer)(libusb_device_handle *handle, unsigned char endpoint, unsigned char *data, int len,
+                         int *transferred, unsigned int timeout);
+    struct libusb_transfer *(*alloc_transfer)(int iso_packets);
+    void (*free_transfer)(struct libusb_transfer *transfer);
+    int (*submit_transfer)(struct libusb_transfer *transfer);
+    int (*cancel_transfer)(struct libusb_transfer *transfer);
+    int (*handle_events_timeout_completed)(libusb_context *ctx, struct timeval *tv, int *completed);
+    int (*has_capability)(uint32_t capability);
+    int (*hotplug_register_callback)(libusb_context *ctx, int events, int flags, int vendor_id, int product_id,
+                                     int dev_class, libusb_hotplug_callback_fn cb, void *user_data,
+                                     libusb_hotplug_callback_handle *handle);
+    void (*hotplug_deregister_callback)(libusb_context *ctx, libusb_hotplug_callback_handle handle);
+};
+
+// libusb itself, libhuawei.c
+extern const struct usb_transport huawei_usb_libusb;
+
+// Simulated modem, huawei_sim.c. huawei_usb_sim_open() replaces huawei_usb_sim.init with
+// options ("sticks=4,latency=5"); each call gets a virtual bus of its own.
+// A bad option string fails with LIBUSB_ERROR_INVALID_PARAM and the reason in err.
+extern const struct usb_transport huawei_usb_sim;
+int huawei_usb_sim_open(libusb_context **ctx, const char *spec, char *err, size_t err_size);
+int huawei_usb_sim_script(libusb_context *ctx, const char *cmd, const char *info);
+
+// Monotonic clock in microseconds
+static inline uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Physical location as "<bus>-<port>[.<port>...]", stable across re-enumeration
+static inline void usb_port_path(const struct usb_transport *usb, libusb_device *dev, char *buf, size_t size) {
+    uint8_t ports[8];
+    int n = usb->get_port_numbers(dev, ports, (int)sizeof(ports));
+    int len = snprintf(buf, size, "%d", usb->get_bus_number(dev));
+    
+    for (int i = 0; i < n && len > 0 && (size_t)len < size; i++) {
+        len += snprintf(buf + len, size - (size_t)len, "%c%d", i == 0 ? '-' : '.', ports[i]);
+    }
+}
+
+// The libusb error for a transfer that did not complete
+static inline int transfer_status_error(enum libusb_transfer_status status) {
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED: return 0;
+        case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_STALL:     return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_OVERFLOW:  return LIBUSB_ERROR_OVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+        default:                        return LIBUSB_ERROR_IO;
+    }
+}
+
+#endif
@@ -0,0 +1,2077 @@
+/*
+ * libhuawei - discovery, AT commands and mode switching for Huawei sticks
+ * See libhuawei.h for the API.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+
+#include "huawei_pids.h"
+#include "libhuawei_internal.h"
+
+const struct usb_transport huawei_usb_libusb = {
+    "libusb",
+    libusb_init,
+    libusb_exit,
+    libusb_get_device_list,
+    libusb_free_device_list,
+    libusb_ref_device,
+    libusb_unref_device,
+    libusb_get_device_descriptor,
+    libusb_get_active_config_descriptor,
+    libusb_free_config_descriptor,
+    libusb_get_bus_number,
+    libusb_get_port_numbers,
+    libusb_open,
+    libusb_close,
+    libusb_get_device,
+    libusb_claim_interface,
+    libusb_release_interface,
+    libusb_set_interface_alt_setting,
+    libusb_kernel_driver_active,
+    libusb_detach_kernel_driver,
+    libusb_set_configuration,
+    libusb_reset_device,
+    libusb_get_string_descriptor_ascii,
+    libusb_control_transfer,
+    libusb_bulk_transfer,
+    libusb_alloc_transfer,
+    libusb_free_transfer,
+    libusb_submit_transfer,
+    libusb_cancel_transfer,
+    libusb_handle_events_timeout_completed,
+    libusb_has_capability,
+    libusb_hotplug_register_callback,
+    libusb_hotplug_deregister_callback,
+};
+
+/*
+ * Context
+ */
+
+void huawei_log(struct huawei_ctx *hc, enum huawei_log_level level, const char *fmt, ...) {
+    char msg[512];
+    va_list ap;
+    
+    if (!hc->log) return;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    hc->log(hc->log_opaque, level, msg);
+}
+
+// The given file, or $<env>, or ~/.cache/<name>; empty if there is no home
+static void cache_path(char *buf, size_t size, const char *given, const char *env, const char *name) {
+    const char *home = getenv("HOME");
+    
+    buf[0] = '\0';
+    if (given || (given = getenv(env))) {
+        snprintf(buf, size, "%s", given);
+    } else if (home) {
+        snprintf(buf, size, "%s/.cache", home);
+        mkdir(buf, 0755);
+        snprintf(buf, size, "%s/.cache/%s", home, name);
+    }
+}
+
+/*
+ * Cache files are rewritten whole through a temporary file that is renamed
+ * over them. The name is unique (mkstemp), so processes saving at the same
+ * time cannot write into each other's temporary file.
+ */
+static FILE *cache_tmp_open(const char *path, char *tmp, size_t size) {
+    if ((size_t)snprintf(tmp, size, "%s.XXXXXX", path) >= size) return NULL;
+    
+    int fd = mkstemp(tmp);
+    if (fd < 0) return NULL;
+    FILE *f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        unlink(tmp);
+    }
+    return f;
+}
+
+static void cache_tmp_commit(FILE *f, const char *tmp, const char *path) {
+    if (fclose(f) != 0 || rename(tmp, path) != 0) unlink(tmp);
+}
+
+int huawei_init(struct huawei_ctx **out, const struct huawei_options *options) {
+    static const struct huawei_options defaults;
+    const struct huawei_options *o = options ? options : &defaults;
+    const char *transport = o->transport ? o->transport : getenv("HUAWEI_TRANSPORT");
+    struct huawei_ctx *hc = calloc(1, sizeof(*hc));
+    
+    *out = NULL;
+    if (!hc) return LIBUSB_ERROR_NO_MEM;
+    hc->log = o->log;
+    hc->log_opaque = o->log_opaque;
+    hc->usb = &huawei_usb_libusb;
+    if (transport && transport[0] && strcmp(transport, "usb") != 0) {
+        if (strcmp(transport, "sim") != 0) {
+            huawei_log(hc, HUAWEI_LOG_ERROR, "Unknown transport '%s' (use usb or sim)", transport);
+            free(hc);
+            return LIBUSB_ERROR_INVALID_PARAM;
+        }
+        hc->usb = &huawei_usb_sim;
+    }
+    
+    hc->use_ep_cache = !o->no_endpoint_cache;
+    hc->use_strategies = !o->no_strategies;
+    cache_path(hc->ep_cache_file, sizeof(hc->ep_cache_file), o->endpoint_cache, "HUAWEI_AT_CACHE",
+               "huawei_at.endpoints");
+    cache_path(hc->strategy_file, sizeof(hc->strategy_file), o->strategy_cache, "HUAWEI_MODESWITCH_CACHE",
+               "huawei_modeswitch.strategies");
+    pthread_mutex_init(&hc->strategy_lock, NULL);
+    
+    char err[256] = "";
+    uint64_t t = now_us();
+    const char *sim = o->sim ? o->sim : getenv("HUAWEI_SIM");
+    int r = hc->usb == &huawei_usb_sim ? huawei_usb_sim_open(&hc->usb_ctx, sim, err, sizeof(err))
+                                       : hc->usb->init(&hc->usb_ctx);
+    hc->startup.init_us = now_us() - t;
+    if (r < 0) {
+        if (err[0]) huawei_log(hc, HUAWEI_LOG_ERROR, "%s", err);
+        pthread_mutex_destroy(&hc->strategy_lock);
+        free(hc);
+        return r;
+    }
+    *out = hc;
+    return 0;
+}
+
+void huawei_exit(struct huawei_ctx *hc) {
+    if (!hc) return;
+    huawei_hotplug_deregister(hc);
+    hc->usb->exit(hc->usb_ctx);
+    pthread_mutex_destroy(&hc->strategy_lock);
+    free(hc);
+}
+
+void huawei_set_endpoint_cache(struct huawei_ctx *hc, int on) {
+    hc->use_ep_cache = on;
+}
+
+void huawei_set_strategies(struct huawei_ctx *hc, int on) {
+    hc->use_strategies = on;
+}
+
+void huawei_get_startup(const struct huawei_ctx *hc, struct huawei_startup *startup) {
+    *startup = hc->startup;
+}
+
+void huawei_clear_startup(struct huawei_ctx *hc) {
+    uint64_t init_us = hc->startup.init_us;
+    
+    memset(&hc->startup, 0, sizeof(hc->startup));
+    hc->startup.init_us = init_us;
+}
+
+int huawei_handle_events(struct huawei_ctx *hc, uint64_t max_us) {
+    struct timeval tv = {(time_t)(max_us / 1000000), (suseconds_t)(max_us % 1000000)};
+    return hc->usb->handle_events_timeout_completed(hc->usb_ctx, &tv, NULL);
+}
+
+int huawei_sim_script(struct huawei_ctx *hc, const char *cmd, const char *info) {
+    if (hc->usb != &huawei_usb_sim) return LIBUSB_ERROR_NOT_SUPPORTED;
+    return huawei_usb_sim_script(hc->usb_ctx, cmd, info);
+}
+
+/*
+ * Interfaces and roles
+ */
+
+static const char *port_role_names[HUAWEI_ROLES] = {"other", "modem", "pcui", "diag", "ncm"};
+
+const char *huawei_role_name(enum huawei_role role) {
+    return (unsigned)role < HUAWEI_ROLES ? port_role_names[role] : "other";
+}
+
+// Interface roles by number, for PIDs whose descriptors do not say
+static const struct {
+    uint16_t pid;
+    enum huawei_role role[4];
+} port_layouts[] = {
+    {0x1001, {HUAWEI_ROLE_MODEM, HUAWEI_ROLE_DIAG, HUAWEI_ROLE_PCUI, HUAWEI_ROLE_OTHER}},     // E169/E620/E800/E1550
+    {0x1003, {HUAWEI_ROLE_MODEM, HUAWEI_ROLE_PCUI, HUAWEI_ROLE_OTHER, HUAWEI_ROLE_OTHER}},    // E220/E1550
+    {0x140c, {HUAWEI_ROLE_MODEM, HUAWEI_ROLE_DIAG, HUAWEI_ROLE_PCUI, HUAWEI_ROLE_OTHER}},     // E180
+    {0x1436, {HUAWEI_ROLE_MODEM, HUAWEI_ROLE_DIAG, HUAWEI_ROLE_PCUI, HUAWEI_ROLE_OTHER}},     // E173/E1750
+};
+
+static enum huawei_role port_role_of(uint16_t pid, const struct libusb_interface_descriptor *setting) {
+    if (setting->bInterfaceClass == 0x0A && setting->bInterfaceProtocol == 0x01) return HUAWEI_ROLE_NCM;
+    if (setting->bInterfaceClass == 0x0A) return HUAWEI_ROLE_MODEM;    // CDC data of an ACM modem
+    if (setting->bInterfaceClass == 0xFF && setting->bInterfaceProtocol != 0xFF) {
+        switch (setting->bInterfaceProtocol & 0x0F) {
+            case 1:  return HUAWEI_ROLE_MODEM;
+            case 2:  return HUAWEI_ROLE_PCUI;
+            case 3:  return HUAWEI_ROLE_DIAG;
+            default: return HUAWEI_ROLE_OTHER;
+        }
+    }
+    for (size_t i = 0; i < sizeof(port_layouts) / sizeof(port_layouts[0]); i++) {
+        if (port_layouts[i].pid == pid && setting->bInterfaceNumber < 4) {
+            return port_layouts[i].role[setting->bInterfaceNumber];
+        }
+    }
+    return HUAWEI_ROLE_OTHER;
+}
+
+int huawei_find_ports(struct huawei_ctx *hc, libusb_device *dev, uint16_t pid, struct huawei_iface *ports, int max,
+                      int *preferred, int *num_interfaces) {
+    struct libusb_config_descriptor *config;
+    int r = hc->usb->get_active_config_descriptor(dev, &config);
+    if (r < 0) return r;
+    
+    int n = 0;
+    *num_interfaces = config->bNumInterfaces;
+    *preferred = -1;
+    
+    for (int i = 0; i < config->bNumInterfaces && n < max; i++) {
+        const struct libusb_interface *iface = &config->interface[i];
+        for (int j = 0; j < iface->num_altsetting; j++) {
+            const struct libusb_interface_descriptor *setting = &iface->altsetting[j];
+            int found_in = -1, found_out = -1;
+            
+            for (int k = 0; k < setting->bNumEndpoints; k++) {
+                const struct libusb_endpoint_descriptor *ep = &setting->endpoint[k];
+                if ((ep->bmAttributes & 0x03) == LIBUSB_TRANSFER_TYPE_BULK) {
+                    if (ep->bEndpointAddress & 0x80) {
+                        found_in = ep->bEndpointAddress;
+                    } else {
+                        found_out = ep->bEndpointAddress;
+                    }
+                }
+            }
+            if (found_in < 0 || found_out < 0) continue;
+            
+            // CDC Data (0x0A), Vendor Specific (0xFF) or CDC Communications (0x02), not NCM data
+            ports[n].role = port_role_of(pid, setting);
+            if (*preferred < 0 && ports[n].role != HUAWEI_ROLE_NCM &&
+                (setting->bInterfaceClass == 0x0A || setting->bInterfaceClass == 0xFF ||
+                 setting->bInterfaceClass == 0x02)) {
+                *preferred = n;
+            }
+            ports[n].interface = setting->bInterfaceNumber;
+            ports[n].ep_in = found_in;
+            ports[n].ep_out = found_out;
+            n++;
+            break;
+        }
+    }
+    
+    hc->usb->free_config_descriptor(config);
+    if (n > 0 && *preferred < 0) *preferred = 0;
+    return n;
+}
+
+int huawei_select_ports(struct huawei_ctx *hc, const struct huawei_iface *ports, int nports, const char *spec,
+                        int *pick, int max, const char *path) {
+    char copy[64];
+    char *save = NULL;
+    int n = 0;
+    
+    snprintf(copy, sizeof(copy), "%s", spec);
+    for (char *name = strtok_r(copy, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        int i = 0;
+        if (isdigit((unsigned char)name[0])) {
+            while (i < nports && ports[i].interface != atoi(name)) i++;
+        } else {
+            while (i < nports && strcmp(huawei_role_name(ports[i].role), name) != 0) i++;
+        }
+        if (i == nports) {
+            huawei_log(hc, HUAWEI_LOG_ERROR, "%s: no %s interface", path, name);
+            return -1;
+        }
+        if (ports[i].role == HUAWEI_ROLE_NCM) {
+            huawei_log(hc, HUAWEI_LOG_ERROR, "%s: interface %d carries NCM data, not AT commands", path,
+                       ports[i].interface);
+            return -1;
+        }
+        for (int k = 0; k < n; k++) {
+            if (pick[k] == i) {
+                huawei_log(hc, HUAWEI_LOG_ERROR, "%s: interface %d listed twice", path, ports[i].interface);
+                return -1;
+            }
+        }
+        if (n == max) {
+            huawei_log(hc, HUAWEI_LOG_ERROR, "%s: at most %d interfaces", path, max);
+            return -1;
+        }
+        pick[n++] = i;
+    }
+    return n;
+}
+
+int huawei_pid_priority(uint16_t pid) {
+    const struct huawei_pid *p = huawei_pid_lookup(pid);
+    return (p && p->priority) ? p->priority : -1;
+}
+
+static int list_devices(struct huawei_ctx *hc, struct huawei_device_info *list, int max, int ports) {
+    libusb_device **devs;
+    ssize_t cnt = hc->usb->get_device_list(hc->usb_ctx, &devs);
+    int n = 0;
+    
+    if (cnt < 0) return (int)cnt;
+    for (ssize_t i = 0; i < cnt && n < max; i++) {
+        struct libusb_device_descriptor desc;
+        if (hc->usb->get_device_descriptor(devs[i], &desc) < 0 || desc.idVendor != HUAWEI_VENDOR_ID) continue;
+        
+        struct huawei_device_info *d = &list[n++];
+        int num_interfaces;
+        usb_port_path(hc->usb, devs[i], d->path, sizeof(d->path));
+        d->pid = desc.idProduct;
+        d->bcd_device = desc.bcdDevice;
+        d->nports = 0;
+        d->preferred = 0;
+        if (!ports) continue;
+        d->nports = huawei_find_ports(hc, devs[i], desc.idProduct, d->ports, MODEM_PORTS_MAX, &d->preferred,
+                                      &num_interfaces);
+        if (d->nports < 0) d->nports = 0;
+    }
+    hc->usb->free_device_list(devs, 1);
+    return n;
+}
+
+int huawei_list_devices(struct huawei_ctx *hc, struct huawei_device_info *list, int max) {
+    return list_devices(hc, list, max, 1);
+}
+
+int huawei_scan_devices(struct huawei_ctx *hc, struct huawei_device_info *list, int max) {
+    return list_devices(hc, list, max, 0);
+}
+
+#define WAIT_POLL_MS        100
+
+int huawei_wait_modem(struct huawei_ctx *hc, const char *path, int timeout_ms, uint16_t *pid) {
+    uint64_t deadline = now_us() + (uint64_t)timeout_ms * 1000;
+    
+    for (;;) {
+        struct huawei_device_info list[MAX_MODEMS];
+        int n = huawei_scan_devices(hc, list, MAX_MODEMS);
+        
+        if (n < 0) return n;
+        for (int i = 0; i < n; i++) {
+            if (huawei_is_zerocd_pid(list[i].pid) || strcmp(list[i].path, path) != 0) continue;
+            *pid = list[i].pid;
+            return 1;
+        }
+        if (now_us() >= deadline) return 0;
+        usleep(WAIT_POLL_MS * 1000);
+    }
+}
+
+/*
+ * Hotplug
+ */
+
+static int hotplug_event(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data) {
+    struct huawei_ctx *hc = user_data;
+    struct libusb_device_descriptor desc;
+    char path[USB_PATH_MAX];
+    
+    (void)ctx;
+    if (hc->usb->get_device_descriptor(dev, &desc) < 0) return 0;
+    usb_port_path(hc->usb, dev, path, sizeof(path));
+    hc->hotplug_fn(hc->hotplug_opaque, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, desc.idProduct, path);
+    return 0;
+}
+
+int huawei_hotplug_register(struct huawei_ctx *hc, huawei_hotplug_fn fn, void *opaque) {
+    if (hc->hotplug) return LIBUSB_ERROR_BUSY;
+    if (!hc->usb->has_capability(LIBUSB_CAP_HAS_HOTPLUG)) return LIBUSB_ERROR_NOT_SUPPORTED;
+    
+    hc->hotplug_fn = fn;
+    hc->hotplug_opaque = opaque;
+    int r = hc->usb->hotplug_register_callback(hc->usb_ctx,
+        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_ENUMERATE, HUAWEI_VENDOR_ID, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+        hotplug_event, hc, &hc->hotplug_handle);
+    if (r == 0) hc->hotplug = 1;
+    return r;
+}
+
+void huawei_hotplug_deregister(struct huawei_ctx *hc) {
+    if (!hc->hotplug) return;
+    hc->usb->hotplug_deregister_callback(hc->usb_ctx, hc->hotplug_handle);
+    hc->hotplug = 0;
+}
+
+/*
+ * Response parser
+ */
+
+static const struct {
+    const char *text;
+    enum huawei_final code;
+    int is_prefix;
+} at_final_codes[] = {
+    {"OK",                  HUAWEI_FINAL_OK,            0},
+    {"ERROR",               HUAWEI_FINAL_ERROR,         0},
+    {"+CME ERROR:",         HUAWEI_FINAL_CME_ERROR,     1},
+    {"+CMS ERROR:",         HUAWEI_FINAL_CMS_ERROR,     1},
+    {"CONNECT",             HUAWEI_FINAL_CONNECT,       1},  // CONNECT <rate>
+    {"NO CARRIER",          HUAWEI_FINAL_NO_CARRIER,    0},
+    {"NO DIALTONE",         HUAWEI_FINAL_NO_DIALTONE,   0},
+    {"NO DIAL TONE",        HUAWEI_FINAL_NO_DIALTONE,   0},
+    {"BUSY",                HUAWEI_FINAL_BUSY,          0},
+    {"NO ANSWER",           HUAWEI_FINAL_NO_ANSWER,     0},
+    {"COMMAND NOT SUPPORT", HUAWEI_FINAL_NOT_SUPPORTED, 0},  // Huawei firmware
+    {NULL, HUAWEI_FINAL_NONE, 0}
+};
+
+// ATV0 numeric result codes (2 is RING, which is unsolicited)
+static const enum huawei_final at_numeric_codes[10] = {
+    HUAWEI_FINAL_OK, HUAWEI_FINAL_CONNECT, HUAWEI_FINAL_NONE, HUAWEI_FINAL_NO_CARRIER, HUAWEI_FINAL_ERROR,
+    HUAWEI_FINAL_NONE, HUAWEI_FINAL_NO_DIALTONE, HUAWEI_FINAL_BUSY, HUAWEI_FINAL_NO_ANSWER, HUAWEI_FINAL_NONE
+};
+
+static const char *urc_class_names[HUAWEI_URC_CLASSES] = {
+    "call", "sms", "ussd", "network", "signal", "data", "system", "other"
+};
+
+const char *huawei_urc_class_name(enum huawei_urc_class cls) {
+    return (unsigned)cls < HUAWEI_URC_CLASSES ? urc_class_names[cls] : "other";
+}
+
+static const struct {
+    const char *prefix;
+    enum huawei_urc_class cls;
+} at_urcs[] = {
+    {"RING",         HUAWEI_URC_CALL},    {"+CRING:",      HUAWEI_URC_CALL},    {"+CLIP:",       HUAWEI_URC_CALL},
+    {"^ORIG:",       HUAWEI_URC_CALL},    {"^CONF:",       HUAWEI_URC_CALL},    {"^CONN:",       HUAWEI_URC_CALL},
+    {"^CEND:",       HUAWEI_URC_CALL},
+    {"+CMTI:",       HUAWEI_URC_SMS},     {"+CMT:",        HUAWEI_URC_SMS},     {"+CDSI:",       HUAWEI_URC_SMS},
+    {"+CDS:",        HUAWEI_URC_SMS},     {"+CBM:",        HUAWEI_URC_SMS},
+    {"+CUSD:",       HUAWEI_URC_USSD},
+    {"+CREG:",       HUAWEI_URC_NETWORK}, {"+CGREG:",      HUAWEI_URC_NETWORK}, {"+CEREG:",      HUAWEI_URC_NETWORK},
+    {"+CGEV:",       HUAWEI_URC_NETWORK}, {"^MODE:",       HUAWEI_URC_NETWORK}, {"^SRVST:",      HUAWEI_URC_NETWORK},
+    {"^NWTIME:",     HUAWEI_URC_NETWORK}, {"^ACTIVEBAND:", HUAWEI_URC_NETWORK}, {"^LOCCHD:",     HUAWEI_URC_NETWORK},
+    {"^RSSI:",       HUAWEI_URC_SIGNAL},  {"^HCSQ:",       HUAWEI_URC_SIGNAL},
+    {"^DSFLOWRPT:",  HUAWEI_URC_DATA},    {"^NDISSTAT:",   HUAWEI_URC_DATA},
+    {"^BOOT:",       HUAWEI_URC_SYSTEM},  {"^SIMST:",      HUAWEI_URC_SYSTEM},  {"^SYSSTART",    HUAWEI_URC_SYSTEM},
+    {"^RFSWITCH:",   HUAWEI_URC_SYSTEM},  {"^STIN:",       HUAWEI_URC_SYSTEM},  {"^EARST:",      HUAWEI_URC_SYSTEM},
+    {NULL, HUAWEI_URC_OTHER}
+};
+
+const char *huawei_final_name(enum huawei_final final) {
+    switch (final) {
+        case HUAWEI_FINAL_OK:            return "OK";
+        case HUAWEI_FINAL_CONNECT:       return "CONNECT";
+        case HUAWEI_FINAL_NO_CARRIER:    return "NO CARRIER";
+        case HUAWEI_FINAL_ERROR:         return "ERROR";
+        case HUAWEI_FINAL_NO_DIALTONE:   return "NO DIALTONE";
+        case HUAWEI_FINAL_BUSY:          return "BUSY";
+        case HUAWEI_FINAL_NO_ANSWER:     return "NO ANSWER";
+        case HUAWEI_FINAL_CME_ERROR:     return "+CME ERROR";
+        case HUAWEI_FINAL_CMS_ERROR:     return "+CMS ERROR";
+        case HUAWEI_FINAL_NOT_SUPPORTED: return "COMMAND NOT SUPPORT";
+        case HUAWEI_FINAL_PROMPT:        return ">";
+        default:                     return "NONE";
+    }
+}
+
+int huawei_final_is_error(enum huawei_final final) {
+    return final != HUAWEI_FINAL_OK && final != HUAWEI_FINAL_CONNECT;
+}
+
+int huawei_at_starts_with(const char *s, size_t len, const char *prefix) {
+    size_t n = strlen(prefix);
+    return len >= n && memcmp(s, prefix, n) == 0;
+}
+
+enum huawei_final huawei_at_match_final(const char *s, size_t len, int numeric) {
+    if (numeric && len == 1 && s[0] >= '0' && s[0] <= '9') {
+        return at_numeric_codes[s[0] - '0'];
+    }
+    for (int i = 0; at_final_codes[i].text; i++) {
+        size_t n = strlen(at_final_codes[i].text);
+        if (len < n || memcmp(s, at_final_codes[i].text, n) != 0) continue;
+        if (len == n || (at_final_codes[i].is_prefix && (s[n] == ' ' || s[n - 1] == ':'))) {
+            return at_final_codes[i].code;
+        }
+    }
+    return HUAWEI_FINAL_NONE;
+}
+
+enum huawei_urc_class huawei_at_urc_class(const char *s, size_t len) {
+    for (int i = 0; at_urcs[i].prefix; i++) {
+        if (huawei_at_starts_with(s, len, at_urcs[i].prefix)) return at_urcs[i].cls;
+    }
+    return HUAWEI_URC_OTHER;
+}
+
+static int at_is_urc(const struct at_parser *p, const char *s, size_t len) {
+    // A query's own reply (+CREG: for AT+CREG?) looks like the URC but isn't
+    if (p->prefix_len && len >= p->prefix_len && memcmp(s, p->prefix, p->prefix_len) == 0 &&
+        (len == p->prefix_len || s[p->prefix_len] == ':')) {
+        return 0;
+    }
+    return huawei_at_urc_class(s, len) != HUAWEI_URC_OTHER;
+}
+
+// cmd == NULL parses traffic with no command outstanding: everything is a URC
+void huawei_at_parser_reset(struct at_parser *p, const char *cmd, huawei_line_fn fn, void *opaque) {
+    memset(p, 0, sizeof(*p));
+    p->on_line = fn;
+    p->opaque = opaque;
+    p->first_line = 1;
+    if (!cmd) return;
+    
+    snprintf(p->cmd, sizeof(p->cmd), "%s", cmd);
+    
+    // "AT+CREG=2;+CGREG?" -> "+CREG"
+    const char *c = p->cmd;
+    if ((c[0] == 'A' || c[0] == 'a') && (c[1] == 'T' || c[1] == 't')) c += 2;
+    if (*c == '+' || *c == '^' || *c == '$' || *c == '%') {
+        p->prefix[p->prefix_len++] = *c++;
+        while (*c && *c != '=' && *c != '?' && *c != ';' && p->prefix_len < sizeof(p->prefix) - 1) {
+            char ch = *c++;
+            p->prefix[p->prefix_len++] = (ch >= 'a' && ch <= 'z') ? (char)(ch - 32) : ch;
+        }
+    }
+    
+    // Text entry commands answer "AT+CMGS=<n>" with a prompt instead of a result code
+    p->prompt = *c == '=' && (strcmp(p->prefix, "+CMGS") == 0 || strcmp(p->prefix, "+CMGW") == 0 ||
+                              strcmp(p->prefix, "+CMGC") == 0);
+}
+
+static void at_parser_line(struct at_parser *p) {
+    const char *s = p->line;
+    size_t len = p->len;
+    enum huawei_line_kind kind;
+    enum huawei_final final;
+    
+    // ATV1 opens every block of reply lines with an empty line (CR LF); in
+    // ATV0 lines only end with one, and only there is a lone digit a result code
+    if (p->lead >= 3 || (p->lead == 2 && !p->lines)) p->framed = 1;
+    
+    p->len = 0;
+    if (p->partial) {
+        // Tail of an overlong line
+        p->partial = 0;
+        kind = HUAWEI_LINE_INFO;
+    } else if (p->first_line && p->cmd[0] && len == strlen(p->cmd) && strncasecmp(s, p->cmd, len) == 0) {
+        kind = HUAWEI_LINE_ECHO;
+    } else if (p->cmd[0] && (final = huawei_at_match_final(s, len, !p->framed)) != HUAWEI_FINAL_NONE) {
+        p->final = final;
+        kind = HUAWEI_LINE_FINAL;
+    } else if (!p->cmd[0] || at_is_urc(p, s, len)) {
+        kind = HUAWEI_LINE_URC;
+    } else {
+        kind = HUAWEI_LINE_INFO;
+    }
+    
+    if (kind != HUAWEI_LINE_ECHO) p->lines++;
+    p->first_line = 0;
+    p->line[len] = '\0';
+    if (p->on_line) p->on_line(p->opaque, kind, s, len);
+}
+
+// Returns the bytes taken: everything, unless the reply ended early with a
+// prompt or CONNECT, after which the rest is not AT traffic
+size_t huawei_at_parser_feed(struct at_parser *p, const unsigned char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = (char)data[i];
+        
+        if (c == '>' && p->prompt && p->len == 0 && !p->partial) {
+            p->final = HUAWEI_FINAL_PROMPT;
+            if (p->on_line) p->on_line(p->opaque, HUAWEI_LINE_FINAL, "> ", 2);
+            return i + 1;   // nothing more comes until the text is sent
+        }
+        
+        if (c == '\r' || c == '\n') {
+            if (p->len > 0) at_parser_line(p);
+            p->breaks++;
+            if (p->final == HUAWEI_FINAL_CONNECT) {
+                // Data mode from the next byte on; the line ending goes with the result code
+                if (c == '\r' && i + 1 < len && data[i + 1] == '\n') i++;
+                return i + 1;
+            }
+            continue;
+        }
+        
+        if (p->len == sizeof(p->line) - 1) {
+            // Hand over what we have and keep going with constant memory
+            p->line[p->len] = '\0';
+            if (p->on_line) p->on_line(p->opaque, HUAWEI_LINE_PARTIAL, p->line, p->len);
+            p->first_line = 0;
+            p->partial = 1;
+            p->len = 0;
+        }
+        if (p->len == 0 && !p->partial) {
+            p->lead = p->breaks;
+            p->breaks = 0;
+        }
+        p->line[p->len++] = c;
+    }
+    return len;
+}
+
+static void at_append(char *buf, size_t size, size_t *used, const char *s, size_t len, int *truncated) {
+    if (*used + len >= size) {
+        len = size - 1 - *used;
+        *truncated = 1;
+    }
+    memcpy(buf + *used, s, len);
+    *used += len;
+    buf[*used] = '\0';
+}
+
+void huawei_result_init(struct huawei_result *res) {
+    res->raw_len = 0;
+    res->raw[0] = '\0';
+    res->info_len = 0;
+    res->info[0] = '\0';
+    res->info_lines = 0;
+    res->urc_len = 0;
+    res->urc[0] = '\0';
+    res->urcs = 0;
+    res->echo = 0;
+    res->truncated = 0;
+    res->final = HUAWEI_FINAL_NONE;
+    res->final_line[0] = '\0';
+}
+
+// Default line callback: collect a structured result
+void huawei_result_line(void *opaque, enum huawei_line_kind kind, const char *line, size_t len) {
+    struct huawei_result *res = opaque;
+    int dropped = 0;
+    
+    switch (kind) {
+        case HUAWEI_LINE_ECHO:
+            res->echo = 1;
+            break;
+        case HUAWEI_LINE_PARTIAL:
+            at_append(res->info, sizeof(res->info), &res->info_len, line, len, &res->truncated);
+            break;
+        case HUAWEI_LINE_INFO:
+            at_append(res->info, sizeof(res->info), &res->info_len, line, len, &res->truncated);
+            at_append(res->info, sizeof(res->info), &res->info_len, "\n", 1, &res->truncated);
+            res->info_lines++;
+            break;
+        case HUAWEI_LINE_URC:
+            at_append(res->urc, sizeof(res->urc), &res->urc_len, line, len, &dropped);
+            at_append(res->urc, sizeof(res->urc), &res->urc_len, "\n", 1, &dropped);
+            res->urcs++;
+            break;
+        case HUAWEI_LINE_FINAL:
+            snprintf(res->final_line, sizeof(res->final_line), "%.*s", (int)len, line);
+            break;
+    }
+}
+
+// Parse a complete raw reply (e.g. one relayed by the daemon) into res
+void huawei_result_parse(struct huawei_result *res, const char *cmd, const char *raw, size_t len) {
+    struct at_parser parser;
+    
+    huawei_result_init(res);
+    huawei_at_parser_reset(&parser, cmd, huawei_result_line, res);
+    huawei_at_parser_feed(&parser, (const unsigned char *)raw, len);
+    if (parser.len > 0) at_parser_line(&parser);
+    
+    at_append(res->raw, sizeof(res->raw), &res->raw_len, raw, len, &res->truncated);
+    res->final = parser.final;
+}
+
+struct huawei_result *huawei_result_new(void) {
+    struct huawei_result *res = malloc(sizeof(*res));
+    
+    if (res) huawei_result_init(res);
+    return res;
+}
+
+void huawei_result_free(struct huawei_result *res) {
+    free(res);
+}
+
+enum huawei_final huawei_result_final(const struct huawei_result *res) {
+    return res->final;
+}
+
+const char *huawei_result_final_line(const struct huawei_result *res) {
+    return res->final_line;
+}
+
+const char *huawei_result_info(const struct huawei_result *res) {
+    return res->info;
+}
+
+int huawei_result_lines(const struct huawei_result *res) {
+    return res->info_lines;
+}
+
+int huawei_result_truncated(const struct huawei_result *res) {
+    return res->truncated;
+}
+
+const char *huawei_result_urc(const struct huawei_result *res) {
+    return res->urc;
+}
+
+const char *huawei_result_raw(const struct huawei_result *res, size_t *len) {
+    if (len) *len = res->raw_len;
+    return res->raw;
+}
+
+static void at_port_fail(struct huawei_port *port, int error) {
+    port->error = error;
+    if (port->state == AT_PENDING) {
+        port->state = AT_FAILED;
+    }
+}
+
+static void at_port_rx(struct huawei_port *port, const unsigned char *data, int len) {
+    // Data with no command pending (unsolicited results, late replies) is
+    // dropped unless a data or URC sink is listening
+    if (port->state != AT_PENDING) {
+        if (port->on_data) {
+            port->on_data(port->data_opaque, data, (size_t)len);
+        } else if (port->on_urc) {
+            huawei_at_parser_feed(&port->idle, data, (size_t)len);
+        }
+        return;
+    }
+    
+    struct huawei_result *res = port->result;
+    port->last_rx_us = now_us();
+    if (!port->first_rx_us) port->first_rx_us = port->last_rx_us;
+    port->rx_bytes += (uint64_t)len;
+    
+    size_t used = huawei_at_parser_feed(&port->parser, data, (size_t)len);
+    if (!port->on_info) {
+        at_append(res->raw, sizeof(res->raw), &res->raw_len, (const char *)data, used, &res->truncated);
+    }
+    
+    if (port->parser.final != HUAWEI_FINAL_NONE) {
+        res->final = port->parser.final;
+        port->state = AT_DONE;
+        // The peer's first frames may share a transfer with the CONNECT
+        if (port->on_data && used < (size_t)len) port->on_data(port->data_opaque, data + used, (size_t)len - used);
+    }
+}
+
+static int at_port_arm(struct huawei_port *port, int i) {
+    int r = port->usb->submit_transfer(port->in_xfer[i]);
+    if (r == 0) {
+        port->in_armed[i] = 1;
+        port->in_flight++;
+    }
+    return r;
+}
+
+static void at_in_callback(struct libusb_transfer *t) {
+    struct huawei_port *port = t->user_data;
+    int i = 0;
+    
+    while (i < IN_TRANSFERS && port->in_xfer[i] != t) i++;
+    port->in_armed[i] = 0;
+    port->in_flight--;
+    
+    if (t->status == LIBUSB_TRANSFER_COMPLETED && t->actual_length > 0) {
+        at_port_rx(port, t->buffer, t->actual_length);
+    }
+    
+    if (port->closing || t->status == LIBUSB_TRANSFER_CANCELLED) return;
+    
+    if (t->status == LIBUSB_TRANSFER_COMPLETED || t->status == LIBUSB_TRANSFER_TIMED_OUT) {
+        if (at_port_arm(port, i) == 0) return;
+    }
+    
+    // Stalls and errors leave the transfer parked; the next command re-arms it
+    if (port->in_flight == 0) {
+        at_port_fail(port, transfer_status_error(t->status));
+    }
+}
+
+static void at_out_callback(struct libusb_transfer *t) {
+    struct huawei_port *port = t->user_data;
+    
+    port->out_busy = 0;
+    port->tx_done_us = now_us();
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+        at_port_fail(port, transfer_status_error(t->status));
+    }
+}
+
+int huawei_port_open(struct huawei_port *port, struct huawei_ctx *hc, libusb_device_handle *h, int in, int out) {
+    memset(port, 0, sizeof(*port));
+    port->usb = hc->usb;
+    port->ctx = hc->usb_ctx;
+    port->handle = h;
+    port->ep_in = in;
+    port->ep_out = out;
+    
+    port->out_xfer = port->usb->alloc_transfer(0);
+    if (!port->out_xfer) return LIBUSB_ERROR_NO_MEM;
+    libusb_fill_bulk_transfer(port->out_xfer, h, (unsigned char)out, port->out_buf, 0,
+                              at_out_callback, port, TIMEOUT_MS);
+    
+    for (int i = 0; i < IN_TRANSFERS; i++) {
+        port->in_xfer[i] = port->usb->alloc_transfer(0);
+        if (!port->in_xfer[i]) return LIBUSB_ERROR_NO_MEM;
+        // No timeout: IN transfers stay queued until data arrives or the port closes
+        libusb_fill_bulk_transfer(port->in_xfer[i], h, (unsigned char)in, port->in_buf[i],
+                                  IN_TRANSFER_SIZE, at_in_callback, port, 0);
+        int r = at_port_arm(port, i);
+        if (r < 0) return r;
+    }
+    
+    return 0;
+}
+
+void huawei_port_close(struct huawei_port *port) {
+    port->closing = 1;
+    
+    for (int i = 0; i < IN_TRANSFERS; i++) {
+        if (port->in_armed[i]) port->usb->cancel_transfer(port->in_xfer[i]);
+    }
+    if (port->out_busy) port->usb->cancel_transfer(port->out_xfer);
+    
+    // Wait for the cancellations to be reaped before freeing anything
+    uint64_t deadline = now_us() + (uint64_t)TIMEOUT_MS * 1000;
+    while ((port->in_flight > 0 || port->out_busy) && now_us() < deadline) {
+        struct timeval tv = {0, 100000};
+        port->usb->handle_events_timeout_completed(port->ctx, &tv, NULL);
+    }
+    
+    for (int i = 0; i < IN_TRANSFERS; i++) {
+        if (port->in_xfer[i]) port->usb->free_transfer(port->in_xfer[i]);
+    }
+    if (port->out_xfer) port->usb->free_transfer(port->out_xfer);
+    memset(port, 0, sizeof(*port));
+}
+
+static void at_port_idle_line(void *opaque, enum huawei_line_kind kind, const char *line, size_t len) {
+    struct huawei_port *port = opaque;
+    
+    // The tail of an overlong line comes back as INFO; its head was already passed on
+    if (kind != HUAWEI_LINE_INFO) port->on_urc(port->urc_opaque, line, len);
+}
+
+// During a command, URCs go to the sink as well as into the result, and
+// information lines of a streamed command go to its callback instead
+static void at_port_line(void *opaque, enum huawei_line_kind kind, const char *line, size_t len) {
+    struct huawei_port *port = opaque;
+    
+    if (kind == HUAWEI_LINE_URC && port->on_urc) port->on_urc(port->urc_opaque, line, len);
+    if (port->on_info && (kind == HUAWEI_LINE_INFO || kind == HUAWEI_LINE_PARTIAL)) {
+        port->on_info(port->info_opaque, kind, line, len);
+    } else {
+        huawei_result_line(port->result, kind, line, len);
+    }
+}
+
+// Pass every unsolicited line to fn, with or without a command pending.
+// Set after huawei_port_open(); fn runs from inside the libusb event loop.
+void huawei_port_set_urc(struct huawei_port *port, huawei_urc_fn fn, void *opaque) {
+    port->on_urc = fn;
+    port->urc_opaque = opaque;
+    huawei_at_parser_reset(&port->idle, NULL, at_port_idle_line, port);
+}
+
+// Pass everything received with no command pending to fn instead of parsing
+// it, for a port switched to data mode (ATD, then PPP). Set before the dial
+// command so nothing after its CONNECT is lost; NULL goes back to AT mode.
+void huawei_port_set_data(struct huawei_port *port, huawei_data_fn fn, void *opaque) {
+    port->on_data = fn;
+    port->data_opaque = opaque;
+}
+
+int huawei_port_queued(const struct huawei_port *port) {
+    return port->in_flight;
+}
+
+// Re-arm IN transfers parked by an earlier error; returns how many are queued
+int huawei_port_rearm(struct huawei_port *port) {
+    for (int i = 0; i < IN_TRANSFERS; i++) {
+        if (!port->in_armed[i]) at_port_arm(port, i);
+    }
+    return port->in_flight;
+}
+
+void huawei_port_set_timeout(struct huawei_port *port, unsigned timeout_ms) {
+    port->timeout_ms = timeout_ms;
+}
+
+void huawei_port_set_deadline(struct huawei_port *port, uint64_t deadline_us) {
+    port->deadline_us = deadline_us;
+}
+
+// Send n bytes already in out_buf and parse the reply as one to cmd
+static int at_port_submit(struct huawei_port *port, const char *cmd, int n, struct huawei_result *result,
+                          huawei_line_fn fn, void *opaque) {
+    huawei_result_init(result);
+    if (port->on_urc || fn) {
+        huawei_at_parser_reset(&port->parser, cmd, at_port_line, port);
+    } else {
+        huawei_at_parser_reset(&port->parser, cmd, huawei_result_line, result);
+    }
+    port->result = result;
+    port->on_info = fn;
+    port->info_opaque = opaque;
+    port->error = 0;
+    port->start_us = now_us();
+    port->tx_done_us = 0;
+    port->first_rx_us = 0;
+    port->last_rx_us = 0;
+    port->rx_bytes = 0;
+    
+    huawei_port_rearm(port);
+    
+    port->out_xfer->length = n;
+    int r = port->usb->submit_transfer(port->out_xfer);
+    if (r < 0) {
+        port->state = AT_FAILED;
+        port->error = r;
+        return r;
+    }
+    port->out_busy = 1;
+    port->state = AT_PENDING;
+    return 0;
+}
+
+/*
+ * Like huawei_port_command(), but information lines go to fn as they are parsed
+ * instead of into result, which then only collects echo, URCs and the final
+ * result code. Replies of any length pass through in constant memory.
+ */
+int huawei_port_stream(struct huawei_port *port, const char *cmd, struct huawei_result *result, huawei_line_fn fn,
+                       void *opaque) {
+    if (port->out_busy) return LIBUSB_ERROR_BUSY;
+    
+    int n = snprintf((char *)port->out_buf, AT_COMMAND_MAX, "%s\r", cmd);
+    if (n < 0 || n >= AT_COMMAND_MAX) return LIBUSB_ERROR_INVALID_PARAM;
+    return at_port_submit(port, cmd, n, result, fn, opaque);
+}
+
+// Start a command on an idle port. Completion is driven by huawei_run().
+int huawei_port_command(struct huawei_port *port, const char *cmd, struct huawei_result *result) {
+    return huawei_port_stream(port, cmd, result, NULL, NULL);
+}
+
+// Answer a "> " prompt: text goes out as-is followed by Ctrl-Z, and the reply
+// is parsed as one to cmd (e.g. "AT+CMGS")
+int huawei_port_text(struct huawei_port *port, const char *cmd, const char *text, struct huawei_result *result) {
+    size_t len = strlen(text);
+    
+    if (port->out_busy) return LIBUSB_ERROR_BUSY;
+    if (len + 1 > sizeof(port->out_buf)) return LIBUSB_ERROR_INVALID_PARAM;
+    memcpy(port->out_buf, text, len);
+    port->out_buf[len++] = 0x1A;
+    return at_port_submit(port, cmd, (int)len, result, NULL, NULL);
+}
+
+// Finish a pending command whose reply has stopped arriving. Returns the
+// time left until it would, in microseconds.
+// A command with its own timeout_ms (slow network operations) waits that
+// long for the final result code however the reply trickles in.
+static uint64_t at_port_check_deadline(struct huawei_port *port, uint64_t now) {
+    uint64_t deadline;
+    
+    if (port->timeout_ms) {
+        deadline = port->start_us + (uint64_t)port->timeout_ms * 1000;
+    } else if (port->last_rx_us) {
+        deadline = port->last_rx_us + (uint64_t)IDLE_TIMEOUT_MS * 1000;
+    } else {
+        deadline = port->start_us + (uint64_t)RESPONSE_TIMEOUT_MS * 1000;
+    }
+    if (port->deadline_us && port->deadline_us < deadline) deadline = port->deadline_us;
+    
+    if (now >= deadline) {
+        port->state = AT_DONE;
+        return 0;
+    }
+    return deadline - now;
+}
+
+// One pass of the event loop, blocking for at most max_us; returns 0 once no
+// port has a command pending
+int huawei_poll_wait(struct huawei_port **ports, int nports, uint64_t max_us) {
+    struct huawei_port *pending = NULL;
+    uint64_t now = now_us();
+    uint64_t wait = max_us;
+    
+    for (int i = 0; i < nports; i++) {
+        if (ports[i]->state != AT_PENDING) continue;
+        uint64_t left = at_port_check_deadline(ports[i], now);
+        if (ports[i]->state != AT_PENDING) continue;
+        if (left < wait) wait = left;
+        pending = ports[i];
+    }
+    if (!pending) return 0;
+    
+    struct timeval tv = {(time_t)(wait / 1000000), (suseconds_t)(wait % 1000000)};
+    pending->usb->handle_events_timeout_completed(pending->ctx, &tv, NULL);
+    return 1;
+}
+
+int huawei_port_pending(const struct huawei_port *port) {
+    return port->state == AT_PENDING;
+}
+
+int huawei_poll(struct huawei_port **ports, int nports) {
+    return huawei_poll_wait(ports, nports, 100000);
+}
+
+// Run the event loop until no port has a command pending
+void huawei_run(struct huawei_port **ports, int nports) {
+    while (huawei_poll(ports, nports)) {
+    }
+}
+
+// Returns the number of response bytes, 0 if nothing came back, -1 on error.
+// For a streamed command that is everything received, not just what result holds.
+int huawei_port_result(struct huawei_port *port) {
+    enum at_state state = port->state;
+    
+    port->state = AT_IDLE;
+    port->timeout_ms = 0;
+    port->deadline_us = 0;
+    port->latency_us = (port->last_rx_us ? port->last_rx_us : now_us()) - port->start_us;
+    if (state == AT_FAILED) return -1;
+    
+    // A reply that stopped without a line ending still has a last line
+    if (port->parser.len > 0) at_parser_line(&port->parser);
+    port->result->final = port->parser.final;
+    if (port->on_info) return port->rx_bytes < INT_MAX ? (int)port->rx_bytes : INT_MAX;
+    return (int)port->result->raw_len;
+}
+
+int huawei_port_error(const struct huawei_port *port) {
+    return port->error;
+}
+
+static uint64_t at_span(uint64_t start, uint64_t end) {
+    return start && end > start ? end - start : 0;
+}
+
+void huawei_port_stats(const struct huawei_port *port, struct huawei_command_stats *stats) {
+    stats->tx_us = at_span(port->start_us, port->tx_done_us);
+    stats->first_byte_us = at_span(port->start_us, port->first_rx_us);
+    stats->final_us = port->latency_us;
+    stats->rx_bytes = port->rx_bytes;
+}
+
+// huawei_command() on another of the modem's ports, e.g. one claimed with -I
+int huawei_command_port(struct huawei_modem *m, struct huawei_port *port, const char *cmd,
+                        struct huawei_result *result) {
+    if (huawei_port_command(port, cmd, result) == 0) {
+        huawei_run(&port, 1);
+    }
+    
+    int r = huawei_port_result(port);
+    if (r < 0) {
+        huawei_log(m->hc, HUAWEI_LOG_ERROR, "%s: error sending command: %s", m->path, libusb_strerror(port->error));
+    }
+    return r;
+}
+
+int huawei_command(struct huawei_modem *m, const char *cmd, struct huawei_result *result) {
+    return huawei_command_port(m, &m->port, cmd, result);
+}
+
+// Send the same command to every modem at once; they share one event loop
+void huawei_command_all(struct huawei_modem **modems, int count, const char *cmd, struct huawei_result **results,
+                        int *status) {
+    struct huawei_port *ports[MAX_MODEMS];
+    int n = 0;
+    
+    for (int i = 0; i < count; i++) {
+        if (huawei_port_command(&modems[i]->port, cmd, results[i]) == 0) {
+            ports[n++] = &modems[i]->port;
+        }
+    }
+    huawei_run(ports, n);
+    
+    for (int i = 0; i < count; i++) {
+        status[i] = huawei_port_result(&modems[i]->port);
+    }
+}
+
+/*
+ * Endpoint cache
+ *
+ * Resolving endpoints means walking the configuration descriptor and probing
+ * interfaces for kernel drivers. The result is kept per physical port
+ * together with the device descriptor fields it came from (PID, bcdDevice,
+ * bNumConfigurations). An entry is resolved again when any of those change,
+ * and dropped when claiming its interface fails.
+ */
+
+static void ep_cache_load(struct huawei_ctx *hc) {
+    char line[256];
+    
+    if (hc->ep_cache_loaded) return;
+    hc->ep_cache_loaded = 1;
+    if (!hc->ep_cache_file[0]) return;
+    
+    FILE *f = fopen(hc->ep_cache_file, "r");
+    if (!f) return;
+    
+    // "<path> <pid> <bcdDevice> <configs> <interface> <ep_in> <ep_out> <detach_mask> [<ports>]",
+    // ports as "<interface>:<ep_in>:<ep_out>:<role>,..."
+    while (fgets(line, sizeof(line), f) && hc->ep_cache_count < EP_CACHE_MAX) {
+        struct ep_cache_entry *e = &hc->ep_cache[hc->ep_cache_count];
+        unsigned pid, bcd, configs, in, out;
+        int end = 0;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%31s %x %x %u %d %x %x %x%n", e->path, &pid, &bcd, &configs, &e->interface,
+                   &in, &out, &e->detach_mask, &end) != 8) {
+            continue;
+        }
+        e->nports = 0;
+        for (char *p = line + end; e->nports < MODEM_PORTS_MAX; ) {
+            struct huawei_iface *port = &e->ports[e->nports];
+            char role[16];
+            unsigned pin, pout;
+            int used = 0;
+            if (sscanf(p, " %d:%x:%x:%15[a-z]%n", &port->interface, &pin, &pout, role, &used) != 4) break;
+            int r = 0;
+            while (r < HUAWEI_ROLES && strcmp(role, huawei_role_name(r)) != 0) r++;
+            port->ep_in = (int)pin;
+            port->ep_out = (int)pout;
+            port->role = r < HUAWEI_ROLES ? (enum huawei_role)r : HUAWEI_ROLE_OTHER;
+            e->nports++;
+            p += used;
+            if (*p == ',') p++;
+        }
+        e->pid = (uint16_t)pid;
+        e->bcd_device = (uint16_t)bcd;
+        e->num_configs = (uint8_t)configs;
+        e->ep_in = (int)in;
+        e->ep_out = (int)out;
+        hc->ep_cache_count++;
+    }
+    fclose(f);
+}
+
+static void ep_cache_save(struct huawei_ctx *hc) {
+    char tmp[sizeof(hc->ep_cache_file) + 8];
+    
+    if (!hc->ep_cache_file[0]) return;
+    FILE *f = cache_tmp_open(hc->ep_cache_file, tmp, sizeof(tmp));
+    if (!f) return;
+    fprintf(f, "# path pid bcdDevice configs interface ep_in ep_out detach_mask ports - huawei_at endpoint cache\n");
+    for (int i = 0; i < hc->ep_cache_count; i++) {
+        struct ep_cache_entry *e = &hc->ep_cache[i];
+        fprintf(f, "%s %04x %04x %u %d %02x %02x %x", e->path, e->pid, e->bcd_device, e->num_configs,
+                e->interface, e->ep_in, e->ep_out, e->detach_mask);
+        for (int k = 0; k < e->nports; k++) {
+            fprintf(f, "%c%d:%02x:%02x:%s", k ? ',' : ' ', e->ports[k].interface, e->ports[k].ep_in,
+                    e->ports[k].ep_out, huawei_role_name(e->ports[k].role));
+        }
+        fprintf(f, "\n");
+    }
+    cache_tmp_commit(f, tmp, hc->ep_cache_file);
+}
+
+static int ep_cache_index(struct huawei_ctx *hc, const char *path) {
+    ep_cache_load(hc);
+    for (int i = 0; i < hc->ep_cache_count; i++) {
+        if (strcmp(hc->ep_cache[i].path, path) == 0) return i;
+    }
+    return -1;
+}
+
+static const struct ep_cache_entry *ep_cache_find(const struct huawei_modem *m) {
+    int i = ep_cache_index(m->hc, m->path);
+    if (i < 0) return NULL;
+    
+    const struct ep_cache_entry *e = &m->hc->ep_cache[i];
+    if (e->pid != m->pid || e->bcd_device != m->bcd_device || e->num_configs != m->num_configs) return NULL;
+    return e;
+}
+
+static void ep_cache_put(const struct huawei_modem *m, const struct huawei_iface *def, unsigned detach_mask,
+                         const struct huawei_iface *ports, int nports) {
+    int i = ep_cache_index(m->hc, m->path);
+    
+    if (i < 0) {
+        if (m->hc->ep_cache_count == EP_CACHE_MAX) return;
+        i = m->hc->ep_cache_count++;
+    }
+    
+    struct ep_cache_entry *e = &m->hc->ep_cache[i];
+    snprintf(e->path, sizeof(e->path), "%s", m->path);
+    e->pid = m->pid;
+    e->bcd_device = m->bcd_device;
+    e->num_configs = m->num_configs;
+    e->interface = def->interface;
+    e->ep_in = def->ep_in;
+    e->ep_out = def->ep_out;
+    e->detach_mask = detach_mask;
+    e->nports = nports;
+    memcpy(e->ports, ports, (size_t)nports * sizeof(ports[0]));
+    ep_cache_save(m->hc);
+}
+
+static void ep_cache_drop(const struct huawei_modem *m) {
+    int i = ep_cache_index(m->hc, m->path);
+    if (i < 0) return;
+    
+    m->hc->ep_cache[i] = m->hc->ep_cache[--m->hc->ep_cache_count];
+    ep_cache_save(m->hc);
+}
+
+int huawei_modem_attach(struct huawei_modem *m, const struct huawei_iface *iface, int verbose) {
+    struct huawei_ctx *hc = m->hc;
+    struct modem_channel *ch = &m->extra[m->nextra];
+    
+    int r = hc->usb->claim_interface(m->handle, iface->interface);
+    if (r < 0) {
+        huawei_log(hc, HUAWEI_LOG_ERROR, "%s: could not claim interface %d (%s): %s", m->path, iface->interface,
+                   huawei_role_name(iface->role), libusb_strerror(r));
+        return -1;
+    }
+    ch->iface = *iface;
+    r = huawei_port_open(&ch->port, hc, m->handle, iface->ep_in, iface->ep_out);
+    if (r < 0) {
+        huawei_log(hc, HUAWEI_LOG_ERROR, "%s: cannot queue transfers: %s", m->path, libusb_strerror(r));
+        huawei_port_close(&ch->port);
+        hc->usb->release_interface(m->handle, iface->interface);
+        return -1;
+    }
+    if (verbose) {
+        huawei_log(hc, HUAWEI_LOG_INFO, "Also claimed: IN=0x%02x OUT=0x%02x Interface=%d (%s)", iface->ep_in,
+                   iface->ep_out, iface->interface, huawei_role_name(iface->role));
+    }
+    m->nextra++;
+    return 0;
+}
+
+static void modem_release_extra(struct huawei_modem *m) {
+    struct huawei_ctx *hc = m->hc;
+    
+    while (m->nextra > 0) {
+        struct modem_channel *ch = &m->extra[--m->nextra];
+        huawei_port_close(&ch->port);
+        hc->usb->release_interface(m->handle, ch->iface.interface);
+    }
+}
+
+// Find endpoints, detach, claim and start the transfer engine on an opened device.
+// ports_spec (-I) names the interfaces to claim, NULL for the default one.
+static int modem_attach(struct huawei_modem *m, const char *ports_spec, int verbose) {
+    struct huawei_ctx *hc = m->hc;
+    libusb_device *dev = hc->usb->get_device(m->handle);
+    const struct ep_cache_entry *cached = hc->use_ep_cache ? ep_cache_find(m) : NULL;
+    struct huawei_iface ports[MODEM_PORTS_MAX];
+    struct huawei_iface def;
+    int nports;
+    int pick[MODEM_CHANNELS];
+    int npick = 1;
+    unsigned detach_mask = 0;
+    int num_interfaces = 0;
+    uint64_t t = now_us();
+    
+    // Entries from before -I only know the default interface
+    if (cached && ports_spec && cached->nports == 0) cached = NULL;
+    
+    if (cached) {
+        def.interface = cached->interface;
+        def.ep_in = cached->ep_in;
+        def.ep_out = cached->ep_out;
+        def.role = HUAWEI_ROLE_OTHER;
+        nports = cached->nports;
+        memcpy(ports, cached->ports, (size_t)nports * sizeof(ports[0]));
+        detach_mask = cached->detach_mask;
+        hc->startup.cache_hits++;
+    } else {
+        int preferred;
+        nports = huawei_find_ports(hc, dev, m->pid, ports, MODEM_PORTS_MAX, &preferred, &num_interfaces);
+        if (nports <= 0) {
+            huawei_log(hc, HUAWEI_LOG_ERROR, "%s: could not find endpoints", m->path);
+            return -1;
+        }
+        def = ports[preferred];
+        hc->startup.cache_misses++;
+    }
+    for (int k = 0; k < nports; k++) {
+        if (ports[k].interface == def.interface) def.role = ports[k].role;
+    }
+    
+    m->interface = def.interface;
+    m->ep_in = def.ep_in;
+    m->ep_out = def.ep_out;
+    m->role = def.role;
+    if (ports_spec) {
+        npick = huawei_select_ports(hc, ports, nports, ports_spec, pick, MODEM_CHANNELS, m->path);
+        if (npick < 0) return -1;
+        m->interface = ports[pick[0]].interface;
+        m->ep_in = ports[pick[0]].ep_in;
+        m->ep_out = ports[pick[0]].ep_out;
+        m->role = ports[pick[0]].role;
+    }
+    hc->startup.endpoints_us += now_us() - t;
+    
+    if (verbose) {
+        huawei_log(hc, HUAWEI_LOG_INFO, "Using device %s 12d1:%04x (%s)%s%s", m->path, m->pid,
+                   huawei_pid_name(m->pid), m->serial[0] ? " serial " : "", m->serial);
+        huawei_log(hc, HUAWEI_LOG_INFO, "Endpoints: IN=0x%02x OUT=0x%02x Interface=%d (%s)%s", m->ep_in, m->ep_out,
+                   m->interface, huawei_role_name(m->role), cached ? " (cached)" : "");
+    }
+    
+    // Detach kernel drivers: known ones from the cache, otherwise probe
+    // every interface the configuration actually has
+    t = now_us();
+    if (cached) {
+        for (int j = 0; j < 32; j++) {
+            if (detach_mask & (1u << j)) hc->usb->detach_kernel_driver(m->handle, j);
+        }
+    } else {
+        for (int j = 0; j < num_interfaces && j < 32; j++) {
+            if (hc->usb->kernel_driver_active(m->handle, j) == 1) {
+                hc->usb->detach_kernel_driver(m->handle, j);
+                detach_mask |= 1u << j;
+            }
+        }
+    }
+    hc->startup.detach_us += now_us() - t;
+    
+    t = now_us();
+    int r = hc->usb->claim_interface(m->handle, m->interface);
+    hc->startup.claim_us += now_us() - t;
+    if (r < 0 && cached) {
+        // Stale entry: forget it and resolve from the descriptors
+        ep_cache_drop(m);
+        return modem_attach(m, ports_spec, verbose);
+    }
+    if (r < 0 && verbose) {
+        huawei_log(hc, HUAWEI_LOG_INFO, "Warning: could not claim interface %d: %s", m->interface,
+                   libusb_strerror(r));
+    }
+    if (r == 0 && !cached && hc->use_ep_cache) {
+        ep_cache_put(m, &def, detach_mask, ports, nports);
+    }
+    
+    t = now_us();
+    r = huawei_port_open(&m->port, hc, m->handle, m->ep_in, m->ep_out);
+    hc->startup.engine_us += now_us() - t;
+    if (r < 0) {
+        huawei_log(hc, HUAWEI_LOG_ERROR, "%s: cannot queue transfers: %s", m->path, libusb_strerror(r));
+        huawei_port_close(&m->port);
+        hc->usb->release_interface(m->handle, m->interface);
+        return -1;
+    }
+    
+    m->nextra = 0;
+    for (int k = 1; k < npick; k++) {
+        if (huawei_modem_attach(m, &ports[pick[k]], verbose) < 0) {
+            modem_release_extra(m);
+            huawei_port_close(&m->port);
+            hc->usb->release_interface(m->handle, m->interface);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void huawei_modem_close(struct huawei_modem *m) {
+    struct huawei_ctx *hc = m->hc;
+    
+    if (!m->handle) return;
+    modem_release_extra(m);
+    huawei_port_close(&m->port);
+    hc->usb->release_interface(m->handle, m->interface);
+    hc->usb->close(m->handle);
+    m->handle = NULL;
+}
+
+static int compare_priority(const void *a, const void *b) {
+    const struct huawei_modem *ma = a, *mb = b;
+    if (ma->priority != mb->priority) return ma->priority - mb->priority;
+    return strcmp(ma->path, mb->path);
+}
+
+int huawei_open_all(struct huawei_ctx *hc, const struct huawei_filter *filter, struct huawei_modem **modems,
+                    int max, int verbose) {
+    libusb_device **devs;
+    struct huawei_modem *found = calloc(MAX_MODEMS, sizeof(*found));
+    int nfound = 0;
+    int opened = 0;
+    
+    uint64_t t = now_us();
+    ssize_t cnt = found ? hc->usb->get_device_list(hc->usb_ctx, &devs) : -1;
+    hc->startup.discover_us += now_us() - t;
+    if (cnt < 0) {
+        free(found);
+        return 0;
+    }
+    
+    for (ssize_t i = 0; i < cnt && nfound < MAX_MODEMS; i++) {
+        struct libusb_device_descriptor desc;
+        if (hc->usb->get_device_descriptor(devs[i], &desc) < 0) continue;
+        if (desc.idVendor != HUAWEI_VENDOR_ID) continue;
+        
+        int priority = huawei_pid_priority(desc.idProduct);
+        if (filter->pid ? desc.idProduct != filter->pid : priority < 0) continue;
+        
+        struct huawei_modem *m = &found[nfound];
+        memset(m, 0, sizeof(*m));
+        m->hc = hc;
+        m->pid = desc.idProduct;
+        m->bcd_device = desc.bcdDevice;
+        m->num_configs = desc.bNumConfigurations;
+        m->priority = priority < 0 ? 0 : priority;
+        usb_port_path(hc->usb, devs[i], m->path, sizeof(m->path));
+        if (filter->path && strcmp(filter->path, m->path) != 0) continue;
+        
+        t = now_us();
+        if (hc->usb->open(devs[i], &m->handle) < 0) {
+            if (verbose) huawei_log(hc, HUAWEI_LOG_INFO, "%s: cannot open 12d1:%04x", m->path, m->pid);
+            continue;
+        }
+        // The serial costs a control transfer; only fetch it when selecting by it
+        if (desc.iSerialNumber && (filter->serial || verbose)) {
+            hc->usb->get_string_descriptor_ascii(m->handle, desc.iSerialNumber, (unsigned char *)m->serial,
+                                                 (int)sizeof(m->serial));
+        }
+        hc->startup.open_us += now_us() - t;
+        if (filter->serial && strcmp(filter->serial, m->serial) != 0) {
+            hc->usb->close(m->handle);
+            continue;
+        }
+        nfound++;
+    }
+    hc->usb->free_device_list(devs, 1);
+    
+    qsort(found, (size_t)nfound, sizeof(found[0]), compare_priority);
+    
+    for (int i = 0; i < nfound; i++) {
+        if (opened < max && (filter->all || opened == 0)) {
+            // Attach in place: the engine's transfers point back at the port
+            struct huawei_modem *m = malloc(sizeof(*m));
+            if (m) {
+                *m = found[i];
+                if (modem_attach(m, filter->ports, verbose) == 0) {
+                    modems[opened++] = m;
+                    continue;
+                }
+                free(m);
+            }
+        }
+        hc->usb->close(found[i].handle);
+    }
+    free(found);
+    
+    if (opened == 0) {
+        if (filter->pid) {
+            huawei_log(hc, HUAWEI_LOG_ERROR, "Device 12d1:%04x not found.", filter->pid);
+        } else {
+            huawei_log(hc, HUAWEI_LOG_ERROR, "No supported Huawei modem found.");
+        }
+    }
+    return opened;
+}
+
+void huawei_modem_read_serial(struct huawei_modem *m) {
+    struct huawei_ctx *hc = m->hc;
+    struct libusb_device_descriptor desc;
+    
+    if (m->serial[0] || hc->usb->get_device_descriptor(hc->usb->get_device(m->handle), &desc) < 0) return;
+    if (desc.iSerialNumber && hc->usb->get_string_descriptor_ascii(m->handle, desc.iSerialNumber,
+                                                                   (unsigned char *)m->serial,
+                                                                   (int)sizeof(m->serial)) < 0) {
+        m->serial[0] = '\0';
+    }
+}
+
+int huawei_open(struct huawei_ctx *hc, const struct huawei_filter *filter, struct huawei_modem **modem) {
+    struct huawei_filter one = *filter;
+    
+    *modem = NULL;
+    one.all = 0;
+    return huawei_open_all(hc, &one, modem, 1, 0) == 1 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+void huawei_close(struct huawei_modem *m) {
+    if (!m) return;
+    huawei_modem_close(m);
+    free(m);
+}
+
+const char *huawei_modem_path(const struct huawei_modem *m) {
+    return m->path;
+}
+
+uint16_t huawei_modem_pid(const struct huawei_modem *m) {
+    return m->pid;
+}
+
+const char *huawei_modem_serial(struct huawei_modem *m) {
+    huawei_modem_read_serial(m);
+    return m->serial;
+}
+
+struct huawei_port *huawei_modem_port(struct huawei_modem *m, int k, enum huawei_role *role) {
+    if (k < 0 || k > m->nextra) return NULL;
+    if (role) *role = k == 0 ? m->role : m->extra[k - 1].iface.role;
+    return k == 0 ? &m->port : &m->extra[k - 1].port;
+}
+
+/*
+ * Mode switching
+ */
+
+// Standard SCSI commands wrapped in USB Mass Storage CBW
+static unsigned char huawei_switch_msg[] = {
+    0x55, 0x53, 0x42, 0x43,  // "USBC" signature
+    0x12, 0x34, 0x56, 0x78,  // Tag
+    0x00, 0x00, 0x00, 0x00,  // Data transfer length
+    0x00,                     // Flags (OUT)
+    0x00,                     // LUN
+    0x11,                     // Command length
+    // Huawei specific SCSI command
+    0x11, 0x06, 0x20, 0x00, 0x00, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+// Alternative Huawei command
+static unsigned char huawei_switch_msg2[] = {
+    0x55, 0x53, 0x42, 0x43,  // "USBC"
+    0x12, 0x34, 0x56, 0x79,  // Tag
+    0x00, 0x00, 0x00, 0x00,  // Transfer length
+    0x00, 0x00, 0x11,        // Flags, LUN, CDB length
+    0x11, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+// Standard "Eject Media" SCSI command
+static unsigned char eject_msg[] = {
+    0x55, 0x53, 0x42, 0x43,  // "USBC"
+    0x12, 0x34, 0x56, 0x7A,  // Tag
+    0x00, 0x00, 0x00, 0x00,  // Transfer length
+    0x00, 0x00, 0x06,        // Flags, LUN, CDB length
+    0x1b, 0x00, 0x00, 0x00, 0x02, 0x00,  // START STOP UNIT with eject
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+int huawei_is_zerocd_pid(uint16_t pid) {
+    return huawei_pid_has_mode(pid, PID_ZEROCD);
+}
+
+int huawei_is_modem_pid(uint16_t pid) {
+    return huawei_pid_has_mode(pid, PID_MODEM);
+}
+
+static void print_hex(struct huawei_ctx *hc, const char *label, const unsigned char *data, int len) {
+    char hex[31 * 3 + 1];
+    int n = 0;
+    
+    for (int i = 0; i < len && i < 31; i++) {
+        n += snprintf(hex + n, sizeof(hex) - (size_t)n, "%02x ", data[i]);
+    }
+    hex[n] = '\0';
+    huawei_log(hc, HUAWEI_LOG_INFO, "%s: %s", label, hex);
+}
+
+static int find_bulk_out_endpoint(struct huawei_ctx *hc, libusb_device *dev, int *out_interface) {
+    struct libusb_config_descriptor *config;
+    int r = hc->usb->get_active_config_descriptor(dev, &config);
+    if (r < 0) return -1;
+    
+    int ep_out = -1;
+    *out_interface = 0;
+    
+    // First look for Mass Storage interface (class 0x08)
+    for (int i = 0; i < config->bNumInterfaces && ep_out < 0; i++) {
+        const struct libusb_interface *iface = &config->interface[i];
+        for (int j = 0; j < iface->num_altsetting && ep_out < 0; j++) {
+            const struct libusb_interface_descriptor *setting = &iface->altsetting[j];
+            
+            if (setting->bInterfaceClass == 0x08) {  // Mass Storage
+                for (int k = 0; k < setting->bNumEndpoints; k++) {
+                    const struct libusb_endpoint_descriptor *ep = &setting->endpoint[k];
+                    if ((ep->bmAttributes & 0x03) == LIBUSB_TRANSFER_TYPE_BULK) {
+                        if (!(ep->bEndpointAddress & 0x80)) {
+                            ep_out = ep->bEndpointAddress;
+                            *out_interface = setting->bInterfaceNumber;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    // Fallback: any bulk OUT endpoint
+    if (ep_out < 0) {
+        for (int i = 0; i < config->bNumInterfaces && ep_out < 0; i++) {
+            const struct libusb_interface *iface = &config->interface[i];
+            for (int j = 0; j < iface->num_altsetting && ep_out < 0; j++) {
+                const struct libusb_interface_descriptor *setting = &iface->altsetting[j];
+                for (int k = 0; k < setting->bNumEndpoints; k++) {
+                    const struct libusb_endpoint_descriptor *ep = &setting->endpoint[k];
+                    if ((ep->bmAttributes & 0x03) == LIBUSB_TRANSFER_TYPE_BULK) {
+                        if (!(ep->bEndpointAddress & 0x80)) {
+                            ep_out = ep->bEndpointAddress;
+                            *out_interface = setting->bInterfaceNumber;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    hc->usb->free_config_descriptor(config);
+    return ep_out;
+}
+
+static int try_bulk_transfer(struct huawei_ctx *hc, libusb_device_handle *handle, int ep_out, unsigned char *msg,
+                             int msg_len, const char *desc) {
+    int transferred;
+    int r;
+    
+    huawei_log(hc, HUAWEI_LOG_INFO, "[%s]", desc);
+    print_hex(hc, "Sending", msg, msg_len);
+    
+    r = hc->usb->bulk_transfer(handle, ep_out, msg, msg_len, &transferred, 2000);
+    if (r == 0) {
+        huawei_log(hc, HUAWEI_LOG_INFO, "Success! Sent %d bytes", transferred);
+        return 0;
+    } else {
+        huawei_log(hc, HUAWEI_LOG_INFO, "Failed: %s", libusb_strerror(r));
+        return -1;
+    }
+}
+
+/*
+ * Open the device to switch in one pass over the device list: the given PID,
+ * or the first ZeroCD device when pid is 0, limited to one port path unless
+ * path is NULL. Returns 0 with *h set, LIBUSB_ERROR_NOT_FOUND if there is
+ * none, or the error opening the last candidate.
+ */
+static int find_zerocd(struct huawei_ctx *hc, uint16_t pid, const char *path, libusb_device_handle **h,
+                       uint16_t *found_pid, struct huawei_switch_timing *timing) {
+    libusb_device **devs;
+    int r = LIBUSB_ERROR_NOT_FOUND;
+    uint64_t t = now_us();
+    ssize_t cnt = hc->usb->get_device_list(hc->usb_ctx, &devs);
+    timing->discover_us += now_us() - t;
+    
+    *h = NULL;
+    for (ssize_t i = 0; i < cnt && !*h; i++) {
+        struct libusb_device_descriptor desc;
+        char dev_path[USB_PATH_MAX];
+        if (hc->usb->get_device_descriptor(devs[i], &desc) < 0) continue;
+        if (desc.idVendor != HUAWEI_VENDOR_ID) continue;
+        if (pid ? desc.idProduct != pid : !huawei_is_zerocd_pid(desc.idProduct)) continue;
+        usb_port_path(hc->usb, devs[i], dev_path, sizeof(dev_path));
+        if (path && strcmp(dev_path, path) != 0) continue;
+        
+        t = now_us();
+        r = hc->usb->open(devs[i], h);
+        if (r == 0) {
+            *found_pid = desc.idProduct;
+            memcpy(timing->path, dev_path, sizeof(timing->path));
+        } else {
+            *h = NULL;
+        }
+        timing->open_us += now_us() - t;
+    }
+    
+    if (cnt >= 0) hc->usb->free_device_list(devs, 1);
+    return r;
+}
+
+/*
+ * Switch methods and the learned-strategy cache
+ *
+ * A given stick only ever needs one of the switch methods below. Whichever
+ * one makes the device drop off the bus is remembered per PID and firmware
+ * revision (bcdDevice) in a small text file, and later runs try it first,
+ * falling back to the full sequence if it stops working. Nothing is stored
+ * until the caller has seen the stick re-enumerate as a modem
+ * (huawei_switch_confirm()). A stick that is slow to detach can leave the bus
+ * after the next method went out, so a method that was not the first one
+ * sent is stored as tentative. It becomes a plain entry once it switches
+ * the stick by itself.
+ */
+
+enum switch_method {
+    METHOD_NONE,
+    METHOD_HUAWEI_MSG,
+    METHOD_HUAWEI_MSG2,
+    METHOD_EJECT,
+    METHOD_ENDPOINT_SWEEP,
+    METHOD_SET_FEATURE,
+    METHOD_SET_CONFIG,
+    METHOD_RESET,
+    METHOD_COUNT
+};
+
+static const char *method_names[METHOD_COUNT] = {
+    "none", "huawei-msg", "huawei-msg2", "eject", "endpoint-sweep", "set-feature", "set-config", "reset"
+};
+
+#define METHOD_SETTLE_MS    500     // how long a device gets to drop off the bus
+#define GONE_POLL_MS        50
+
+static enum switch_method method_by_name(const char *name) {
+    for (int m = METHOD_HUAWEI_MSG; m < METHOD_COUNT; m++) {
+        if (strcmp(method_names[m], name) == 0) return (enum switch_method)m;
+    }
+    return METHOD_NONE;
+}
+
+// Called with the strategy lock held
+static void strategy_load(struct huawei_ctx *hc) {
+    char line[128];
+    
+    if (hc->strategies_loaded) return;
+    hc->strategies_loaded = 1;
+    if (!hc->strategy_file[0]) return;
+    
+    FILE *f = fopen(hc->strategy_file, "r");
+    if (!f) return;
+    
+    // "<pid> <bcdDevice> <method> [tentative]", hex
+    while (fgets(line, sizeof(line), f) && hc->nstrategies < STRATEGY_MAX) {
+        unsigned pid, bcd;
+        char name[32], flag[16] = "";
+        if (line[0] == '#' || sscanf(line, "%x %x %31s %15s", &pid, &bcd, name, flag) < 3) continue;
+        enum switch_method m = method_by_name(name);
+        if (m == METHOD_NONE) continue;
+        hc->strategies[hc->nstrategies].pid = (uint16_t)pid;
+        hc->strategies[hc->nstrategies].bcd_device = (uint16_t)bcd;
+        hc->strategies[hc->nstrategies].method = (uint8_t)m;
+        hc->strategies[hc->nstrategies].tentative = strcmp(flag, "tentative") == 0;
+        hc->nstrategies++;
+    }
+    fclose(f);
+}
+
+static enum switch_method strategy_lookup(struct huawei_ctx *hc, uint16_t pid, uint16_t bcd_device) {
+    enum switch_method m = METHOD_NONE;
+    
+    pthread_mutex_lock(&hc->strategy_lock);
+    strategy_load(hc);
+    for (int i = 0; i < hc->nstrategies; i++) {
+        if (hc->strategies[i].pid == pid && hc->strategies[i].bcd_device == bcd_device) {
+            m = (enum switch_method)hc->strategies[i].method;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hc->strategy_lock);
+    return m;
+}
+
+static void strategy_store(struct huawei_ctx *hc, uint16_t pid, uint16_t bcd_device, enum switch_method method,
+                           int tentative) {
+    char tmp[sizeof(hc->strategy_file) + 8];
+    int i;
+    
+    pthread_mutex_lock(&hc->strategy_lock);
+    strategy_load(hc);
+    for (i = 0; i < hc->nstrategies; i++) {
+        if (hc->strategies[i].pid == pid && hc->strategies[i].bcd_device == bcd_device) break;
+    }
+    if (i < hc->nstrategies && hc->strategies[i].method == method && hc->strategies[i].tentative == tentative) {
+        pthread_mutex_unlock(&hc->strategy_lock);
+        return;
+    }
+    if (i == hc->nstrategies && hc->nstrategies < STRATEGY_MAX) hc->nstrategies++;
+    if (i < hc->nstrategies) {
+        hc->strategies[i].pid = pid;
+        hc->strategies[i].bcd_device = bcd_device;
+        hc->strategies[i].method = (uint8_t)method;
+        hc->strategies[i].tentative = (uint8_t)tentative;
+    }
+    
+    // Rewrite the whole (tiny) file and swap it in
+    FILE *f = hc->strategy_file[0] ? cache_tmp_open(hc->strategy_file, tmp, sizeof(tmp)) : NULL;
+    if (f) {
+        fprintf(f, "# pid bcdDevice method [tentative] - learned by huawei_modeswitch\n");
+        for (i = 0; i < hc->nstrategies; i++) {
+            fprintf(f, "%04x %04x %s%s\n", hc->strategies[i].pid, hc->strategies[i].bcd_device,
+                    method_names[hc->strategies[i].method], hc->strategies[i].tentative ? " tentative" : "");
+        }
+        cache_tmp_commit(f, tmp, hc->strategy_file);
+    }
+    pthread_mutex_unlock(&hc->strategy_lock);
+}
+
+struct switch_state {
+    struct huawei_ctx *hc;
+    libusb_device_handle *handle;
+    int ep_out;
+    int interface;
+    int claimed;            // 1 claimed, -1 claim failed, 0 not tried/released
+    struct huawei_switch_timing *timing;
+};
+
+// Wait up to wait_ms for the device to leave the bus
+static int device_gone(struct switch_state *sw, int wait_ms) {
+    struct huawei_ctx *hc = sw->hc;
+    libusb_device *dev = hc->usb->get_device(sw->handle);
+    uint64_t deadline = now_us() + (uint64_t)wait_ms * 1000;
+    
+    for (;;) {
+        libusb_device **devs;
+        int present = 0;
+        ssize_t cnt = hc->usb->get_device_list(hc->usb_ctx, &devs);
+        
+        for (ssize_t i = 0; i < cnt && !present; i++) {
+            present = devs[i] == dev;
+        }
+        if (cnt >= 0) hc->usb->free_device_list(devs, 1);
+        
+        if (cnt >= 0 && !present) return 1;
+        if (now_us() >= deadline) return 0;
+        usleep(GONE_POLL_MS * 1000);
+    }
+}
+
+// Returns 1 if the device re-enumerated after this method, 2 if it was already leaving when the method went out
+static int try_method(struct switch_state *sw, enum switch_method m) {
+    struct huawei_ctx *hc = sw->hc;
+    int r;
+    
+    if (m <= METHOD_ENDPOINT_SWEEP) {
+        // Bulk methods need the storage interface
+        if (sw->claimed == 0) {
+            huawei_log(hc, HUAWEI_LOG_INFO, "[Claiming interface %d]", sw->interface);
+            uint64_t t = now_us();
+            r = hc->usb->claim_interface(sw->handle, sw->interface);
+            sw->timing->claim_us += now_us() - t;
+            if (r < 0) {
+                huawei_log(hc, HUAWEI_LOG_INFO, "Cannot claim interface: %s", libusb_strerror(r));
+                huawei_log(hc, HUAWEI_LOG_INFO, "Trying without claiming...");
+                sw->claimed = -1;
+            } else {
+                huawei_log(hc, HUAWEI_LOG_INFO, "Interface claimed successfully");
+                sw->claimed = 1;
+            }
+        }
+        if (sw->claimed < 0) return 0;
+    } else if (sw->claimed > 0) {
+        hc->usb->release_interface(sw->handle, sw->interface);
+        sw->claimed = 0;
+    }
+    
+    uint64_t t = now_us();
+    switch (m) {
+        case METHOD_HUAWEI_MSG:
+            r = try_bulk_transfer(hc, sw->handle, sw->ep_out, huawei_switch_msg, sizeof(huawei_switch_msg),
+                                  "Huawei switch message 1");
+            break;
+        case METHOD_HUAWEI_MSG2:
+            r = try_bulk_transfer(hc, sw->handle, sw->ep_out, huawei_switch_msg2, sizeof(huawei_switch_msg2),
+                                  "Huawei switch message 2");
+            break;
+        case METHOD_EJECT:
+            r = try_bulk_transfer(hc, sw->handle, sw->ep_out, eject_msg, sizeof(eject_msg), "Eject message");
+            break;
+        case METHOD_ENDPOINT_SWEEP: {
+            // Try common endpoints
+            huawei_log(hc, HUAWEI_LOG_INFO, "No bulk endpoint found, trying common endpoints...");
+            int endpoints[] = {0x01, 0x02, 0x03, 0x04, 0x05};
+            r = -1;
+            for (int i = 0; i < 5 && r != 0; i++) {
+                int transferred;
+                r = hc->usb->bulk_transfer(sw->handle, endpoints[i], huawei_switch_msg,
+                                           sizeof(huawei_switch_msg), &transferred, 1000);
+                if (r == 0) {
+                    huawei_log(hc, HUAWEI_LOG_INFO, "Success on endpoint 0x%02x", endpoints[i]);
+                }
+            }
+            break;
+        }
+        case METHOD_SET_FEATURE:
+            huawei_log(hc, HUAWEI_LOG_INFO, "[Control transfer: Huawei SET_FEATURE]");
+            r = hc->usb->control_transfer(sw->handle,
+                LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+                LIBUSB_REQUEST_SET_FEATURE,
+                0x0001,
+                0x0000,
+                NULL, 0,
+                1000);
+            huawei_log(hc, HUAWEI_LOG_INFO, "  Result: %s", r < 0 ? libusb_strerror(r) : "OK");
+            break;
+        case METHOD_SET_CONFIG:
+            huawei_log(hc, HUAWEI_LOG_INFO, "[Control transfer: set configuration]");
+            r = hc->usb->set_configuration(sw->handle, 1);
+            huawei_log(hc, HUAWEI_LOG_INFO, "  Result: %s", r < 0 ? libusb_strerror(r) : "OK");
+            break;
+        case METHOD_RESET:
+            huawei_log(hc, HUAWEI_LOG_INFO, "[USB device reset]");
+            r = hc->usb->reset_device(sw->handle);
+            if (r == LIBUSB_ERROR_NOT_FOUND) {
+                huawei_log(hc, HUAWEI_LOG_INFO, "  Device disconnected (mode switch may have worked!)");
+            } else {
+                huawei_log(hc, HUAWEI_LOG_INFO, "  Result: %s", r < 0 ? libusb_strerror(r) : "OK");
+            }
+            break;
+        default:
+            return 0;
+    }
+    sw->timing->tx_us += now_us() - t;
+    sw->timing->methods++;
+    
+    int gone;
+    if (m == METHOD_RESET) {
+        gone = r == LIBUSB_ERROR_NOT_FOUND;
+    } else if (r == LIBUSB_ERROR_NO_DEVICE) {
+        gone = 2;
+    } else {
+        t = now_us();
+        gone = device_gone(sw, METHOD_SETTLE_MS);
+        sw->timing->gone_us += now_us() - t;
+    }
+    if (gone) sw->timing->left_at = now_us();
+    return gone;
+}
+
+// Returns 1 once the device has left the bus to re-enumerate, 0 if no method made it
+static int switch_device(struct huawei_ctx *hc, libusb_device_handle *handle, uint16_t pid,
+                         struct huawei_switch_timing *timing) {
+    libusb_device *dev = hc->usb->get_device(handle);
+    int interface_num = 0;
+    int r;
+    uint64_t t = now_us();
+    
+    huawei_log(hc, HUAWEI_LOG_INFO, "Switching device 12d1:%04x (%s)...", pid, huawei_pid_name(pid));
+    
+    // Get device info
+    // A stick may leave the bus between arrival and here (hotplug, -a workers)
+    struct libusb_device_descriptor desc;
+    r = hc->usb->get_device_descriptor(dev, &desc);
+    if (r < 0) {
+        huawei_log(hc, HUAWEI_LOG_ERROR, "Cannot read the device descriptor: %s", libusb_strerror(r));
+        return 0;
+    }
+    huawei_log(hc, HUAWEI_LOG_INFO, "bNumConfigurations: %d", desc.bNumConfigurations);
+    
+    struct libusb_config_descriptor *config;
+    r = hc->usb->get_active_config_descriptor(dev, &config);
+    if (r < 0) {
+        huawei_log(hc, HUAWEI_LOG_ERROR, "Cannot read the configuration descriptor: %s", libusb_strerror(r));
+        return 0;
+    }
+    huawei_log(hc, HUAWEI_LOG_INFO, "bNumInterfaces: %d", config->bNumInterfaces);
+    
+    // Print interface info
+    for (int i = 0; i < config->bNumInterfaces; i++) {
+        const struct libusb_interface *iface = &config->interface[i];
+        for (int j = 0; j < iface->num_altsetting; j++) {
+            const struct libusb_interface_descriptor *setting = &iface->altsetting[j];
+            huawei_log(hc, HUAWEI_LOG_INFO, "Interface %d: class=0x%02x subclass=0x%02x protocol=0x%02x endpoints=%d",
+                       setting->bInterfaceNumber,
+                       setting->bInterfaceClass,
+                       setting->bInterfaceSubClass,
+                       setting->bInterfaceProtocol,
+                       setting->bNumEndpoints);
+            
+            for (int k = 0; k < setting->bNumEndpoints; k++) {
+                const struct libusb_endpoint_descriptor *ep = &setting->endpoint[k];
+                huawei_log(hc, HUAWEI_LOG_INFO, "  Endpoint 0x%02x: type=%d",
+                           ep->bEndpointAddress,
+                           ep->bmAttributes & 0x03);
+            }
+        }
+    }
+    
+    hc->usb->free_config_descriptor(config);
+    
+    // Find bulk OUT endpoint
+    int ep_out = find_bulk_out_endpoint(hc, dev, &interface_num);
+    if (ep_out >= 0) {
+        huawei_log(hc, HUAWEI_LOG_INFO, "Found bulk OUT endpoint: 0x%02x on interface %d", ep_out, interface_num);
+    }
+    
+    timing->descriptors_us += now_us() - t;
+    
+    // Detach kernel drivers
+    t = now_us();
+    huawei_log(hc, HUAWEI_LOG_INFO, "[Detaching kernel drivers]");
+    for (int i = 0; i < 8; i++) {
+        r = hc->usb->kernel_driver_active(handle, i);
+        if (r == 1) {
+            huawei_log(hc, HUAWEI_LOG_INFO, "Detaching driver from interface %d...", i);
+            hc->usb->detach_kernel_driver(handle, i);
+        }
+    }
+    
+    timing->detach_us += now_us() - t;
+    
+    struct switch_state sw = {hc, handle, ep_out, interface_num, 0, timing};
+    enum switch_method learned = hc->use_strategies ? strategy_lookup(hc, pid, desc.bcdDevice) : METHOD_NONE;
+    enum switch_method worked = METHOD_NONE;
+    enum switch_method sent = METHOD_NONE;      // the last method that went out
+    int nsent = 0;
+    
+    if (learned != METHOD_NONE) {
+        huawei_log(hc, HUAWEI_LOG_INFO, "[Learned method for 12d1:%04x firmware %04x: %s]", pid, desc.bcdDevice,
+                   method_names[learned]);
+        if (try_method(&sw, learned)) {
+            worked = learned;
+        } else {
+            huawei_log(hc, HUAWEI_LOG_INFO, "Learned method did not switch the device, trying all methods");
+        }
+        sent = learned;
+        nsent++;
+    }
+    
+    for (int m = METHOD_HUAWEI_MSG; m < METHOD_COUNT && worked == METHOD_NONE; m++) {
+        int bulk_msg = m >= METHOD_HUAWEI_MSG && m <= METHOD_EJECT;
+        if (m == (int)learned) continue;
+        if (ep_out >= 0 ? m == METHOD_ENDPOINT_SWEEP : bulk_msg) continue;
+        
+        int gone = try_method(&sw, (enum switch_method)m);
+        if (gone == 2 && sent != METHOD_NONE) {
+            // It was already on its way out: the previous method did it, just slower than METHOD_SETTLE_MS
+            worked = sent;
+        } else {
+            if (gone) worked = (enum switch_method)m;
+            sent = (enum switch_method)m;
+            nsent++;
+        }
+    }
+    
+    if (sw.claimed > 0) {
+        hc->usb->release_interface(handle, interface_num);
+    }
+    
+    if (worked == METHOD_NONE) return 0;
+    
+    huawei_log(hc, HUAWEI_LOG_INFO, "Device re-enumerating after: %s", method_names[worked]);
+    timing->pid = pid;
+    timing->bcd_device = desc.bcdDevice;
+    timing->method = worked;
+    timing->first = nsent == 1;
+    return 1;
+}
+
+void huawei_switch_confirm(struct huawei_ctx *hc, const struct huawei_switch_timing *timing, uint16_t new_pid) {
+    if (timing->method == METHOD_NONE || !huawei_is_modem_pid(new_pid)) return;
+    strategy_store(hc, timing->pid, timing->bcd_device, (enum switch_method)timing->method, !timing->first);
+}
+
+static int switch_one(struct huawei_ctx *hc, uint16_t pid, const char *path, struct huawei_switch_timing *timing) {
+    libusb_device_handle *h;
+    uint16_t found_pid = 0;
+    int r = find_zerocd(hc, pid, path, &h, &found_pid, timing);
+    
+    if (r < 0) return r;
+    r = switch_device(hc, h, found_pid, timing);
+    hc->usb->close(h);
+    return r;
+}
+
+int huawei_switch(struct huawei_ctx *hc, uint16_t pid, struct huawei_switch_timing *timing) {
+    return switch_one(hc, pid, NULL, timing);
+}
+
+int huawei_switch_at(struct huawei_ctx *hc, const char *path, struct huawei_switch_timing *timing) {
+    return switch_one(hc, 0, path, timing);
+}
@@ -0,0 +1,573 @@
+/*
+ * libhuawei - discovery, AT commands, mode switching and datapaths for Huawei sticks
+ *
+ * The core huawei_at and huawei_modeswitch are built on, as a static or
+ * shared library for programs that drive sticks in-process instead of
+ * spawning the tools and parsing their output. Everything it keeps between
+ * calls lives in a struct huawei_ctx from huawei_init(): the USB transport
+ * and libusb context, the endpoint and switch-method caches, and startup
+ * timings. Nothing is printed; messages go to the context's log callback,
+ * if one is set. Functions return negative libusb error codes unless noted.
+ *
+ *   struct huawei_ctx *hc;
+ *   struct huawei_filter filter = {0};
+ *   struct huawei_modem *m;
+ *   struct huawei_result *res = huawei_result_new();
+ *
+ *   if (!res || huawei_init(&hc, NULL) < 0) return 1;
+ *   if (huawei_open(hc, &filter, &m) == 0) {
+ *       if (huawei_command(m, "AT+CSQ", res) > 0 && huawei_result_final(res) == HUAWEI_FINAL_OK) {
+ *           fputs(huawei_result_info(res), stdout);
+ *       }
+ *       huawei_close(m);
+ *   }
+ *   huawei_result_free(res);
+ *   huawei_exit(hc);
+ *
+ * Contexts, modems and results are opaque and only handled through the
+ * functions below. A context and its modems belong to one thread at a time,
+ * except that huawei_switch() and huawei_switch_at() may run on several
+ * threads at once.
+ */
+
+#ifndef LIBHUAWEI_H
+#define LIBHUAWEI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HUAWEI_PATH_MAX     32      // "<bus>-<port>[.<port>...]"
+#define HUAWEI_PORTS_MAX    8       // interfaces with a bulk pair looked at per stick
+#define HUAWEI_MODEMS_MAX   64      // opened at once, see huawei_open_all()
+#define HUAWEI_CHANNELS_MAX 3       // interfaces one modem claims at most (filter->ports)
+#define HUAWEI_COMMAND_MAX  256
+#define HUAWEI_RESPONSE_MAX 4096    // reply bytes a result holds
+#define HUAWEI_LINE_MAX     1024    // longer information lines are streamed in pieces
+
+struct huawei_ctx;
+struct huawei_modem;
+struct huawei_port;
+struct huawei_result;
+
+/*
+ * Context
+ */
+
+enum huawei_log_level {
+    HUAWEI_LOG_ERROR,
+    HUAWEI_LOG_INFO         // progress, and what verbose callers asked to hear about
+};
+
+typedef void (*huawei_log_fn)(void *opaque, enum huawei_log_level level, const char *msg);
+
+// All zero (or a NULL pointer to huawei_init()) gives the defaults
+struct huawei_options {
+    const char *transport;      // "usb" or "sim", NULL = $HUAWEI_TRANSPORT, usb if unset
+    const char *sim;            // simulator options, NULL = $HUAWEI_SIM
+    const char *endpoint_cache; // NULL = $HUAWEI_AT_CACHE or ~/.cache/huawei_at.endpoints, "" = in memory
+    const char *strategy_cache; // NULL = $HUAWEI_MODESWITCH_CACHE or ~/.cache/huawei_modeswitch.strategies
+    int no_endpoint_cache;      // resolve endpoints from the descriptors every time
+    int no_strategies;          // ignore learned switch methods, always try the full sequence
+    huawei_log_fn log;
+    void *log_opaque;
+};
+
+// Startup phase durations, summed over every modem opened through a context
+struct huawei_startup {
+    uint64_t init_us;
+    uint64_t discover_us;
+    uint64_t open_us;
+    uint64_t endpoints_us;
+    uint64_t detach_us;
+    uint64_t claim_us;
+    uint64_t engine_us;
+    int cache_hits;
+    int cache_misses;
+};
+
+// Select the transport and initialise it; *hc is NULL on failure
+int huawei_init(struct huawei_ctx **hc, const struct huawei_options *options);
+void huawei_exit(struct huawei_ctx *hc);
+
+// Turn the caches from huawei_options on or off between calls
+void huawei_set_endpoint_cache(struct huawei_ctx *hc, int on);
+void huawei_set_strategies(struct huawei_ctx *hc, int on);
+
+// The startup timings so far; huawei_clear_startup() starts them over (init_us stays)
+void huawei_get_startup(const struct huawei_ctx *hc, struct huawei_startup *startup);
+void huawei_clear_startup(struct huawei_ctx *hc);
+
+/*
+ * Handle pending USB events for at most max_us: transfer completions, the
+ * URC sinks of open ports, hotplug callbacks. Library calls that wait do
+ * this themselves; programs with nothing else to wait on call it in their
+ * main loop. Returns 0 or a libusb error.
+ */
+int huawei_handle_events(struct huawei_ctx *hc, uint64_t max_us);
+
+// Simulator only: make every simulated stick answer cmd with info and OK.
+// LIBUSB_ERROR_NOT_SUPPORTED on the usb transport.
+int huawei_sim_script(struct huawei_ctx *hc, const char *cmd, const char *info);
+
+/*
+ * Interfaces and roles
+ *
+ * A stick in modem mode has several interfaces with a bulk IN/OUT pair: the
+ * modem port (AT commands, then PPP data), the PC UI port (AT commands, and
+ * where status URCs go) and the diagnostic port (binary, no AT). Newer
+ * firmware names them in the low nibble of bInterfaceProtocol on its vendor
+ * interfaces (x1 modem, x2 PC UI, x3 diagnostic); older sticks report
+ * ff/ff/ff everywhere and their layout comes from a table by PID. The data
+ * interface of an NCM function has a bulk pair too but carries no AT
+ * commands.
+ */
+
+enum huawei_role {
+    HUAWEI_ROLE_OTHER,
+    HUAWEI_ROLE_MODEM,
+    HUAWEI_ROLE_PCUI,
+    HUAWEI_ROLE_DIAG,
+    HUAWEI_ROLE_NCM,
+    HUAWEI_ROLES
+};
+
+struct huawei_iface {
+    int interface;
+    int ep_in;
+    int ep_out;
+    enum huawei_role role;
+};
+
+// A Huawei device on the bus, see huawei_list_devices()
+struct huawei_device_info {
+    char path[HUAWEI_PATH_MAX];
+    uint16_t pid;
+    uint16_t bcd_device;
+    int nports;             // interfaces with a bulk pair, 0 if the descriptors could not be read
+    int preferred;          // index of the port used when no roles are asked for
+    struct huawei_iface ports[HUAWEI_PORTS_MAX];
+};
+
+const char *huawei_role_name(enum huawei_role role);
+
+/*
+ * Every Huawei device on the bus, up to max, with its serial interfaces and
+ * their roles. Returns how many there are, or a libusb error.
+ */
+int huawei_list_devices(struct huawei_ctx *hc, struct huawei_device_info *list, int max);
+
+// Like huawei_list_devices(), from the device descriptors alone (nports is
+// 0), which is cheap enough to poll the bus with
+int huawei_scan_devices(struct huawei_ctx *hc, struct huawei_device_info *list, int max);
+
+/*
+ * Wait up to timeout_ms for a stick in modem mode (a Huawei PID other than
+ * the ZeroCD ones) at a port path. Returns 1 with *pid set once it is there,
+ * 0 on timeout, or a libusb error.
+ */
+int huawei_wait_modem(struct huawei_ctx *hc, const char *path, int timeout_ms, uint16_t *pid);
+
+/*
+ * Hotplug
+ *
+ * fn hears about every Huawei device arriving on or leaving the bus,
+ * starting with the ones already there. It runs from inside USB event
+ * handling (huawei_handle_events(), or any library call that waits on the
+ * bus, on whichever thread makes it), so it should only queue the event.
+ * LIBUSB_ERROR_NOT_SUPPORTED where the platform has no hotplug events: poll
+ * huawei_scan_devices() instead.
+ */
+typedef void (*huawei_hotplug_fn)(void *opaque, int arrived, uint16_t pid, const char *path);
+
+int huawei_hotplug_register(struct huawei_ctx *hc, huawei_hotplug_fn fn, void *opaque);
+void huawei_hotplug_deregister(struct huawei_ctx *hc);
+
+/*
+ * Modems and commands
+ *
+ * Every opened modem carries its own handle, endpoints and transfer engine,
+ * so one process can drive any number of them. Devices are picked by PID,
+ * physical port path or serial number. Final result codes are recognised in
+ * verbose (ATV1) and numeric (ATV0) form.
+ */
+
+enum huawei_final {
+    HUAWEI_FINAL_NONE,
+    HUAWEI_FINAL_OK,
+    HUAWEI_FINAL_CONNECT,
+    HUAWEI_FINAL_NO_CARRIER,
+    HUAWEI_FINAL_ERROR,
+    HUAWEI_FINAL_NO_DIALTONE,
+    HUAWEI_FINAL_BUSY,
+    HUAWEI_FINAL_NO_ANSWER,
+    HUAWEI_FINAL_CME_ERROR,
+    HUAWEI_FINAL_CMS_ERROR,
+    HUAWEI_FINAL_NOT_SUPPORTED,
+    HUAWEI_FINAL_PROMPT         // "> ", the modem waits for text (AT+CMGS)
+};
+
+const char *huawei_final_name(enum huawei_final final);
+int huawei_final_is_error(enum huawei_final final);
+
+struct huawei_filter {
+    uint16_t pid;           // 0 = any supported PID
+    const char *path;       // bus-port path, NULL = any
+    const char *serial;     // NULL = any
+    int all;                // every match (huawei_at -a); huawei_open() takes the best one
+    const char *ports;      // interfaces to claim by role or number ("pcui,modem"), NULL = the default one
+};
+
+// Open the best match for the filter; LIBUSB_ERROR_NOT_FOUND (logged) if none opens
+int huawei_open(struct huawei_ctx *hc, const struct huawei_filter *filter, struct huawei_modem **modem);
+void huawei_close(struct huawei_modem *m);
+
+/*
+ * Open the matches for the filter, best PID first: every one with
+ * filter->all, up to max, otherwise the first that opens. Returns how many
+ * went into modems[] (none is logged); each is closed with huawei_close().
+ * With verbose, their endpoints and serial numbers are logged.
+ */
+int huawei_open_all(struct huawei_ctx *hc, const struct huawei_filter *filter, struct huawei_modem **modems,
+                    int max, int verbose);
+
+const char *huawei_modem_path(const struct huawei_modem *m);
+uint16_t huawei_modem_pid(const struct huawei_modem *m);
+
+// Read from the stick on first use, "" if it has none
+const char *huawei_modem_serial(struct huawei_modem *m);
+
+// A result holds one reply of up to 4 KiB; reuse it for any number of commands
+struct huawei_result *huawei_result_new(void);
+void huawei_result_free(struct huawei_result *res);
+
+enum huawei_final huawei_result_final(const struct huawei_result *res);
+const char *huawei_result_final_line(const struct huawei_result *res);  // "+CME ERROR: 10", "" if none
+
+// Information lines, '\n' terminated, and how many; truncated says the reply did not fit
+const char *huawei_result_info(const struct huawei_result *res);
+int huawei_result_lines(const struct huawei_result *res);
+int huawei_result_truncated(const struct huawei_result *res);
+
+// Unsolicited results that arrived mid-command, '\n' terminated; "" if none
+const char *huawei_result_urc(const struct huawei_result *res);
+
+// The reply exactly as received
+const char *huawei_result_raw(const struct huawei_result *res, size_t *len);
+
+// Parse a complete reply to cmd, e.g. one relayed by another process
+void huawei_result_parse(struct huawei_result *res, const char *cmd, const char *raw, size_t len);
+
+// Send a command and wait for its reply. Returns the number of response
+// bytes, 0 if nothing came back, -1 on error.
+int huawei_command(struct huawei_modem *m, const char *cmd, struct huawei_result *res);
+
+/*
+ * Reply lines
+ *
+ * Replies are parsed as they arrive. Every complete line is command echo,
+ * information text, an unsolicited result code (URC) or the final result
+ * code; a line to a query that looks like a URC (+CREG: to AT+CREG?) is
+ * information. URCs are grouped into classes by their prefix.
+ */
+
+enum huawei_line_kind {
+    HUAWEI_LINE_ECHO,
+    HUAWEI_LINE_INFO,
+    HUAWEI_LINE_PARTIAL,    // piece of an information line longer than HUAWEI_LINE_MAX
+    HUAWEI_LINE_URC,
+    HUAWEI_LINE_FINAL
+};
+
+enum huawei_urc_class {
+    HUAWEI_URC_CALL,
+    HUAWEI_URC_SMS,
+    HUAWEI_URC_USSD,
+    HUAWEI_URC_NETWORK,
+    HUAWEI_URC_SIGNAL,
+    HUAWEI_URC_DATA,
+    HUAWEI_URC_SYSTEM,
+    HUAWEI_URC_OTHER,       // not in the URC table (late replies, unknown vendor codes)
+    HUAWEI_URC_CLASSES
+};
+
+const char *huawei_urc_class_name(enum huawei_urc_class cls);
+enum huawei_urc_class huawei_at_urc_class(const char *s, size_t len);
+
+// The final result code s is, HUAWEI_FINAL_NONE if none; numeric also takes
+// ATV0 result codes ("0" for OK)
+enum huawei_final huawei_at_match_final(const char *s, size_t len, int numeric);
+int huawei_at_starts_with(const char *s, size_t len, const char *prefix);
+
+/*
+ * Ports and the event loop
+ *
+ * Underneath huawei_command(), every interface a modem has claimed is a
+ * port with a transfer engine of its own, which keeps IN transfers queued
+ * so replies are collected as they arrive. Commands are started on ports
+ * and completed by one event loop over any number of them, ports of
+ * several modems included, so commands proceed in parallel. A command can
+ * stream its information lines as they are parsed, and lines that arrive
+ * between commands can go to a URC sink.
+ */
+
+#define HUAWEI_RESPONSE_TIMEOUT_MS  2500    // a command nothing comes back for is given up
+
+typedef void (*huawei_line_fn)(void *opaque, enum huawei_line_kind kind, const char *line, size_t len);
+typedef void (*huawei_urc_fn)(void *opaque, const char *line, size_t len);
+
+// Port k of an opened modem: 0 is the primary one, the others were claimed
+// through filter->ports. NULL past the last; role may be NULL.
+struct huawei_port *huawei_modem_port(struct huawei_modem *m, int k, enum huawei_role *role);
+
+// Pass every unsolicited line to fn, with or without a command pending;
+// fn runs from inside USB event handling
+void huawei_port_set_urc(struct huawei_port *port, huawei_urc_fn fn, void *opaque);
+
+// IN transfers queued; 0 once every one failed, e.g. the stick is gone.
+// huawei_port_rearm() queues those parked by an error again first.
+int huawei_port_queued(const struct huawei_port *port);
+int huawei_port_rearm(struct huawei_port *port);
+
+/*
+ * For the pending or next command: wait up to timeout_ms for the final
+ * result code however its reply trickles in (0 = the default timeouts), and
+ * give up at deadline_us (CLOCK_MONOTONIC microseconds, 0 = never) whatever
+ * the timeouts. Both go back to 0 once its result is taken.
+ */
+void huawei_port_set_timeout(struct huawei_port *port, unsigned timeout_ms);
+void huawei_port_set_deadline(struct huawei_port *port, uint64_t deadline_us);
+
+// Start a command on an idle port; the event loop completes it
+int huawei_port_command(struct huawei_port *port, const char *cmd, struct huawei_result *res);
+
+/*
+ * Like huawei_port_command(), but information lines go to fn as they are
+ * parsed instead of into res, which then only collects echo, URCs and the
+ * final result code. Replies of any length pass through in constant memory.
+ */
+int huawei_port_stream(struct huawei_port *port, const char *cmd, struct huawei_result *res, huawei_line_fn fn,
+                       void *opaque);
+
+// Answer a "> " prompt: text goes out as-is followed by Ctrl-Z, and the reply
+// is parsed as one to cmd (e.g. "AT+CMGS")
+int huawei_port_text(struct huawei_port *port, const char *cmd, const char *text, struct huawei_result *res);
+
+// A command was started and its result not taken yet
+int huawei_port_pending(const struct huawei_port *port);
+
+// One pass of the event loop, blocking for at most max_us; returns 0 once no
+// port has a command pending
+int huawei_poll_wait(struct huawei_port **ports, int nports, uint64_t max_us);
+int huawei_poll(struct huawei_port **ports, int nports);
+
+// Run the event loop until no port has a command pending
+void huawei_run(struct huawei_port **ports, int nports);
+
+/*
+ * Take the result of a completed command. Returns the number of response
+ * bytes, 0 if nothing came back, -1 on error (see huawei_port_error()). For
+ * a streamed command that is everything received, not just what res holds.
+ */
+int huawei_port_result(struct huawei_port *port);
+
+// The libusb error the last command failed with
+int huawei_port_error(const struct huawei_port *port);
+
+// Phases of the last command from when it was started, 0 if it never got there
+struct huawei_command_stats {
+    uint64_t tx_us;         // sent
+    uint64_t first_byte_us; // first byte of the reply received
+    uint64_t final_us;      // last byte received, or given up
+    uint64_t rx_bytes;
+};
+
+void huawei_port_stats(const struct huawei_port *port, struct huawei_command_stats *stats);
+
+// Send the same command to every modem at once; they share one event loop.
+// status[i] is what huawei_port_result() returned for modems[i].
+void huawei_command_all(struct huawei_modem **modems, int count, const char *cmd, struct huawei_result **results,
+                        int *status);
+
+/*
+ * Mode switching
+ *
+ * A stick in ZeroCD mode shows up as mass storage and has to be told to
+ * come back as a modem. Several methods exist and a given stick only ever
+ * needs one of them; whichever one makes it drop off the bus is remembered
+ * per PID and firmware revision (bcdDevice), and tried first next time -
+ * but only once huawei_switch_confirm() has seen the stick come back as a
+ * modem.
+ */
+
+// Phase durations of one switch
+struct huawei_switch_timing {
+    uint64_t discover_us;
+    uint64_t open_us;
+    uint64_t descriptors_us;
+    uint64_t detach_us;
+    uint64_t claim_us;
+    uint64_t tx_us;         // sending switch messages and requests
+    uint64_t gone_us;       // waiting for the device to leave the bus
+    uint64_t reenum_us;     // off the bus until the modem showed up
+    uint64_t left_at;       // when it left the bus, 0 if it never did
+    int methods;            // switch methods tried
+    
+    // What huawei_switch_confirm() learns from
+    char path[HUAWEI_PATH_MAX];
+    uint16_t pid;
+    uint16_t bcd_device;
+    int method;             // the method it left the bus after, 0 if none
+    int first;              // that method went out first, so the departure was its doing
+};
+
+int huawei_is_zerocd_pid(uint16_t pid);
+int huawei_is_modem_pid(uint16_t pid);
+
+/*
+ * Switch the stick with the given PID, or the first ZeroCD one when pid is
+ * 0. Returns 1 once it has left the bus to re-enumerate (at timing->path),
+ * 0 if no method made it, LIBUSB_ERROR_NOT_FOUND if there is none, or the
+ * error opening it.
+ */
+int huawei_switch(struct huawei_ctx *hc, uint16_t pid, struct huawei_switch_timing *timing);
+
+// The same for the ZeroCD stick at a port path, e.g. one a hotplug callback reported
+int huawei_switch_at(struct huawei_ctx *hc, const char *path, struct huawei_switch_timing *timing);
+
+/*
+ * Call when the switched stick is back on its port, with its new PID. The
+ * method is learned only if that is a modem PID: a stick that drops off and
+ * returns in ZeroCD mode, or never returns, teaches nothing.
+ */
+void huawei_switch_confirm(struct huawei_ctx *hc, const struct huawei_switch_timing *timing, uint16_t new_pid);
+
+/*
+ * Datapaths
+ *
+ * IP traffic between an opened modem and a host device: NCM for sticks
+ * with a CDC-NCM function (dialed with AT^NDISDUP), PPP over the modem port
+ * for the others. fd is the caller's TAP or TUN device, or anything else
+ * that is non-blocking and keeps packet boundaries (a datagram socket
+ * pair). The run functions block until the device fails or the matching
+ * shutdown function is called, from another thread or a signal handler.
+ */
+
+#define HUAWEI_NCM_FRAME_MAX    1514    // Ethernet frame without FCS
+#define HUAWEI_PPP_MRU          1500
+
+struct huawei_link_stats {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t dropped;       // packets the other side had no room for, or too large
+    uint64_t errors;        // malformed blocks or frames, failed transfers
+    uint64_t frames;        // PPP only: HDLC frames with a good FCS
+    uint64_t transfers;
+};
+
+struct huawei_ncm;
+struct huawei_ppp;
+
+struct huawei_ncm_options {
+    int l3;                 // fd carries IP packets (TUN), not Ethernet frames (TAP)
+    int af_header;          // bytes of address family before each packet (utun)
+    int ntb32;              // ask for 32-bit transfer blocks
+    int verbose;
+};
+
+// Claim the NCM function of m; the stick is dialed separately
+int huawei_ncm_open(struct huawei_ncm **ncm, struct huawei_modem *m, int fd, const struct huawei_ncm_options *options);
+void huawei_ncm_close(struct huawei_ncm *ncm);
+
+int huawei_ncm_ntb32(const struct huawei_ncm *ncm);
+void huawei_ncm_host_mac(const struct huawei_ncm *ncm, uint8_t mac[6]);  // for a TAP device
+
+// Returns 0 after huawei_ncm_shutdown(), or the libusb error the transfers failed with
+int huawei_ncm_run(struct huawei_ncm *ncm);
+void huawei_ncm_shutdown(struct huawei_ncm *ncm);
+void huawei_ncm_stats(const struct huawei_ncm *ncm, struct huawei_link_stats *rx, struct huawei_link_stats *tx);
+
+// Negotiated addresses, host byte order
+struct huawei_ppp_addrs {
+    uint32_t addr;
+    uint32_t peer;
+    uint32_t dns[2];
+};
+
+// Called from huawei_ppp_run() once IPCP is up
+typedef void (*huawei_ppp_up_fn)(void *opaque, const struct huawei_ppp_addrs *addrs);
+
+struct huawei_ppp_options {
+    const char *apn;        // set context 1 to this APN before dialing, NULL = as configured
+    const char *user;       // PAP, if the network asks; NULL = empty
+    const char *password;
+    int af_header;          // bytes of address family before each packet (utun)
+    huawei_ppp_up_fn up;
+    void *opaque;
+    int verbose;
+};
+
+// Dial ATD*99# on the modem port (claimed if need be); 0 once it answers CONNECT
+int huawei_ppp_dial(struct huawei_ppp **ppp, struct huawei_modem *m, int fd, const struct huawei_ppp_options *options);
+
+// Hang up (ATH) and free the session
+void huawei_ppp_close(struct huawei_ppp *ppp);
+
+// Returns 0 once the link is down, or the libusb error the transfers failed with
+int huawei_ppp_run(struct huawei_ppp *ppp);
+void huawei_ppp_shutdown(struct huawei_ppp *ppp);
+
+int huawei_ppp_is_up(const struct huawei_ppp *ppp);
+
+// Why the link went down ("the peer closed the link"), NULL if on request
+const char *huawei_ppp_reason(const struct huawei_ppp *ppp);
+void huawei_ppp_stats(const struct huawei_ppp *ppp, struct huawei_link_stats *rx, struct huawei_link_stats *tx);
+
+/*
+ * Diagnostic capture
+ *
+ * huawei_diag_open() claims the diagnostic interface of an open modem, if
+ * it is not one of its AT ports, and creates a capture file of ring_size
+ * bytes of records (a multiple of 8) that huawei_diag reads back. Requests
+ * such as a log mask go out with huawei_diag_send() before the capture
+ * starts; huawei_diag_run() then records everything the port sends until
+ * the time limit or huawei_diag_shutdown(), which may be called from a
+ * signal handler.
+ */
+
+struct huawei_diag;
+
+struct huawei_diag_stats {
+    uint64_t records;       // packets recorded, requests included
+    uint64_t bytes;         // received from the port
+    uint64_t transfers;
+    uint64_t bad;           // frames with a bad FCS, aborted or too long
+    uint64_t dropped;       // received bytes lost because the file writer fell behind
+    unsigned peak;          // most transfer buffers ever waiting for the writer...
+    unsigned buffers;       // ... out of this many
+    uint64_t overwritten;   // oldest bytes of the capture that newer ones took the place of
+};
+
+int huawei_diag_open(struct huawei_diag **diag, struct huawei_modem *m, const char *path, uint64_t ring_size,
+                     int verbose);
+
+// Finish the capture and free the session; -1 with errno if the file did not reach the disk
+int huawei_diag_close(struct huawei_diag *diag);
+
+// Send one request (unframed, without CRC) and record it; before huawei_diag_run() only
+int huawei_diag_send(struct huawei_diag *diag, const uint8_t *p, size_t len);
+
+// Returns 0 at the limit (0 = none) or after huawei_diag_shutdown(), or the libusb error the port failed with
+int huawei_diag_run(struct huawei_diag *diag, uint64_t limit_us);
+void huawei_diag_shutdown(struct huawei_diag *diag);
+void huawei_diag_stats(const struct huawei_diag *diag, struct huawei_diag_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
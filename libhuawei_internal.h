@@ -0,0 +1,285 @@
+/*
+ * libhuawei internals
+ *
+ * What the library sources share beyond the public API in libhuawei.h:
+ * the structures behind its opaque types, the limits they are sized by,
+ * the response parser and the asynchronous transfer engine. Programs
+ * linking the library, huawei_at and huawei_modeswitch included, use
+ * libhuawei.h only; nothing here is a stable interface.
+ */
+
+#ifndef LIBHUAWEI_INTERNAL_H
+#define LIBHUAWEI_INTERNAL_H
+
+#include <pthread.h>
+
+#include "libhuawei.h"
+#include "huawei_usb.h"
+
+#if USB_PATH_MAX != HUAWEI_PATH_MAX
+#error "USB_PATH_MAX and HUAWEI_PATH_MAX differ"
+#endif
+
+#define TIMEOUT_MS          2000
+#define READ_TIMEOUT_MS     500
+#define MAX_RESPONSE_SIZE   HUAWEI_RESPONSE_MAX
+#define AT_COMMAND_MAX      HUAWEI_COMMAND_MAX
+#define AT_OUT_MAX          512     // text after a "> " prompt: a full SMS PDU
+#define AT_LINE_MAX         HUAWEI_LINE_MAX
+#define AT_FINAL_LINE_MAX   128
+#define AT_URC_BUFFER       1024
+
+// Async engine: IN transfers kept queued per port, and how long to wait for
+// a reply that has no final result code
+#define IN_TRANSFERS        4
+#define IN_TRANSFER_SIZE    512
+#define RESPONSE_TIMEOUT_MS HUAWEI_RESPONSE_TIMEOUT_MS
+#define IDLE_TIMEOUT_MS     (READ_TIMEOUT_MS * 2)   // reply stalled midway
+
+#define MAX_MODEMS          HUAWEI_MODEMS_MAX
+#define MODEM_PORTS_MAX     HUAWEI_PORTS_MAX
+#define MODEM_CHANNELS      HUAWEI_CHANNELS_MAX
+
+#define EP_CACHE_MAX        64
+#define STRATEGY_MAX        128
+
+/*
+ * Context
+ */
+
+// Endpoints resolved for a physical port, with the descriptor fields they came from
+struct ep_cache_entry {
+    char path[USB_PATH_MAX];
+    uint16_t pid;
+    uint16_t bcd_device;
+    uint8_t num_configs;
+    int interface;
+    int ep_in;
+    int ep_out;
+    unsigned detach_mask;   // interfaces that had a kernel driver bound
+    int nports;             // every interface with a bulk pair, for -I; 0 in entries from older versions
+    struct huawei_iface ports[MODEM_PORTS_MAX];
+};
+
+// The switch method that worked for a PID and firmware revision
+struct strategy {
+    uint16_t pid;
+    uint16_t bcd_device;
+    uint8_t method;
+    uint8_t tentative;      // other methods went out before it, the departure may have been theirs
+};
+
+struct huawei_ctx {
+    const struct usb_transport *usb;
+    libusb_context *usb_ctx;
+    huawei_log_fn log;
+    void *log_opaque;
+    struct huawei_startup startup;
+    
+    int use_ep_cache;
+    int ep_cache_loaded;
+    int ep_cache_count;
+    char ep_cache_file[512];
+    struct ep_cache_entry ep_cache[EP_CACHE_MAX];
+    
+    int use_strategies;
+    int strategies_loaded;
+    int nstrategies;
+    char strategy_file[512];
+    struct strategy strategies[STRATEGY_MAX];
+    pthread_mutex_t strategy_lock;
+    
+    int hotplug;            // a callback is registered
+    libusb_hotplug_callback_handle hotplug_handle;
+    huawei_hotplug_fn hotplug_fn;
+    void *hotplug_opaque;
+};
+
+// Format a message for the context's log callback, if it has one
+void huawei_log(struct huawei_ctx *hc, enum huawei_log_level level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Probe order from the PID table (lower is preferred), -1 if not an AT device
+int huawei_pid_priority(uint16_t pid);
+
+/*
+ * Every interface with a bulk IN/OUT pair, in interface order; *preferred is
+ * set to the index of the first CDC or vendor one, which is the port used
+ * when no roles are asked for. Returns how many were found, or a libusb error.
+ */
+int huawei_find_ports(struct huawei_ctx *hc, libusb_device *dev, uint16_t pid, struct huawei_iface *ports, int max,
+                      int *preferred, int *num_interfaces);
+
+/*
+ * Pick interfaces for -I: spec is a comma separated list of roles or
+ * interface numbers ("pcui,modem", "2,0"), the first becoming the primary
+ * port. Returns how many were picked into pick[] (indexes into ports), -1
+ * (logged) if one is missing.
+ */
+int huawei_select_ports(struct huawei_ctx *hc, const struct huawei_iface *ports, int nports, const char *spec,
+                        int *pick, int max, const char *path);
+
+/*
+ * Streaming response parser
+ *
+ * Bytes are fed in as they arrive and each one is looked at exactly once.
+ * Complete lines are classified (enum huawei_line_kind) and handed to a
+ * line callback. The default callback collects them into a struct
+ * huawei_result. Besides OK and ERROR, CONNECT/NO CARRIER/BUSY and
+ * +CME/+CMS ERROR end a reply.
+ */
+
+struct at_parser {
+    char cmd[AT_COMMAND_MAX];
+    char prefix[32];        // "+CSQ" for AT+CSQ - such lines are replies, not URCs
+    size_t prefix_len;
+    int first_line;
+    int partial;
+    int prompt;             // a "> " at the start of a line ends the command
+    int breaks;             // CR and LF bytes since the last line
+    int lead;               // ... and in front of the current one
+    int lines;              // lines after the echo
+    int framed;             // a line came CR LF framed, so the port is in ATV1
+    enum huawei_final final;
+    size_t len;
+    char line[AT_LINE_MAX];
+    huawei_line_fn on_line;
+    void *opaque;
+};
+
+struct huawei_result {
+    char raw[MAX_RESPONSE_SIZE];    // bytes exactly as received (-r, daemon)
+    size_t raw_len;
+    char info[MAX_RESPONSE_SIZE];   // information lines, '\n' terminated
+    size_t info_len;
+    int info_lines;
+    char urc[AT_URC_BUFFER];        // URCs that arrived mid-command
+    size_t urc_len;
+    int urcs;
+    int echo;
+    int truncated;
+    enum huawei_final final;
+    char final_line[AT_FINAL_LINE_MAX];
+};
+
+// cmd == NULL parses traffic with no command outstanding: everything is a URC
+void huawei_at_parser_reset(struct at_parser *p, const char *cmd, huawei_line_fn fn, void *opaque);
+
+// Returns the bytes taken: everything, unless the reply ended early with a
+// prompt or CONNECT, after which the rest is not AT traffic
+size_t huawei_at_parser_feed(struct at_parser *p, const unsigned char *data, size_t len);
+
+void huawei_result_init(struct huawei_result *res);
+
+// Default line callback: collect a structured result
+void huawei_result_line(void *opaque, enum huawei_line_kind kind, const char *line, size_t len);
+
+/*
+ * Asynchronous transfer engine
+ *
+ * Every open port keeps IN_TRANSFERS bulk IN transfers queued at all times,
+ * so libusb collects response data as it arrives instead of a blocking read
+ * loop polling for it. A command completes from the IN callback as soon as
+ * its final result code shows up. The port functions in libhuawei.h drive
+ * it; what is here is for the library itself.
+ */
+
+// Receives the raw bytes of a port in data mode, see huawei_port_set_data()
+typedef void (*huawei_data_fn)(void *opaque, const unsigned char *data, size_t len);
+
+enum at_state {
+    AT_IDLE,
+    AT_PENDING,
+    AT_DONE,
+    AT_FAILED
+};
+
+struct huawei_port {
+    const struct usb_transport *usb;
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    int ep_in;
+    int ep_out;
+    int closing;
+    int in_flight;
+    struct libusb_transfer *in_xfer[IN_TRANSFERS];
+    unsigned char in_armed[IN_TRANSFERS];
+    unsigned char in_buf[IN_TRANSFERS][IN_TRANSFER_SIZE];
+    struct libusb_transfer *out_xfer;
+    int out_busy;
+    unsigned char out_buf[AT_OUT_MAX];
+    
+    // Command in progress
+    enum at_state state;
+    int error;
+    struct at_parser parser;
+    struct huawei_result *result;
+    huawei_line_fn on_info; // streaming: information lines bypass result
+    void *info_opaque;
+    unsigned timeout_ms;    // 0 = default timeouts, see huawei_poll_wait()
+    uint64_t deadline_us;   // give up at this monotonic time whatever the timeouts, 0 = never
+    uint64_t start_us;
+    uint64_t tx_done_us;    // OUT transfer completed
+    uint64_t first_rx_us;
+    uint64_t last_rx_us;
+    uint64_t rx_bytes;
+    uint64_t latency_us;    // of the last completed command
+    
+    // URC sink: lines arriving between commands go through the idle parser
+    huawei_urc_fn on_urc;
+    void *urc_opaque;
+    struct at_parser idle;
+    
+    // Data sink: after a CONNECT, everything received goes here untouched
+    huawei_data_fn on_data;
+    void *data_opaque;
+};
+
+int huawei_port_open(struct huawei_port *port, struct huawei_ctx *hc, libusb_device_handle *h, int in, int out);
+void huawei_port_close(struct huawei_port *port);
+
+// Pass everything received with no command pending to fn instead of parsing
+// it, for a port switched to data mode (ATD, then PPP). Set before the dial
+// command so nothing after its CONNECT is lost; NULL goes back to AT mode.
+void huawei_port_set_data(struct huawei_port *port, huawei_data_fn fn, void *opaque);
+
+/*
+ * Devices
+ */
+
+struct huawei_modem {
+    struct huawei_ctx *hc;
+    libusb_device_handle *handle;
+    uint16_t pid;
+    uint16_t bcd_device;
+    uint8_t num_configs;
+    int priority;
+    char path[USB_PATH_MAX];
+    char serial[64];
+    int ep_in;
+    int ep_out;
+    int interface;
+    enum huawei_role role;
+    struct huawei_port port;
+    
+    // Further interfaces claimed with -I, each with its own engine port
+    int nextra;
+    struct modem_channel {
+        struct huawei_iface iface;
+        struct huawei_port port;
+    } extra[MODEM_CHANNELS - 1];
+};
+
+void huawei_modem_close(struct huawei_modem *m);
+
+// huawei_open_all() only reads the serial number when filtering by it or verbose
+void huawei_modem_read_serial(struct huawei_modem *m);
+
+// Claim another of the modem's interfaces and start its engine port, as -I does
+int huawei_modem_attach(struct huawei_modem *m, const struct huawei_iface *iface, int verbose);
+
+// huawei_command() on another of the modem's ports, e.g. one claimed with -I
+int huawei_command_port(struct huawei_modem *m, struct huawei_port *port, const char *cmd,
+                        struct huawei_result *result);
+
+#endif